@@ -0,0 +1,44 @@
+#!/bin/sh
+# Spawn latency: runs external commands from a shell whose heap has been
+# grown by an array of SIZE elements, once forking directly in
+# execute_external() and once through the spawner (XSH_ZYGOTE), and
+# reports the time per command for each.
+#
+#   bench/spawn.sh [-n COMMANDS] [-s SIZES] XSH_BINARY
+
+set -e
+
+commands=500
+sizes="0 100000 400000"
+while getopts n:s: opt; do
+    case $opt in
+        n) commands=$OPTARG ;;
+        s) sizes=$OPTARG ;;
+        *) echo "usage: $0 [-n commands] [-s sizes] xsh" >&2; exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+xsh=${1:?usage: $0 [-n commands] [-s sizes] xsh}
+
+scratch=$(mktemp -d)
+trap 'rm -rf "$scratch"' EXIT INT TERM
+export HOME="$scratch"
+
+# Prints the nanoseconds taken by the commands alone
+script() {
+    cat <<SCRIPT
+for ((i = 0; i < $1; i++)); do heap[i]=element-\$i-of-the-array-that-grows-the-heap; done
+start=\$(/bin/date +%s%N)
+for ((i = 0; i < $commands; i++)); do /bin/true; done
+end=\$(/bin/date +%s%N)
+echo \$((end - start))
+SCRIPT
+}
+
+printf '%-12s %14s %14s\n' "heap" "fork us/cmd" "spawner us/cmd"
+for size in $sizes; do
+    direct=$(env -u XSH_ZYGOTE "$xsh" -c "$(script "$size")")
+    spawner=$(XSH_ZYGOTE=1 "$xsh" -c "$(script "$size")")
+    printf '%-12s %14d %14d\n' "$size" $((direct / commands / 1000)) $((spawner / commands / 1000))
+done
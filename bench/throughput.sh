@@ -0,0 +1,67 @@
+#!/bin/sh
+# Throughput harness: replays every script in bench/corpus through xsh and
+# reports wall time per script. Also used as the PGO training workload.
+#
+#   bench/throughput.sh [-q] [-n RUNS] XSH_BINARY
+
+set -e
+
+runs=5
+quiet=0
+while getopts qn: opt; do
+    case $opt in
+        q) quiet=1 ;;
+        n) runs=$OPTARG ;;
+        *) echo "usage: $0 [-q] [-n runs] xsh" >&2; exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+xsh=${1:?usage: $0 [-q] [-n runs] xsh}
+case $xsh in
+    /*) ;;
+    *) xsh=$(pwd)/$xsh ;;
+esac
+corpus=$(cd "$(dirname "$0")/corpus" && pwd)
+
+# Keep history and rc files out of the caller's home directory
+scratch=$(mktemp -d)
+trap 'rm -rf "$scratch"' EXIT INT TERM
+export HOME="$scratch"
+
+now_ns() {
+    date +%s%N
+}
+
+total=0
+failed=0
+for script in "$corpus"/*.xsh; do
+    name=$(basename "$script" .xsh)
+    start=$(now_ns)
+    i=0
+    while [ $i -lt "$runs" ]; do
+        # A script that fails is reported, with what it wrote to stderr,
+        # rather than timed as if it had run
+        status=0
+        (cd "$scratch" && "$xsh" < "$script" > /dev/null 2> "$scratch/.stderr") || status=$?
+        if [ $status -ne 0 ]; then
+            echo "$name: exit status $status" >&2
+            tail -n 5 "$scratch/.stderr" >&2
+            failed=1
+            break
+        fi
+        i=$((i + 1))
+    done
+    end=$(now_ns)
+    elapsed=$(( (end - start) / 1000 ))
+    total=$((total + elapsed))
+    if [ $quiet -eq 0 ]; then
+        printf '%-12s %8d runs  %10d us/run\n' "$name" "$runs" $((elapsed / runs))
+    fi
+done
+
+if [ $quiet -eq 0 ]; then
+    printf '%-12s %8s       %10d us\n' "total" "" "$total"
+fi
+
+exit $failed
@@ -0,0 +1,843 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include "shell.h"
+
+// Shell arithmetic over 64-bit integers.
+//
+// Expressions are compiled once into a tree by precedence climbing and
+// evaluated as often as needed, so a loop condition is never re-parsed.
+// Simple parameter references such as $i and ${n} are compiled as
+// operands too: their values are read just before evaluation, and only
+// a value that is not a plain integer sends the caller back to textual
+// expansion.
+
+enum {
+    A_NUM, A_VAR, A_PARAM,
+    A_NEG, A_POS, A_NOT, A_BITNOT,
+    A_PREINC, A_PREDEC, A_POSTINC, A_POSTDEC,
+    A_MUL, A_DIV, A_MOD, A_ADD, A_SUB, A_SHL, A_SHR,
+    A_LT, A_LE, A_GT, A_GE, A_EQ, A_NE,
+    A_BITAND, A_BITXOR, A_BITOR, A_AND, A_OR, A_POW,
+    A_TERNARY, A_ASSIGN, A_COMMA
+};
+
+struct ArithExpr {
+    int op;
+    int assign_op;          // A_ASSIGN: binary op applied first, or -1
+    long long value;        // A_NUM, and A_PARAM once read
+    char *name;             // A_VAR, A_PARAM and assignment targets
+    size_t name_len;
+    char *key;              // subscript of name[sub] as written, or NULL
+    size_t key_len;
+    struct ArithExpr *index;    // ... compiled, for indexed arrays
+    struct ArithExpr *a, *b, *c;
+};
+
+typedef struct {
+    const char *s;
+    size_t len;
+    size_t pos;
+    int error;
+    int quiet;              // fail without printing, for $-containing text
+} ArithParser;
+
+#define ARITH_MAX_DEPTH 64
+
+static ArithExpr *parse_comma(ArithParser *ap);
+static ArithExpr *parse_assign(ArithParser *ap);
+static ArithExpr *compile(const char *text, size_t len, int quiet);
+
+static void skip_space(ArithParser *ap) {
+    while (ap->pos < ap->len && isspace((unsigned char)ap->s[ap->pos])) ap->pos++;
+}
+
+static int peek(ArithParser *ap, const char *tok) {
+    skip_space(ap);
+    size_t n = strlen(tok);
+    return ap->pos + n <= ap->len && strncmp(ap->s + ap->pos, tok, n) == 0;
+}
+
+static int accept_tok(ArithParser *ap, const char *tok) {
+    if (!peek(ap, tok)) return 0;
+    ap->pos += strlen(tok);
+    return 1;
+}
+
+static ArithExpr *arith_node(ArithParser *ap, int op) {
+    ArithExpr *e = calloc(1, sizeof(ArithExpr));
+    if (!e) {
+        ap->error = 1;
+        return NULL;
+    }
+    e->op = op;
+    e->assign_op = -1;
+    return e;
+}
+
+void arith_free(ArithExpr *e) {
+    if (!e) return;
+    arith_free(e->a);
+    arith_free(e->b);
+    arith_free(e->c);
+    arith_free(e->index);
+    free(e->name);
+    free(e->key);
+    free(e);
+}
+
+static void syntax_error(ArithParser *ap) {
+    if (ap->error) return;
+    ap->error = 1;
+    if (ap->quiet) return;
+    skip_space(ap);
+    if (ap->pos >= ap->len) {
+        print_error("%.*s: syntax error: operand expected", (int)ap->len, ap->s);
+    } else {
+        print_error("%.*s: syntax error: invalid arithmetic operator (error token is \"%.*s\")",
+                    (int)ap->len, ap->s, (int)(ap->len - ap->pos), ap->s + ap->pos);
+    }
+}
+
+// Parse an integer constant: decimal, 0x hex, 0 octal or base#digits
+int arith_parse_number(const char *s, size_t len, long long *out) {
+    size_t i = 0;
+    int base = 10;
+    unsigned long long v = 0;
+
+    if (len == 0) return -1;
+
+    const char *hash = memchr(s, '#', len);
+    if (hash) {
+        base = 0;
+        for (const char *p = s; p < hash; p++) {
+            if (!isdigit((unsigned char)*p)) return -1;
+            base = base * 10 + (*p - '0');
+        }
+        if (base < 2 || base > 64) return -1;
+        i = hash - s + 1;
+        if (i == len) return -1;
+    } else if (len > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+        base = 16;
+        i = 2;
+    } else if (len > 1 && s[0] == '0') {
+        base = 8;
+        i = 1;
+    }
+
+    for (; i < len; i++) {
+        int c = (unsigned char)s[i], d;
+        if (isdigit(c)) d = c - '0';
+        else if (c >= 'a' && c <= 'z') d = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'Z') d = base <= 36 ? c - 'A' + 10 : c - 'A' + 36;
+        else if (c == '@') d = 62;
+        else if (c == '_') d = 63;
+        else return -1;
+        if (d >= base) return -1;
+        v = v * base + d;
+    }
+    *out = (long long)v;
+    return 0;
+}
+
+// Length of a [sub] subscript at s[pos], including the brackets, or 0
+static size_t subscript_len(const char *s, size_t len, size_t pos) {
+    if (pos >= len || s[pos] != '[') return 0;
+    size_t end = skip_subscript(s + pos + 1, len - pos - 1);
+    return end < len - pos - 1 ? end + 2 : 0;
+}
+
+// Attach the subscript sub to a variable or assignment node. It is kept
+// as written for associative arrays and compiled for indexed ones; text
+// that does not compile is only an error if it is used as an index.
+static int set_subscript(ArithParser *ap, ArithExpr *e, const char *sub, size_t len) {
+    e->key = strndup(sub, len);
+    e->key_len = len;
+    if (!e->key) {
+        ap->error = 1;
+        return -1;
+    }
+    e->index = compile(sub, len, 1);
+    return 0;
+}
+
+// $name, ${name}, $N, $# or $?. Anything more complex is left to
+// textual expansion.
+static ArithExpr *parse_param(ArithParser *ap) {
+    const char *s = ap->s;
+    size_t i = ap->pos + 1;
+    int braced = i < ap->len && s[i] == '{';
+    if (braced) i++;
+
+    size_t start = i;
+    if (i < ap->len && (isalpha((unsigned char)s[i]) || s[i] == '_')) {
+        while (i < ap->len && (isalnum((unsigned char)s[i]) || s[i] == '_')) i++;
+    } else if (i < ap->len && isdigit((unsigned char)s[i])) {
+        i++;
+        while (braced && i < ap->len && isdigit((unsigned char)s[i])) i++;
+    } else if (i < ap->len && (s[i] == '#' || s[i] == '?')) {
+        i++;
+    }
+    size_t end = i;
+    if (braced && (i >= ap->len || s[i++] != '}')) end = start;
+    if (end == start) {
+        syntax_error(ap);
+        return NULL;
+    }
+
+    ArithExpr *e = arith_node(ap, A_PARAM);
+    if (!e) return NULL;
+    e->name = strndup(s + start, end - start);
+    e->name_len = end - start;
+    if (!e->name) {
+        ap->error = 1;
+        arith_free(e);
+        return NULL;
+    }
+    ap->pos = i;
+    return e;
+}
+
+static ArithExpr *parse_primary(ArithParser *ap) {
+    skip_space(ap);
+    if (ap->pos >= ap->len) {
+        syntax_error(ap);
+        return NULL;
+    }
+
+    char c = ap->s[ap->pos];
+    if (c == '(') {
+        ap->pos++;
+        ArithExpr *e = parse_comma(ap);
+        if (!e) return NULL;
+        if (!accept_tok(ap, ")")) {
+            syntax_error(ap);
+            arith_free(e);
+            return NULL;
+        }
+        return e;
+    }
+
+    if (isdigit((unsigned char)c)) {
+        size_t start = ap->pos;
+        while (ap->pos < ap->len && (isalnum((unsigned char)ap->s[ap->pos]) ||
+                                     ap->s[ap->pos] == '#' || ap->s[ap->pos] == '@' ||
+                                     ap->s[ap->pos] == '_')) {
+            ap->pos++;
+        }
+        ArithExpr *e = arith_node(ap, A_NUM);
+        if (!e) return NULL;
+        if (arith_parse_number(ap->s + start, ap->pos - start, &e->value) != 0) {
+            if (!ap->quiet) print_error("%.*s: value too great for base (error token is \"%.*s\")",
+                        (int)ap->len, ap->s, (int)(ap->pos - start), ap->s + start);
+            ap->error = 1;
+            arith_free(e);
+            return NULL;
+        }
+        return e;
+    }
+
+    if (c == '$') return parse_param(ap);
+
+    if (isalpha((unsigned char)c) || c == '_') {
+        size_t start = ap->pos;
+        while (ap->pos < ap->len && (isalnum((unsigned char)ap->s[ap->pos]) || ap->s[ap->pos] == '_')) {
+            ap->pos++;
+        }
+        ArithExpr *e = arith_node(ap, A_VAR);
+        if (!e) return NULL;
+        e->name = strndup(ap->s + start, ap->pos - start);
+        e->name_len = ap->pos - start;
+        if (!e->name) {
+            ap->error = 1;
+            arith_free(e);
+            return NULL;
+        }
+        size_t sub = subscript_len(ap->s, ap->len, ap->pos);
+        if (sub) {
+            if (set_subscript(ap, e, ap->s + ap->pos + 1, sub - 2) != 0) {
+                arith_free(e);
+                return NULL;
+            }
+            ap->pos += sub;
+        }
+        return e;
+    }
+
+    syntax_error(ap);
+    return NULL;
+}
+
+static ArithExpr *parse_postfix(ArithParser *ap) {
+    ArithExpr *e = parse_primary(ap);
+    if (!e || e->op != A_VAR) return e;
+
+    int op = -1;
+    if (accept_tok(ap, "++")) op = A_POSTINC;
+    else if (accept_tok(ap, "--")) op = A_POSTDEC;
+    if (op < 0) return e;
+
+    ArithExpr *n = arith_node(ap, op);
+    if (!n) {
+        arith_free(e);
+        return NULL;
+    }
+    n->a = e;
+    return n;
+}
+
+static ArithExpr *parse_unary(ArithParser *ap) {
+    int op = -1;
+    if (accept_tok(ap, "++")) op = A_PREINC;
+    else if (accept_tok(ap, "--")) op = A_PREDEC;
+    else if (accept_tok(ap, "+")) op = A_POS;
+    else if (accept_tok(ap, "-")) op = A_NEG;
+    else if (peek(ap, "!") && !peek(ap, "!=")) { ap->pos++; op = A_NOT; }
+    else if (accept_tok(ap, "~")) op = A_BITNOT;
+
+    if (op < 0) return parse_postfix(ap);
+
+    ArithExpr *operand = parse_unary(ap);
+    if (!operand) return NULL;
+    if ((op == A_PREINC || op == A_PREDEC) && operand->op != A_VAR) {
+        if (!ap->quiet) print_error("%.*s: syntax error: variable expected", (int)ap->len, ap->s);
+        ap->error = 1;
+        arith_free(operand);
+        return NULL;
+    }
+    ArithExpr *n = arith_node(ap, op);
+    if (!n) {
+        arith_free(operand);
+        return NULL;
+    }
+    n->a = operand;
+    return n;
+}
+
+// Binary operators by precedence; longer spellings first so "<<" is not
+// read as "<"
+static const struct {
+    const char *tok;
+    int op;
+    int prec;
+} binary_ops[] = {
+    {"**", A_POW, 11},
+    {"*", A_MUL, 10}, {"/", A_DIV, 10}, {"%", A_MOD, 10},
+    {"+", A_ADD, 9}, {"-", A_SUB, 9},
+    {"<<", A_SHL, 8}, {">>", A_SHR, 8},
+    {"<=", A_LE, 7}, {">=", A_GE, 7}, {"<", A_LT, 7}, {">", A_GT, 7},
+    {"==", A_EQ, 6}, {"!=", A_NE, 6},
+    {"&&", A_AND, 2}, {"||", A_OR, 1},
+    {"&", A_BITAND, 5}, {"^", A_BITXOR, 4}, {"|", A_BITOR, 3},
+};
+
+// Match a binary operator at the current position, rejecting compound
+// assignment operators such as "+=" and "<<="
+static int match_binary(ArithParser *ap, int *prec) {
+    skip_space(ap);
+    for (size_t k = 0; k < sizeof(binary_ops) / sizeof(binary_ops[0]); k++) {
+        size_t n = strlen(binary_ops[k].tok);
+        if (ap->pos + n > ap->len || strncmp(ap->s + ap->pos, binary_ops[k].tok, n) != 0) continue;
+
+        char next = ap->pos + n < ap->len ? ap->s[ap->pos + n] : '\0';
+        int op = binary_ops[k].op;
+        if (next == '=' && op != A_LE && op != A_GE && op != A_EQ && op != A_NE &&
+            op != A_AND && op != A_OR) {
+            return -1;
+        }
+        *prec = binary_ops[k].prec;
+        return (int)k;
+    }
+    return -1;
+}
+
+// Precedence climbing over the binary operators
+static ArithExpr *parse_binary(ArithParser *ap, int min_prec) {
+    ArithExpr *lhs = parse_unary(ap);
+
+    while (lhs) {
+        int prec;
+        int k = match_binary(ap, &prec);
+        if (k < 0 || prec < min_prec) break;
+        ap->pos += strlen(binary_ops[k].tok);
+
+        // ** is right-associative, everything else left-associative
+        int next_prec = binary_ops[k].op == A_POW ? prec : prec + 1;
+        ArithExpr *rhs = parse_binary(ap, next_prec);
+        ArithExpr *n = rhs ? arith_node(ap, binary_ops[k].op) : NULL;
+        if (!n) {
+            arith_free(lhs);
+            arith_free(rhs);
+            return NULL;
+        }
+        n->a = lhs;
+        n->b = rhs;
+        lhs = n;
+    }
+    return lhs;
+}
+
+static ArithExpr *parse_ternary(ArithParser *ap) {
+    ArithExpr *cond = parse_binary(ap, 1);
+    if (!cond || !accept_tok(ap, "?")) return cond;
+
+    ArithExpr *n = arith_node(ap, A_TERNARY);
+    if (!n) {
+        arith_free(cond);
+        return NULL;
+    }
+    n->a = cond;
+    if (!(n->b = parse_comma(ap)) || !accept_tok(ap, ":") || !(n->c = parse_assign(ap))) {
+        syntax_error(ap);
+        arith_free(n);
+        return NULL;
+    }
+    return n;
+}
+
+static ArithExpr *parse_assign(ArithParser *ap) {
+    static const struct {
+        const char *tok;
+        int op;
+    } assign_ops[] = {
+        {"<<=", A_SHL}, {">>=", A_SHR}, {"*=", A_MUL}, {"/=", A_DIV}, {"%=", A_MOD},
+        {"+=", A_ADD}, {"-=", A_SUB}, {"&=", A_BITAND}, {"^=", A_BITXOR}, {"|=", A_BITOR},
+        {"=", -1},
+    };
+
+    // Look ahead for NAME <assignment-op>
+    skip_space(ap);
+    size_t start = ap->pos;
+    size_t i = start;
+    if (i < ap->len && (isalpha((unsigned char)ap->s[i]) || ap->s[i] == '_')) {
+        while (i < ap->len && (isalnum((unsigned char)ap->s[i]) || ap->s[i] == '_')) i++;
+        size_t name_end = i;
+        size_t sub = subscript_len(ap->s, ap->len, i);
+        i += sub;
+        while (i < ap->len && isspace((unsigned char)ap->s[i])) i++;
+
+        for (size_t k = 0; k < sizeof(assign_ops) / sizeof(assign_ops[0]); k++) {
+            size_t n = strlen(assign_ops[k].tok);
+            if (i + n > ap->len || strncmp(ap->s + i, assign_ops[k].tok, n) != 0) continue;
+            if (n == 1 && i + 1 < ap->len && ap->s[i + 1] == '=') break;  // ==
+
+            ap->pos = i + n;
+            ArithExpr *value = parse_assign(ap);
+            ArithExpr *e = value ? arith_node(ap, A_ASSIGN) : NULL;
+            if (!e) {
+                arith_free(value);
+                return NULL;
+            }
+            e->assign_op = assign_ops[k].op;
+            e->name = strndup(ap->s + start, name_end - start);
+            e->name_len = name_end - start;
+            e->a = value;
+            if (!e->name || (sub && set_subscript(ap, e, ap->s + name_end + 1, sub - 2) != 0)) {
+                arith_free(e);
+                return NULL;
+            }
+            return e;
+        }
+    }
+    return parse_ternary(ap);
+}
+
+static ArithExpr *parse_comma(ArithParser *ap) {
+    ArithExpr *e = parse_assign(ap);
+    while (e && accept_tok(ap, ",")) {
+        ArithExpr *rhs = parse_assign(ap);
+        ArithExpr *n = rhs ? arith_node(ap, A_COMMA) : NULL;
+        if (!n) {
+            arith_free(e);
+            arith_free(rhs);
+            return NULL;
+        }
+        n->a = e;
+        n->b = rhs;
+        e = n;
+    }
+    return e;
+}
+
+static ArithExpr *compile(const char *text, size_t len, int quiet) {
+    ArithParser ap = {text, len, 0, 0, quiet};
+
+    skip_space(&ap);
+    if (ap.pos == len) return arith_node(&ap, A_NUM);
+
+    ArithExpr *e = parse_comma(&ap);
+    skip_space(&ap);
+    if (e && ap.pos < len) {
+        syntax_error(&ap);
+        arith_free(e);
+        return NULL;
+    }
+    if (!e && !ap.error && !quiet) print_error("%.*s: syntax error in expression", (int)len, text);
+    return e;
+}
+
+// Compile an expression. An empty expression compiles to the constant 0.
+ArithExpr *arith_compile(const char *text, size_t len) {
+    return compile(text, len, 0);
+}
+
+static int arith_eval(const ArithExpr *e, long long *out, int depth);
+
+// Evaluate the value of a variable. Values that are not plain numbers
+// are themselves evaluated as expressions.
+static int read_value(const char *name, size_t len, const char *value, long long *out, int depth) {
+    *out = 0;
+    if (!value || !*value) return 0;
+
+    if (depth >= ARITH_MAX_DEPTH) {
+        print_error("%.*s: expression recursion level exceeded", (int)len, name);
+        return -1;
+    }
+    ArithExpr *e = arith_compile(value, strlen(value));
+    if (!e) return -1;
+    int rc = arith_eval(e, out, depth + 1);
+    arith_free(e);
+    return rc;
+}
+
+// Read a variable as an integer
+static int read_var(const char *name, size_t len, long long *out, int depth) {
+    if (var_get_number(name, len, out)) return 0;
+    return read_value(name, len, var_lookup(name, len), out, depth);
+}
+
+static int write_var(const char *name, size_t len, long long value) {
+    return var_set_number(name, len, value);
+}
+
+// Evaluate the index of name[sub] when name is not an associative array
+static int eval_index(const ArithExpr *e, long long *index, int depth) {
+    *index = 0;
+    if (!e->key) return 0;
+    Array *a = var_array(e->name, e->name_len);
+    if (a && array_is_assoc(a)) return 0;
+    if (!e->index) {
+        arith_free(arith_compile(e->key, e->key_len));  // report it
+        return -1;
+    }
+    return arith_eval(e->index, index, depth);
+}
+
+// Read name or name[sub], given the index from eval_index
+static int read_target(const ArithExpr *e, long long index, long long *out, int depth) {
+    if (!e->key) return read_var(e->name, e->name_len, out, depth);
+
+    Array *a = var_array(e->name, e->name_len);
+    const char *value;
+    if (a && array_is_assoc(a)) {
+        value = array_lookup(a, e->key, e->key_len);
+    } else if (a) {
+        value = array_get(a, index);
+    } else {
+        value = index == 0 || index == -1 ? var_lookup(e->name, e->name_len) : NULL;
+    }
+    return read_value(e->name, e->name_len, value, out, depth);
+}
+
+static int write_target(const ArithExpr *e, long long index, long long value) {
+    if (!e->key) return write_var(e->name, e->name_len, value);
+
+    Array *a = var_make_array(e->name, e->name_len, 0);
+    if (!a) return -1;
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "%lld", value);
+    if (array_is_assoc(a)) return array_store(a, e->key, e->key_len, buf, n);
+    return array_set(a, index, buf, n);
+}
+
+// Value of a parameter operand if it is a plain integer
+static int read_param(const ArithExpr *e, long long *out) {
+    char tmp[32];
+    const char *value;
+
+    if (isalpha((unsigned char)e->name[0]) || e->name[0] == '_') {
+        return var_get_number(e->name, e->name_len, out) ? 0 : ARITH_TEXTUAL;
+    }
+    if (e->name[0] == '#') {
+        *out = positional_count();
+        return 0;
+    }
+    if (e->name[0] == '?') {
+        *out = config.last_status;
+        return 0;
+    }
+    value = get_positional(atoi(e->name));
+    if (!value) return ARITH_TEXTUAL;
+
+    // Same rules as variable values: optional sign, then a number
+    snprintf(tmp, sizeof(tmp), "%s", value);
+    const char *p = tmp;
+    while (isspace((unsigned char)*p)) p++;
+    int negative = 0;
+    if (*p == '-' || *p == '+') negative = *p++ == '-';
+    size_t n = strlen(p);
+    while (n > 0 && isspace((unsigned char)p[n - 1])) n--;
+    if (strlen(value) >= sizeof(tmp) || n == 0 || !isdigit((unsigned char)*p) ||
+        arith_parse_number(p, n, out) != 0) {
+        return ARITH_TEXTUAL;
+    }
+    if (negative) *out = (long long)(0ULL - (unsigned long long)*out);
+    return 0;
+}
+
+// Read every parameter operand before evaluation starts, as textual
+// expansion would. Returns ARITH_TEXTUAL if one of them is not a number.
+static int bind_params(ArithExpr *e) {
+    if (!e) return 0;
+    if (e->op == A_PARAM) return read_param(e, &e->value);
+    int rc;
+
+    // A key with expansions in it has to be expanded as text
+    if (e->key && strpbrk(e->key, "$`'\"\\")) return ARITH_TEXTUAL;
+    if ((rc = bind_params(e->index)) != 0) return rc;
+    if ((rc = bind_params(e->a)) != 0) return rc;
+    if ((rc = bind_params(e->b)) != 0) return rc;
+    return bind_params(e->c);
+}
+
+// Apply a binary operator. Returns -1 on division by zero.
+static int apply_binary(int op, long long x, long long y, long long *out) {
+    switch (op) {
+        case A_MUL: *out = (long long)((unsigned long long)x * (unsigned long long)y); return 0;
+        case A_DIV:
+        case A_MOD:
+            if (y == 0) {
+                print_error("division by 0");
+                return -1;
+            }
+            if (x == INT64_MIN && y == -1) {
+                *out = op == A_DIV ? x : 0;
+                return 0;
+            }
+            *out = op == A_DIV ? x / y : x % y;
+            return 0;
+        case A_ADD: *out = (long long)((unsigned long long)x + (unsigned long long)y); return 0;
+        case A_SUB: *out = (long long)((unsigned long long)x - (unsigned long long)y); return 0;
+        case A_SHL: *out = (long long)((unsigned long long)x << (y & 63)); return 0;
+        case A_SHR: *out = x >> (y & 63); return 0;
+        case A_LT: *out = x < y; return 0;
+        case A_LE: *out = x <= y; return 0;
+        case A_GT: *out = x > y; return 0;
+        case A_GE: *out = x >= y; return 0;
+        case A_EQ: *out = x == y; return 0;
+        case A_NE: *out = x != y; return 0;
+        case A_BITAND: *out = x & y; return 0;
+        case A_BITXOR: *out = x ^ y; return 0;
+        case A_BITOR: *out = x | y; return 0;
+        case A_POW: {
+            if (y < 0) {
+                print_error("exponent less than 0");
+                return -1;
+            }
+            unsigned long long r = 1, b = (unsigned long long)x;
+            while (y) {
+                if (y & 1) r *= b;
+                b *= b;
+                y >>= 1;
+            }
+            *out = (long long)r;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int arith_eval(const ArithExpr *e, long long *out, int depth) {
+    long long x, y;
+
+    switch (e->op) {
+        case A_NUM:
+            *out = e->value;
+            return 0;
+
+        case A_VAR:
+            if (eval_index(e, &y, depth) != 0) return -1;
+            return read_target(e, y, out, depth);
+
+        case A_PARAM:
+            *out = e->value;
+            return 0;
+
+        case A_NEG:
+        case A_POS:
+        case A_NOT:
+        case A_BITNOT:
+            if (arith_eval(e->a, &x, depth) != 0) return -1;
+            *out = e->op == A_NEG ? (long long)(0ULL - (unsigned long long)x)
+                 : e->op == A_POS ? x
+                 : e->op == A_NOT ? !x : ~x;
+            return 0;
+
+        case A_PREINC:
+        case A_PREDEC:
+        case A_POSTINC:
+        case A_POSTDEC: {
+            const ArithExpr *v = e->a;
+            long long index;
+            if (eval_index(v, &index, depth) != 0) return -1;
+            if (read_target(v, index, &x, depth) != 0) return -1;
+            y = (e->op == A_PREINC || e->op == A_POSTINC) ? x + 1 : x - 1;
+            if (write_target(v, index, y) != 0) return -1;
+            *out = (e->op == A_PREINC || e->op == A_PREDEC) ? y : x;
+            return 0;
+        }
+
+        case A_AND:
+            if (arith_eval(e->a, &x, depth) != 0) return -1;
+            if (!x) {
+                *out = 0;
+                return 0;
+            }
+            if (arith_eval(e->b, &y, depth) != 0) return -1;
+            *out = y != 0;
+            return 0;
+
+        case A_OR:
+            if (arith_eval(e->a, &x, depth) != 0) return -1;
+            if (x) {
+                *out = 1;
+                return 0;
+            }
+            if (arith_eval(e->b, &y, depth) != 0) return -1;
+            *out = y != 0;
+            return 0;
+
+        case A_TERNARY:
+            if (arith_eval(e->a, &x, depth) != 0) return -1;
+            return arith_eval(x ? e->b : e->c, out, depth);
+
+        case A_ASSIGN: {
+            long long index;
+            if (eval_index(e, &index, depth) != 0) return -1;
+            if (arith_eval(e->a, &y, depth) != 0) return -1;
+            if (e->assign_op >= 0) {
+                if (read_target(e, index, &x, depth) != 0) return -1;
+                if (apply_binary(e->assign_op, x, y, &y) != 0) return -1;
+            }
+            if (write_target(e, index, y) != 0) return -1;
+            *out = y;
+            return 0;
+        }
+
+        case A_COMMA:
+            if (arith_eval(e->a, &x, depth) != 0) return -1;
+            return arith_eval(e->b, out, depth);
+
+        default:
+            if (arith_eval(e->a, &x, depth) != 0) return -1;
+            if (arith_eval(e->b, &y, depth) != 0) return -1;
+            return apply_binary(e->op, x, y, out);
+    }
+}
+
+// Evaluate a compiled expression. Returns ARITH_TEXTUAL without
+// evaluating anything if a parameter operand does not hold a number.
+int arith_evaluate(ArithExpr *e, long long *result) {
+    int rc = bind_params(e);
+    if (rc != 0) return rc;
+    return arith_eval(e, result, 0);
+}
+
+// Recently compiled expressions, for $(( )) inside words. Entries that
+// failed to compile are kept too, so text that needs textual expansion
+// is only tried once.
+#define ARITH_CACHE_SIZE 64
+
+typedef struct {
+    char *text;
+    size_t len;
+    ArithExpr *expr;
+    unsigned long last_used;
+} ArithCacheEntry;
+
+static ArithCacheEntry arith_cache[ARITH_CACHE_SIZE];
+static unsigned long arith_clock;
+
+// Compile text or fetch it from the cache. With quiet set, parameter
+// operands are accepted and errors are not reported.
+ArithExpr *arith_cached(const char *text, size_t len, int quiet) {
+    ArithCacheEntry *victim = &arith_cache[0];
+
+    for (int k = 0; k < ARITH_CACHE_SIZE; k++) {
+        ArithCacheEntry *e = &arith_cache[k];
+        if (e->text && e->len == len && memcmp(e->text, text, len) == 0) {
+            e->last_used = ++arith_clock;
+            if (!e->expr && !quiet) arith_free(arith_compile(text, len));  // report it
+            return e->expr;
+        }
+        if (e->last_used < victim->last_used) victim = e;
+    }
+
+    ArithExpr *expr = compile(text, len, quiet);
+    char *copy = malloc(len + 1);
+    if (!copy) {
+        arith_free(expr);
+        return NULL;
+    }
+    memcpy(copy, text, len);
+    copy[len] = '\0';
+
+    arith_free(victim->expr);
+    free(victim->text);
+    victim->text = copy;
+    victim->len = len;
+    victim->expr = expr;
+    victim->last_used = ++arith_clock;
+    return expr;
+}
+
+static void arith_cache_free(void *ptr) {
+    ArithCache *cache = ptr;
+    arith_free(cache->raw);
+    arith_free(cache->expr);
+    free(cache->text);
+    cache->raw = NULL;
+    cache->expr = NULL;
+    cache->text = NULL;
+}
+
+// Evaluate the expression in w using the compiled trees cached on its
+// node. The word is compiled as written once; it is only expanded and
+// recompiled when it uses something other than simple numeric
+// parameters, and then only when the expanded text changes.
+int arith_eval_word(ArithCache *cache, Script *owner, const Word *w,
+                    Arena *arena, long long *result) {
+    if (!cache->attached) {
+        if (owner) script_attach(owner, cache, arith_cache_free);
+        cache->attached = 1;
+        cache->raw = compile(w->text, w->len, (w->flags & (WORD_DOLLAR | WORD_QUOTED)) != 0);
+    }
+    if (cache->raw) {
+        int rc = arith_evaluate(cache->raw, result);
+        if (rc != ARITH_TEXTUAL) return rc;
+    } else if (!(w->flags & (WORD_DOLLAR | WORD_QUOTED))) {
+        return -1;  // a plain syntax error, already reported
+    }
+
+    char *text = expand_string(w->text, w->len, arena);
+    if (!text) return -1;
+    size_t len = strlen(text);
+
+    if (!cache->expr || cache->len != len || memcmp(cache->text, text, len) != 0) {
+        ArithExpr *e = arith_compile(text, len);
+        char *copy = e ? strndup(text, len) : NULL;
+        if (!copy) {
+            arith_free(e);
+            return -1;
+        }
+        arith_free(cache->expr);
+        free(cache->text);
+        cache->expr = e;
+        cache->text = copy;
+        cache->len = len;
+    }
+    int rc = arith_evaluate(cache->expr, result);
+    return rc == ARITH_TEXTUAL ? -1 : rc;
+}
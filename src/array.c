@@ -0,0 +1,557 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include "shell.h"
+
+// Array storage.
+//
+// Element values are interned: each distinct string is stored once with
+// a reference count, and array slots hold pointers to its text. Indexed
+// arrays are contiguous vectors of those pointers, with NULL for unset
+// indices, as long as most of the vector would be in use; an index far
+// past the others, as in pids[$!]=..., turns the array into a vector of
+// index and value pairs sorted by index instead. Associative arrays
+// keep their entries in a dense vector in insertion order, found
+// through an open-addressed table of entry numbers.
+
+typedef struct {
+    unsigned refs;
+    unsigned hash;
+    size_t len;
+    char text[];
+} Interned;
+
+#define INTERNED(s) ((Interned *)((char *)(s) - offsetof(Interned, text)))
+#define INTERN_TOMBSTONE ((Interned *)-1)
+
+static Interned **intern_table;
+static size_t intern_capacity;
+static size_t intern_used;      // live entries plus tombstones
+
+typedef struct {
+    const char *key;        // interned, NULL once deleted
+    const char *value;      // interned
+    unsigned hash;
+} AssocEntry;
+
+#define ASSOC_EMPTY   0
+#define ASSOC_DELETED UINT32_MAX
+
+typedef struct {
+    long long index;
+    const char *value;      // interned
+} SparseItem;
+
+// Indices an indexed array may leave unset below its highest one and
+// stay a plain vector: half of it, plus this many
+#define ARRAY_DENSE_SLACK 64
+
+struct Array {
+    int assoc;
+    size_t count;           // elements set
+
+    // Indexed
+    const char **items;
+    long long size;         // highest set index + 1
+    size_t capacity;
+    SparseItem *sparse;     // used instead of items once set
+    size_t sparse_capacity;
+
+    // Associative
+    AssocEntry *entries;
+    size_t used;            // entries, including deleted ones
+    size_t entries_capacity;
+    uint32_t *slots;        // entry number + 1, ASSOC_EMPTY or ASSOC_DELETED
+    size_t nslots;
+};
+
+static unsigned hash_text(const char *s, size_t len) {
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int intern_grow(void) {
+    size_t old_capacity = intern_capacity;
+    Interned **old = intern_table;
+
+    size_t capacity = old_capacity ? old_capacity * 2 : 1024;
+    Interned **table = calloc(capacity, sizeof(Interned *));
+    if (!table) return -1;
+
+    intern_table = table;
+    intern_capacity = capacity;
+    intern_used = 0;
+    for (size_t i = 0; i < old_capacity; i++) {
+        Interned *s = old[i];
+        if (!s || s == INTERN_TOMBSTONE) continue;
+        size_t k = s->hash & (capacity - 1);
+        while (table[k]) k = (k + 1) & (capacity - 1);
+        table[k] = s;
+        intern_used++;
+    }
+    free(old);
+    return 0;
+}
+
+// Intern a string, returning its shared copy with one more reference
+const char *str_intern(const char *s, size_t len) {
+    if ((intern_used + 1) * 4 >= intern_capacity * 3 && intern_grow() != 0) return NULL;
+
+    unsigned hash = hash_text(s, len);
+    size_t mask = intern_capacity - 1;
+    Interned **tombstone = NULL;
+    size_t k = hash & mask;
+    for (;; k = (k + 1) & mask) {
+        Interned *e = intern_table[k];
+        if (!e) break;
+        if (e == INTERN_TOMBSTONE) {
+            if (!tombstone) tombstone = &intern_table[k];
+            continue;
+        }
+        if (e->hash == hash && e->len == len && memcmp(e->text, s, len) == 0) {
+            e->refs++;
+            return e->text;
+        }
+    }
+
+    Interned *e = malloc(sizeof(Interned) + len + 1);
+    if (!e) return NULL;
+    e->refs = 1;
+    e->hash = hash;
+    e->len = len;
+    memcpy(e->text, s, len);
+    e->text[len] = '\0';
+
+    if (tombstone) {
+        *tombstone = e;
+    } else {
+        intern_table[k] = e;
+        intern_used++;
+    }
+    return e->text;
+}
+
+// Drop a reference taken by str_intern
+void str_release(const char *s) {
+    if (!s) return;
+    Interned *e = INTERNED(s);
+    if (--e->refs > 0) return;
+
+    size_t mask = intern_capacity - 1;
+    for (size_t k = e->hash & mask;; k = (k + 1) & mask) {
+        if (intern_table[k] == e) {
+            intern_table[k] = INTERN_TOMBSTONE;
+            break;
+        }
+    }
+    free(e);
+}
+
+// Length of an interned string
+size_t str_length(const char *s) {
+    return INTERNED(s)->len;
+}
+
+static const char *str_retain(const char *s) {
+    INTERNED(s)->refs++;
+    return s;
+}
+
+Array *array_new(int assoc) {
+    Array *a = calloc(1, sizeof(Array));
+    if (a) a->assoc = assoc;
+    return a;
+}
+
+void array_clear(Array *a) {
+    for (long long i = 0; a->items && i < a->size; i++) str_release(a->items[i]);
+    for (size_t i = 0; a->sparse && i < a->count; i++) str_release(a->sparse[i].value);
+    for (size_t i = 0; i < a->used; i++) {
+        str_release(a->entries[i].key);
+        str_release(a->entries[i].value);
+    }
+    free(a->items);
+    free(a->sparse);
+    free(a->entries);
+    free(a->slots);
+    int assoc = a->assoc;
+    memset(a, 0, sizeof(*a));
+    a->assoc = assoc;
+}
+
+void array_free(Array *a) {
+    if (!a) return;
+    array_clear(a);
+    free(a);
+}
+
+int array_is_assoc(const Array *a) {
+    return a->assoc;
+}
+
+size_t array_count(const Array *a) {
+    return a->count;
+}
+
+// Highest index plus one: where the next appended element goes
+long long array_size(const Array *a) {
+    return a->assoc ? (long long)a->count : a->size;
+}
+
+// Resolve a negative index against the end of the array. The result is
+// still negative if it is out of range.
+static long long array_index(const Array *a, long long index) {
+    if (index < 0) index += a->size;
+    return index;
+}
+
+// Position of index among the pairs of a sparse array, or of the first
+// pair past it. Sets *found if it is there.
+static size_t sparse_find(const Array *a, long long index, int *found) {
+    size_t lo = 0, hi = a->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (a->sparse[mid].index < index) lo = mid + 1;
+        else hi = mid;
+    }
+    *found = lo < a->count && a->sparse[lo].index == index;
+    return lo;
+}
+
+// Turn the vector into index and value pairs, with room for more
+static int make_sparse(Array *a) {
+    size_t cap = a->count + 8;
+    SparseItem *pairs = malloc(cap * sizeof(SparseItem));
+    if (!pairs) return -1;
+    size_t n = 0;
+    for (long long i = 0; i < a->size; i++) {
+        if (a->items[i]) pairs[n++] = (SparseItem){i, a->items[i]};
+    }
+    free(a->items);
+    a->items = NULL;
+    a->capacity = 0;
+    a->sparse = pairs;
+    a->sparse_capacity = cap;
+    return 0;
+}
+
+static int sparse_set(Array *a, long long index, const char *v) {
+    int found;
+    size_t k = sparse_find(a, index, &found);
+    if (found) {
+        str_release(a->sparse[k].value);
+        a->sparse[k].value = v;
+        return 0;
+    }
+    if (a->count == a->sparse_capacity) {
+        size_t cap = a->sparse_capacity * 2;
+        SparseItem *grown = realloc(a->sparse, cap * sizeof(SparseItem));
+        if (!grown) return -1;
+        a->sparse = grown;
+        a->sparse_capacity = cap;
+    }
+    memmove(a->sparse + k + 1, a->sparse + k, (a->count - k) * sizeof(SparseItem));
+    a->sparse[k] = (SparseItem){index, v};
+    a->count++;
+    if (index >= a->size) a->size = index + 1;
+    return 0;
+}
+
+const char *array_get(const Array *a, long long index) {
+    if (a->assoc) {
+        char buf[32];
+        int n = snprintf(buf, sizeof(buf), "%lld", index);
+        return array_lookup(a, buf, n);
+    }
+    index = array_index(a, index);
+    if (index < 0 || index >= a->size) return NULL;
+    if (a->sparse) {
+        int found;
+        size_t k = sparse_find(a, index, &found);
+        return found ? a->sparse[k].value : NULL;
+    }
+    return a->items[index];
+}
+
+int array_set(Array *a, long long index, const char *value, size_t len) {
+    if (a->assoc) {
+        char buf[32];
+        int n = snprintf(buf, sizeof(buf), "%lld", index);
+        return array_store(a, buf, n, value, len);
+    }
+
+    long long i = array_index(a, index);
+    if (i < 0) {
+        print_error("[%lld]: bad array subscript", index);
+        return -1;
+    }
+    if (i == LLONG_MAX) {
+        print_error("[%lld]: array index too large", index);
+        return -1;
+    }
+    // An index that would leave most of the vector unset goes into pairs
+    if (!a->sparse && (unsigned long long)i >= a->capacity &&
+        (unsigned long long)i >= 2 * (a->count + 1) + ARRAY_DENSE_SLACK && make_sparse(a) != 0) {
+        print_error("malloc: failed to allocate memory");
+        return -1;
+    }
+    if (a->sparse) {
+        const char *v = str_intern(value, len);
+        if (!v) return -1;
+        if (sparse_set(a, i, v) != 0) {
+            str_release(v);
+            print_error("malloc: failed to allocate memory");
+            return -1;
+        }
+        return 0;
+    }
+    if ((size_t)i >= a->capacity) {
+        size_t cap = a->capacity ? a->capacity : 8;
+        while (cap <= (size_t)i) cap *= 2;
+        const char **grown = realloc(a->items, cap * sizeof(char *));
+        if (!grown) {
+            print_error("malloc: failed to allocate memory");
+            return -1;
+        }
+        memset(grown + a->capacity, 0, (cap - a->capacity) * sizeof(char *));
+        a->items = grown;
+        a->capacity = cap;
+    }
+
+    const char *v = str_intern(value, len);
+    if (!v) return -1;
+    if (a->items[i]) {
+        str_release(a->items[i]);
+    } else {
+        a->count++;
+    }
+    a->items[i] = v;
+    if (i >= a->size) a->size = i + 1;
+    return 0;
+}
+
+int array_append(Array *a, const char *value, size_t len) {
+    return array_set(a, array_size(a), value, len);
+}
+
+void array_unset(Array *a, long long index) {
+    if (a->assoc) {
+        char buf[32];
+        int n = snprintf(buf, sizeof(buf), "%lld", index);
+        array_delete(a, buf, n);
+        return;
+    }
+    index = array_index(a, index);
+    if (index < 0 || index >= a->size) return;
+    if (a->sparse) {
+        int found;
+        size_t k = sparse_find(a, index, &found);
+        if (!found) return;
+        str_release(a->sparse[k].value);
+        memmove(a->sparse + k, a->sparse + k + 1, (a->count - k - 1) * sizeof(SparseItem));
+        a->count--;
+        a->size = a->count ? a->sparse[a->count - 1].index + 1 : 0;
+        return;
+    }
+    if (!a->items[index]) return;
+    str_release(a->items[index]);
+    a->items[index] = NULL;
+    a->count--;
+    while (a->size > 0 && !a->items[a->size - 1]) a->size--;
+}
+
+// Slot holding key, or the empty slot ending its probe sequence
+static uint32_t *assoc_slot(const Array *a, const char *key, size_t len, unsigned hash) {
+    size_t mask = a->nslots - 1;
+    for (size_t k = hash & mask;; k = (k + 1) & mask) {
+        uint32_t s = a->slots[k];
+        if (s == ASSOC_EMPTY) return &a->slots[k];
+        if (s == ASSOC_DELETED) continue;
+        const AssocEntry *e = &a->entries[s - 1];
+        if (e->hash == hash && str_length(e->key) == len && memcmp(e->key, key, len) == 0) {
+            return &a->slots[k];
+        }
+    }
+}
+
+// Rebuild the slot table, dropping deleted entries from the vector
+static int assoc_rehash(Array *a, size_t nslots) {
+    uint32_t *slots = calloc(nslots, sizeof(uint32_t));
+    if (!slots) return -1;
+
+    size_t live = 0;
+    for (size_t i = 0; i < a->used; i++) {
+        if (!a->entries[i].key) continue;
+        a->entries[live] = a->entries[i];
+        size_t k = a->entries[live].hash & (nslots - 1);
+        while (slots[k]) k = (k + 1) & (nslots - 1);
+        slots[k] = (uint32_t)(live + 1);
+        live++;
+    }
+    free(a->slots);
+    a->slots = slots;
+    a->nslots = nslots;
+    a->used = live;
+    return 0;
+}
+
+const char *array_lookup(const Array *a, const char *key, size_t len) {
+    if (!a->assoc) {
+        long long index;
+        if (arith_parse_number(key, len, &index) != 0) index = 0;
+        return array_get(a, index);
+    }
+    if (!a->count) return NULL;
+    uint32_t *slot = assoc_slot(a, key, len, hash_text(key, len));
+    return *slot ? a->entries[*slot - 1].value : NULL;
+}
+
+int array_store(Array *a, const char *key, size_t klen, const char *value, size_t vlen) {
+    if (!a->assoc) {
+        long long index;
+        if (arith_parse_number(key, klen, &index) != 0) index = 0;
+        return array_set(a, index, value, vlen);
+    }
+
+    // Slots are kept at most half full, counting deleted entries
+    if ((a->used + 1) * 2 > a->nslots) {
+        size_t nslots = 16;
+        while ((a->count + 1) * 4 > nslots) nslots *= 2;
+        if (assoc_rehash(a, nslots) != 0) {
+            print_error("malloc: failed to allocate memory");
+            return -1;
+        }
+    }
+
+    unsigned hash = hash_text(key, klen);
+    uint32_t *slot = assoc_slot(a, key, klen, hash);
+    const char *v = str_intern(value, vlen);
+    if (!v) return -1;
+    if (*slot) {
+        AssocEntry *e = &a->entries[*slot - 1];
+        str_release(e->value);
+        e->value = v;
+        return 0;
+    }
+
+    if (a->used == a->entries_capacity) {
+        size_t cap = a->entries_capacity ? a->entries_capacity * 2 : 8;
+        AssocEntry *grown = realloc(a->entries, cap * sizeof(AssocEntry));
+        if (!grown) {
+            str_release(v);
+            return -1;
+        }
+        a->entries = grown;
+        a->entries_capacity = cap;
+    }
+    const char *k = str_intern(key, klen);
+    if (!k) {
+        str_release(v);
+        return -1;
+    }
+    AssocEntry *e = &a->entries[a->used++];
+    e->key = k;
+    e->value = v;
+    e->hash = hash;
+    *slot = (uint32_t)a->used;
+    a->count++;
+    return 0;
+}
+
+void array_delete(Array *a, const char *key, size_t len) {
+    if (!a->assoc) {
+        long long index;
+        if (arith_parse_number(key, len, &index) == 0) array_unset(a, index);
+        return;
+    }
+    if (!a->count) return;
+    uint32_t *slot = assoc_slot(a, key, len, hash_text(key, len));
+    if (!*slot) return;
+
+    AssocEntry *e = &a->entries[*slot - 1];
+    str_release(e->key);
+    str_release(e->value);
+    e->key = NULL;
+    e->value = NULL;
+    *slot = ASSOC_DELETED;
+    a->count--;
+}
+
+// Step through the elements in order. *pos starts at 0. Sets *value and
+// either *key (associative) or *index (indexed, *key NULL); returns 0
+// after the last element.
+int array_next(const Array *a, size_t *pos, const char **key, long long *index,
+               const char **value) {
+    if (a->assoc) {
+        while (*pos < a->used && !a->entries[*pos].key) (*pos)++;
+        if (*pos >= a->used) return 0;
+        const AssocEntry *e = &a->entries[(*pos)++];
+        *key = e->key;
+        *value = e->value;
+        return 1;
+    }
+    if (a->sparse) {
+        if (*pos >= a->count) return 0;
+        *key = NULL;
+        *index = a->sparse[*pos].index;
+        *value = a->sparse[(*pos)++].value;
+        return 1;
+    }
+    while ((long long)*pos < a->size && !a->items[*pos]) (*pos)++;
+    if ((long long)*pos >= a->size) return 0;
+    *key = NULL;
+    *index = (long long)*pos;
+    *value = a->items[(*pos)++];
+    return 1;
+}
+
+// Copy an array, sharing the interned strings
+Array *array_copy(const Array *a) {
+    Array *c = array_new(a->assoc);
+    if (!c) return NULL;
+    if (a->sparse) {
+        c->sparse = malloc(a->sparse_capacity * sizeof(SparseItem));
+        if (!c->sparse) {
+            free(c);
+            return NULL;
+        }
+        for (size_t i = 0; i < a->count; i++) {
+            c->sparse[i] = (SparseItem){a->sparse[i].index, str_retain(a->sparse[i].value)};
+        }
+        c->sparse_capacity = a->sparse_capacity;
+        c->size = a->size;
+        c->count = a->count;
+        return c;
+    }
+    if (!a->assoc) {
+        c->items = malloc((a->size ? a->size : 1) * sizeof(char *));
+        if (!c->items) {
+            free(c);
+            return NULL;
+        }
+        for (long long i = 0; i < a->size; i++) {
+            c->items[i] = a->items[i] ? str_retain(a->items[i]) : NULL;
+        }
+        c->size = c->capacity = a->size;
+        c->count = a->count;
+        return c;
+    }
+
+    size_t pos = 0;
+    const char *key, *value;
+    long long index;
+    while (array_next(a, &pos, &key, &index, &value)) {
+        if (array_store(c, key, str_length(key), value, str_length(value)) != 0) {
+            array_free(c);
+            return NULL;
+        }
+    }
+    return c;
+}
@@ -0,0 +1,525 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+#include "shell.h"
+
+// Control groups for jobs.
+//
+// Where the shell's cgroup in the cgroup v2 hierarchy is delegated to
+// it, every background job and every command run with the limit
+// prefix gets a cgroup of its own, <n>, in a subtree the shell makes
+// for itself, xsh-<shell pid>. The child joins
+// it before exec, so all the job starts, down to grandchildren that
+// outlive it, is accounted and limited together. When the job is done
+// its CPU time and memory peak are read from cpu.stat and memory.peak
+// and the cgroup is removed once it is empty: when the job is reaped,
+// or, if processes it left behind are still in it, on a later look at
+// the jobs. Cgroups still in use when the shell exits are removed by
+// the next shell that sets up cgroups in the same place, once their
+// owner is gone.
+//
+// A cgroup counts as delegated if it is the root of the hierarchy the
+// shell sees, as in a container, if systemd marked it with a delegate
+// attribute, or, for other users than root, if its control files belong
+// to the user, as systemd arranges for units with Delegate=yes. Being
+// able to write to it is not enough: root can write anywhere.
+//
+// Limits need their controllers enabled for the subtree. Holding no
+// processes of its own, it can always have enabled what it is offered;
+// the shell's cgroup offers what its own subtree_control enables, and
+// the shell adds what is missing there if the kernel lets it. It never
+// moves a process it did not start to make room for that, and never
+// disables a controller: other shells' jobs may depend on it. That is
+// only done the first time a limit is asked for; plain jobs need no
+// controllers.
+//
+// A forked subshell that starts jobs of its own makes its own subtree,
+// xsh-<its pid>, and removes it when it exits. The cgroup it was
+// started in, as a job of its parent, stays in the parent's subtree.
+
+#define CPU_PERIOD_USEC 100000
+
+static int cg_state;            // 1: available, -1: not, 0: not looked at yet
+static int cg_base_fd = -1;     // the shell's cgroup directory
+static pid_t cg_owner;
+static unsigned cg_next = 1;
+static pid_t cg_parent;         // owner of the subtree this child was forked from
+static unsigned cg_current;     // the cgroup this child was placed in
+static pid_t cg_current_owner;  // ... in the subtree of this process
+static int cg_tree;             // the subtree has been made
+static int cg_controllers;      // enable_controllers has run
+static unsigned *cg_busy;       // cgroups to remove once they are empty
+static int cg_busy_count, cg_busy_size;
+
+// The path of a cgroup, or of a file in it, in the subtree of owner
+static void cg_path(pid_t owner, unsigned id, const char *file, char *buf, size_t size) {
+    if (file && id) snprintf(buf, size, "xsh-%d/%u/%s", (int)owner, id, file);
+    else if (file) snprintf(buf, size, "xsh-%d/%s", (int)owner, file);
+    else if (id) snprintf(buf, size, "xsh-%d/%u", (int)owner, id);
+    else snprintf(buf, size, "xsh-%d", (int)owner);
+}
+
+// ... in the subtree of this process
+static void cg_name(unsigned id, const char *file, char *buf, size_t size) {
+    cg_path(cg_owner, id, file, buf, size);
+}
+
+static int write_at(int dirfd, const char *path, const char *value) {
+    int fd = openat(dirfd, path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    size_t len = strlen(value);
+    ssize_t n = write(fd, value, len);
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return n == (ssize_t)len ? 0 : -1;
+}
+
+static ssize_t read_at(int dirfd, const char *path, char *buf, size_t size) {
+    int fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    if (n < 0) return -1;
+    buf[n] = '\0';
+    return n;
+}
+
+// The directory of this process's cgroup in the v2 hierarchy. Sets
+// *root if it is the root of the hierarchy this process sees.
+static int find_base(char *path, size_t size, int *root) {
+    char line[MAX_PATH_LENGTH + 64], own[sizeof(line)] = "";
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    if (!f) return -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "0::", 3) == 0) {
+            snprintf(own, sizeof(own), "%s", line + 3);
+            own[strcspn(own, "\n")] = '\0';
+            break;
+        }
+    }
+    fclose(f);
+    if (!own[0]) return -1;
+    *root = strcmp(own, "/") == 0;
+
+    // mountinfo: id parent dev root mountpoint options... - type source
+    if (!(f = fopen("/proc/self/mountinfo", "r"))) return -1;
+    int found = -1;
+    while (found != 0 && fgets(line, sizeof(line), f)) {
+        char mnt_root[MAX_PATH_LENGTH], mount[MAX_PATH_LENGTH];
+        const char *dash = strstr(line, " - cgroup2 ");
+        if (!dash || sscanf(line, "%*s %*s %*s %4095s %4095s", mnt_root, mount) != 2) continue;
+        size_t root_len = strcmp(mnt_root, "/") == 0 ? 0 : strlen(mnt_root);
+        if (strncmp(own, mnt_root, root_len) != 0) continue;
+        snprintf(path, size, "%s%s", mount, own + root_len);
+        found = 0;
+    }
+    fclose(f);
+    return found;
+}
+
+// Is word one of the space-separated words of list?
+static int word_in(const char *word, const char *list) {
+    size_t len = strlen(word);
+    for (const char *p = strstr(list, word); p; p = strstr(p + 1, word)) {
+        if ((p == list || p[-1] == ' ') && (p[len] == ' ' || p[len] == '\n' || p[len] == '\0')) return 1;
+    }
+    return 0;
+}
+
+// Is the cgroup open as fd, the root of its hierarchy if root is set,
+// delegated to this process's user?
+static int delegated(int fd, int root) {
+    if (root) return 1;
+    char mark[8];
+    ssize_t n = fgetxattr(fd, "trusted.delegate", mark, sizeof(mark));
+    if (n < 0) n = fgetxattr(fd, "user.delegate", mark, sizeof(mark));
+    if (n == 1 && mark[0] == '1') return 1;
+    if (geteuid() == 0) return 0;
+
+    static const char *files[] = {".", "cgroup.procs", "cgroup.subtree_control"};
+    for (size_t k = 0; k < sizeof(files) / sizeof(files[0]); k++) {
+        struct stat st;
+        if (fstatat(fd, files[k], &st, 0) != 0 || st.st_uid != geteuid()) return 0;
+    }
+    return 1;
+}
+
+// Enable the wanted controllers that dir offers, and that are not on
+// yet, for its children
+static void enable_in(const char *dir) {
+    static const char *wanted[] = {"cpu", "memory", "io", "pids"};
+    char path[96], offered[512], enabled[512], request[128] = "";
+    snprintf(path, sizeof(path), "%s/cgroup.controllers", dir);
+    if (read_at(cg_base_fd, path, offered, sizeof(offered)) < 0) return;
+    snprintf(path, sizeof(path), "%s/cgroup.subtree_control", dir);
+    if (read_at(cg_base_fd, path, enabled, sizeof(enabled)) < 0) return;
+    for (size_t k = 0; k < sizeof(wanted) / sizeof(wanted[0]); k++) {
+        if (!word_in(wanted[k], offered) || word_in(wanted[k], enabled)) continue;
+        strcat(request, request[0] ? " +" : "+");
+        strcat(request, wanted[k]);
+    }
+    // The shell's cgroup refuses with EBUSY while processes are in it;
+    // whatever it already offers the subtree is used then
+    if (request[0]) write_at(cg_base_fd, path, request);
+}
+
+// Enable the controllers limits need for the jobs in owner's subtree
+static void enable_controllers(pid_t owner) {
+    char tree[64];
+    if (owner == cg_owner) {
+        if (cg_controllers) return;
+        cg_controllers = 1;
+    }
+    cg_path(owner, 0, NULL, tree, sizeof(tree));
+    enable_in(".");
+    enable_in(tree);
+}
+
+// Remove the subtree of a shell that is gone, with the cgroups of its
+// jobs that have emptied since. Cgroups still in use stay.
+static void remove_tree(const char *name) {
+    int fd = openat(cg_base_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir) {
+        if (fd >= 0) close(fd);
+        return;
+    }
+    struct dirent *e;
+    while ((e = readdir(dir))) {
+        if (e->d_type == DT_DIR && e->d_name[0] != '.') unlinkat(fd, e->d_name, AT_REMOVEDIR);
+    }
+    closedir(dir);
+    unlinkat(cg_base_fd, name, AT_REMOVEDIR);
+}
+
+// Remove the subtrees of shells that are gone, left behind because
+// their jobs were still running when they exited
+static void sweep_stale(void) {
+    int fd = dup(cg_base_fd);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir) {
+        if (fd >= 0) close(fd);
+        return;
+    }
+    struct dirent *e;
+    while ((e = readdir(dir))) {
+        int pid, len = 0;
+        if (sscanf(e->d_name, "xsh-%d%n", &pid, &len) != 1 || e->d_name[len] || pid <= 0) continue;
+        if (pid != (int)cg_owner && (kill(pid, 0) == 0 || errno != ESRCH)) continue;
+        remove_tree(e->d_name);
+    }
+    closedir(dir);
+}
+
+static void cgroup_exit(void) {
+    if (getpid() != cg_owner || !cg_tree) return;
+    for (unsigned id = 1; id < cg_next; id++) cgroup_remove(id);
+    free(cg_busy);
+    cg_busy = NULL;
+    cg_busy_count = 0;
+    char tree[64];
+    cg_name(0, NULL, tree, sizeof(tree));
+    unlinkat(cg_base_fd, tree, AT_REMOVEDIR);
+}
+
+static int cgroup_available(void) {
+    if (cg_state) return cg_state > 0;
+    cg_state = -1;
+    char base[MAX_PATH_LENGTH];
+    int root;
+    if (find_base(base, sizeof(base), &root) != 0) return 0;
+    cg_base_fd = open(base, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cg_base_fd < 0) return 0;
+    if (!delegated(cg_base_fd, root) || faccessat(cg_base_fd, ".", W_OK, AT_EACCESS) != 0) {
+        close(cg_base_fd);
+        cg_base_fd = -1;
+        return 0;
+    }
+    cg_owner = getpid();
+    cg_state = 1;
+    sweep_stale();
+    atexit(cgroup_exit);
+    return 1;
+}
+
+// A size such as 512M; suffixes K, M, G and T count in 1024s
+static int parse_size(const char *text, long long *value) {
+    char *end;
+    errno = 0;
+    long long v = strtoll(text, &end, 10);
+    if (end == text || errno || v <= 0) return -1;
+    const char *units = "KMGT";
+    const char *unit = *end ? strchr(units, toupper((unsigned char)*end)) : NULL;
+    if (*end && (!unit || end[1])) return -1;
+    for (const char *u = units; unit && u <= unit; u++) {
+        if (v > LLONG_MAX / 1024) return -1;
+        v *= 1024;
+    }
+    *value = v;
+    return 0;
+}
+
+// The disk holding the current directory; io.max takes whole disks,
+// not partitions
+static int io_device(dev_t *dev) {
+    struct stat st;
+    if (stat(".", &st) != 0 || major(st.st_dev) == 0) return -1;
+    char path[96], text[32];
+    unsigned maj, min;
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/partition", major(st.st_dev), minor(st.st_dev));
+    *dev = st.st_dev;
+    if (access(path, F_OK) != 0) return 0;
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../dev", major(st.st_dev), minor(st.st_dev));
+    if (read_at(AT_FDCWD, path, text, sizeof(text)) > 0 && sscanf(text, "%u:%u", &maj, &min) == 2) {
+        *dev = makedev(maj, min);
+    }
+    return 0;
+}
+
+// Take the value of option -m, -c, -r, -w or -p. Returns -1 after
+// printing an error if either is invalid.
+int cgroup_option(CgroupLimits *l, const char *opt, const char *value) {
+    if (!value) {
+        print_error("limit: %s: option requires an argument", opt);
+        return -1;
+    }
+    int rc = -1;
+    char *end;
+    switch (opt[1]) {
+        case 'm': rc = parse_size(value, &l->memory); break;
+        case 'c': {
+            double cpus = strtod(value, &end);
+            if (end != value && !*end && cpus > 0 && cpus <= 1e6) {
+                l->cpu_quota = (long long)(cpus * CPU_PERIOD_USEC);
+                rc = l->cpu_quota > 0 ? 0 : -1;
+            }
+            break;
+        }
+        case 'r':
+        case 'w':
+            rc = parse_size(value, opt[1] == 'r' ? &l->read_bps : &l->write_bps);
+            if (rc == 0 && io_device(&l->io_dev) != 0) {
+                print_error("limit: %s: no block device under the current directory", opt);
+                return -1;
+            }
+            break;
+        case 'p': rc = parse_size(value, &l->pids); break;
+        default:
+            print_error("limit: %s: invalid option", opt);
+            return -1;
+    }
+    if (rc != 0) print_error("limit: %s: invalid value for %s", value, opt);
+    return rc;
+}
+
+// Write the limits into the control files of cgroup id of owner
+static int cgroup_limit(pid_t owner, unsigned id, const CgroupLimits *l) {
+    char path[128], value[128];
+    const char *file = NULL;
+    enable_controllers(owner);
+    if (l->memory > 0) {
+        cg_path(owner, id, file = "memory.max", path, sizeof(path));
+        snprintf(value, sizeof(value), "%lld", l->memory);
+        if (write_at(cg_base_fd, path, value) != 0) goto fail;
+    }
+    if (l->cpu_quota > 0) {
+        cg_path(owner, id, file = "cpu.max", path, sizeof(path));
+        snprintf(value, sizeof(value), "%lld %d", l->cpu_quota, CPU_PERIOD_USEC);
+        if (write_at(cg_base_fd, path, value) != 0) goto fail;
+    }
+    if (l->read_bps > 0 || l->write_bps > 0) {
+        cg_path(owner, id, file = "io.max", path, sizeof(path));
+        int len = snprintf(value, sizeof(value), "%u:%u", major(l->io_dev), minor(l->io_dev));
+        if (l->read_bps > 0) len += snprintf(value + len, sizeof(value) - len, " rbps=%lld", l->read_bps);
+        if (l->write_bps > 0) snprintf(value + len, sizeof(value) - len, " wbps=%lld", l->write_bps);
+        if (write_at(cg_base_fd, path, value) != 0) goto fail;
+    }
+    if (l->pids > 0) {
+        cg_path(owner, id, file = "pids.max", path, sizeof(path));
+        snprintf(value, sizeof(value), "%lld", l->pids);
+        if (write_at(cg_base_fd, path, value) != 0) goto fail;
+    }
+    return 0;
+
+fail:
+    if (errno == ENOENT) print_error("limit: %s: controller not delegated to this shell", file);
+    else print_error("limit: %s: %s", file, strerror(errno));
+    return -1;
+}
+
+static int has_limits(const CgroupLimits *l) {
+    return l && (l->memory > 0 || l->cpu_quota > 0 || l->read_bps > 0 || l->write_bps > 0 || l->pids > 0);
+}
+
+// Create a cgroup for a job, with limits if l gives any. Sets *id to
+// it, or to 0 if cgroups are not available and no limits were asked
+// for. Returns -1 after printing an error otherwise.
+int cgroup_create(const CgroupLimits *l, unsigned *id) {
+    *id = 0;
+    if (!cgroup_available()) {
+        if (!has_limits(l)) return 0;
+        print_error("limit: no delegated cgroup v2 hierarchy");
+        return -1;
+    }
+    char name[64];
+    if (!cg_tree) {
+        // One there already was left by a process gone with this pid
+        cg_name(0, NULL, name, sizeof(name));
+        if (mkdirat(cg_base_fd, name, 0755) != 0 && errno == EEXIST) {
+            remove_tree(name);
+            mkdirat(cg_base_fd, name, 0755);
+        }
+        cg_tree = 1;
+    }
+    cg_name(cg_next, NULL, name, sizeof(name));
+    if (mkdirat(cg_base_fd, name, 0755) != 0) {
+        // A job without limits runs without a cgroup where none can be
+        // made, but never in one that is not its own
+        if (!has_limits(l) && errno != EEXIST) return 0;
+        print_error("%s: %s: %s", has_limits(l) ? "limit" : "cgroup", name, strerror(errno));
+        return -1;
+    }
+    *id = cg_next++;
+    if (has_limits(l) && cgroup_limit(cg_owner, *id, l) != 0) {
+        cgroup_remove(*id);
+        *id = 0;
+        return -1;
+    }
+    return 0;
+}
+
+// Move the calling process into cgroup id of owner
+static int enter_in(pid_t owner, unsigned id) {
+    char path[128];
+    cg_path(owner, id, "cgroup.procs", path, sizeof(path));
+    if (write_at(cg_base_fd, path, "0") != 0) {
+        print_error("cgroup: %s: %s", path, strerror(errno));
+        return -1;
+    }
+    cg_current = id;
+    cg_current_owner = owner;
+    return 0;
+}
+
+// Move the calling process into a cgroup its parent made for it, as a
+// child does before it runs the job
+int cgroup_enter(unsigned id) {
+    return enter_in(cg_parent ? cg_parent : cg_owner, id);
+}
+
+// Move a child into the cgroup from the shell's side as well. The job
+// may not have got there itself before the shell exits and removes its
+// cgroups; one that has already exited is not an error.
+void cgroup_place(unsigned id, pid_t pid) {
+    char path[128], value[24];
+    if (!id || cg_base_fd < 0) return;
+    cg_name(id, "cgroup.procs", path, sizeof(path));
+    snprintf(value, sizeof(value), "%d", (int)pid);
+    write_at(cg_base_fd, path, value);
+}
+
+// Limit the cgroup this child was placed in, or a new one if none.
+// Used by limit in a background job, which already has its cgroup.
+int cgroup_limit_self(const CgroupLimits *l) {
+    if (cg_current && cg_base_fd >= 0) return cgroup_limit(cg_current_owner, cg_current, l);
+    unsigned id;
+    if (cgroup_create(l, &id) != 0) return -1;
+    return id ? enter_in(cg_owner, id) : 0;
+}
+
+// In a forked child: start a subtree of its own for the jobs it starts,
+// leaving the parent's to the parent
+void cgroup_forget(void) {
+    if (cg_state <= 0) return;
+    cg_parent = cg_owner;
+    cg_owner = getpid();
+    cg_next = 1;
+    cg_tree = 0;
+    cg_controllers = 0;
+    free(cg_busy);
+    cg_busy = NULL;
+    cg_busy_count = cg_busy_size = 0;
+}
+
+// The value of key in a file of "key value" lines
+static long long stat_field(const char *text, const char *key) {
+    size_t len = strlen(key);
+    const char *p = text;
+    while (p) {
+        if (strncmp(p, key, len) == 0 && p[len] == ' ') return strtoll(p + len + 1, NULL, 10);
+        p = strchr(p, '\n');
+        if (p) p++;
+    }
+    return -1;
+}
+
+// Read the cgroup's CPU time and memory peak
+int cgroup_stats(unsigned id, CgroupStats *s) {
+    char path[128], text[1024];
+    s->usage_usec = s->user_usec = s->system_usec = s->memory_peak = -1;
+    if (!id || cg_base_fd < 0) return -1;
+    cg_name(id, "cpu.stat", path, sizeof(path));
+    if (read_at(cg_base_fd, path, text, sizeof(text)) < 0) return -1;
+    s->usage_usec = stat_field(text, "usage_usec");
+    s->user_usec = stat_field(text, "user_usec");
+    s->system_usec = stat_field(text, "system_usec");
+    cg_name(id, "memory.peak", path, sizeof(path));
+    if (read_at(cg_base_fd, path, text, sizeof(text)) > 0) s->memory_peak = strtoll(text, NULL, 10);
+    return 0;
+}
+
+// Remove the cgroup, or, if processes are left in it, remember to try
+// again from cgroup_sweep
+void cgroup_remove(unsigned id) {
+    char name[64];
+    if (!id || cg_base_fd < 0) return;
+    cg_name(id, NULL, name, sizeof(name));
+    if (unlinkat(cg_base_fd, name, AT_REMOVEDIR) == 0 || errno != EBUSY) return;
+    for (int i = 0; i < cg_busy_count; i++) {
+        if (cg_busy[i] == id) return;
+    }
+    if (cg_busy_count == cg_busy_size) {
+        int size = cg_busy_size ? cg_busy_size * 2 : 16;
+        unsigned *grown = realloc(cg_busy, size * sizeof(*grown));
+        if (!grown) return;
+        cg_busy = grown;
+        cg_busy_size = size;
+    }
+    cg_busy[cg_busy_count++] = id;
+}
+
+// Remove the cgroups of finished jobs that have emptied since
+void cgroup_sweep(void) {
+    char name[64];
+    int kept = 0;
+    for (int i = 0; i < cg_busy_count; i++) {
+        cg_name(cg_busy[i], NULL, name, sizeof(name));
+        if (unlinkat(cg_base_fd, name, AT_REMOVEDIR) != 0 && errno == EBUSY) cg_busy[kept++] = cg_busy[i];
+    }
+    cg_busy_count = kept;
+}
+
+// Describe the usage as "cpu 1.20s (user 1.00s, sys 0.20s), peak 3.1M"
+void cgroup_format(const CgroupStats *s, char *buf, size_t size) {
+    if (s->usage_usec < 0) {
+        buf[0] = '\0';
+        return;
+    }
+    int len = snprintf(buf, size, "cpu %.2fs (user %.2fs, sys %.2fs)", s->usage_usec / 1e6,
+                       s->user_usec / 1e6, s->system_usec / 1e6);
+    if (s->memory_peak >= 0 && len > 0 && (size_t)len < size) {
+        snprintf(buf + len, size - len, ", peak %s", format_size(s->memory_peak));
+    }
+}
@@ -0,0 +1,328 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <regex.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include "shell.h"
+
+// Conditional expressions: [[ ... ]].
+//
+// Operands are expanded without field splitting or pathname expansion.
+// The right side of == and != is a pattern, and the right side of =~ an
+// extended regex that is compiled once per node and only recompiled
+// when its expanded text changes. File tests share a small cache of
+// statx results that lives for one command, so [[ -f x && -r x && -s x ]]
+// looks at x once.
+
+#define STAT_CACHE_SIZE 8
+#define COND_MAX_GROUPS 32
+
+typedef struct {
+    char *path;
+    int follow;         // stat the target of a symbolic link
+    int error;          // errno of a failed call, or 0
+    struct statx st;
+} StatEntry;
+
+static StatEntry stat_cache[STAT_CACHE_SIZE];
+static int stat_count;
+static int stat_victim;
+
+struct CondRegex {
+    char *text;
+    size_t len;
+    regex_t re;
+};
+
+// Drop the file status cached for the current command
+void stat_cache_clear(void) {
+    for (int k = 0; k < stat_count; k++) {
+        free(stat_cache[k].path);
+        stat_cache[k].path = NULL;
+    }
+    stat_count = 0;
+    stat_victim = 0;
+}
+
+// Status of path, or NULL with errno set if it cannot be read. Without
+// follow a symbolic link itself is described.
+static const struct statx *stat_cached(const char *path, int follow) {
+    for (int k = 0; k < stat_count; k++) {
+        StatEntry *e = &stat_cache[k];
+        if (e->follow == follow && strcmp(e->path, path) == 0) {
+            errno = e->error;
+            return e->error ? NULL : &e->st;
+        }
+    }
+
+    char *copy = strdup(path);
+    if (!copy) return NULL;
+    StatEntry *e;
+    if (stat_count < STAT_CACHE_SIZE) {
+        e = &stat_cache[stat_count++];
+    } else {
+        e = &stat_cache[stat_victim];
+        stat_victim = (stat_victim + 1) % STAT_CACHE_SIZE;
+        free(e->path);
+    }
+    e->path = copy;
+    e->follow = follow;
+    e->error = 0;
+    if (statx(AT_FDCWD, path, follow ? 0 : AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &e->st) != 0) {
+        e->error = errno;
+        return NULL;
+    }
+    return &e->st;
+}
+
+static int in_group(gid_t gid) {
+    if (gid == getegid()) return 1;
+    gid_t groups[256];
+    int n = getgroups(256, groups);
+    for (int i = 0; i < n; i++) {
+        if (groups[i] == gid) return 1;
+    }
+    return 0;
+}
+
+// Would the effective user be allowed access? mode is made of R_OK,
+// W_OK and X_OK, which match the permission bits.
+static int may_access(const struct statx *st, int mode) {
+    uid_t uid = geteuid();
+    if (uid == 0) {
+        // Only execution needs a permission bit, or a directory
+        return !(mode & X_OK) || (st->stx_mode & 0111) || S_ISDIR(st->stx_mode);
+    }
+    int shift = st->stx_uid == uid ? 6 : in_group(st->stx_gid) ? 3 : 0;
+    return ((st->stx_mode >> shift) & mode) == mode;
+}
+
+int is_directory(const char *path) {
+    const struct statx *st = stat_cached(path, 1);
+    return st && S_ISDIR(st->stx_mode);
+}
+
+int is_executable(const char *path) {
+    const struct statx *st = stat_cached(path, 1);
+    return st && S_ISREG(st->stx_mode) && may_access(st, X_OK);
+}
+
+static int time_after(const struct statx_timestamp *a, const struct statx_timestamp *b) {
+    return a->tv_sec != b->tv_sec ? a->tv_sec > b->tv_sec : a->tv_nsec > b->tv_nsec;
+}
+
+static int file_test(int op, const char *path) {
+    const struct statx *st = stat_cached(path, op != 'h' && op != 'L');
+    if (!st) return 0;
+
+    unsigned mode = st->stx_mode;
+    switch (op) {
+        case 'a':
+        case 'e': return 1;
+        case 'f': return S_ISREG(mode);
+        case 'd': return S_ISDIR(mode);
+        case 'b': return S_ISBLK(mode);
+        case 'c': return S_ISCHR(mode);
+        case 'p': return S_ISFIFO(mode);
+        case 'S': return S_ISSOCK(mode);
+        case 'h':
+        case 'L': return S_ISLNK(mode);
+        case 's': return st->stx_size > 0;
+        case 'g': return (mode & S_ISGID) != 0;
+        case 'u': return (mode & S_ISUID) != 0;
+        case 'k': return (mode & S_ISVTX) != 0;
+        case 'r': return may_access(st, R_OK);
+        case 'w': return may_access(st, W_OK);
+        case 'x': return may_access(st, X_OK);
+        case 'O': return st->stx_uid == geteuid();
+        case 'G': return st->stx_gid == getegid();
+        case 'N': return time_after(&st->stx_mtime, &st->stx_atime);
+    }
+    return 0;
+}
+
+static int unary_test(int op, const char *arg) {
+    switch (op) {
+        case 'z': return *arg == '\0';
+        case 'n': return *arg != '\0';
+        case 'v': return var_lookup(arg, strlen(arg)) != NULL;
+        case 't': {
+            char *end;
+            long fd = strtol(arg, &end, 10);
+            return *arg && !*end && fd >= 0 && fd <= INT_MAX && isatty((int)fd);
+        }
+    }
+    return file_test(op, arg);
+}
+
+// -nt, -ot and -ef
+static int file_compare(int op, const char *a, const char *b) {
+    const struct statx *sa = stat_cached(a, 1);
+    struct statx_timestamp ta = {0};
+    unsigned long long dev = 0, ino = 0;
+    if (sa) {
+        ta = sa->stx_mtime;
+        dev = makedev(sa->stx_dev_major, sa->stx_dev_minor);
+        ino = sa->stx_ino;
+    }
+    // The second lookup may evict the first entry
+    const struct statx *sb = stat_cached(b, 1);
+
+    switch (op) {
+        case COND_NEWER: return sa && (!sb || time_after(&ta, &sb->stx_mtime));
+        case COND_OLDER: return sb && (!sa || time_after(&sb->stx_mtime, &ta));
+    }
+    return sa && sb && dev == makedev(sb->stx_dev_major, sb->stx_dev_minor) && ino == sb->stx_ino;
+}
+
+// Evaluate an operand of -eq and friends as an arithmetic expression
+static int cond_number(const char *text, long long *value) {
+    *value = 0;
+    size_t len = strlen(text);
+    if (len == 0) return 0;
+    if (arith_parse_number(text, len, value) == 0) return 0;
+    ArithExpr *e = arith_cached(text, len, 0);
+    return e && arith_evaluate(e, value) == 0 ? 0 : -1;
+}
+
+static void cond_regex_free(void *ptr) {
+    CondRegex *r = ptr;
+    if (r->text) regfree(&r->re);
+    free(r->text);
+    free(r);
+}
+
+// The regex cached on e for pattern text pat, compiling it if the text
+// differs from the last one used there
+static regex_t *cond_regex(CondExpr *e, Script *owner, const char *pat) {
+    size_t len = strlen(pat);
+    CondRegex *r = e->regex;
+    if (r && r->text && r->len == len && memcmp(r->text, pat, len) == 0) return &r->re;
+
+    if (!r) {
+        r = calloc(1, sizeof(CondRegex));
+        if (!r) {
+            print_error("malloc: failed to allocate memory");
+            return NULL;
+        }
+        e->regex = r;
+        if (owner) script_attach(owner, r, cond_regex_free);
+    }
+    if (r->text) {
+        regfree(&r->re);
+        free(r->text);
+        r->text = NULL;
+    }
+
+    int rc = regcomp(&r->re, pat, REG_EXTENDED);
+    if (rc != 0) {
+        char msg[256];
+        regerror(rc, &r->re, msg, sizeof(msg));
+        print_error("[[: %s: %s", pat, msg);
+        return NULL;
+    }
+    if (!(r->text = strndup(pat, len))) {
+        regfree(&r->re);
+        print_error("malloc: failed to allocate memory");
+        return NULL;
+    }
+    r->len = len;
+    return &r->re;
+}
+
+// subject =~ regex, setting BASH_REMATCH to the match and its groups
+static int regex_test(CondExpr *e, Script *owner, const char *subject, const char *pat) {
+    regex_t *re = cond_regex(e, owner, pat);
+    if (!re) return -EXIT_USAGE;
+
+    regmatch_t m[COND_MAX_GROUPS];
+    size_t groups = re->re_nsub + 1 < COND_MAX_GROUPS ? re->re_nsub + 1 : COND_MAX_GROUPS;
+    int matched = regexec(re, subject, groups, m, 0) == 0;
+
+    Array *a = array_new(0);
+    if (!a) return -EXIT_FAILURE;
+    for (size_t i = 0; matched && i < groups; i++) {
+        const char *text = m[i].rm_so < 0 ? "" : subject + m[i].rm_so;
+        size_t len = m[i].rm_so < 0 ? 0 : (size_t)(m[i].rm_eo - m[i].rm_so);
+        if (array_set(a, i, text, len) != 0) {
+            array_free(a);
+            return -EXIT_FAILURE;
+        }
+    }
+    if (var_set_array("BASH_REMATCH", 12, a) != 0) return -EXIT_FAILURE;
+    return matched;
+}
+
+static int binary_test(CondExpr *e, Script *owner, Arena *arena) {
+    Word *l = &e->word[0], *r = &e->word[1];
+    char *left = expand_string(l->text, l->len, arena);
+    if (!left) return -EXIT_FAILURE;
+
+    char *right;
+    switch (e->op) {
+        case COND_STR_EQ:
+        case COND_STR_NE: {
+            if (!(right = expand_pattern(r->text, r->len, arena))) return -EXIT_FAILURE;
+            const Pattern *p = pattern_cached(right, strlen(right), 0);
+            if (!p) return -EXIT_FAILURE;
+            return pattern_match(p, left, strlen(left)) == (e->op == COND_STR_EQ);
+        }
+        case COND_MATCH:
+            if (!(right = expand_regex(r->text, r->len, arena))) return -EXIT_FAILURE;
+            return regex_test(e, owner, left, right);
+    }
+
+    if (!(right = expand_string(r->text, r->len, arena))) return -EXIT_FAILURE;
+    long long a, b;
+    switch (e->op) {
+        case COND_STR_LT: return strcoll(left, right) < 0;
+        case COND_STR_GT: return strcoll(left, right) > 0;
+        case COND_NEWER:
+        case COND_OLDER:
+        case COND_SAME_FILE:
+            return file_compare(e->op, left, right);
+    }
+    if (cond_number(left, &a) != 0 || cond_number(right, &b) != 0) return -EXIT_FAILURE;
+    switch (e->op) {
+        case COND_INT_EQ: return a == b;
+        case COND_INT_NE: return a != b;
+        case COND_INT_LT: return a < b;
+        case COND_INT_LE: return a <= b;
+        case COND_INT_GT: return a > b;
+        case COND_INT_GE: return a >= b;
+    }
+    return -EXIT_FAILURE;
+}
+
+// Evaluate e. Returns 1 if it is true, 0 if false, or a negated exit
+// status on error.
+int cond_evaluate(CondExpr *e, Script *owner, Arena *arena) {
+    int rc;
+    char *arg;
+    switch (e->type) {
+        case COND_AND:
+            rc = cond_evaluate(e->left, owner, arena);
+            return rc == 1 ? cond_evaluate(e->right, owner, arena) : rc;
+        case COND_OR:
+            rc = cond_evaluate(e->left, owner, arena);
+            return rc == 0 ? cond_evaluate(e->right, owner, arena) : rc;
+        case COND_NOT:
+            rc = cond_evaluate(e->left, owner, arena);
+            return rc < 0 ? rc : !rc;
+        case COND_UNARY:
+            if (!(arg = expand_string(e->word[0].text, e->word[0].len, arena))) return -EXIT_FAILURE;
+            return unary_test(e->op, arg);
+        case COND_BINARY:
+            return binary_test(e, owner, arena);
+        case COND_WORD:
+            if (!(arg = expand_string(e->word[0].text, e->word[0].len, arena))) return -EXIT_FAILURE;
+            return *arg != '\0';
+    }
+    return -EXIT_FAILURE;
+}
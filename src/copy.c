@@ -0,0 +1,786 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+#include "shell.h"
+
+// Moving data between descriptors: the cat, tee and cp builtins.
+//
+// Data stays in the kernel where the descriptor types allow it:
+// copy_file_range between regular files, splice when either side is a
+// pipe, and sendfile from a regular file to anything else. tee reading
+// a pipe duplicates each chunk with tee() into one of two scratch pipes
+// and splices it out to every destination in turn, so no byte passes
+// through user space. Whatever the kernel refuses, such as a terminal
+// or a file opened for appending, goes through a read/write loop with a
+// large buffer.
+//
+// cp walks its sources in the shell, creating directories and links as
+// it goes and collecting the regular files; the entries of a directory
+// are stated in one batch of file operations. A pool of threads then takes
+// files from the list; each is cloned with FICLONE where the filesystem
+// shares extents, and copied with copy_file_range otherwise. Errors are
+// kept with the file and reported in order once the pool is done.
+//
+// Options beyond the common ones, and reading from a terminal, are left
+// to the external commands so that Ctrl-C can stop them: the builtins
+// return EXIT_DEFER and the name is looked up in PATH as usual.
+
+#define COPY_CHUNK       (1 << 30)
+#define COPY_BUFFER_SIZE (128 * 1024)
+#define TEE_CHUNK        (64 * 1024)
+#define CP_MIN_WORKERS   4      // small files wait on the disk, not a CPU
+#define CP_MAX_WORKERS   32
+
+enum { COPY_RANGE, COPY_SPLICE, COPY_SENDFILE, COPY_BUFFER };
+
+// A destination of tee
+typedef struct {
+    const char *name;
+    int fd;             // -1: standard output is being captured
+    int splice;         // splice into it has not been refused
+    int failed;         // a write failed; its data is dropped
+} Sink;
+
+// A regular file for cp to copy
+typedef struct {
+    char *src;
+    char *dst;
+    off_t size;
+    mode_t mode;
+    int err;            // errno of a failed copy, or 0
+    int at_dst;         // err refers to dst rather than src
+} CopyJob;
+
+// A directory created writable, to be given its own mode at the end
+typedef struct {
+    char *path;
+    mode_t mode;
+} CopyDir;
+
+typedef struct {
+    CopyJob *jobs;
+    size_t count, cap;
+    size_t next;        // next job to hand out, taken atomically
+    CopyDir *dirs;
+    size_t ndirs, dcap;
+    int recursive;
+    int status;
+    dev_t top_dev;      // the directory being created by the current
+    ino_t top_ino;      // top-level source, never copied into itself
+} CopyPlan;
+
+static char copy_buf[COPY_BUFFER_SIZE];
+
+// Did the kernel refuse the zero-copy call for this pair of descriptors,
+// rather than fail to move the data?
+static int refused(int err) {
+    return err == EINVAL || err == ENOSYS || err == EXDEV || err == EOPNOTSUPP || err == EBADF;
+}
+
+static int write_full(int fd, const char *p, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += w;
+        n -= w;
+    }
+    return 0;
+}
+
+static ssize_t read_some(int fd, char *p, size_t n) {
+    ssize_t r;
+    while ((r = read(fd, p, n)) < 0 && errno == EINTR) {}
+    return r;
+}
+
+// Copy in to out until end of file, using buf if the kernel cannot move
+// the data itself. Returns 0, or -1 with errno set.
+static int copy_data(int in, int out, char *buf, size_t size) {
+    struct stat si, so;
+    if (fstat(in, &si) != 0 || fstat(out, &so) != 0) return -1;
+
+    int method = S_ISREG(si.st_mode) && S_ISREG(so.st_mode) ? COPY_RANGE
+               : S_ISFIFO(si.st_mode) || S_ISFIFO(so.st_mode) ? COPY_SPLICE
+               : S_ISREG(si.st_mode) ? COPY_SENDFILE
+               : COPY_BUFFER;
+
+    // Without offsets every call advances the file positions, so the
+    // buffered loop can take over from where a refused call left off
+    while (method != COPY_BUFFER) {
+        ssize_t n;
+        if (method == COPY_RANGE) n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0);
+        else if (method == COPY_SPLICE) n = splice(in, NULL, out, NULL, COPY_CHUNK, SPLICE_F_MOVE);
+        else n = sendfile(out, in, NULL, COPY_CHUNK);
+        if (n == 0) return 0;
+        if (n > 0 || errno == EINTR) continue;
+        if (!refused(errno)) return -1;
+        method = COPY_BUFFER;
+    }
+
+    for (;;) {
+        ssize_t n = read_some(in, buf, size);
+        if (n <= 0) return n;
+        if (write_full(out, buf, n) != 0) return -1;
+    }
+}
+
+int copy_fd(int in, int out) {
+    return copy_data(in, out, copy_buf, sizeof(copy_buf));
+}
+
+// Copy in to standard output while it is being captured
+static int copy_to_capture(int in) {
+    for (;;) {
+        ssize_t n = read_some(in, copy_buf, sizeof(copy_buf));
+        if (n <= 0) return n;
+        out_write(STDOUT_FILENO, copy_buf, n);
+    }
+}
+
+int cmd_cat(char **args) {
+    int i = 1;
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        if (strcmp(args[i], "-u") != 0) return EXIT_DEFER;  // output is never buffered
+    }
+
+    char *stdin_only[] = {"-", NULL};
+    char **files = args[i] ? args + i : stdin_only;
+    for (i = 0; files[i]; i++) {
+        if (strcmp(files[i], "-") == 0 && isatty(STDIN_FILENO)) return EXIT_DEFER;
+    }
+
+    int captured = out_direct(STDOUT_FILENO) != 0;
+    struct stat so;
+    int out_regular = !captured && fstat(STDOUT_FILENO, &so) == 0 && S_ISREG(so.st_mode);
+
+    int status = EXIT_SUCCESS;
+    for (i = 0; files[i]; i++) {
+        int from_stdin = strcmp(files[i], "-") == 0;
+        int fd = from_stdin ? STDIN_FILENO : open(files[i], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            print_error("cat: %s: %s", files[i], strerror(errno));
+            status = EXIT_FAILURE;
+            continue;
+        }
+
+        // Copying a file into itself would never reach its end
+        struct stat si;
+        int rc = 0;
+        if (out_regular && fstat(fd, &si) == 0 && si.st_dev == so.st_dev && si.st_ino == so.st_ino &&
+            lseek(fd, 0, SEEK_CUR) < si.st_size) {
+            print_error("cat: %s: input file is output file", files[i]);
+            status = EXIT_FAILURE;
+        } else {
+            rc = captured ? copy_to_capture(fd) : copy_fd(fd, STDOUT_FILENO);
+        }
+        int err = errno;
+        if (!from_stdin) close(fd);
+        if (rc != 0) {
+            // A reader that went away ends the command quietly, as
+            // SIGPIPE would have
+            if (err == EPIPE) return EXIT_FAILURE;
+            print_error("cat: %s: %s", files[i], strerror(err));
+            status = EXIT_FAILURE;
+        }
+    }
+    return status;
+}
+
+static void sink_fail(Sink *s, int err) {
+    if (s->failed) return;
+    s->failed = 1;
+    if (err != EPIPE) print_error("tee: %s: %s", s->name, strerror(err));
+}
+
+static void sink_write(Sink *s, const char *p, size_t n) {
+    if (s->failed) return;
+    if (s->fd < 0) {
+        out_write(STDOUT_FILENO, p, n);
+    } else if (write_full(s->fd, p, n) != 0) {
+        sink_fail(s, errno);
+    }
+}
+
+// Move exactly n bytes out of pipe into s, or drop them if s has failed
+static int sink_drain(Sink *s, int pipe, size_t n) {
+    while (n > 0) {
+        if (!s->failed && s->splice) {
+            ssize_t r = splice(pipe, NULL, s->fd, NULL, n, SPLICE_F_MOVE);
+            if (r > 0) {
+                n -= r;
+            } else if (r < 0 && errno != EINTR) {
+                if (refused(errno)) s->splice = 0;
+                else sink_fail(s, errno);
+            }
+            continue;
+        }
+        ssize_t r = read_some(pipe, copy_buf, n < sizeof(copy_buf) ? n : sizeof(copy_buf));
+        if (r <= 0) return -1;
+        sink_write(s, copy_buf, r);
+        n -= r;
+    }
+    return 0;
+}
+
+// Hand n bytes waiting in pipe to every sink through the buffer
+static int spill(int pipe, size_t n, Sink *sinks, int count) {
+    while (n > 0) {
+        ssize_t r = read_some(pipe, copy_buf, n < sizeof(copy_buf) ? n : sizeof(copy_buf));
+        if (r <= 0) return -1;
+        for (int i = 0; i < count; i++) sink_write(&sinks[i], copy_buf, r);
+        n -= r;
+    }
+    return 0;
+}
+
+// Is there a sink still taking data?
+static int sinks_left(const Sink *sinks, int count) {
+    for (int i = 0; i < count; i++) {
+        if (!sinks[i].failed) return 1;
+    }
+    return 0;
+}
+
+// Copy standard input, a pipe, to every sink until every sink has
+// failed. A chunk is duplicated into a scratch pipe before the pipe
+// holding it is spliced out, so the last sink takes the final copy.
+// Returns 0, 1 if tee() is refused before anything was copied, or -1
+// with errno set on a read error.
+static int tee_spliced(Sink *sinks, int count) {
+    int scratch[2][2];
+    if (pipe2(scratch[0], O_CLOEXEC) != 0) return 1;
+    if (pipe2(scratch[1], O_CLOEXEC) != 0) {
+        close(scratch[0][0]);
+        close(scratch[0][1]);
+        return 1;
+    }
+
+    int rc = 0, copied = 0;
+    for (;;) {
+        ssize_t m = tee(STDIN_FILENO, scratch[0][1], TEE_CHUNK, 0);
+        if (m == 0) break;
+        if (m < 0) {
+            if (errno == EINTR) continue;
+            rc = copied || !refused(errno) ? -1 : 1;
+            break;
+        }
+        copied = 1;
+
+        int src = STDIN_FILENO;
+        for (int i = 0; i < count; i++) {
+            // Both scratch pipes have the same capacity, and the one
+            // being filled is empty, so the whole chunk fits
+            int *dst = scratch[i % 2];
+            if (i > 0 && i < count - 1) {
+                ssize_t n = tee(src, dst[1], m, 0);
+                if (n != m) {
+                    Sink drop = {NULL, -1, 0, 1};
+                    if (n > 0) sink_drain(&drop, dst[0], n);
+                    if (spill(src, m, sinks + i, count - i) != 0) rc = -1;
+                    break;
+                }
+            }
+            if (sink_drain(&sinks[i], src, m) != 0) {
+                rc = -1;
+                break;
+            }
+            src = dst[0];
+        }
+        if (rc != 0 || !sinks_left(sinks, count)) break;
+    }
+
+    for (int k = 0; k < 2; k++) {
+        close(scratch[k][0]);
+        close(scratch[k][1]);
+    }
+    return rc;
+}
+
+// Copy standard input to every sink through the buffer, until the end
+// of input or until every sink has failed
+static int tee_buffered(Sink *sinks, int count) {
+    for (;;) {
+        ssize_t n = read_some(STDIN_FILENO, copy_buf, sizeof(copy_buf));
+        if (n <= 0) return n;
+        for (int i = 0; i < count; i++) sink_write(&sinks[i], copy_buf, n);
+        if (!sinks_left(sinks, count)) return 0;
+    }
+}
+
+// tee [-ai] [file...]
+//
+// Like GNU tee, a file that cannot be opened or written is reported and
+// dropped while the copy goes on to the others, and the status is then
+// 1. Input is only left unread once no destination is left.
+int cmd_tee(char **args) {
+    int append = 0, ignore_int = 0;
+    int i = 1;
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        const char *p = args[i] + 1;
+        if (strspn(p, "ai") != strlen(p)) return EXIT_DEFER;
+        for (; *p; p++) {
+            if (*p == 'a') append = 1;
+            else ignore_int = 1;
+        }
+    }
+    if (isatty(STDIN_FILENO)) return EXIT_DEFER;
+
+    int count = 0;
+    for (int k = i; args[k]; k++) count++;
+    Sink *sinks = calloc(count + 1, sizeof(Sink));
+    if (!sinks) {
+        print_error("malloc: failed to allocate memory");
+        return EXIT_FAILURE;
+    }
+
+    int status = EXIT_SUCCESS;
+    int captured = out_direct(STDOUT_FILENO) != 0;
+    sinks[0] = (Sink){"standard output", captured ? -1 : STDOUT_FILENO, !captured, 0};
+    count = 1;
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC);
+    for (; args[i]; i++) {
+        int fd = open(args[i], flags, 0666);
+        if (fd < 0) {
+            print_error("tee: %s: %s", args[i], strerror(errno));
+            status = EXIT_FAILURE;
+            continue;
+        }
+        sinks[count++] = (Sink){args[i], fd, 1, 0};
+    }
+
+    struct sigaction ignore = {.sa_handler = SIG_IGN}, saved;
+    if (ignore_int) sigaction(SIGINT, &ignore, &saved);
+
+    struct stat si;
+    int rc;
+    if (count == 1 && !captured) {
+        rc = copy_fd(STDIN_FILENO, STDOUT_FILENO);
+        if (rc != 0 && errno == EPIPE) {
+            sinks[0].failed = 1;
+            rc = 0;
+        }
+    } else {
+        rc = count > 1 && fstat(STDIN_FILENO, &si) == 0 && S_ISFIFO(si.st_mode) ? tee_spliced(sinks, count) : 1;
+        if (rc == 1) rc = tee_buffered(sinks, count);
+    }
+    if (rc != 0) {
+        print_error("tee: %s", strerror(errno));
+        status = EXIT_FAILURE;
+    }
+
+    if (ignore_int) sigaction(SIGINT, &saved, NULL);
+    for (int k = 0; k < count; k++) {
+        if (sinks[k].failed) status = EXIT_FAILURE;
+        if (k > 0 && close(sinks[k].fd) != 0 && !sinks[k].failed) {
+            print_error("tee: %s: %s", sinks[k].name, strerror(errno));
+            status = EXIT_FAILURE;
+        }
+    }
+    free(sinks);
+    return status;
+}
+
+static char *path_join(const char *dir, const char *name) {
+    size_t dlen = strlen(dir), nlen = strlen(name);
+    int slash = dlen > 0 && dir[dlen - 1] != '/';
+    char *path = malloc(dlen + slash + nlen + 1);
+    if (!path) return NULL;
+    memcpy(path, dir, dlen);
+    if (slash) path[dlen] = '/';
+    memcpy(path + dlen + slash, name, nlen + 1);
+    return path;
+}
+
+// The last component of path, ignoring trailing slashes
+static char *path_last(const char *path) {
+    size_t end = strlen(path);
+    while (end > 1 && path[end - 1] == '/') end--;
+    size_t start = end;
+    while (start > 0 && path[start - 1] != '/') start--;
+    return strndup(path + start, end - start);
+}
+
+static int plan_push(CopyPlan *p, char *src, char *dst, const struct stat *st) {
+    if (p->count == p->cap) {
+        size_t cap = p->cap ? p->cap * 2 : 64;
+        CopyJob *jobs = realloc(p->jobs, cap * sizeof(CopyJob));
+        if (!jobs) return -1;
+        p->jobs = jobs;
+        p->cap = cap;
+    }
+    p->jobs[p->count++] = (CopyJob){src, dst, st->st_size, st->st_mode, 0, 0};
+    return 0;
+}
+
+static int plan_dir(CopyPlan *p, const char *dst, mode_t mode) {
+    if (p->ndirs == p->dcap) {
+        size_t cap = p->dcap ? p->dcap * 2 : 16;
+        CopyDir *dirs = realloc(p->dirs, cap * sizeof(CopyDir));
+        if (!dirs) return -1;
+        p->dirs = dirs;
+        p->dcap = cap;
+    }
+    char *path = strdup(dst);
+    if (!path) return -1;
+    p->dirs[p->ndirs++] = (CopyDir){path, mode};
+    return 0;
+}
+
+static void plan_fail(CopyPlan *p, const char *path) {
+    print_error("cp: %s: %s", path, strerror(errno));
+    p->status = EXIT_FAILURE;
+}
+
+static void plan_entry(CopyPlan *p, char *src, char *dst, const struct stat *st, int top);
+
+// An entry of a directory being copied, with its status
+typedef struct {
+    char *src;
+    struct statx stx;
+    int error;          // errno of a failed statx, or 0
+} CopyEntry;
+
+// Read the entries of the open directory src, stating them all in one
+// batch. Returns their number, or -1 with errno set.
+static long read_entries(DIR *dir, const char *src, CopyEntry **out) {
+    CopyEntry *entries = NULL;
+    size_t n = 0, cap = 0;
+    struct dirent *e;
+    while ((e = readdir(dir))) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            CopyEntry *grown = realloc(entries, cap * sizeof(CopyEntry));
+            if (!grown) break;
+            entries = grown;
+        }
+        if (!(entries[n].src = path_join(src, e->d_name))) break;
+        n++;
+    }
+
+    FileOp *ops = e ? NULL : malloc((n ? n : 1) * sizeof(FileOp));
+    if (!ops) {
+        for (size_t k = 0; k < n; k++) free(entries[k].src);
+        free(entries);
+        errno = ENOMEM;
+        return -1;
+    }
+    for (size_t k = 0; k < n; k++) {
+        ops[k] = (FileOp){FOP_STATX, dirfd(dir), strrchr(entries[k].src, '/') + 1, AT_SYMLINK_NOFOLLOW,
+                          &entries[k].stx, STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_INO, 0};
+    }
+    file_ops_run(ops, n);
+    // Failures are reported when the entry is planned
+    for (size_t k = 0; k < n; k++) entries[k].error = ops[k].result < 0 ? (int)-ops[k].result : 0;
+    free(ops);
+    *out = entries;
+    return (long)n;
+}
+
+// Create dst for the directory src and plan copies of its entries
+static void plan_tree(CopyPlan *p, const char *src, const char *dst, const struct stat *st, int top) {
+    if (!top && st->st_dev == p->top_dev && st->st_ino == p->top_ino) {
+        print_error("cp: cannot copy a directory, '%s', into itself", src);
+        p->status = EXIT_FAILURE;
+        return;
+    }
+
+    // Files are created inside it before it gets its own mode
+    mode_t mode = st->st_mode & 07777;
+    struct stat ds;
+    if (mkdir(dst, mode | S_IRWXU) != 0 && (errno != EEXIST || stat(dst, &ds) != 0 || !S_ISDIR(ds.st_mode))) {
+        if (errno == EEXIST) errno = ENOTDIR;
+        plan_fail(p, dst);
+        return;
+    }
+    if ((mode & S_IRWXU) != S_IRWXU && plan_dir(p, dst, mode) != 0) {
+        plan_fail(p, dst);
+        return;
+    }
+    if (top && stat(dst, &ds) == 0) {
+        p->top_dev = ds.st_dev;
+        p->top_ino = ds.st_ino;
+    }
+
+    DIR *dir = opendir(src);
+    if (!dir) {
+        plan_fail(p, src);
+        return;
+    }
+    CopyEntry *entries;
+    long n = read_entries(dir, src, &entries);
+    closedir(dir);
+    if (n < 0) {
+        plan_fail(p, src);
+        return;
+    }
+
+    for (long k = 0; k < n; k++) {
+        CopyEntry *e = &entries[k];
+        char *d = path_join(dst, strrchr(e->src, '/') + 1);
+        if (!d) {
+            errno = ENOMEM;
+            plan_fail(p, e->src);
+            free(e->src);
+        } else if (e->error) {
+            errno = e->error;
+            plan_fail(p, e->src);
+            free(e->src);
+            free(d);
+        } else {
+            struct stat est = {0};
+            est.st_mode = e->stx.stx_mode;
+            est.st_size = e->stx.stx_size;
+            est.st_ino = e->stx.stx_ino;
+            est.st_dev = makedev(e->stx.stx_dev_major, e->stx.stx_dev_minor);
+            plan_entry(p, e->src, d, &est, 0);
+        }
+    }
+    free(entries);
+}
+
+// Plan the copy of src to dst, taking ownership of both paths
+static void plan_copy(CopyPlan *p, char *src, char *dst) {
+    struct stat st;
+    // Recursive copies keep symbolic links as they are
+    if ((p->recursive ? lstat(src, &st) : stat(src, &st)) != 0) {
+        plan_fail(p, src);
+        free(src);
+        free(dst);
+        return;
+    }
+    plan_entry(p, src, dst, &st, 1);
+}
+
+// Plan the copy of src, described by st, to dst, taking ownership of
+// both paths. Regular files are queued; everything else is made on the
+// spot.
+static void plan_entry(CopyPlan *p, char *src, char *dst, const struct stat *st, int top) {
+    if (S_ISREG(st->st_mode)) {
+        struct stat ds;
+        if (top && stat(dst, &ds) == 0 && ds.st_dev == st->st_dev && ds.st_ino == st->st_ino) {
+            print_error("cp: '%s' and '%s' are the same file", src, dst);
+            p->status = EXIT_FAILURE;
+        } else if (plan_push(p, src, dst, st) == 0) {
+            return;
+        } else {
+            plan_fail(p, src);
+        }
+    } else if (S_ISDIR(st->st_mode)) {
+        if (p->recursive) {
+            plan_tree(p, src, dst, st, top);
+        } else {
+            print_error("cp: -r not specified; omitting directory '%s'", src);
+            p->status = EXIT_FAILURE;
+        }
+    } else if (S_ISLNK(st->st_mode)) {
+        char target[MAX_PATH_LENGTH];
+        ssize_t n = readlink(src, target, sizeof(target) - 1);
+        if (n < 0) {
+            plan_fail(p, src);
+        } else {
+            target[n] = '\0';
+            if (symlink(target, dst) != 0 && (errno != EEXIST || unlink(dst) != 0 || symlink(target, dst) != 0)) {
+                plan_fail(p, dst);
+            }
+        }
+    } else if (S_ISFIFO(st->st_mode)) {
+        if (mkfifo(dst, st->st_mode & 07777) != 0 && errno != EEXIST) plan_fail(p, dst);
+    } else {
+        print_error("cp: %s: unsupported file type", src);
+        p->status = EXIT_FAILURE;
+    }
+    free(src);
+    free(dst);
+}
+
+static void copy_job(CopyJob *j, char *buf, size_t size) {
+    int in = open(j->src, O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        j->err = errno;
+        return;
+    }
+    int out = open(j->dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, j->mode & 07777);
+    if (out < 0) {
+        j->err = errno;
+        j->at_dst = 1;
+        close(in);
+        return;
+    }
+    // A clone shares the source's extents; copy_file_range may still do
+    // the same on filesystems that only support it there
+    if (ioctl(out, FICLONE, in) != 0) {
+        if (!buf) {
+            j->err = ENOMEM;
+        } else if (copy_data(in, out, buf, size) != 0) {
+            j->err = errno;
+        }
+        j->at_dst = 1;
+    }
+    if (close(out) != 0 && !j->err) {
+        j->err = errno;
+        j->at_dst = 1;
+    }
+    close(in);
+}
+
+static void *copy_worker(void *arg) {
+    CopyPlan *p = arg;
+    char *buf = malloc(COPY_BUFFER_SIZE);
+    for (;;) {
+        size_t k = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED);
+        if (k >= p->count) break;
+        copy_job(&p->jobs[k], buf, COPY_BUFFER_SIZE);
+    }
+    free(buf);
+    return NULL;
+}
+
+// Copy every planned file with up to workers threads, the shell's
+// included
+static void copy_files(CopyPlan *p, int workers) {
+    if ((size_t)workers > p->count) workers = (int)p->count;
+    pthread_t threads[CP_MAX_WORKERS];
+    int started = 0;
+    while (started < workers - 1 && pthread_create(&threads[started], NULL, copy_worker, p) == 0) {
+        started++;
+    }
+    copy_worker(p);
+    for (int k = 0; k < started; k++) pthread_join(threads[k], NULL);
+}
+
+static double elapsed_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// cp [-rRv] [-j jobs] source... dest
+int cmd_cp(char **args) {
+    CopyPlan plan = {0};
+    int verbose = 0;
+    long workers = 0;
+    int i = 1;
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (const char *p = args[i] + 1; *p; p++) {
+            if (*p == 'r' || *p == 'R') {
+                plan.recursive = 1;
+            } else if (*p == 'v') {
+                verbose = 1;
+            } else if (*p == 'j') {
+                const char *value = p[1] ? p + 1 : args[++i];
+                char *end;
+                workers = value ? strtol(value, &end, 10) : -1;
+                if (!value || *end || workers < 1) {
+                    print_error("cp: %s: invalid number of jobs", value ? value : "-j");
+                    return EXIT_USAGE;
+                }
+                break;
+            } else {
+                return EXIT_DEFER;
+            }
+        }
+    }
+
+    int nsrc = 0;
+    while (args[i + nsrc]) nsrc++;
+    if (nsrc < 2) {
+        print_error("cp: usage: cp [-rv] [-j jobs] source... dest");
+        return EXIT_USAGE;
+    }
+    const char *dest = args[i + --nsrc];
+    struct stat ds;
+    int into_dir = stat(dest, &ds) == 0 && S_ISDIR(ds.st_mode);
+    if (nsrc > 1 && !into_dir) {
+        print_error("cp: target '%s' is not a directory", dest);
+        return EXIT_FAILURE;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int k = 0; k < nsrc; k++) {
+        const char *src = args[i + k];
+        char *name = into_dir ? path_last(src) : NULL;
+        char *s = strdup(src);
+        char *d = into_dir ? (name ? path_join(dest, name) : NULL) : strdup(dest);
+        free(name);
+        if (!s || !d) {
+            free(s);
+            free(d);
+            print_error("malloc: failed to allocate memory");
+            plan.status = EXIT_FAILURE;
+            break;
+        }
+        plan.top_dev = 0;
+        plan.top_ino = 0;
+        plan_copy(&plan, s, d);
+    }
+
+    if (workers == 0) {
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+        if (workers < CP_MIN_WORKERS) workers = CP_MIN_WORKERS;
+    }
+    if (workers > CP_MAX_WORKERS) workers = CP_MAX_WORKERS;
+    copy_files(&plan, (int)workers);
+
+    off_t bytes = 0;
+    size_t copied = 0;
+    for (size_t k = 0; k < plan.count; k++) {
+        CopyJob *j = &plan.jobs[k];
+        if (j->err) {
+            print_error("cp: %s: %s", j->at_dst ? j->dst : j->src, strerror(j->err));
+            plan.status = EXIT_FAILURE;
+        } else {
+            bytes += j->size;
+            copied++;
+        }
+        free(j->src);
+        free(j->dst);
+    }
+    free(plan.jobs);
+
+    // Directories that were created writable get their own mode now
+    mode_t mask = umask(0);
+    umask(mask);
+    for (size_t k = plan.ndirs; k-- > 0;) {
+        if (chmod(plan.dirs[k].path, plan.dirs[k].mode & ~mask) != 0) plan_fail(&plan, plan.dirs[k].path);
+        free(plan.dirs[k].path);
+    }
+    free(plan.dirs);
+
+    if (verbose) {
+        double secs = elapsed_since(&start);
+        out_printf(STDOUT_FILENO, "cp: %zu files, %s in %.3fs", copied, format_size(bytes), secs);
+        if (secs > 0) out_printf(STDOUT_FILENO, " (%s/s)", format_size((off_t)(bytes / secs)));
+        out_putc(STDOUT_FILENO, '\n');
+    }
+    return plan.status;
+}
@@ -0,0 +1,2104 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include "shell.h"
+
+// Executor: walks the syntax tree produced by the parser.
+//
+// Expansion results live in one arena that each command rolls back to
+// where it found it, so nested execution (function calls, loop bodies)
+// never frees strings its caller is still using. Argument vectors come
+// from a pool indexed by nesting depth for the same reason.
+
+#define FUNC_MAX_DEPTH 1000
+#define REDIR_MAX 32
+#define HEREDOC_PIPE_MAX 65536
+#define FOR_MAX_FAILURES 100
+#define FOR_READ_SIZE 65536
+
+static Arena exec_arena;
+
+static ArgvBuilder **argv_pool;
+static int argv_pool_size;
+static int argv_pool_used;
+
+// Control flow requested by break, continue and return
+static int loop_depth;
+static int func_depth;
+static int source_depth;
+static int breaking;        // loops left to break out of
+static int continuing;      // loops left to skip to the next iteration of
+static int returning;
+static int return_status;
+static int interrupted;     // a foreground command died of SIGINT
+
+// Set in a forked child whose next simple command may replace it
+static int exec_in_place;
+
+// Pipe ends held for pipeline stages that run inside the shell, and the
+// signal mask to restore once one of them has run with SIGPIPE blocked
+static int *stage_fds;
+static int stage_fd_count;
+static sigset_t stage_mask;
+static int stage_masked;
+
+static int subst_status;        // status of the last command substitution
+static unsigned long subst_count;
+
+static int is_pure(const Node *n, int depth);
+
+// Shell functions: an open-addressed table of pre-parsed bodies. Each
+// entry holds a reference to the Script its body lives in.
+typedef struct {
+    char *name;
+    Node *body;
+    unsigned int hash;
+} ShellFunction;
+
+#define FUNC_TOMBSTONE ((char *)-1)
+
+static ShellFunction *func_table;
+static size_t func_capacity;
+static size_t func_used;
+
+static unsigned int hash_name(const char *name) {
+    unsigned int h = 2166136261u;
+    for (; *name; name++) {
+        h ^= (unsigned char)*name;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static ShellFunction *function_slot(const char *name, unsigned int hash, int for_insert) {
+    if (func_capacity == 0) return NULL;
+    ShellFunction *tomb = NULL;
+    size_t mask = func_capacity - 1;
+
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        ShellFunction *f = &func_table[i];
+        if (!f->name) return (for_insert && tomb) ? tomb : (for_insert ? f : NULL);
+        if (f->name == FUNC_TOMBSTONE) {
+            if (!tomb) tomb = f;
+        } else if (f->hash == hash && strcmp(f->name, name) == 0) {
+            return f;
+        }
+    }
+}
+
+static int function_grow(void) {
+    size_t cap = func_capacity ? func_capacity * 2 : 32;
+    ShellFunction *table = calloc(cap, sizeof(ShellFunction));
+    if (!table) {
+        print_error("malloc: failed to allocate memory");
+        return -1;
+    }
+
+    ShellFunction *old = func_table;
+    size_t old_cap = func_capacity;
+    func_table = table;
+    func_capacity = cap;
+    func_used = 0;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].name && old[i].name != FUNC_TOMBSTONE) {
+            *function_slot(old[i].name, old[i].hash, 1) = old[i];
+            func_used++;
+        }
+    }
+    free(old);
+    return 0;
+}
+
+static ShellFunction *function_find(const char *name) {
+    return function_slot(name, hash_name(name), 0);
+}
+
+int function_exists(const char *name) {
+    return function_find(name) != NULL;
+}
+
+// Define or replace a function, keeping its script alive
+static int function_define(const char *name, Node *body) {
+    if ((func_used + 1) * 2 > func_capacity && function_grow() != 0) return -1;
+
+    unsigned int hash = hash_name(name);
+    ShellFunction *f = function_slot(name, hash, 1);
+    script_retain(body->owner);
+    if (f->name && f->name != FUNC_TOMBSTONE) {
+        script_release(f->body->owner);
+        f->body = body;
+        return 0;
+    }
+
+    char *copy = strdup(name);
+    if (!copy) {
+        script_release(body->owner);
+        return -1;
+    }
+    if (!f->name) func_used++;
+    f->name = copy;
+    f->body = body;
+    f->hash = hash;
+    return 0;
+}
+
+int function_remove(const char *name) {
+    ShellFunction *f = function_find(name);
+    if (!f) return 0;
+    script_release(f->body->owner);
+    free(f->name);
+    f->name = FUNC_TOMBSTONE;
+    f->body = NULL;
+    return 0;
+}
+
+// Argument vector for the current nesting level
+static ArgvBuilder *argv_acquire(void) {
+    if (argv_pool_used == argv_pool_size) {
+        int size = argv_pool_size ? argv_pool_size * 2 : 16;
+        ArgvBuilder **pool = realloc(argv_pool, size * sizeof(ArgvBuilder *));
+        if (!pool) {
+            print_error("malloc: failed to allocate memory");
+            return NULL;
+        }
+        for (int i = argv_pool_size; i < size; i++) pool[i] = NULL;
+        argv_pool = pool;
+        argv_pool_size = size;
+    }
+
+    ArgvBuilder **slot = &argv_pool[argv_pool_used];
+    if (!*slot && !(*slot = calloc(1, sizeof(ArgvBuilder)))) {
+        print_error("malloc: failed to allocate memory");
+        return NULL;
+    }
+    argv_pool_used++;
+    argv_reset(*slot);
+    return *slot;
+}
+
+static void argv_release(int count) {
+    argv_pool_used -= count;
+}
+
+// Stop executing a list because of break, continue, return or exit?
+static int unwinding(void) {
+    return breaking || continuing || returning || interrupted || !running;
+}
+
+// Decide what a loop does after its body ran. Returns 1 to leave the loop.
+static int loop_should_stop(void) {
+    if (returning || interrupted || !running) return 1;
+    if (breaking) {
+        breaking--;
+        return 1;
+    }
+    if (continuing) {
+        return --continuing > 0;
+    }
+    return 0;
+}
+
+// Reset signal dispositions and standard output in a forked child, and
+// let go of pipes held for stages running inside the shell
+static void child_setup(void) {
+    out_capture(NULL);
+    queue_forget();
+    joblog_forget();
+    cgroup_forget();
+    for (int k = 0; k < stage_fd_count; k++) {
+        if (stage_fds[k] >= 0) close(stage_fds[k]);
+    }
+    stage_fd_count = 0;
+    if (stage_masked) {
+        sigprocmask(SIG_SETMASK, &stage_mask, NULL);
+        stage_masked = 0;
+    }
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+}
+
+// Wait for a foreground child and convert its status
+int wait_for(pid_t pid) {
+    int status;
+    joblog_wait(pid);
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return EXIT_FAILURE;
+    }
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) {
+        if (WTERMSIG(status) == SIGINT) interrupted = 1;
+        return 128 + WTERMSIG(status);
+    }
+    return EXIT_FAILURE;
+}
+
+// Redirections are applied to the shell itself. The original descriptors
+// are kept on close-on-exec duplicates and restored afterwards; children
+// forked in between simply inherit the redirected descriptors.
+typedef struct {
+    int fd;
+    int saved;      // -1 if fd was closed before
+} SavedFd;
+
+typedef struct {
+    SavedFd fds[REDIR_MAX];
+    int count;
+} RedirState;
+
+static void restore_redirects(RedirState *rs) {
+    if (rs->count == 0) return;
+    out_flush();
+    for (int i = rs->count - 1; i >= 0; i--) {
+        SavedFd *s = &rs->fds[i];
+        if (s->saved >= 0) {
+            dup2(s->saved, s->fd);
+            close(s->saved);
+        } else {
+            close(s->fd);
+        }
+    }
+    rs->count = 0;
+}
+
+// Point fd at newfd (or close it if newfd is -1), saving the original
+static int redirect_fd(RedirState *rs, int fd, int newfd) {
+    if (rs->count == REDIR_MAX) {
+        print_error("too many redirections");
+        if (newfd >= 0 && newfd != fd) close(newfd);
+        return -1;
+    }
+
+    // The target may have been opened onto fd itself if fd was closed;
+    // then there is nothing to save and only close-on-exec to clear
+    int saved = newfd == fd ? -1 : fcntl(fd, F_DUPFD_CLOEXEC, 10);
+    if (saved < 0 && newfd != fd && errno != EBADF) {
+        print_error("redirection: %s", strerror(errno));
+        if (newfd >= 0 && newfd != fd) close(newfd);
+        return -1;
+    }
+    rs->fds[rs->count].fd = fd;
+    rs->fds[rs->count].saved = saved;
+    rs->count++;
+    if (newfd >= 0) zygote_track_fd(fd);
+
+    if (newfd < 0) {
+        close(fd);
+    } else if (newfd == fd) {
+        fcntl(fd, F_SETFD, 0);
+    } else {
+        if (dup2(newfd, fd) < 0) {
+            print_error("redirection: %s", strerror(errno));
+            close(newfd);
+            return -1;
+        }
+        close(newfd);
+    }
+    return 0;
+}
+
+// Make a readable descriptor holding the given text
+static int here_document_fd(const char *text, size_t len) {
+    if (len <= HEREDOC_PIPE_MAX) {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) != 0) {
+            print_error("pipe: %s", strerror(errno));
+            return -1;
+        }
+        if (len > 0 && write(fds[1], text, len) != (ssize_t)len) {
+            print_error("here-document: %s", strerror(errno));
+            close(fds[0]);
+            close(fds[1]);
+            return -1;
+        }
+        close(fds[1]);
+        return fds[0];
+    }
+
+    // Too large for a pipe buffer: use an unlinked temporary file
+    char path[] = "/tmp/xsh-heredoc-XXXXXX";
+    int fd = mkostemp(path, O_CLOEXEC);
+    if (fd < 0) {
+        print_error("here-document: %s", strerror(errno));
+        return -1;
+    }
+    unlink(path);
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, text + done, len - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            print_error("here-document: %s", strerror(errno));
+            close(fd);
+            return -1;
+        }
+        done += n;
+    }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+static int parse_fd(const char *s) {
+    if (!*s) return -1;
+    int fd = 0;
+    for (; *s; s++) {
+        if (*s < '0' || *s > '9' || fd > 10000) return -1;
+        fd = fd * 10 + (*s - '0');
+    }
+    return fd;
+}
+
+static int open_target(const char *path, int flags) {
+    int fd = open(path, flags | O_CLOEXEC, 0666);
+    if (fd < 0) print_error("%s: %s", path, strerror(errno));
+    return fd;
+}
+
+static int apply_redirect(Redirect *r, RedirState *rs) {
+    const char *target;
+    int fd;
+
+    if (r->type == REDIR_HEREDOC) {
+        const char *body = r->target.text;
+        size_t len = r->target.len;
+        if (!r->literal && memchr(body, '$', len)) {
+            body = expand_heredoc(body, len, &exec_arena);
+            if (!body) return -1;
+            len = strlen(body);
+        }
+        fd = here_document_fd(body, len);
+        return fd < 0 ? -1 : redirect_fd(rs, r->fd, fd);
+    }
+
+    target = expand_string(r->target.text, r->target.len, &exec_arena);
+    if (!target) return -1;
+
+    switch (r->type) {
+        case REDIR_IN:
+            fd = open_target(target, O_RDONLY);
+            break;
+        case REDIR_OUT:
+            fd = open_target(target, O_WRONLY | O_CREAT | O_TRUNC);
+            break;
+        case REDIR_APPEND:
+            fd = open_target(target, O_WRONLY | O_CREAT | O_APPEND);
+            break;
+        case REDIR_RDWR:
+            fd = open_target(target, O_RDWR | O_CREAT);
+            break;
+        case REDIR_HERESTRING: {
+            size_t len = strlen(target);
+            char *text = arena_alloc(&exec_arena, len + 1);
+            if (!text) return -1;
+            memcpy(text, target, len);
+            text[len] = '\n';
+            fd = here_document_fd(text, len + 1);
+            break;
+        }
+        case REDIR_DUP: {
+            if (strcmp(target, "-") == 0) return redirect_fd(rs, r->fd, -1);
+            int src = parse_fd(target);
+            if (src < 0) {
+                if (r->fd != 1) {
+                    print_error("%s: ambiguous redirect", target);
+                    return -1;
+                }
+                // >&file is the same as &>file
+                fd = open_target(target, O_WRONLY | O_CREAT | O_TRUNC);
+                if (fd < 0) return -1;
+                int copy = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+                if (redirect_fd(rs, 1, fd) != 0) {
+                    if (copy >= 0) close(copy);
+                    return -1;
+                }
+                return copy < 0 ? -1 : redirect_fd(rs, 2, copy);
+            }
+            if (fcntl(src, F_GETFD) < 0) {
+                print_error("%d: bad file descriptor", src);
+                return -1;
+            }
+            if (src == r->fd) return 0;
+            fd = fcntl(src, F_DUPFD_CLOEXEC, 0);
+            break;
+        }
+        case REDIR_BOTH:
+        case REDIR_BOTH_APPEND: {
+            int flags = O_WRONLY | O_CREAT | (r->type == REDIR_BOTH ? O_TRUNC : O_APPEND);
+            fd = open_target(target, flags);
+            if (fd < 0) return -1;
+            int copy = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+            if (redirect_fd(rs, 1, fd) != 0) {
+                if (copy >= 0) close(copy);
+                return -1;
+            }
+            return copy < 0 ? -1 : redirect_fd(rs, 2, copy);
+        }
+        default:
+            return -1;
+    }
+
+    if (fd < 0) return -1;
+    return redirect_fd(rs, r->fd, fd);
+}
+
+// Apply a redirection list; on failure everything applied is undone
+static int apply_redirects(Redirect *list, RedirState *rs) {
+    out_flush();
+    for (Redirect *r = list; r; r = r->next) {
+        if (apply_redirect(r, rs) != 0) {
+            restore_redirects(rs);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Saved value of a variable overridden by a prefix assignment
+typedef struct {
+    char *name;
+    char *value;
+    int flags;
+} SavedVar;
+
+// Apply NAME=value prefix assignments for the duration of one command
+static int apply_assignments(char **assigns, int count, SavedVar *saved) {
+    for (int i = 0; i < count; i++) {
+        char *equals = strchr(assigns[i], '=');
+        *equals = '\0';
+        const char *old = var_lookup(assigns[i], equals - assigns[i]);
+        saved[i].name = assigns[i];
+        saved[i].value = old ? strdup(old) : NULL;
+        saved[i].flags = var_flags(assigns[i]);
+        int rc = var_set(assigns[i], equals + 1, VAR_EXPORT);
+        *equals = '=';
+        if (rc != 0) return i;
+    }
+    return count;
+}
+
+static void restore_assignments(SavedVar *saved, int count) {
+    for (int i = count - 1; i >= 0; i--) {
+        char *equals = strchr(saved[i].name, '=');
+        *equals = '\0';
+        if (saved[i].flags < 0) {
+            var_remove(saved[i].name);
+        } else {
+            // Drop the export flag the assignment added, then restore
+            var_remove(saved[i].name);
+            var_set(saved[i].name, saved[i].value, saved[i].flags);
+        }
+        *equals = '=';
+        free(saved[i].value);
+    }
+}
+
+// Replace the current (forked) process with an external command
+static void exec_external_in_place(char **args) {
+    char *cmd_path = find_command(args[0]);
+    if (!cmd_path) {
+        print_error("%s: command not found", args[0]);
+        exit(EXIT_NOT_FOUND);
+    }
+    out_flush();
+    execv(cmd_path, args);
+    print_error("%s: execution failed: %s", args[0], strerror(errno));
+    exit(EXIT_NOT_FOUND);
+}
+
+static int call_function(ShellFunction *f, char **args) {
+    if (func_depth >= FUNC_MAX_DEPTH) {
+        print_error("%s: maximum function nesting level exceeded", args[0]);
+        return EXIT_FAILURE;
+    }
+
+    // The function may be redefined while it runs
+    Node *body = f->body;
+    Script *owner = body->owner;
+    script_retain(owner);
+
+    int argc = 0;
+    while (args[argc]) argc++;
+    PositionalSave save;
+    positional_push(argc - 1, args + 1, &save);
+    if (var_push_scope() != 0) {
+        positional_pop(&save);
+        script_release(owner);
+        return EXIT_FAILURE;
+    }
+
+    int saved_loop_depth = loop_depth;
+    loop_depth = 0;
+    func_depth++;
+    int status = exec_node(body);
+    func_depth--;
+    loop_depth = saved_loop_depth;
+
+    if (returning) {
+        returning = 0;
+        status = return_status;
+    }
+    var_pop_scope();
+    positional_pop(&save);
+    script_release(owner);
+    return status;
+}
+
+// Run a function, builtin or external command
+static int run_argv(char **args, int in_place) {
+    ShellFunction *f = function_find(args[0]);
+    if (f) return call_function(f, args);
+
+    BuiltinFn builtin = find_builtin(args[0]);
+    if (builtin) {
+        int status = execute_builtin(builtin, args);
+        if (status != EXIT_DEFER) return status;
+    }
+
+    if (in_place) exec_external_in_place(args);
+    return execute_external(args);
+}
+
+int exec_argv(char **args) {
+    if (!args || !args[0]) return EXIT_SUCCESS;
+    return run_argv(args, 0);
+}
+
+// Set when fork_argv gave the terminal to a child's process group
+static int terminal_given;
+
+// Run args in a background child, as `args &` would. With group set the
+// child leads a process group of its own, so whatever it starts can be
+// signalled along with it through kill(-pid). If the shell itself, not
+// a subshell or job sharing its process group, holds the terminal, that
+// group is given it, so the command can read from it and gets the
+// keyboard's signals; terminal_reclaim takes it back once the child is
+// done. Returns its pid, or -1 if it could not be forked.
+pid_t fork_argv(char **args, int group) {
+    out_flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        child_setup();
+        if (group) setpgid(0, 0);
+        exit(run_argv(args, 1));
+    }
+    if (pid < 0) {
+        print_error("fork: %s", strerror(errno));
+        return pid;
+    }
+    if (!group) return pid;
+    // Either side may get there first
+    setpgid(pid, pid);
+    if (getpid() == config.shell_pid && isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp() &&
+        tcsetpgrp(STDIN_FILENO, pid) == 0) {
+        terminal_given = 1;
+        // It may have stopped reading the terminal before it had it
+        kill(-pid, SIGCONT);
+    }
+    return pid;
+}
+
+// Take back the terminal fork_argv gave away
+void terminal_reclaim(void) {
+    if (!terminal_given) return;
+    terminal_given = 0;
+    // The shell is in the background until this is done
+    sigset_t set, saved;
+    sigemptyset(&set);
+    sigaddset(&set, SIGTTOU);
+    sigprocmask(SIG_BLOCK, &set, &saved);
+    tcsetpgrp(STDIN_FILENO, getpgrp());
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+}
+
+// chunk [-P jobs] [-n max] [-k words] command args...
+//
+// Runs command with its arguments split into batches that fit the
+// kernel's limit, like xargs. The command word, and with -k that many
+// words after it, as in `chunk -k 3 grep -e "$pat" -- *.c`, stay in
+// every batch; a -- among the arguments is passed on like any other.
+// The rest are cut into batches while they are expanded, so a huge glob
+// or brace range is never held in full: each batch runs as soon as it
+// is full and its strings are released. With -P, a new batch starts as
+// soon as any running one is done, whichever that is.
+
+#define CHUNK_HEADROOM 2048    // bytes kept free below the measured limit
+
+typedef struct {
+    int fixed;              // leading arguments repeated in every batch
+    size_t fixed_bytes;
+    size_t bytes;           // size of the current batch, fixed part included
+    size_t limit;
+    int max_args;
+    int jobs;               // batches run at once
+    pid_t *pids;
+    int *pidfds;            // of pids, -1 where there is none
+    int running;
+    int batches;
+    int status;             // highest status of any batch
+    ArenaMark mark;         // arena position after the fixed arguments
+} Chunker;
+
+static StrBuf chunk_carry;
+
+// Bytes an argument takes in the new process image
+static size_t arg_cost(const char *arg) {
+    return strlen(arg) + 1 + sizeof(char *);
+}
+
+// Room for arguments: ARG_MAX less the environment the child inherits
+static size_t chunk_limit(void) {
+    long max = sysconf(_SC_ARG_MAX);
+    if (max <= 0) max = _POSIX_ARG_MAX;
+    size_t env = CHUNK_HEADROOM;
+    for (char **e = environ; *e; e++) env += arg_cost(*e);
+    return (size_t)max > env + CHUNK_HEADROOM ? (size_t)max - env : CHUNK_HEADROOM;
+}
+
+static void chunk_collect(Chunker *c, int status) {
+    if (status > c->status) c->status = status;
+}
+
+// Wait for whichever running batch finishes first, through the pidfds,
+// or for the oldest if a pidfd is missing
+static void chunk_wait(Chunker *c) {
+    struct pollfd pfds[c->running];
+    int k = 0, polled = 1;
+    for (int j = 0; j < c->running; j++) {
+        if (c->pidfds[j] < 0) polled = 0;
+        pfds[j] = (struct pollfd){c->pidfds[j], POLLIN, 0};
+    }
+    while (polled && poll(pfds, c->running, -1) < 0) {
+        if (errno != EINTR) polled = 0;
+    }
+    for (int j = 0; polled && j < c->running; j++) {
+        if (pfds[j].revents) {
+            k = j;
+            break;
+        }
+    }
+    chunk_collect(c, wait_for(c->pids[k]));
+    if (c->pidfds[k] >= 0) close(c->pidfds[k]);
+    c->running--;
+    memmove(c->pids + k, c->pids + k + 1, (c->running - k) * sizeof(pid_t));
+    memmove(c->pidfds + k, c->pidfds + k + 1, (c->running - k) * sizeof(int));
+}
+
+static int chunk_run(Chunker *c, char **argv) {
+    c->batches++;
+    if (c->jobs <= 1) {
+        chunk_collect(c, run_argv(argv, 0));
+        return interrupted ? -1 : 0;
+    }
+
+    if (c->running == c->jobs) {
+        chunk_wait(c);
+        if (interrupted) return -1;
+    }
+    out_flush();
+    pid_t pid = fork();
+    if (pid < 0) {
+        print_error("fork: %s", strerror(errno));
+        return -1;
+    }
+    if (pid == 0) {
+        child_setup();
+        exit(run_argv(argv, 1));
+    }
+    int pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd >= 0) fcntl(pidfd, F_SETFD, FD_CLOEXEC);
+    c->pids[c->running] = pid;
+    c->pidfds[c->running++] = pidfd;
+    return 0;
+}
+
+// ArgvBuilder hook: run the pending batch when arg would overflow it
+static char *chunk_flush(ArgvBuilder *b, char *arg) {
+    Chunker *c = b->flush_ctx;
+    size_t cost = arg_cost(arg);
+
+    if (b->argc > c->fixed &&
+        (c->bytes + cost > c->limit || (c->max_args && b->argc - c->fixed >= c->max_args))) {
+        // arg may live in the part of the arena the batch releases
+        strbuf_reset(&chunk_carry);
+        if (strbuf_append(&chunk_carry, arg, strlen(arg)) != 0) return NULL;
+        if (chunk_run(c, b->argv) != 0) return NULL;
+
+        b->argc = c->fixed;
+        b->argv[b->argc] = NULL;
+        arena_release(&exec_arena, c->mark);
+        c->bytes = c->fixed_bytes;
+        arg = arena_strndup(&exec_arena, chunk_carry.data, chunk_carry.len);
+        if (!arg) return NULL;
+    }
+    if (c->fixed_bytes + cost > c->limit) {
+        print_error("chunk: argument list entry too long");
+        return NULL;
+    }
+    c->bytes += cost;
+    return arg;
+}
+
+// Parse a numeric chunk option value
+static int chunk_number(const char *opt, const char *text, int *value) {
+    char *end;
+    long v = text ? strtol(text, &end, 10) : -1;
+    if (!text || *end || v < 0 || v > INT_MAX) {
+        print_error("chunk: %s: invalid number", text ? text : opt);
+        return -1;
+    }
+    *value = (int)v;
+    return 0;
+}
+
+// Run the words from first on as a chunked command. Redirections and
+// prefix assignments apply to every batch.
+static int exec_chunked(Node *n, int first, ArgvBuilder *args, ArgvBuilder *assigns) {
+    Word *words = n->u.cmd.words;
+    int count = n->u.cmd.count;
+    Chunker c = {0};
+    c.jobs = 1;
+    int kept = 0;
+
+    int i = first;
+    for (; i < count && words[i].flags == 0 && words[i].text[0] == '-'; i++) {
+        const char *w = words[i].text;
+        if (strcmp(w, "--") == 0) {
+            i++;
+            break;
+        }
+        if (!w[1] || !strchr("Pnk", w[1]) || (!w[2] && i + 1 >= count)) {
+            print_error("chunk: %s: invalid option", w);
+            return EXIT_USAGE;
+        }
+        const char *value = w[2] ? w + 2 : words[++i].text;
+        int *target = w[1] == 'P' ? &c.jobs : w[1] == 'n' ? &c.max_args : &kept;
+        if (chunk_number(w, value, target) != 0) return EXIT_USAGE;
+    }
+    if (i >= count || kept > count - i - 1) {
+        print_error("chunk: usage: chunk [-P jobs] [-n max] [-k words] command [args...]");
+        return EXIT_USAGE;
+    }
+    if (c.jobs == 0) c.jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (c.jobs < 1) c.jobs = 1;
+
+    RedirState rs;
+    rs.count = 0;
+    if (n->redirects && apply_redirects(n->redirects, &rs) != 0) return EXIT_FAILURE;
+
+    SavedVar saved[assigns->argc + 1];
+    int applied = apply_assignments(assigns->argv, assigns->argc, saved);
+    int status = EXIT_FAILURE;
+    if (applied != assigns->argc) goto out;
+
+    // The command and the words -k keeps are repeated in every batch
+    for (int fixed_words = i + 1 + kept; i < fixed_words; i++) {
+        if (expand_word(words[i].text, words[i].len, words[i].flags, &exec_arena, args) != 0) goto out;
+    }
+    if (args->argc == 0) {
+        status = EXIT_SUCCESS;
+        goto out;
+    }
+    c.fixed = args->argc;
+    for (int k = 0; k < c.fixed; k++) c.fixed_bytes += arg_cost(args->argv[k]);
+    c.bytes = c.fixed_bytes;
+    c.limit = chunk_limit();
+    c.mark = arena_mark(&exec_arena);
+    if (c.jobs > 1) {
+        c.pids = malloc(c.jobs * sizeof(pid_t));
+        c.pidfds = malloc(c.jobs * sizeof(int));
+        if (!c.pids || !c.pidfds) {
+            free(c.pids);
+            free(c.pidfds);
+            goto out;
+        }
+    }
+
+    args->flush = chunk_flush;
+    args->flush_ctx = &c;
+    int rc = 0;
+    for (; i < count && rc == 0; i++) {
+        rc = expand_word(words[i].text, words[i].len, words[i].flags, &exec_arena, args);
+    }
+    args->flush = NULL;
+    glob_cache_clear();
+
+    // The last partial batch; a command with no arguments still runs once
+    if (rc == 0 && (args->argc > c.fixed || c.batches == 0)) rc = chunk_run(&c, args->argv);
+    while (c.running > 0) chunk_wait(&c);
+    free(c.pids);
+    free(c.pidfds);
+    status = rc == 0 ? c.status : (c.status ? c.status : EXIT_FAILURE);
+
+out:
+    args->flush = NULL;
+    restore_assignments(saved, applied);
+    restore_redirects(&rs);
+    return status;
+}
+
+// Run args with the prefix assignments and the node's redirections,
+// in a child that calls setup first. A child that is already running
+// the command alone, such as a background job, calls it itself.
+static int run_prefixed(Node *n, ArgvBuilder *args, ArgvBuilder *assigns, int in_place,
+                        int (*setup)(void *), void *ctx) {
+    RedirState rs;
+    rs.count = 0;
+    if (n->redirects && apply_redirects(n->redirects, &rs) != 0) return EXIT_FAILURE;
+
+    SavedVar saved[assigns->argc + 1];
+    int applied = apply_assignments(assigns->argv, assigns->argc, saved);
+    int status = EXIT_FAILURE;
+    if (applied != assigns->argc) goto out;
+
+    if (in_place) {
+        if (setup(ctx) == 0) status = run_argv(args->argv, 1);
+        goto out;
+    }
+    out_flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        child_setup();
+        if (setup(ctx) != 0) exit(EXIT_FAILURE);
+        exit(run_argv(args->argv, 1));
+    }
+    if (pid < 0) {
+        print_error("fork: %s", strerror(errno));
+        goto out;
+    }
+    status = wait_for(pid);
+
+out:
+    restore_assignments(saved, applied);
+    restore_redirects(&rs);
+    return status;
+}
+
+// Expand the words from first on, which name the command of a prefix
+static int expand_prefixed(Node *n, int first, ArgvBuilder *args) {
+    Word *words = n->u.cmd.words;
+    for (int i = first; i < n->u.cmd.count; i++) {
+        if (expand_word(words[i].text, words[i].len, words[i].flags, &exec_arena, args) != 0) return -1;
+    }
+    glob_cache_clear();
+    return 0;
+}
+
+// pin [-c cpus] [-n nice] [-s policy] [-i class] [cpus|nodeN] command...
+//
+// Runs command with the given CPU affinity, scheduling policy, nice
+// level and I/O priority. They are set in the child that runs it, just
+// before exec; builtins and functions run in that child too.
+
+// A CPU list such as 0-3,8 or a NUMA node such as node1
+static int is_cpu_spec(const char *s) {
+    if (strncmp(s, "node", 4) == 0 && s[4]) s += 4;
+    if (!isdigit((unsigned char)*s)) return 0;
+    return strspn(s, "0123456789,-") == strlen(s);
+}
+
+static int pin_setup(void *ctx) {
+    return sched_apply(ctx, "pin");
+}
+
+static int exec_pinned(Node *n, int first, ArgvBuilder *args, ArgvBuilder *assigns, int in_place) {
+    Word *words = n->u.cmd.words;
+    int count = n->u.cmd.count;
+    SchedAttrs attrs = {0};
+
+    int i = first;
+    for (; i < count && words[i].flags == 0 && words[i].text[0] == '-'; i++) {
+        const char *w = words[i].text;
+        if (strcmp(w, "--") == 0) {
+            i++;
+            break;
+        }
+        if (!w[1] || !strchr("cnsi", w[1])) {
+            print_error("pin: %s: invalid option", w);
+            return EXIT_USAGE;
+        }
+        char opt[3] = {'-', w[1], '\0'};
+        const char *value = w[2] ? w + 2 : NULL;
+        if (!value && i + 1 < count) {
+            i++;
+            value = expand_string(words[i].text, words[i].len, &exec_arena);
+        }
+        if (sched_option(&attrs, "pin", opt, value) != 0) return EXIT_USAGE;
+    }
+    if (i + 1 < count) {
+        char *spec = expand_string(words[i].text, words[i].len, &exec_arena);
+        if (spec && is_cpu_spec(spec)) {
+            if (sched_cpus(&attrs, "pin", spec) != 0) return EXIT_USAGE;
+            i++;
+        }
+    }
+    if (i >= count) {
+        print_error("pin: usage: pin [-n nice] [-s policy] [-i class] [cpus] command [args...]");
+        return EXIT_USAGE;
+    }
+
+    if (expand_prefixed(n, i, args) != 0) return EXIT_FAILURE;
+    if (args->argc == 0) return EXIT_SUCCESS;
+    return run_prefixed(n, args, assigns, in_place, pin_setup, &attrs);
+}
+
+// limit [-m memory] [-c cpus] [-r rate] [-w rate] [-p procs] [-v] command...
+//
+// Runs command in a cgroup of its own with the given limits on memory,
+// CPUs, disk reads and writes under the current directory, and number
+// of processes. With -v the cgroup's CPU time and memory peak are shown
+// when the command is done.
+
+typedef struct {
+    unsigned cgroup;
+    CgroupLimits *limits;
+} LimitSetup;
+
+static int limit_setup(void *ctx) {
+    LimitSetup *ls = ctx;
+    return ls->cgroup ? cgroup_enter(ls->cgroup) : cgroup_limit_self(ls->limits);
+}
+
+static int exec_limited(Node *n, int first, ArgvBuilder *args, ArgvBuilder *assigns, int in_place) {
+    Word *words = n->u.cmd.words;
+    int count = n->u.cmd.count;
+    CgroupLimits limits = {0};
+    int verbose = 0;
+
+    int i = first;
+    for (; i < count && words[i].flags == 0 && words[i].text[0] == '-'; i++) {
+        const char *w = words[i].text;
+        if (strcmp(w, "--") == 0) {
+            i++;
+            break;
+        }
+        if (strcmp(w, "-v") == 0) {
+            verbose = 1;
+            continue;
+        }
+        if (!w[1] || !strchr("mcrwp", w[1])) {
+            print_error("limit: %s: invalid option", w);
+            return EXIT_USAGE;
+        }
+        char opt[3] = {'-', w[1], '\0'};
+        const char *value = w[2] ? w + 2 : NULL;
+        if (!value && i + 1 < count) {
+            i++;
+            value = expand_string(words[i].text, words[i].len, &exec_arena);
+        }
+        if (cgroup_option(&limits, opt, value) != 0) return EXIT_USAGE;
+    }
+    if (i >= count) {
+        print_error("limit: usage: limit [-m mem] [-c cpus] [-r rate] [-w rate] [-p procs] [-v] command [args...]");
+        return EXIT_USAGE;
+    }
+
+    if (expand_prefixed(n, i, args) != 0) return EXIT_FAILURE;
+    if (args->argc == 0) return EXIT_SUCCESS;
+
+    LimitSetup ls = {0, &limits};
+    if (!in_place && cgroup_create(&limits, &ls.cgroup) != 0) return EXIT_FAILURE;
+    int status = run_prefixed(n, args, assigns, in_place, limit_setup, &ls);
+    if (ls.cgroup) {
+        CgroupStats usage;
+        char text[128];
+        if (verbose && cgroup_stats(ls.cgroup, &usage) == 0) {
+            cgroup_format(&usage, text, sizeof(text));
+            out_printf(STDERR_FILENO, "limit: %s\n", text);
+        }
+        cgroup_remove(ls.cgroup);
+    }
+    return status;
+}
+
+// NAME=(...) or NAME+=(...); the lexer keeps the list in the word
+static int is_compound_assign(const Word *w) {
+    const char *equals = memchr(w->text, '=', w->len);
+    return equals && equals + 1 < w->text + w->len && equals[1] == '(';
+}
+
+// Builtins that take assignment arguments, whose compound array values
+// they expand themselves
+static int is_declaration(const char *cmd) {
+    return strcmp(cmd, "local") == 0 || strcmp(cmd, "declare") == 0 ||
+           strcmp(cmd, "typeset") == 0;
+}
+
+static int exec_simple(Node *n) {
+    int in_place = exec_in_place;
+    exec_in_place = 0;
+    unsigned long substs = subst_count;
+    queue_pump();
+
+    ArenaMark mark = arena_mark(&exec_arena);
+    ArgvBuilder *args = argv_acquire();
+    ArgvBuilder *assigns = args ? argv_acquire() : NULL;
+    RedirState rs;
+    rs.count = 0;
+    int status = EXIT_SUCCESS;
+
+    if (!assigns) {
+        status = EXIT_FAILURE;
+        goto done;
+    }
+
+    // Expand words: leading NAME=value assignments, then arguments
+    Word *words = n->u.cmd.words;
+    int count = n->u.cmd.count;
+    int i = 0;
+    for (; i < count && (words[i].flags & WORD_ASSIGN); i++) {
+        char *word = words[i].text;
+        char *equals = memchr(word, '=', words[i].len);
+        size_t name_len = equals - word;
+        if (!is_valid_name(word, name_len) || is_compound_assign(&words[i])) {
+            // Array elements, whole arrays and += take effect at once,
+            // in order, even before a command
+            if (assign_word(word, words[i].len, &exec_arena) != 0) {
+                status = EXIT_FAILURE;
+                goto done;
+            }
+            continue;
+        }
+        char *value = expand_string(equals + 1, words[i].len - name_len - 1, &exec_arena);
+        char *assign = value ? arena_alloc(&exec_arena, name_len + strlen(value) + 2) : NULL;
+        if (!assign || argv_push(assigns, assign) != 0) {
+            status = EXIT_FAILURE;
+            goto done;
+        }
+        memcpy(assign, word, name_len + 1);
+        strcpy(assign + name_len + 1, value);
+    }
+    if (i < count && words[i].flags == 0 && words[i].len == 5 && memcmp(words[i].text, "chunk", 5) == 0) {
+        status = exec_chunked(n, i + 1, args, assigns);
+        goto done;
+    }
+    if (i < count && words[i].flags == 0 && words[i].len == 3 && memcmp(words[i].text, "pin", 3) == 0) {
+        status = exec_pinned(n, i + 1, args, assigns, in_place);
+        goto done;
+    }
+    if (i < count && words[i].flags == 0 && words[i].len == 5 && memcmp(words[i].text, "limit", 5) == 0) {
+        status = exec_limited(n, i + 1, args, assigns, in_place);
+        goto done;
+    }
+    for (; i < count; i++) {
+        if ((words[i].flags & WORD_ASSIGN) && args->argc > 0 && is_declaration(args->argv[0]) &&
+            is_compound_assign(&words[i])) {
+            if (argv_push(args, words[i].text) != 0) {
+                status = EXIT_FAILURE;
+                goto done;
+            }
+            continue;
+        }
+        if (expand_word(words[i].text, words[i].len, words[i].flags, &exec_arena, args) != 0) {
+            status = EXIT_FAILURE;
+            goto done;
+        }
+    }
+    glob_cache_clear();
+    stat_cache_clear();
+
+    if (n->redirects && apply_redirects(n->redirects, &rs) != 0) {
+        status = EXIT_FAILURE;
+        goto done;
+    }
+
+    if (args->argc == 0) {
+        // Bare assignments set shell variables; the status is that of
+        // the last command substitution, if any
+        if (subst_count != substs) status = subst_status;
+        for (int k = 0; k < assigns->argc; k++) {
+            char *equals = strchr(assigns->argv[k], '=');
+            if (var_assign(assigns->argv[k], equals - assigns->argv[k], equals + 1, 0) != 0) {
+                status = EXIT_FAILURE;
+            }
+        }
+    } else if (assigns->argc == 0) {
+        status = run_argv(args->argv, in_place);
+    } else {
+        // Prefix assignments are exported for this command only
+        SavedVar saved[assigns->argc];
+        int applied = apply_assignments(assigns->argv, assigns->argc, saved);
+        if (applied == assigns->argc) {
+            status = run_argv(args->argv, in_place);
+        } else {
+            status = EXIT_FAILURE;
+        }
+        restore_assignments(saved, applied);
+    }
+
+    restore_redirects(&rs);
+
+done:
+    if (assigns) argv_release(2);
+    else if (args) argv_release(1);
+    arena_release(&exec_arena, mark);
+    return status;
+}
+
+// Run n in a forked child; returns the child's pid. parent_end is the
+// other end of the child's output pipe, which a builtin stage would
+// otherwise keep open.
+static pid_t fork_node(Node *n, int in, int out, int parent_end) {
+    out_flush();
+    pid_t pid = fork();
+    if (pid < 0) {
+        print_error("fork: %s", strerror(errno));
+        return -1;
+    }
+    if (pid > 0) return pid;
+
+    child_setup();
+    if (parent_end >= 0) close(parent_end);
+    if (in >= 0) {
+        dup2(in, STDIN_FILENO);
+        close(in);
+    }
+    if (out >= 0) {
+        dup2(out, STDOUT_FILENO);
+        close(out);
+    }
+    exec_in_place = n->type == NODE_COMMAND && !(n->flags & NODE_NEGATE);
+    exit(exec_node(n));
+}
+
+// Run stages that pass a table along, one after another, and render
+// the table they end with unless one of them failed. The redirections
+// of the last stage are held around both it and the rendering.
+static int exec_table_stages(Node **stages, int count) {
+    Node *last = stages[count - 1];
+    Redirect *redirects = last->redirects;
+    RedirState rs;
+    rs.count = 0;
+    if (redirects && apply_redirects(redirects, &rs) != 0) return EXIT_FAILURE;
+    last->redirects = NULL;
+
+    int status = EXIT_SUCCESS;
+    table_begin();
+    for (int i = 0; i < count && status == EXIT_SUCCESS && !unwinding(); i++) {
+        status = exec_node(stages[i]);
+    }
+    table_end(status == EXIT_SUCCESS);
+
+    last->redirects = redirects;
+    restore_redirects(&rs);
+    return status;
+}
+
+static int exec_stages(Node **stages, int count) {
+    return count == 1 ? exec_node(stages[0]) : exec_table_stages(stages, count);
+}
+
+// Run a pipeline stage that only prints, inside the shell, with its
+// output on the pipe out, or on the shell's own stdout if out is -1. A
+// run of table stages counts as one.
+static int exec_stage_in_shell(Node **stages, int count, int out) {
+    if (out < 0) return exec_stages(stages, count);
+
+    RedirState rs;
+    rs.count = 0;
+    out_flush();
+    if (redirect_fd(&rs, STDOUT_FILENO, out) != 0) return EXIT_FAILURE;
+
+    // The reader may be gone: writes then fail with EPIPE instead of
+    // SIGPIPE killing the shell
+    sigset_t pipe_set;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    sigprocmask(SIG_BLOCK, &pipe_set, &stage_mask);
+    stage_masked = 1;
+
+    int status = exec_stages(stages, count);
+    restore_redirects(&rs);
+
+    struct timespec zero = {0, 0};
+    while (sigtimedwait(&pipe_set, NULL, &zero) > 0) {
+        // discard it
+    }
+    sigprocmask(SIG_SETMASK, &stage_mask, NULL);
+    stage_masked = 0;
+    return status;
+}
+
+// Stages that is_pure() accepts, such as `history | grep foo` or a
+// function made of echo, run inside the shell rather than in a fork.
+// They never read their input, so they are simply run one after another
+// on the shell's own thread once every forked stage has started: a
+// reader downstream is already draining the pipe. Forked stages close
+// the write ends the shell holds for them. Leading table stages, as in
+// `files | where size -gt 1M | sort-by size`, run there too as a single
+// stage, and hand each other the table rather than text.
+static int exec_pipeline(Node *n) {
+    int count = n->u.list.count;
+    Node **items = n->u.list.items;
+    pid_t pids[count];      // 0 for a stage run inside the shell
+    int outs[count];        // ... and the write end of its output pipe
+    int in = -1;
+    int spawned = 0;
+    int tabled = table_stages(items, count);
+
+    for (int i = 0; i < count; i++) outs[i] = -1;
+    stage_fds = outs;
+    stage_fd_count = count;
+
+    for (int i = 0; i < count; i++) {
+        int fds[2] = {-1, -1};
+        if (i < tabled - 1) {
+            // Run with the last table stage
+            pids[i] = 0;
+            spawned++;
+            continue;
+        }
+        if (i < count - 1 && pipe2(fds, O_CLOEXEC) != 0) {
+            print_error("pipe: %s", strerror(errno));
+            break;
+        }
+        if (i < tabled || is_pure(items[i], 0)) {
+            pids[i] = 0;
+            outs[i] = fds[1];
+        } else {
+            pids[i] = fork_node(items[i], in, fds[1], fds[0]);
+            if (fds[1] >= 0) close(fds[1]);
+        }
+        if (in >= 0) close(in);
+        in = fds[0];
+        if (pids[i] < 0) break;
+        spawned++;
+    }
+    if (in >= 0) close(in);
+
+    int status = EXIT_FAILURE;
+    for (int i = 0; i < spawned; i++) {
+        if (pids[i] != 0 || i < tabled - 1) continue;
+        int out = outs[i];
+        outs[i] = -1;
+        if (spawned < count) {
+            if (out >= 0) close(out);
+            continue;
+        }
+        int first = i < tabled ? 0 : i;
+        int stage_status = exec_stage_in_shell(items + first, i - first + 1, out);
+        if (i == count - 1) status = stage_status;
+    }
+    stage_fd_count = 0;
+
+    for (int i = 0; i < spawned; i++) {
+        if (pids[i] == 0) continue;
+        int stage_status = wait_for(pids[i]);
+        if (i == count - 1) status = stage_status;
+    }
+    return spawned == count ? status : EXIT_FAILURE;
+}
+
+static int exec_background(Node *n) {
+    if (config.job_count >= MAX_ARGS) {
+        print_error("Maximum number of background jobs reached");
+        return EXIT_FAILURE;
+    }
+    // The job gets a cgroup of its own where the shell may make one
+    unsigned cgroup;
+    cgroup_create(NULL, &cgroup);
+    // and its output may go to a log rather than the terminal
+    int log_fd = -1;
+    JobLog *log = joblog_wanted() ? joblog_create(&log_fd) : NULL;
+    n->flags &= ~NODE_BACKGROUND;
+    out_flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        child_setup();
+        if (cgroup) cgroup_enter(cgroup);
+        if (log) {
+            dup2(log_fd, STDOUT_FILENO);
+            dup2(log_fd, STDERR_FILENO);
+            close(log_fd);
+        }
+        exec_in_place = n->type == NODE_COMMAND && !(n->flags & NODE_NEGATE);
+        exit(exec_node(n));
+    }
+    n->flags |= NODE_BACKGROUND;
+    if (log) close(log_fd);
+    if (pid < 0) {
+        print_error("fork: %s", strerror(errno));
+        cgroup_remove(cgroup);
+        joblog_free(log);
+        return EXIT_FAILURE;
+    }
+
+    cgroup_place(cgroup, pid);
+    if (add_job(pid, n->text ? n->text : "", cgroup, log) != 0) {
+        // Not tracked, so not left running with nobody to read its output
+        kill(pid, SIGTERM);
+        wait_for(pid);
+        cgroup_remove(cgroup);
+        joblog_free(log);
+        return EXIT_FAILURE;
+    }
+    config.last_bg_pid = pid;
+    if (config.interactive) out_printf(STDOUT_FILENO, "[%d] %d\n", config.job_count, (int)pid);
+    return EXIT_SUCCESS;
+}
+
+static int exec_subshell(Node *n) {
+    pid_t pid = fork_node(n->u.group.body, -1, -1, -1);
+    return pid < 0 ? EXIT_FAILURE : wait_for(pid);
+}
+
+static int exec_list(Node *n) {
+    int status = EXIT_SUCCESS;
+    for (int i = 0; i < n->u.list.count; i++) {
+        status = exec_node(n->u.list.items[i]);
+        if (unwinding()) break;
+    }
+    return status;
+}
+
+static int exec_loop(Node *n) {
+    int status = EXIT_SUCCESS;
+    loop_depth++;
+    for (;;) {
+        int cond = exec_node(n->u.loop.cond);
+        if (unwinding()) {
+            if (loop_should_stop()) break;
+            continue;
+        }
+        if ((n->type == NODE_WHILE) != (cond == 0)) break;
+        status = exec_node(n->u.loop.body);
+        if (loop_should_stop()) break;
+    }
+    loop_depth--;
+    return status;
+}
+
+// One iteration of a parallel for loop
+typedef struct {
+    pid_t pid;
+    int pidfd;          // -1 if there is none
+    int fd;             // read end of its output pipe, -1 at end of file
+    int done;
+    StrBuf out;
+} ForIteration;
+
+// Fork an iteration with value assigned to the loop variable and its
+// output on a pipe for the shell to collect
+static int for_start(Node *n, ForIteration *it, const char *value) {
+    Word *name = &n->u.for_.name;
+    if (var_assign(name->text, name->len, value, 0) != 0) return -1;
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        print_error("pipe: %s", strerror(errno));
+        return -1;
+    }
+    it->pid = fork_node(n->u.for_.body, -1, fds[1], fds[0]);
+    close(fds[1]);
+    if (it->pid < 0) {
+        close(fds[0]);
+        return -1;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    it->fd = fds[0];
+    it->pidfd = (int)syscall(SYS_pidfd_open, it->pid, 0);
+    if (it->pidfd >= 0) fcntl(it->pidfd, F_SETFD, FD_CLOEXEC);
+    return 0;
+}
+
+// Read what an iteration has written so far, closing the pipe at end of
+// file
+static void for_collect(ForIteration *it) {
+    while (it->fd >= 0) {
+        if (strbuf_reserve(&it->out, FOR_READ_SIZE) != 0) return;
+        ssize_t got = read(it->fd, it->out.data + it->out.len, FOR_READ_SIZE);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0 && errno == EAGAIN) return;
+        if (got <= 0) {
+            close(it->fd);
+            it->fd = -1;
+            return;
+        }
+        it->out.len += got;
+    }
+}
+
+// Has the iteration's process exited? It is left to be waited for.
+static int for_exited(ForIteration *it, const struct pollfd *pfd) {
+    if (it->pidfd >= 0) return pfd->revents != 0;
+    siginfo_t info;
+    info.si_pid = 0;
+    return waitid(P_PID, it->pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == it->pid;
+}
+
+static void for_emit(ForIteration *it) {
+    if (it->out.len > 0) out_write(STDOUT_FILENO, it->out.data, it->out.len);
+    out_done();
+    strbuf_free(&it->out);
+}
+
+// for -P jobs: run the body for every value in a child of its own, at
+// most jobs at a time. Each iteration's standard output is collected
+// and written out whole, in the order of the values or, with -u, as
+// iterations finish. An iteration is over when its process exits,
+// through a pidfd, whatever it left running on the pipe; what is in
+// the pipe by then is its output. The status is the number of
+// iterations that failed, up to FOR_MAX_FAILURES.
+static int exec_for_parallel(Node *n, ArgvBuilder *values, int jobs) {
+    int total = values->argc;
+    if (total == 0) return EXIT_SUCCESS;
+    size_t slots = jobs < total ? (size_t)jobs : (size_t)total;
+    ForIteration *its = calloc(total, sizeof(ForIteration));
+    int *active = malloc(slots * sizeof(int));
+    // The pipe, then the pidfd, of each active iteration
+    struct pollfd *pfds = malloc(2 * slots * sizeof(struct pollfd));
+    if (!its || !active || !pfds) {
+        free(its);
+        free(active);
+        free(pfds);
+        print_error("malloc: failed to allocate memory");
+        return EXIT_FAILURE;
+    }
+
+    size_t busy = 0;
+    int next = 0, emitted = 0, failed = 0, error = 0;
+    for (;;) {
+        while (!error && !interrupted && busy < slots && next < total) {
+            if (for_start(n, &its[next], values->argv[next]) != 0) {
+                error = 1;
+                break;
+            }
+            active[busy++] = next++;
+        }
+        if (busy == 0) break;
+
+        // Without a pidfd, look for the exit now and then
+        int timeout = -1;
+        for (size_t k = 0; k < busy; k++) {
+            ForIteration *it = &its[active[k]];
+            pfds[2 * k] = (struct pollfd){it->fd, POLLIN, 0};
+            pfds[2 * k + 1] = (struct pollfd){it->pidfd, POLLIN, 0};
+            if (it->pidfd < 0) timeout = 10;
+        }
+        if (poll(pfds, 2 * busy, timeout) < 0) {
+            if (errno == EINTR) continue;
+            print_error("poll: %s", strerror(errno));
+            error = 1;
+        }
+
+        for (size_t k = busy; k-- > 0;) {
+            ForIteration *it = &its[active[k]];
+            if (pfds[2 * k].revents) for_collect(it);
+            if (!error && !for_exited(it, &pfds[2 * k + 1])) continue;
+            // Whatever the iteration wrote before it exited is in the pipe
+            for_collect(it);
+            if (it->fd >= 0) close(it->fd);
+            if (it->pidfd >= 0) close(it->pidfd);
+            if (wait_for(it->pid) != 0) failed++;
+            it->done = 1;
+            active[k] = active[--busy];
+            if (n->u.for_.unordered) for_emit(it);
+        }
+        while (!n->u.for_.unordered && emitted < next && its[emitted].done) for_emit(&its[emitted++]);
+    }
+
+    free(its);
+    free(active);
+    free(pfds);
+    if (error) return EXIT_FAILURE;
+    return failed < FOR_MAX_FAILURES ? failed : FOR_MAX_FAILURES;
+}
+
+// Expand the job count of for -P; 0 stands for the number of CPUs
+static int for_job_count(Word *w, int *jobs) {
+    char *text = expand_string(w->text, w->len, &exec_arena);
+    if (!text) return EXIT_FAILURE;
+    char *end;
+    long v = strtol(text, &end, 10);
+    if (!*text || *end || v < 0 || v > INT_MAX) {
+        print_error("for: %s: invalid number of jobs", text);
+        return EXIT_USAGE;
+    }
+    if (v == 0) v = sysconf(_SC_NPROCESSORS_ONLN);
+    *jobs = v > 0 ? (int)v : 1;
+    return EXIT_SUCCESS;
+}
+
+static int exec_for(Node *n) {
+    ArenaMark mark = arena_mark(&exec_arena);
+    ArgvBuilder *values = argv_acquire();
+    if (!values) return EXIT_FAILURE;
+
+    int status = EXIT_SUCCESS;
+    if (n->u.for_.has_in) {
+        for (int i = 0; i < n->u.for_.count; i++) {
+            Word *w = &n->u.for_.words[i];
+            if (expand_word(w->text, w->len, w->flags, &exec_arena, values) != 0) {
+                status = EXIT_FAILURE;
+                goto done;
+            }
+        }
+        glob_cache_clear();
+    } else {
+        // The body may change the positional parameters: iterate a copy
+        for (int i = 1; i <= positional_count(); i++) {
+            const char *p = get_positional(i);
+            char *copy = arena_strndup(&exec_arena, p, strlen(p));
+            if (!copy || argv_push(values, copy) != 0) {
+                status = EXIT_FAILURE;
+                goto done;
+            }
+        }
+    }
+
+    Word *name = &n->u.for_.name;
+    loop_depth++;
+    if (n->u.for_.jobs.text) {
+        // break and continue in the body only end its own iteration
+        int jobs;
+        status = for_job_count(&n->u.for_.jobs, &jobs);
+        if (status == EXIT_SUCCESS) status = exec_for_parallel(n, values, jobs);
+    } else {
+        for (int i = 0; i < values->argc; i++) {
+            if (var_assign(name->text, name->len, values->argv[i], 0) != 0) {
+                status = EXIT_FAILURE;
+                break;
+            }
+            status = exec_node(n->u.for_.body);
+            if (loop_should_stop()) break;
+        }
+    }
+    loop_depth--;
+
+done:
+    argv_release(1);
+    arena_release(&exec_arena, mark);
+    return status;
+}
+
+static int is_blank(const Word *w) {
+    for (size_t i = 0; i < w->len; i++) {
+        if (!isspace((unsigned char)w->text[i])) return 0;
+    }
+    return 1;
+}
+
+// Evaluate one part of for ((init; cond; step)); blank parts are true
+static int eval_arith_part(Node *n, int part, long long *value) {
+    Word *w = &n->u.arith_for.expr[part];
+    if (is_blank(w)) {
+        *value = 1;
+        return 0;
+    }
+    ArenaMark mark = arena_mark(&exec_arena);
+    int rc = arith_eval_word(&n->u.arith_for.cache[part], n->owner, w, &exec_arena, value);
+    arena_release(&exec_arena, mark);
+    return rc;
+}
+
+static int exec_arith_for(Node *n) {
+    long long value;
+    int status = EXIT_SUCCESS;
+
+    if (eval_arith_part(n, 0, &value) != 0) return EXIT_FAILURE;
+    loop_depth++;
+    for (;;) {
+        if (eval_arith_part(n, 1, &value) != 0) {
+            status = EXIT_FAILURE;
+            break;
+        }
+        if (value == 0) break;
+        status = exec_node(n->u.arith_for.body);
+        if (loop_should_stop()) break;
+        if (eval_arith_part(n, 2, &value) != 0) {
+            status = EXIT_FAILURE;
+            break;
+        }
+    }
+    loop_depth--;
+    return status;
+}
+
+// (( expression )): true if the value is non-zero
+static int exec_arith(Node *n) {
+    long long value;
+    ArenaMark mark = arena_mark(&exec_arena);
+    int rc = arith_eval_word(&n->u.arith.cache, n->owner, &n->u.arith.expr, &exec_arena, &value);
+    arena_release(&exec_arena, mark);
+    if (rc != 0) return EXIT_FAILURE;
+    return value != 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// [[ expression ]]
+static int exec_cond(Node *n) {
+    ArenaMark mark = arena_mark(&exec_arena);
+    stat_cache_clear();
+    int rc = cond_evaluate(n->u.cond.expr, n->owner, &exec_arena);
+    stat_cache_clear();
+    arena_release(&exec_arena, mark);
+    if (rc < 0) return -rc;
+    return rc ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int case_item_matches(CaseItem *item, const char *subject, size_t len) {
+    for (int k = 0; k < item->count; k++) {
+        Word *w = &item->patterns[k];
+        char *pat = expand_pattern(w->text, w->len, &exec_arena);
+        if (!pat) return -1;
+        if (pattern_match(pattern_cached(pat, strlen(pat), 0), subject, len)) return 1;
+    }
+    return 0;
+}
+
+static int exec_case(Node *n) {
+    ArenaMark mark = arena_mark(&exec_arena);
+    Word *w = &n->u.case_.subject;
+    char *subject = expand_string(w->text, w->len, &exec_arena);
+    if (!subject) return EXIT_FAILURE;
+    size_t len = strlen(subject);
+
+    int status = EXIT_SUCCESS;
+    int run_next = 0;   // previous item ended with ;&
+    for (int i = 0; i < n->u.case_.count; i++) {
+        CaseItem *item = &n->u.case_.items[i];
+        if (!run_next) {
+            int m = case_item_matches(item, subject, len);
+            if (m < 0) {
+                status = EXIT_FAILURE;
+                break;
+            }
+            if (!m) continue;
+        }
+        status = exec_node(item->body);
+        if (unwinding() || item->fallthrough == 0) break;
+        run_next = item->fallthrough == CASE_FALLTHROUGH;
+    }
+
+    arena_release(&exec_arena, mark);
+    return status;
+}
+
+static int exec_compound(Node *n) {
+    switch (n->type) {
+        case NODE_COMMAND:
+            return exec_simple(n);
+        case NODE_PIPELINE:
+            return exec_pipeline(n);
+        case NODE_AND:
+        case NODE_OR: {
+            int status = exec_node(n->u.binary.left);
+            if (unwinding()) return status;
+            if ((status == 0) == (n->type == NODE_AND)) status = exec_node(n->u.binary.right);
+            return status;
+        }
+        case NODE_LIST:
+            return exec_list(n);
+        case NODE_SUBSHELL:
+            return exec_subshell(n);
+        case NODE_GROUP:
+            return exec_node(n->u.group.body);
+        case NODE_IF: {
+            int cond = exec_node(n->u.if_.cond);
+            if (unwinding()) return cond;
+            if (cond == 0) return exec_node(n->u.if_.then_part);
+            if (n->u.if_.else_part) return exec_node(n->u.if_.else_part);
+            return EXIT_SUCCESS;
+        }
+        case NODE_WHILE:
+        case NODE_UNTIL:
+            return exec_loop(n);
+        case NODE_FOR:
+            return exec_for(n);
+        case NODE_ARITH_FOR:
+            return exec_arith_for(n);
+        case NODE_CASE:
+            return exec_case(n);
+        case NODE_ARITH:
+            return exec_arith(n);
+        case NODE_COND:
+            return exec_cond(n);
+        case NODE_FUNCTION:
+            return function_define(n->u.func.name, n->u.func.body) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    return EXIT_FAILURE;
+}
+
+// Execute a syntax tree node
+int exec_node(Node *n) {
+    if (!n) return EXIT_SUCCESS;
+    if (n->flags & NODE_BACKGROUND) return config.last_status = exec_background(n);
+
+    int status;
+    if (n->redirects && n->type != NODE_COMMAND) {
+        RedirState rs;
+        rs.count = 0;
+        ArenaMark mark = arena_mark(&exec_arena);
+        if (apply_redirects(n->redirects, &rs) != 0) {
+            status = EXIT_FAILURE;
+        } else {
+            status = exec_compound(n);
+            restore_redirects(&rs);
+        }
+        arena_release(&exec_arena, mark);
+    } else {
+        status = exec_compound(n);
+    }
+
+    if (n->flags & NODE_NEGATE) status = !status;
+    config.last_status = status;
+    return status;
+}
+
+// Parse and execute text one top-level command at a time, as for script
+// files and -c, so aliases and functions defined earlier apply later
+int run_script(const char *text, size_t len) {
+    Parser p;
+    parser_init(&p, text, len);
+
+    int status = EXIT_SUCCESS;
+    Node *n;
+    while (running && (n = parse_next(&p))) {
+        Script *script = p.script;
+        status = exec_node(n);
+        script_release(script);
+        if (returning || interrupted) break;
+    }
+
+    if (p.status == PARSE_INCOMPLETE) {
+        print_error("syntax error: unexpected end of file");
+    }
+    if (p.status == PARSE_ERROR || p.status == PARSE_INCOMPLETE) {
+        status = config.last_status = EXIT_USAGE;
+    }
+    if (source_depth == 0 && func_depth == 0) interrupted = 0;
+    return status;
+}
+
+// Parse a complete interactive input, add it to the history and then
+// execute it. Returns PARSE_INCOMPLETE without executing anything if more
+// input is needed.
+int run_input(const char *text, size_t len, int *status) {
+    Parser p;
+    parser_init(&p, text, len);
+
+    Node **nodes = NULL;
+    int count = 0, capacity = 0;
+    Node *n;
+    while ((n = parse_next(&p))) {
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 8;
+            Node **grown = realloc(nodes, capacity * sizeof(Node *));
+            if (!grown) {
+                print_error("malloc: failed to allocate memory");
+                script_release(n->owner);
+                p.status = PARSE_ERROR;
+                break;
+            }
+            nodes = grown;
+        }
+        nodes[count++] = n;
+    }
+
+    int result = p.status;
+    if (result != PARSE_INCOMPLETE) add_to_history(text);
+    if (result == PARSE_EOF) {
+        for (int i = 0; i < count && running && !interrupted; i++) {
+            *status = exec_node(nodes[i]);
+        }
+        interrupted = 0;
+    } else if (result == PARSE_ERROR) {
+        *status = config.last_status = EXIT_USAGE;
+    }
+
+    for (int i = 0; i < count; i++) script_release(nodes[i]->owner);
+    free(nodes);
+    return result;
+}
+
+// Command substitution.
+//
+// Bodies are parsed once and cached by text. A body made only of
+// builtins that just print, and of functions that are themselves made
+// of them, runs in-process with stdout captured straight into the
+// caller's buffer. Anything else runs in a forked child whose output is
+// read from a pipe in large chunks.
+
+#define SUBST_CACHE_SIZE 32
+#define SUBST_READ_SIZE 65536
+
+typedef struct {
+    char *text;
+    size_t len;
+    Node *root;
+    unsigned long last_used;
+} SubstCacheEntry;
+
+static SubstCacheEntry subst_cache[SUBST_CACHE_SIZE];
+static unsigned long subst_clock;
+
+static Node *subst_parse(const char *text, size_t len) {
+    SubstCacheEntry *victim = &subst_cache[0];
+
+    for (int k = 0; k < SUBST_CACHE_SIZE; k++) {
+        SubstCacheEntry *e = &subst_cache[k];
+        if (e->root && e->len == len && memcmp(e->text, text, len) == 0) {
+            e->last_used = ++subst_clock;
+            return e->root;
+        }
+        if (e->last_used < victim->last_used) victim = e;
+    }
+
+    Node *root = parse_program(text, len);
+    char *copy = root ? strndup(text, len) : NULL;
+    if (!copy) {
+        if (root) script_release(root->owner);
+        return NULL;
+    }
+
+    if (victim->root) script_release(victim->root->owner);
+    free(victim->text);
+    victim->text = copy;
+    victim->len = len;
+    victim->root = root;
+    victim->last_used = ++subst_clock;
+    return root;
+}
+
+// Builtins that only write to stdout and change no shell state
+static int is_pure_builtin(const Word *words, int count) {
+    static const char *always[] = {"echo", "pwd", "true", "false", ":", "help", "history", NULL};
+    static const char *listing[] = {"alias", "set", "export", NULL};
+
+    for (int i = 0; always[i]; i++) {
+        if (strcmp(words[0].text, always[i]) == 0) return 1;
+    }
+    for (int i = 0; listing[i]; i++) {
+        if (count == 1 && strcmp(words[0].text, listing[i]) == 0) return 1;
+    }
+
+    // cat of named files only reads them. Standard input, and device
+    // files that could stand for it, may be the shell's own input.
+    if (strcmp(words[0].text, "cat") == 0 && count > 1) {
+        for (int i = 1; i < count; i++) {
+            const char *arg = words[i].text;
+            if (words[i].flags != 0 || arg[0] == '-' || strstr(arg, "dev/") || strstr(arg, "proc/")) {
+                return 0;
+            }
+        }
+        return 1;
+    }
+    return 0;
+}
+
+// Could expanding this word assign a variable, as ${x:=y} or $((i++)) do?
+static int word_may_assign(const Word *w) {
+    if (!(w->flags & WORD_DOLLAR)) return 0;
+    return memchr(w->text, '=', w->len) || strstr(w->text, "++") || strstr(w->text, "--");
+}
+
+#define PURE_MAX_DEPTH 16
+
+// Does a conditional expression only test, without assigning anything?
+// A =~ match sets BASH_REMATCH.
+static int is_pure_cond(const CondExpr *e) {
+    if (!e) return 1;
+    if (e->type == COND_BINARY && e->op == COND_MATCH) return 0;
+    if (word_may_assign(&e->word[0]) || word_may_assign(&e->word[1])) return 0;
+    return is_pure_cond(e->left) && is_pure_cond(e->right);
+}
+
+// Can this tree run in-process without any visible side effect?
+static int is_pure(const Node *n, int depth) {
+    if (!n) return 1;
+    if (depth > PURE_MAX_DEPTH || n->redirects || (n->flags & NODE_BACKGROUND)) return 0;
+
+    switch (n->type) {
+        case NODE_COMMAND: {
+            const Word *words = n->u.cmd.words;
+            int count = n->u.cmd.count;
+            if (count == 0 || words[0].flags != 0) return 0;
+            for (int i = 1; i < count; i++) {
+                if (word_may_assign(&words[i])) return 0;
+            }
+            if (is_pure_builtin(words, count)) return 1;
+            if (depth > 0 && (strcmp(words[0].text, "local") == 0 ||
+                              strcmp(words[0].text, "return") == 0)) {
+                return 1;
+            }
+
+            ShellFunction *f = function_find(words[0].text);
+            return f && is_pure(f->body, depth + 1);
+        }
+        case NODE_AND:
+        case NODE_OR:
+            return is_pure(n->u.binary.left, depth) && is_pure(n->u.binary.right, depth);
+        case NODE_LIST:
+            for (int i = 0; i < n->u.list.count; i++) {
+                if (!is_pure(n->u.list.items[i], depth)) return 0;
+            }
+            return 1;
+        case NODE_GROUP:
+            return is_pure(n->u.group.body, depth);
+        case NODE_IF:
+            return is_pure(n->u.if_.cond, depth) && is_pure(n->u.if_.then_part, depth) &&
+                   is_pure(n->u.if_.else_part, depth);
+        case NODE_COND:
+            return is_pure_cond(n->u.cond.expr);
+        case NODE_CASE:
+            if (word_may_assign(&n->u.case_.subject)) return 0;
+            for (int i = 0; i < n->u.case_.count; i++) {
+                if (!is_pure(n->u.case_.items[i].body, depth)) return 0;
+            }
+            return 1;
+    }
+    return 0;
+}
+
+static int capture_in_process(Node *root, StrBuf *out) {
+    StrBuf *saved = out_capture(out);
+    int status = exec_node(root);
+    out_capture(saved);
+    return status;
+}
+
+static int capture_forked(Node *root, StrBuf *out) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        print_error("pipe: %s", strerror(errno));
+        return -1;
+    }
+    pid_t pid = fork_node(root, -1, fds[1], fds[0]);
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        return -1;
+    }
+
+    for (;;) {
+        size_t room = out->cap > out->len + 1 ? out->cap - out->len - 1 : 0;
+        if (room < SUBST_READ_SIZE) {
+            if (strbuf_reserve(out, room + SUBST_READ_SIZE) != 0) break;
+            room = out->cap - out->len - 1;
+        }
+        ssize_t n = read(fds[0], out->data + out->len, room);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        out->len += n;
+    }
+    if (out->data) out->data[out->len] = '\0';
+    close(fds[0]);
+    return wait_for(pid);
+}
+
+// Run text and append its standard output to out. Returns 0, or -1 if
+// it could not be run at all; its exit status becomes $?.
+int command_subst(const char *text, size_t len, StrBuf *out) {
+    Node *root = subst_parse(text, len);
+    if (!root) return -1;
+
+    // The cache may evict this entry while it runs
+    Script *owner = root->owner;
+    script_retain(owner);
+    int status = is_pure(root, 0) ? capture_in_process(root, out) : capture_forked(root, out);
+    script_release(owner);
+    if (status < 0) return -1;
+
+    subst_status = config.last_status = status;
+    subst_count++;
+    return 0;
+}
+
+// Built-in commands
+static int loop_count_arg(char **args, int *count) {
+    *count = 1;
+    if (args[1]) {
+        char *end;
+        long n = strtol(args[1], &end, 10);
+        if (*end || n < 1) {
+            print_error("%s: %s: loop count out of range", args[0], args[1]);
+            return -1;
+        }
+        *count = n > loop_depth ? loop_depth : (int)n;
+    }
+    if (loop_depth == 0) {
+        print_error("%s: only meaningful in a `for', `while', or `until' loop", args[0]);
+        return -1;
+    }
+    return 0;
+}
+
+int cmd_break(char **args) {
+    int count;
+    if (loop_count_arg(args, &count) != 0) return EXIT_FAILURE;
+    breaking = count;
+    return EXIT_SUCCESS;
+}
+
+int cmd_continue(char **args) {
+    int count;
+    if (loop_count_arg(args, &count) != 0) return EXIT_FAILURE;
+    continuing = count;
+    return EXIT_SUCCESS;
+}
+
+int cmd_return(char **args) {
+    if (func_depth == 0 && source_depth == 0) {
+        print_error("return: can only `return' from a function or sourced script");
+        return EXIT_FAILURE;
+    }
+    return_status = config.last_status;
+    if (args[1]) {
+        char *end;
+        long n = strtol(args[1], &end, 10);
+        if (*end || end == args[1]) {
+            print_error("return: %s: numeric argument required", args[1]);
+            n = EXIT_USAGE;
+        }
+        return_status = (int)(n & 0xff);
+    }
+    returning = 1;
+    return return_status;
+}
+
+int cmd_source(char **args) {
+    if (!args[1]) {
+        print_error("source: filename argument required");
+        return EXIT_USAGE;
+    }
+
+    FILE *f = fopen(args[1], "r");
+    if (!f) {
+        print_error("source: %s: %s", args[1], strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    StrBuf text = {0};
+    char chunk[8192];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        if (strbuf_append(&text, chunk, n) != 0) break;
+    }
+    fclose(f);
+
+    // Extra arguments become the positional parameters
+    PositionalSave save;
+    int argc = 0;
+    while (args[argc + 2]) argc++;
+    if (argc > 0) positional_push(argc, args + 2, &save);
+
+    source_depth++;
+    int status = run_script(text.data ? text.data : "", text.len);
+    source_depth--;
+    if (returning) {
+        returning = 0;
+        status = return_status;
+    }
+
+    if (argc > 0) positional_pop(&save);
+    strbuf_free(&text);
+    return status;
+}
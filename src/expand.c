@@ -0,0 +1,1436 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <ctype.h>
+#include "shell.h"
+
+// Word expansion: braces, tilde, parameters, arithmetic, command
+// substitution, quote removal, field splitting and pathname expansion.
+//
+// Expansion works directly on the token spans produced by the lexer.
+// Words that contain nothing to expand are passed through as-is; words
+// that do are built in a reusable scratch buffer and copied exactly once
+// into the per-command arena.
+
+enum {
+    EXPAND_FIELDS,      // split into argv fields
+    EXPAND_STRING,      // single string, no splitting
+    EXPAND_PATTERN,     // single string, quoted metacharacters escaped
+    EXPAND_REGEX        // as EXPAND_PATTERN, for an extended regex
+};
+
+#define EXPAND_MAX_DEPTH 64
+
+typedef struct {
+    int mode;
+    int depth;
+    StrBuf *buf;
+    int active;             // current field exists, even if empty
+    Arena *arena;
+    ArgvBuilder *out;
+    int magic;              // current field has unquoted pattern characters
+    StrBuf *pat;            // field with quoted characters escaped, once
+    int escaped;            // ... it differs from buf
+} Expander;
+
+// Scratch buffers, one per nesting level of ${...} operands and command
+// substitutions
+static StrBuf scratch[EXPAND_MAX_DEPTH + 1];
+static StrBuf joined_scratch[EXPAND_MAX_DEPTH + 1];
+static StrBuf capture_scratch[EXPAND_MAX_DEPTH + 1];
+static StrBuf pattern_scratch[EXPAND_MAX_DEPTH + 1];
+static StrBuf brace_scratch[EXPAND_MAX_DEPTH + 1];
+
+// First free nesting level. Commands run by a substitution expand their
+// words above the levels the enclosing expansion is still using.
+static int expand_base;
+
+static int ex_walk(Expander *ex, const char *s, size_t n, int tilde);
+
+static const char *ifs_chars(void) {
+    const char *ifs = var_lookup("IFS", 3);
+    return ifs ? ifs : " \t\n";
+}
+
+// Characters that are special in a pattern and must be escaped when quoted
+#define PATTERN_CHARS "*?[]\\()|"
+#define REGEX_CHARS "*?[]\\()|.^$+{}"
+
+// Does unquoted text contain pattern characters?
+static int has_pattern_chars(const char *s, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (s[i] == '*' || s[i] == '?' || s[i] == '[') return 1;
+        if ((s[i] == '+' || s[i] == '@' || s[i] == '!') && i + 1 < n && s[i + 1] == '(') return 1;
+    }
+    return 0;
+}
+
+static int needs_escape(const char *s, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (s[i] && strchr(PATTERN_CHARS, s[i])) return 1;
+    }
+    return 0;
+}
+
+// Append s to b with the given special characters escaped
+static int append_escaped(StrBuf *b, const char *s, size_t n, const char *special) {
+    for (size_t i = 0; i < n; i++) {
+        if (s[i] && strchr(special, s[i]) && strbuf_putc(b, '\\') != 0) return -1;
+        if (strbuf_putc(b, s[i]) != 0) return -1;
+    }
+    return 0;
+}
+
+// Finish the current field and push it to argv. A field with unquoted
+// pattern characters is replaced by the paths it matches, if any.
+static int ex_end_field(Expander *ex) {
+    if (ex->mode != EXPAND_FIELDS || !ex->active) return 0;
+
+    int matches = 0;
+    if (ex->magic) {
+        StrBuf *p = ex->escaped ? ex->pat : ex->buf;
+        matches = glob_expand(p->data, p->len, ex->arena, ex->out);
+        if (matches < 0) return -1;
+    }
+    if (matches == 0) {
+        char *field = arena_strndup(ex->arena, ex->buf->data ? ex->buf->data : "", ex->buf->len);
+        if (!field || argv_push(ex->out, field) != 0) return -1;
+    }
+    strbuf_reset(ex->buf);
+    ex->active = 0;
+    ex->magic = 0;
+    ex->escaped = 0;
+    return 0;
+}
+
+static int ex_literal(Expander *ex, const char *s, size_t n) {
+    ex->active = 1;
+    if (ex->mode == EXPAND_FIELDS) {
+        if (!ex->magic && has_pattern_chars(s, n)) ex->magic = 1;
+        if (ex->escaped && strbuf_append(ex->pat, s, n) != 0) return -1;
+    }
+    return strbuf_append(ex->buf, s, n);
+}
+
+// Append text that came from a quoted context. In fields, the pattern
+// form of the field is only built once quoted text needs escaping.
+static int ex_quoted(Expander *ex, const char *s, size_t n) {
+    if (ex->mode == EXPAND_PATTERN || ex->mode == EXPAND_REGEX) {
+        ex->active = 1;
+        return append_escaped(ex->buf, s, n, ex->mode == EXPAND_REGEX ? REGEX_CHARS : PATTERN_CHARS);
+    }
+    if (ex->mode == EXPAND_FIELDS && !ex->escaped && needs_escape(s, n)) {
+        strbuf_reset(ex->pat);
+        if (strbuf_append(ex->pat, ex->buf->data ? ex->buf->data : "", ex->buf->len) != 0) return -1;
+        ex->escaped = 1;
+    }
+    if (ex->escaped && append_escaped(ex->pat, s, n, PATTERN_CHARS) != 0) return -1;
+    ex->active = 1;
+    return strbuf_append(ex->buf, s, n);
+}
+
+// Append the result of an unquoted expansion, splitting on IFS
+static int ex_split(Expander *ex, const char *s, size_t n) {
+    if (ex->mode != EXPAND_FIELDS) return ex_literal(ex, s, n);
+
+    const char *ifs = ifs_chars();
+    size_t start = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!strchr(ifs, s[i]) || s[i] == '\0') continue;
+
+        if (i > start && ex_literal(ex, s + start, i - start) != 0) return -1;
+        if (isspace((unsigned char)s[i])) {
+            if (ex_end_field(ex) != 0) return -1;
+        } else {
+            // Non-whitespace separators delimit fields, even empty ones
+            ex->active = 1;
+            if (ex_end_field(ex) != 0) return -1;
+        }
+        start = i + 1;
+    }
+    if (n > start) return ex_literal(ex, s + start, n - start);
+    return 0;
+}
+
+static int ex_emit(Expander *ex, const char *s, size_t n, int quoted) {
+    return quoted ? ex_quoted(ex, s, n) : ex_split(ex, s, n);
+}
+
+// Tilde prefix: ~ or ~user, up to the first '/'. Returns bytes consumed.
+static size_t ex_tilde(Expander *ex, const char *s, size_t n) {
+    size_t end = 1;
+    while (end < n && s[end] != '/') {
+        if (strchr("'\"\\$", s[end])) return 0;
+        end++;
+    }
+
+    const char *home = NULL;
+    if (end == 1) {
+        home = var_lookup("HOME", 4);
+    } else {
+        char user[256];
+        if (end - 1 >= sizeof(user)) return 0;
+        memcpy(user, s + 1, end - 1);
+        user[end - 1] = '\0';
+        struct passwd *pw = getpwnam(user);
+        if (pw) home = pw->pw_dir;
+    }
+    if (!home) return 0;
+
+    if (ex_quoted(ex, home, strlen(home)) != 0) return 0;
+    return end;
+}
+
+// Expand ~ at the start of a path. Returns a malloc'd string.
+char *expand_path(const char *path) {
+    if (!path) return NULL;
+    if (path[0] != '~') return strdup(path);
+
+    StrBuf buf = {0};
+    Expander ex = {EXPAND_STRING, EXPAND_MAX_DEPTH, &buf, 0, NULL, NULL, 0, NULL, 0};
+    size_t len = strlen(path);
+    size_t used = ex_tilde(&ex, path, len);
+    if (strbuf_append(&buf, path + used, len - used) != 0) {
+        strbuf_free(&buf);
+        return NULL;
+    }
+    return buf.data;
+}
+
+// Value of a named or special parameter, or NULL if unset. Numeric
+// specials are formatted into tmp.
+static const char *param_value(const char *name, size_t n, char *tmp, size_t tmpsz) {
+    if (n == 1) {
+        switch (name[0]) {
+            case '?':
+                snprintf(tmp, tmpsz, "%d", config.last_status);
+                return tmp;
+            case '$':
+                snprintf(tmp, tmpsz, "%ld", (long)config.shell_pid);
+                return tmp;
+            case '!':
+                if (!config.last_bg_pid) return NULL;
+                snprintf(tmp, tmpsz, "%ld", (long)config.last_bg_pid);
+                return tmp;
+            case '#':
+                snprintf(tmp, tmpsz, "%d", positional_count());
+                return tmp;
+            case '-':
+                return "";
+        }
+    }
+    if (isdigit((unsigned char)name[0])) {
+        int index = 0;
+        for (size_t i = 0; i < n; i++) index = index * 10 + (name[i] - '0');
+        return get_positional(index);
+    }
+    return var_lookup(name, n);
+}
+
+// Join the positional parameters with sep into buf
+static void join_positional(StrBuf *buf, const char *sep, size_t seplen) {
+    for (int i = 1; i <= positional_count(); i++) {
+        if (i > 1) strbuf_append(buf, sep, seplen);
+        const char *arg = get_positional(i);
+        strbuf_append(buf, arg, strlen(arg));
+    }
+}
+
+// Expand "$@" / $@ / "$*" / $*
+static int ex_positional(Expander *ex, char which, int quoted) {
+    int count = positional_count();
+
+    if (which == '*' || ex->mode != EXPAND_FIELDS) {
+        const char *ifs = ifs_chars();
+        char sep = quoted ? ifs[0] : ' ';
+        for (int i = 1; i <= count; i++) {
+            if (i > 1 && sep && ex_emit(ex, &sep, 1, quoted) != 0) return -1;
+            const char *arg = get_positional(i);
+            if (ex_emit(ex, arg, strlen(arg), quoted) != 0) return -1;
+        }
+        return 0;
+    }
+
+    // $@: every parameter is its own field
+    for (int i = 1; i <= count; i++) {
+        if (i > 1 && (ex->active = 1, ex_end_field(ex)) != 0) return -1;
+        const char *arg = get_positional(i);
+        if (ex_emit(ex, arg, strlen(arg), quoted) != 0) return -1;
+    }
+    return 0;
+}
+
+// Expand an operand such as the word in ${var:-word} into a scratch
+// buffer one level deeper. Returns NULL on error.
+static StrBuf *ex_operand(Expander *ex, const char *s, size_t n, int mode) {
+    if (ex->depth + 1 > EXPAND_MAX_DEPTH) {
+        print_error("expansion nested too deeply");
+        return NULL;
+    }
+    StrBuf *buf = &scratch[ex->depth + 1];
+    strbuf_reset(buf);
+
+    Expander sub = {mode, ex->depth + 1, buf, 0, ex->arena, NULL, 0, NULL, 0};
+    if (ex_walk(&sub, s, n, 1) != 0) return NULL;
+    if (strbuf_reserve(buf, 0) != 0) return NULL;
+    return buf;
+}
+
+// Evaluate arithmetic text, expanding it first only if it uses more than
+// simple parameters
+static int ex_arith_value(Expander *ex, const char *s, size_t n, long long *value) {
+    int rc = ARITH_TEXTUAL;
+
+    ArithExpr *e = arith_cached(s, n, 1);
+    if (e) rc = arith_evaluate(e, value);
+    if (rc == ARITH_TEXTUAL) {
+        StrBuf *text = ex_operand(ex, s, n, EXPAND_STRING);
+        if (!text) return -1;
+        e = arith_cached(text->data, text->len, 0);
+        rc = e ? arith_evaluate(e, value) : -1;
+    }
+    return rc == 0 ? 0 : -1;
+}
+
+// Resolve the subscript of name[sub]: a string key for associative
+// arrays, copied to the arena, otherwise an arithmetic index. Stores the
+// element's value, or NULL if it is unset; a scalar is element 0.
+static int ex_subscript(Expander *ex, const char *name, size_t n, const char *sub, size_t slen,
+                        char **key, long long *index, const char **val) {
+    Array *a = var_array(name, n);
+    *key = NULL;
+    *index = 0;
+    if (a && array_is_assoc(a)) {
+        StrBuf *k = ex_operand(ex, sub, slen, EXPAND_STRING);
+        if (!k || !(*key = arena_strndup(ex->arena, k->data, k->len))) return -1;
+        *val = array_lookup(a, k->data, k->len);
+        return 0;
+    }
+    if (ex_arith_value(ex, sub, slen, index) != 0) return -1;
+    if (a) {
+        *val = array_get(a, *index);
+    } else {
+        *val = *index == 0 || *index == -1 ? var_lookup(name, n) : NULL;
+    }
+    return 0;
+}
+
+// Separate element k of a list expansion from the one before: by the
+// first IFS character when the list is joined, otherwise by ending the
+// field
+static int ex_list_sep(Expander *ex, char which, int quoted, long long k) {
+    if (k == 0) return 0;
+    if (which == '*' || ex->mode != EXPAND_FIELDS) {
+        const char *ifs = ifs_chars();
+        char sep = quoted ? ifs[0] : ' ';
+        return sep ? ex_emit(ex, &sep, 1, quoted) : 0;
+    }
+    ex->active = 1;
+    return ex_end_field(ex);
+}
+
+// Expand "${name[@]}" and friends: the elements, or with keys set their
+// keys or indices, from position from on and at most limit of them
+// (limit < 0 for all). Slices of indexed arrays count from index from.
+static int ex_array(Expander *ex, const char *name, size_t n, char which, int quoted,
+                    int keys, long long from, long long limit) {
+    Array *a = var_array(name, n);
+    if (!a) {
+        const char *v = var_lookup(name, n);
+        if (!v || from > 0 || limit == 0) return 0;
+        if (quoted) ex->active = 1;
+        return keys ? ex_emit(ex, "0", 1, quoted) : ex_emit(ex, v, strlen(v), quoted);
+    }
+
+    if (from < 0) from += array_size(a);
+    if (from < 0) return 0;
+
+    size_t pos = 0;
+    const char *key, *value;
+    long long index, at = 0;
+
+    // Elements to expand, so the last one can be told apart
+    long long total = 0;
+    if (from == 0) {
+        total = (long long)array_count(a);
+    } else {
+        for (; array_next(a, &pos, &key, &index, &value); at++) {
+            if ((key ? at : index) >= from) total++;
+        }
+        pos = 0;
+        at = 0;
+    }
+    if (limit >= 0 && limit < total) total = limit;
+
+    int join = which == '*' || ex->mode != EXPAND_FIELDS;
+    int direct = 0;
+    char tmp[32];
+
+    for (long long k = 0; k < total && array_next(a, &pos, &key, &index, &value); at++) {
+        if ((key ? at : index) < from) continue;
+
+        const char *text = value;
+        size_t len;
+        if (!keys) {
+            len = str_length(value);
+        } else if (key) {
+            text = key;
+            len = str_length(key);
+        } else {
+            text = tmp;
+            len = snprintf(tmp, sizeof(tmp), "%lld", index);
+        }
+
+        // When every element is its own field, a quoted one between the
+        // first and the last is the whole field: it is copied straight
+        // from the array into the arena
+        if (!direct && ex_list_sep(ex, which, quoted, k) != 0) return -1;
+        direct = !join && quoted && k > 0 && k + 1 < total;
+        if (direct) {
+            char *field = arena_strndup(ex->arena, text, len);
+            if (!field || argv_push(ex->out, field) != 0) return -1;
+        } else if (ex_emit(ex, text, len, quoted) != 0) {
+            return -1;
+        }
+        k++;
+    }
+    return 0;
+}
+
+// Join the elements of an array with spaces into buf, for operators
+// applied to "${name[@]}" as a whole. Returns the element count.
+static size_t join_array(StrBuf *buf, const char *name, size_t n) {
+    Array *a = var_array(name, n);
+    if (!a) {
+        const char *v = var_lookup(name, n);
+        if (v) strbuf_append(buf, v, strlen(v));
+        return v != NULL;
+    }
+
+    size_t pos = 0;
+    const char *key, *value;
+    long long index;
+    for (int first = 1; array_next(a, &pos, &key, &index, &value); first = 0) {
+        if (!first) strbuf_append(buf, " ", 1);
+        strbuf_append(buf, value, str_length(value));
+    }
+    return array_count(a);
+}
+
+// Length in characters of a UTF-8 string
+static size_t utf8_length(const char *s) {
+    size_t count = 0;
+    for (; *s; s++) {
+        if (((unsigned char)*s & 0xc0) != 0x80) count++;
+    }
+    return count;
+}
+
+// Find the unquoted '/' separating pattern and replacement in ${v/p/r}
+static size_t find_replacement_slash(const char *s, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (s[i] == '\\') {
+            i++;
+        } else if (s[i] == '\'') {
+            const char *close = memchr(s + i + 1, '\'', n - i - 1);
+            if (!close) return n;
+            i = close - s;
+        } else if (s[i] == '"') {
+            for (i++; i < n && s[i] != '"'; i++) {
+                if (s[i] == '\\') i++;
+            }
+        } else if (s[i] == '$' && i + 1 < n && s[i + 1] == '{') {
+            i += 2 + skip_param_braces(s + i + 2, n - i - 2);
+        } else if (s[i] == '/') {
+            return i;
+        }
+    }
+    return n;
+}
+
+// ${name/pattern/replacement} and friends. mode is '/', '#', '%' or 'g'.
+static int ex_replace(Expander *ex, const char *val, const char *op, size_t oplen,
+                      char mode, int quoted) {
+    size_t vlen = strlen(val);
+    size_t slash = find_replacement_slash(op, oplen);
+
+    StrBuf *pat = ex_operand(ex, op, slash, EXPAND_PATTERN);
+    if (!pat) return -1;
+    const Pattern *p = pattern_cached(pat->data, pat->len,
+                                      mode == '%' ? PATTERN_REVERSE : 0);
+    if (!p) return -1;
+
+    // Replacement shares the next scratch level with the pattern, which
+    // has already been compiled, so it can be overwritten
+    const char *rep = "";
+    size_t replen = 0;
+    if (slash < oplen) {
+        StrBuf *r = ex_operand(ex, op + slash + 1, oplen - slash - 1, EXPAND_STRING);
+        if (!r) return -1;
+        rep = r->data;
+        replen = r->len;
+    }
+
+    if (mode == '%') {
+        long m = pattern_match_suffix(p, val, vlen, 1);
+        if (m < 0) return ex_emit(ex, val, vlen, quoted);
+        if (ex_emit(ex, val, vlen - m, quoted) != 0) return -1;
+        return ex_emit(ex, rep, replen, quoted);
+    }
+
+    size_t i = 0, copied = 0;
+    while (i <= vlen) {
+        long m = pattern_match_prefix(p, val + i, vlen - i, 1);
+        if (m > 0 || (m == 0 && mode == '#')) {
+            if (ex_emit(ex, val + copied, i - copied, quoted) != 0) return -1;
+            if (ex_emit(ex, rep, replen, quoted) != 0) return -1;
+            i += m;
+            copied = i;
+            if (mode != 'g') break;
+            continue;
+        }
+        if (mode == '#') break;
+        i++;
+    }
+    return ex_emit(ex, val + copied, vlen - copied, quoted);
+}
+
+// ${name#pat}, ${name%pat}, ${name/pat/rep} and their variants applied
+// to val
+static int ex_affix(Expander *ex, const char *val, const char *op, size_t oplen, int quoted) {
+    size_t vlen = strlen(val);
+
+    if (op[0] == '/') {
+        char mode = '/';
+        if (oplen > 1 && (op[1] == '/' || op[1] == '#' || op[1] == '%')) {
+            mode = op[1] == '/' ? 'g' : op[1];
+            op++;
+            oplen--;
+        }
+        return ex_replace(ex, val, op + 1, oplen - 1, mode, quoted);
+    }
+
+    int longest = oplen > 1 && op[1] == op[0];
+    const char *pat_text = op + 1 + longest;
+    size_t pat_len = oplen - 1 - longest;
+
+    StrBuf *pat = ex_operand(ex, pat_text, pat_len, EXPAND_PATTERN);
+    if (!pat) return -1;
+
+    if (op[0] == '#') {
+        const Pattern *p = pattern_cached(pat->data, pat->len, 0);
+        long k = p ? pattern_match_prefix(p, val, vlen, longest) : -1;
+        if (k < 0) k = 0;
+        return ex_emit(ex, val + k, vlen - k, quoted);
+    } else {
+        const Pattern *p = pattern_cached(pat->data, pat->len, PATTERN_REVERSE);
+        long k = p ? pattern_match_suffix(p, val, vlen, longest) : -1;
+        if (k < 0) k = 0;
+        return ex_emit(ex, val, vlen - k, quoted);
+    }
+}
+
+// The same operators applied to each element of $@ or name[@] in turn
+static int ex_list_affix(Expander *ex, const char *name, size_t n, int is_array, char which,
+                         const char *op, size_t oplen, int quoted) {
+    Array *a = is_array ? var_array(name, n) : NULL;
+    if (is_array && !a) {
+        const char *v = var_lookup(name, n);
+        return v ? ex_affix(ex, v, op, oplen, quoted) : 0;
+    }
+
+    size_t pos = 0;
+    const char *key, *value;
+    long long index;
+    for (long long k = 0;; k++) {
+        if (a) {
+            if (!array_next(a, &pos, &key, &index, &value)) break;
+        } else if (!(value = get_positional((int)k + 1))) {
+            break;
+        }
+        if (ex_list_sep(ex, which, quoted, k) != 0) return -1;
+        if (ex_affix(ex, value, op, oplen, quoted) != 0) return -1;
+    }
+    return 0;
+}
+
+// Expand the body of ${...}
+static int ex_braced(Expander *ex, const char *body, size_t m, int quoted) {
+    char tmp[32];
+    size_t i = 0;
+    int length_op = 0;
+    int keys_op = 0;
+
+    // ${#name} is the length of name; ${#} alone is the parameter count.
+    // ${!name[@]} lists the keys of an array.
+    if (m > 1 && body[0] == '#') {
+        length_op = 1;
+        i = 1;
+    } else if (m > 1 && body[0] == '!') {
+        keys_op = 1;
+        i = 1;
+    }
+
+    size_t name_start = i;
+    if (i < m && (isalpha((unsigned char)body[i]) || body[i] == '_')) {
+        while (i < m && (isalnum((unsigned char)body[i]) || body[i] == '_')) i++;
+    } else if (i < m && isdigit((unsigned char)body[i])) {
+        while (i < m && isdigit((unsigned char)body[i])) i++;
+    } else if (i < m && strchr("?$!#@*-", body[i])) {
+        i++;
+    }
+    size_t name_len = i - name_start;
+    const char *name = body + name_start;
+
+    // name[sub]
+    const char *sub = NULL;
+    size_t sub_len = 0;
+    if (name_len > 0 && !isdigit((unsigned char)name[0]) && is_valid_name(name, name_len) &&
+        i < m && body[i] == '[') {
+        sub = body + i + 1;
+        sub_len = skip_subscript(sub, m - i - 1);
+        i += sub_len + 2;
+    }
+
+    // Whole lists: $@ and $* as ${@}, or name[@] and name[*]
+    char which = 0;
+    if (sub && sub_len == 1 && (sub[0] == '@' || sub[0] == '*')) {
+        which = sub[0];
+    } else if (!sub && name_len == 1 && (name[0] == '@' || name[0] == '*')) {
+        which = name[0];
+    }
+    int is_array = sub && which;
+
+    if (name_len == 0 || i > m || ((length_op || keys_op) && i != m) || (keys_op && !is_array)) {
+        print_error("${%.*s}: bad substitution", (int)m, body);
+        return -1;
+    }
+    if (keys_op) return ex_array(ex, name, name_len, which, quoted, 1, 0, -1);
+
+    char *key = NULL;
+    long long index = 0;
+    const char *val = NULL;
+    if (sub && !which && ex_subscript(ex, name, name_len, sub, sub_len, &key, &index, &val) != 0) {
+        return -1;
+    }
+
+    if (length_op) {
+        if (is_array) {
+            Array *a = var_array(name, name_len);
+            snprintf(tmp, sizeof(tmp), "%zu", a ? array_count(a) : var_lookup(name, name_len) != NULL);
+        } else if (which) {
+            snprintf(tmp, sizeof(tmp), "%d", positional_count());
+        } else {
+            const char *v = sub ? val : param_value(name, name_len, tmp, sizeof(tmp));
+            snprintf(tmp, sizeof(tmp), "%zu", v ? utf8_length(v) : 0);
+        }
+        return ex_emit(ex, tmp, strlen(tmp), quoted);
+    }
+
+    // Plain ${name}
+    if (i == m) {
+        if (is_array) return ex_array(ex, name, name_len, which, quoted, 0, 0, -1);
+        if (which) return ex_positional(ex, name[0], quoted);
+        const char *v = sub ? val : param_value(name, name_len, tmp, sizeof(tmp));
+        if (v && ex_emit(ex, v, strlen(v), quoted) != 0) return -1;
+        if (quoted) ex->active = 1;
+        return 0;
+    }
+
+    StrBuf *joined = NULL;
+    if (is_array && body[i] == ':' && (i + 1 >= m || !strchr("-=+?", body[i + 1]))) {
+        // A slice only needs to know whether there are elements
+        Array *a = var_array(name, name_len);
+        val = (a ? array_count(a) != 0 : var_lookup(name, name_len) != NULL) ? "" : NULL;
+    } else if (which) {
+        joined = &joined_scratch[ex->depth];
+        strbuf_reset(joined);
+        size_t count;
+        if (is_array) {
+            count = join_array(joined, name, name_len);
+        } else {
+            join_positional(joined, " ", 1);
+            count = positional_count();
+        }
+        if (strbuf_reserve(joined, 0) != 0) return -1;
+        val = count ? joined->data : NULL;
+    } else if (!sub) {
+        val = param_value(name, name_len, tmp, sizeof(tmp));
+    }
+
+    const char *op = body + i;
+    size_t oplen = m - i;
+    int colon = op[0] == ':';
+    if (colon && oplen > 1 && strchr("-=+?", op[1])) {
+        op++;
+        oplen--;
+    } else {
+        colon = 0;
+    }
+
+    const char *word = op + 1;
+    size_t wlen = oplen - 1;
+    int unset = !val || (colon && !*val);
+    if (quoted) ex->active = 1;
+
+    switch (op[0]) {
+        case '-':
+            if (!unset) return ex_emit(ex, val, strlen(val), quoted);
+            {
+                StrBuf *w = ex_operand(ex, word, wlen, EXPAND_STRING);
+                return w ? ex_emit(ex, w->data, w->len, quoted) : -1;
+            }
+
+        case '=':
+            if (!unset) return ex_emit(ex, val, strlen(val), quoted);
+            {
+                StrBuf *w = ex_operand(ex, word, wlen, EXPAND_STRING);
+                if (!w) return -1;
+                if (sub) {
+                    Array *a = which ? NULL : var_make_array(name, name_len, 0);
+                    if (!a) {
+                        if (which) print_error("${%.*s}: bad substitution", (int)m, body);
+                        return -1;
+                    }
+                    int rc = key ? array_store(a, key, strlen(key), w->data, w->len)
+                                 : array_set(a, index, w->data, w->len);
+                    if (rc != 0) return -1;
+                } else if (var_assign(name, name_len, w->data, 0) != 0) {
+                    return -1;
+                }
+                return ex_emit(ex, w->data, w->len, quoted);
+            }
+
+        case '+':
+            if (unset) return 0;
+            {
+                StrBuf *w = ex_operand(ex, word, wlen, EXPAND_STRING);
+                return w ? ex_emit(ex, w->data, w->len, quoted) : -1;
+            }
+
+        case '?':
+            if (!unset) return ex_emit(ex, val, strlen(val), quoted);
+            {
+                StrBuf *w = ex_operand(ex, word, wlen, EXPAND_STRING);
+                if (!w) return -1;
+                print_error("%.*s: %s", (int)name_len, name,
+                            w->len ? w->data : "parameter null or not set");
+                return -1;
+            }
+
+        case '#':
+        case '%':
+        case '/':
+            if (!val) return 0;
+            if (which) return ex_list_affix(ex, name, name_len, is_array, which, op, oplen, quoted);
+            return ex_affix(ex, val, op, oplen, quoted);
+
+        case ':': {
+            // ${name:offset} / ${name:offset:length}
+            if (!val) return 0;
+            char *end;
+            char numbuf[64];
+            size_t copy = oplen - 1 < sizeof(numbuf) - 1 ? oplen - 1 : sizeof(numbuf) - 1;
+            memcpy(numbuf, op + 1, copy);
+            numbuf[copy] = '\0';
+
+            long vlen = (long)strlen(val);
+            long offset = strtol(numbuf, &end, 10);
+            long length = vlen;
+            int has_length = 0;
+            while (isspace((unsigned char)*end)) end++;
+            if (*end == ':') {
+                length = strtol(end + 1, &end, 10);
+                has_length = 1;
+                while (isspace((unsigned char)*end)) end++;
+            }
+            if (*end) {
+                print_error("${%.*s}: bad substitution", (int)m, body);
+                return -1;
+            }
+
+            // ${name[@]:offset:length} selects elements
+            if (is_array) {
+                if (has_length && length < 0) {
+                    print_error("%.*s: substring expression < 0", (int)(sub_len + name_len + 2), name);
+                    return -1;
+                }
+                return ex_array(ex, name, name_len, which, quoted, 0, offset,
+                                has_length ? length : -1);
+            }
+
+            if (offset < 0) offset += vlen;
+            if (offset < 0 || offset > vlen) return 0;
+            if (length < 0) length = vlen - offset + length;
+            if (length < 0) {
+                print_error("%.*s: substring expression < 0", (int)name_len, name);
+                return -1;
+            }
+            if (offset + length > vlen) length = vlen - offset;
+            return ex_emit(ex, val + offset, length, quoted);
+        }
+    }
+
+    print_error("${%.*s}: bad substitution", (int)m, body);
+    return -1;
+}
+
+// Expand a '$' construct at s. Stores the bytes consumed in *used.
+// Is the $( ... ) body at s (just past "$(") an arithmetic expansion,
+// that is, "( expr )" with the parentheses matching each other?
+static int is_arith_body(const char *s, size_t end) {
+    if (end < 2 || s[0] != '(' || s[end - 1] != ')') return 0;
+    return skip_subst_parens(s + 1, end - 1) == end - 2;
+}
+
+// $(( expr )). The expression is compiled as written when it only uses
+// simple parameters; otherwise it is expanded first.
+static int ex_arith(Expander *ex, const char *s, size_t n, int quoted) {
+    long long value;
+    if (ex_arith_value(ex, s, n, &value) != 0) return -1;
+
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%lld", value);
+    if (quoted) ex->active = 1;
+    return ex_emit(ex, buf, len, quoted);
+}
+
+// Command substitution. The output is captured into a per-level buffer
+// and split or quoted in place after trailing newlines are dropped.
+static int ex_command(Expander *ex, const char *s, size_t n, int quoted) {
+    if (ex->depth + 1 > EXPAND_MAX_DEPTH) {
+        print_error("expansion nested too deeply");
+        return -1;
+    }
+    StrBuf *out = &capture_scratch[ex->depth + 1];
+    strbuf_reset(out);
+
+    int saved_base = expand_base;
+    expand_base = ex->depth + 1;
+    int rc = command_subst(s, n, out);
+    expand_base = saved_base;
+    if (rc != 0) return -1;
+
+    size_t len = out->len;
+    while (len > 0 && out->data[len - 1] == '\n') len--;
+    if (quoted) ex->active = 1;
+    return len ? ex_emit(ex, out->data, len, quoted) : 0;
+}
+
+// `command`: backslash only escapes $, ` and \ inside backquotes
+static int ex_backquote(Expander *ex, const char *s, size_t n, int quoted, size_t *used) {
+    size_t end = skip_backquote(s + 1, n - 1);
+    if (end >= n - 1) {
+        print_error("syntax error: unterminated `");
+        return -1;
+    }
+    *used = end + 2;
+
+    char *body = arena_alloc(ex->arena, end + 1);
+    if (!body) return -1;
+    size_t len = 0;
+    for (size_t i = 1; i <= end; i++) {
+        if (s[i] == '\\' && i < end && strchr("$`\\", s[i + 1])) i++;
+        body[len++] = s[i];
+    }
+    body[len] = '\0';
+    return ex_command(ex, body, len, quoted);
+}
+
+static int ex_dollar(Expander *ex, const char *s, size_t n, int quoted, size_t *used) {
+    char tmp[32];
+
+    if (n > 1 && s[1] == '(') {
+        size_t end = skip_subst_parens(s + 2, n - 2);
+        if (end >= n - 2) {
+            print_error("syntax error: unterminated $(");
+            return -1;
+        }
+        *used = end + 3;
+        if (is_arith_body(s + 2, end)) return ex_arith(ex, s + 3, end - 2, quoted);
+        return ex_command(ex, s + 2, end, quoted);
+    }
+
+    if (n > 1 && s[1] == '{') {
+        size_t end = skip_param_braces(s + 2, n - 2);
+        if (end >= n - 2) {
+            print_error("syntax error: unterminated ${");
+            return -1;
+        }
+        *used = end + 3;
+        return ex_braced(ex, s + 2, end, quoted);
+    }
+
+    if (n > 1 && (isalpha((unsigned char)s[1]) || s[1] == '_')) {
+        size_t i = 2;
+        while (i < n && (isalnum((unsigned char)s[i]) || s[i] == '_')) i++;
+        *used = i;
+        const char *v = var_lookup(s + 1, i - 1);
+        if (quoted) ex->active = 1;
+        return v ? ex_emit(ex, v, strlen(v), quoted) : 0;
+    }
+
+    if (n > 1 && (s[1] == '@' || s[1] == '*')) {
+        *used = 2;
+        if (quoted && s[1] == '*') ex->active = 1;
+        return ex_positional(ex, s[1], quoted);
+    }
+
+    if (n > 1 && (isdigit((unsigned char)s[1]) || strchr("?$!#-", s[1]))) {
+        *used = 2;
+        const char *v = param_value(s + 1, 1, tmp, sizeof(tmp));
+        if (quoted) ex->active = 1;
+        return v ? ex_emit(ex, v, strlen(v), quoted) : 0;
+    }
+
+    // A lone '$' is literal
+    *used = 1;
+    return ex_literal(ex, "$", 1);
+}
+
+// Expand double-quoted text starting at s[*pos], stopping at the closing
+// quote. Here-document bodies use the same rules but have no closing
+// quote, and a backslash before '"' is kept.
+static int ex_dquote(Expander *ex, const char *s, size_t n, size_t *pos, int heredoc) {
+    const char *escapable = heredoc ? "$`\\\n" : "$`\"\\\n";
+    size_t i = *pos;
+
+    while (i < n && (heredoc || s[i] != '"')) {
+        if (s[i] == '\\' && i + 1 < n && strchr(escapable, s[i + 1])) {
+            if (s[i + 1] != '\n' && ex_quoted(ex, s + i + 1, 1) != 0) return -1;
+            i += 2;
+        } else if (s[i] == '$') {
+            size_t used;
+            if (ex_dollar(ex, s + i, n - i, 1, &used) != 0) return -1;
+            i += used;
+        } else if (s[i] == '`') {
+            size_t used;
+            if (ex_backquote(ex, s + i, n - i, 1, &used) != 0) return -1;
+            i += used;
+        } else {
+            size_t start = i;
+            while (i < n && (heredoc || s[i] != '"') && !strchr("\\$`", s[i])) i++;
+            if (i == start) i++;
+            if (ex_quoted(ex, s + start, i - start) != 0) return -1;
+        }
+    }
+    *pos = i;
+    return 0;
+}
+
+// Is s a quoted "$@", "${@}" or "${name[@]}", which expands to no field
+// at all when there is nothing in the list?
+static int is_bare_list(const char *s, size_t n) {
+    if (n >= 4 && strncmp(s, "\"$@\"", 4) == 0) return 1;
+    if (n < 6 || strncmp(s, "\"${", 3) != 0) return 0;
+    size_t end = skip_param_braces(s + 3, n - 3);
+    if (end + 4 >= n || s[end + 4] != '"') return 0;
+    const char *body = s + 3;
+    if (end == 1) return body[0] == '@';
+    return end > 3 && memcmp(body + end - 3, "[@]", 3) == 0 && body[0] != '#';
+}
+
+// Walk a word, performing quote removal and expansions
+static int ex_walk(Expander *ex, const char *s, size_t n, int tilde) {
+    size_t i = 0;
+
+    if (tilde && n > 0 && s[0] == '~') {
+        i = ex_tilde(ex, s, n);
+    }
+
+    while (i < n) {
+        char c = s[i];
+
+        if (c == '\'') {
+            const char *close = memchr(s + i + 1, '\'', n - i - 1);
+            size_t end = close ? (size_t)(close - s) : n;
+            if (ex_quoted(ex, s + i + 1, end - i - 1) != 0) return -1;
+            i = end + 1;
+        } else if (c == '"') {
+            // "$@" with no positional parameters expands to no field at all
+            if (!is_bare_list(s + i, n - i)) ex->active = 1;
+            i++;
+            if (ex_dquote(ex, s, n, &i, 0) != 0) return -1;
+            i++;
+        } else if (c == '\\') {
+            if (i + 1 < n) {
+                if (ex->mode == EXPAND_PATTERN || ex->mode == EXPAND_REGEX) {
+                    if (ex_literal(ex, s + i, 2) != 0) return -1;
+                } else if (ex_quoted(ex, s + i + 1, 1) != 0) {
+                    return -1;
+                }
+            }
+            i += 2;
+        } else if (c == '$') {
+            size_t used;
+            if (ex_dollar(ex, s + i, n - i, 0, &used) != 0) return -1;
+            i += used;
+        } else if (c == '`') {
+            size_t used;
+            if (ex_backquote(ex, s + i, n - i, 0, &used) != 0) return -1;
+            i += used;
+        } else {
+            size_t start = i;
+            while (i < n && !strchr("'\"\\$`", s[i])) i++;
+            if (ex_literal(ex, s + start, i - start) != 0) return -1;
+        }
+    }
+    return 0;
+}
+
+// Expand a word into fields after brace expansion. Literal words are
+// pushed without copying unless copy is set.
+static int expand_fields(char *word, size_t len, unsigned flags, int copy,
+                         Arena *arena, ArgvBuilder *out) {
+    if (!(flags & (WORD_QUOTED | WORD_DOLLAR | WORD_TILDE))) {
+        int matches = (flags & WORD_GLOB) ? glob_expand(word, len, arena, out) : 0;
+        if (matches != 0) return matches < 0 ? -1 : 0;
+        if (copy && !(word = arena_strndup(arena, word, len))) return -1;
+        return argv_push(out, word);
+    }
+
+    StrBuf *buf = &scratch[expand_base];
+    strbuf_reset(buf);
+    Expander ex = {EXPAND_FIELDS, expand_base, buf, 0, arena, out, 0, &pattern_scratch[expand_base], 0};
+    if (ex_walk(&ex, word, len, 1) != 0) return -1;
+    return ex_end_field(&ex);
+}
+
+// Brace expansion rewrites the raw word before any other expansion, so
+// quotes and $ inside an alternative keep their meaning. Words are
+// generated one at a time into a single buffer and expanded straight
+// into argv: a range such as {1..100000} never exists as a list.
+
+typedef struct BraceRest {
+    const char *s;          // text still to generate after the current group
+    size_t n;
+    const struct BraceRest *next;
+} BraceRest;
+
+typedef struct {
+    StrBuf *buf;            // word generated so far
+    unsigned flags;
+    Arena *arena;
+    ArgvBuilder *out;
+} BraceGen;
+
+typedef struct {
+    size_t open;            // index of '{'
+    size_t close;           // index of the matching '}'
+    int seq;                // {x..y[..step]} rather than {a,b}
+    long long from, to;
+    unsigned long long step;
+    int chars;              // sequence of characters, not numbers
+    int width;              // zero-padded width of numbers
+} BraceGroup;
+
+// Index just past the quoted string or substitution at s[i], or i + 1
+static size_t brace_skip(const char *s, size_t n, size_t i) {
+    if (s[i] == '\\') return i + 2 < n ? i + 2 : n;
+    if (s[i] == '\'') {
+        const char *close = memchr(s + i + 1, '\'', n - i - 1);
+        return close ? (size_t)(close - s) + 1 : n;
+    }
+    if (s[i] == '"') {
+        for (i++; i < n && s[i] != '"'; i++) {
+            if (s[i] == '\\') i++;
+        }
+        return i < n ? i + 1 : n;
+    }
+    if (s[i] == '$' && i + 1 < n && s[i + 1] == '{') return i + 3 + skip_param_braces(s + i + 2, n - i - 2);
+    if (s[i] == '$' && i + 1 < n && s[i + 1] == '(') return i + 3 + skip_subst_parens(s + i + 2, n - i - 2);
+    if (s[i] == '`') return i + 2 + skip_backquote(s + i + 1, n - i - 1);
+    return i + 1;
+}
+
+// Parse one end of a sequence: an integer, or a single character
+static int brace_bound(const char *s, size_t n, long long *value, int *is_char, int *width) {
+    if (n == 1 && !isdigit((unsigned char)s[0])) {
+        *value = (unsigned char)s[0];
+        *is_char = 1;
+        return 0;
+    }
+    size_t i = (n > 0 && (s[0] == '-' || s[0] == '+')) ? 1 : 0;
+    if (i == n || n - i > 19) return -1;
+    for (size_t k = i; k < n; k++) {
+        if (!isdigit((unsigned char)s[k])) return -1;
+    }
+    *value = strtoll(s, NULL, 10);
+    *is_char = 0;
+    if (s[i] == '0' && n - i > 1) *width = (int)n;
+    return 0;
+}
+
+// Is body, the text between the braces, a sequence expression?
+static int brace_sequence(const char *body, size_t n, BraceGroup *b) {
+    const char *dots = n >= 4 ? memmem(body, n, "..", 2) : NULL;
+    if (!dots) return 0;
+
+    size_t first = dots - body;
+    const char *rest = dots + 2;
+    size_t rlen = n - first - 2;
+    const char *more = memmem(rest, rlen, "..", 2);
+    size_t second = more ? (size_t)(more - rest) : rlen;
+
+    int c1, c2, step_char;
+    long long step = 1;
+    b->width = 0;
+    if (brace_bound(body, first, &b->from, &c1, &b->width) != 0) return 0;
+    if (brace_bound(rest, second, &b->to, &c2, &b->width) != 0 || c1 != c2) return 0;
+    if (more) {
+        int unused = 0;
+        if (brace_bound(more + 2, rlen - second - 2, &step, &step_char, &unused) != 0 || step_char) {
+            return 0;
+        }
+    }
+    b->step = step < 0 ? -(unsigned long long)step : (unsigned long long)step;
+    if (b->step == 0) b->step = 1;
+    b->chars = c1;
+    b->seq = 1;
+    return 1;
+}
+
+// Find the first brace group in s. Groups without a top-level comma that
+// are not sequences are literal, as is a group with no closing brace.
+static int brace_find(const char *s, size_t n, BraceGroup *b) {
+    size_t i = 0;
+    while (i < n) {
+        if (s[i] != '{') {
+            i = brace_skip(s, n, i);
+            continue;
+        }
+
+        int depth = 0, comma = 0;
+        size_t k = i;
+        while (k < n) {
+            if (s[k] == '{') {
+                depth++;
+            } else if (s[k] == '}' && --depth == 0) {
+                break;
+            } else if (s[k] == ',' && depth == 1) {
+                comma = 1;
+            }
+            k = (s[k] == '{' || s[k] == '}' || s[k] == ',') ? k + 1 : brace_skip(s, n, k);
+        }
+        if (k >= n) return 0;
+
+        b->open = i;
+        b->close = k;
+        b->seq = 0;
+        if (comma || brace_sequence(s + i + 1, k - i - 1, b)) return 1;
+        i++;
+    }
+    return 0;
+}
+
+// Expand the word generated so far
+static int brace_emit(BraceGen *g) {
+    if (g->buf->len == 0) return 0;
+    if (strbuf_reserve(g->buf, 0) != 0) return -1;
+
+    unsigned flags = g->flags & ~(WORD_BRACE | WORD_TILDE);
+    if (g->buf->data[0] == '~') flags |= WORD_TILDE;
+    return expand_fields(g->buf->data, g->buf->len, flags, 1, g->arena, g->out);
+}
+
+// Generate every word for s followed by the pending rest
+static int brace_gen(BraceGen *g, const char *s, size_t n, const BraceRest *rest) {
+    size_t base = g->buf->len;
+    BraceGroup b;
+    int rc = 0;
+
+    // Copy literal text up to the next group, moving on to the rest
+    while (!brace_find(s, n, &b)) {
+        if (strbuf_append(g->buf, s, n) != 0) return -1;
+        if (!rest) {
+            rc = brace_emit(g);
+            g->buf->len = base;
+            return rc;
+        }
+        s = rest->s;
+        n = rest->n;
+        rest = rest->next;
+    }
+
+    if (strbuf_append(g->buf, s, b.open) != 0) return -1;
+    size_t mark = g->buf->len;
+    const char *after = s + b.close + 1;
+    size_t after_len = n - b.close - 1;
+
+    if (b.seq) {
+        // Count the steps in unsigned arithmetic, so that a range ending
+        // near the limits of long long cannot overflow and run forever
+        int up = b.from <= b.to;
+        unsigned long long span = up ? (unsigned long long)b.to - (unsigned long long)b.from
+                                     : (unsigned long long)b.from - (unsigned long long)b.to;
+        unsigned long long steps = span / b.step;
+        for (unsigned long long i = 0; rc == 0 && i <= steps; i++) {
+            unsigned long long offset = i * b.step;
+            long long v = (long long)(up ? (unsigned long long)b.from + offset
+                                         : (unsigned long long)b.from - offset);
+            char num[32];
+            int len = b.chars ? (num[0] = (char)v, 1) : snprintf(num, sizeof(num), "%0*lld", b.width, v);
+            g->buf->len = mark;
+            if (strbuf_append(g->buf, num, len) != 0) return -1;
+            rc = brace_gen(g, after, after_len, rest);
+        }
+    } else {
+        // Alternatives may contain groups of their own, which must be
+        // expanded before the text after this group
+        BraceRest next = {after, after_len, rest};
+        size_t start = b.open + 1, k = start;
+        int depth = 0;
+        while (rc == 0 && k <= b.close) {
+            if (k == b.close || (s[k] == ',' && depth == 0)) {
+                g->buf->len = mark;
+                rc = brace_gen(g, s + start, k - start, &next);
+                start = ++k;
+                continue;
+            }
+            if (s[k] == '{') depth++;
+            if (s[k] == '}') depth--;
+            k = (s[k] == '{' || s[k] == '}') ? k + 1 : brace_skip(s, b.close, k);
+        }
+    }
+    g->buf->len = base;
+    return rc;
+}
+
+// Expand one word into zero or more argv fields. word must be
+// NUL-terminated at word[len]; literal words are pushed without copying.
+int expand_word(char *word, size_t len, unsigned flags, Arena *arena, ArgvBuilder *out) {
+    if (flags & WORD_BRACE) {
+        BraceGroup b;
+        if (brace_find(word, len, &b)) {
+            StrBuf *buf = &brace_scratch[expand_base];
+            strbuf_reset(buf);
+            BraceGen g = {buf, flags, arena, out};
+            return brace_gen(&g, word, len, NULL);
+        }
+    }
+    return expand_fields(word, len, flags, 0, arena, out);
+}
+
+// Expand a word to a single string without field splitting, as for the
+// value of an assignment. The result lives in the arena.
+char *expand_string(const char *word, size_t len, Arena *arena) {
+    StrBuf *buf = &scratch[expand_base];
+    strbuf_reset(buf);
+    Expander ex = {EXPAND_STRING, expand_base, buf, 0, arena, NULL, 0, NULL, 0};
+    if (ex_walk(&ex, word, len, 1) != 0) return NULL;
+    return arena_strndup(arena, buf->data ? buf->data : "", buf->len);
+}
+
+// Expand a word for use as a pattern, as in case items and ${var%pat}.
+// Quoted metacharacters are escaped so they match literally.
+char *expand_pattern(const char *word, size_t len, Arena *arena) {
+    StrBuf *buf = &scratch[expand_base];
+    strbuf_reset(buf);
+    Expander ex = {EXPAND_PATTERN, expand_base, buf, 0, arena, NULL, 0, NULL, 0};
+    if (ex_walk(&ex, word, len, 1) != 0) return NULL;
+    return arena_strndup(arena, buf->data ? buf->data : "", buf->len);
+}
+
+// Expand the right side of =~. Quoted text is escaped so it matches
+// literally in an extended regex.
+char *expand_regex(const char *word, size_t len, Arena *arena) {
+    StrBuf *buf = &scratch[expand_base];
+    strbuf_reset(buf);
+    Expander ex = {EXPAND_REGEX, expand_base, buf, 0, arena, NULL, 0, NULL, 0};
+    if (ex_walk(&ex, word, len, 1) != 0) return NULL;
+    return arena_strndup(arena, buf->data ? buf->data : "", buf->len);
+}
+
+// Expand the body of an unquoted here-document
+char *expand_heredoc(const char *body, size_t len, Arena *arena) {
+    StrBuf *buf = &scratch[expand_base];
+    strbuf_reset(buf);
+    Expander ex = {EXPAND_STRING, expand_base, buf, 0, arena, NULL, 0, NULL, 0};
+    size_t pos = 0;
+    if (ex_dquote(&ex, body, len, &pos, 1) != 0) return NULL;
+    return arena_strndup(arena, buf->data ? buf->data : "", buf->len);
+}
+
+// Evaluate an indexed array subscript outside of any expansion
+int expand_subscript(const char *sub, size_t len, Arena *arena, long long *index) {
+    int rc = ARITH_TEXTUAL;
+    ArithExpr *e = arith_cached(sub, len, 1);
+    if (e) rc = arith_evaluate(e, index);
+    if (rc == ARITH_TEXTUAL) {
+        char *text = expand_string(sub, len, arena);
+        if (!text) return -1;
+        e = arith_cached(text, strlen(text), 0);
+        rc = e ? arith_evaluate(e, index) : -1;
+    }
+    return rc == 0 ? 0 : -1;
+}
+
+// Store value into element sub of a, appending to the old value if
+// append is set. Returns the index stored to, for indexed arrays.
+static int assign_element(Array *a, const char *sub, size_t sub_len, const char *value,
+                          int append, Arena *arena, long long *index) {
+    const char *key = NULL;
+    const char *old;
+    if (array_is_assoc(a)) {
+        if (!(key = expand_string(sub, sub_len, arena))) return -1;
+        old = array_lookup(a, key, strlen(key));
+    } else {
+        if (expand_subscript(sub, sub_len, arena, index) != 0) return -1;
+        old = array_get(a, *index);
+    }
+
+    size_t vlen = strlen(value);
+    if (append && old) {
+        size_t olen = str_length(old);
+        char *joined = arena_alloc(arena, olen + vlen + 1);
+        if (!joined) return -1;
+        memcpy(joined, old, olen);
+        memcpy(joined + olen, value, vlen + 1);
+        value = joined;
+        vlen += olen;
+    }
+    return key ? array_store(a, key, strlen(key), value, vlen) : array_set(a, *index, value, vlen);
+}
+
+// The elements of NAME=(...) or NAME+=(...). Plain elements are expanded
+// like command arguments and fill consecutive indices, or for an
+// associative array alternate between keys and values; [sub]=value
+// elements are expanded as single strings.
+static int assign_elements(Array *a, const char *body, size_t len, Arena *arena) {
+    ArgvBuilder fields = {0};
+    Lexer lx;
+    Token tok;
+    long long next = array_size(a);
+    const char *key = NULL;     // associative key waiting for its value
+    int rc = 0;
+
+    lexer_init(&lx, body, len);
+    while (rc == 0) {
+        // [sub]=value: the subscript may contain blanks, so it is found
+        // here rather than by the lexer
+        size_t *pos = &lx.stack[0].pos;
+        while (*pos < len && isspace((unsigned char)body[*pos])) (*pos)++;
+        if (*pos < len && body[*pos] == '[') {
+            const char *sub = body + *pos + 1;
+            size_t sub_len = skip_subscript(sub, len - *pos - 1);
+            const char *eq = sub + sub_len + 1;
+            int append = eq < body + len && *eq == '+';
+            if (append) eq++;
+            if (sub_len < len - *pos - 1 && eq < body + len && *eq == '=') {
+                *pos = eq + 1 - body;
+                tok.type = TOK_WORD;
+                tok.len = 0;
+                if (*pos < len && !isspace((unsigned char)body[*pos]) && lex_next(&lx, &tok) != 0) {
+                    tok.type = TOK_EOF;
+                }
+                if (tok.type != TOK_WORD) {
+                    print_error("syntax error in array assignment");
+                    rc = -1;
+                    break;
+                }
+                char *value = expand_string(tok.text, tok.len, arena);
+                long long index = next;
+                rc = value ? assign_element(a, sub, sub_len, value, append, arena, &index) : -1;
+                next = index + 1;
+                continue;
+            }
+        }
+
+        if (lex_next(&lx, &tok) != 0) {
+            print_error("syntax error: unterminated quote in array assignment");
+            rc = -1;
+            break;
+        }
+        if (tok.type == TOK_EOF) break;
+        if (tok.type == TOK_NEWLINE) continue;
+        if (tok.type != TOK_WORD) {
+            print_error("syntax error in array assignment near `%.*s'", (int)tok.len, tok.text);
+            rc = -1;
+            break;
+        }
+
+        char *word = arena_strndup(arena, tok.text, tok.len);
+        argv_reset(&fields);
+        if (!word || expand_word(word, tok.len, tok.flags, arena, &fields) != 0) {
+            rc = -1;
+            break;
+        }
+        for (int k = 0; k < fields.argc && rc == 0; k++) {
+            const char *f = fields.argv[k];
+            if (!array_is_assoc(a)) {
+                rc = array_set(a, next++, f, strlen(f));
+            } else if (!key) {
+                key = f;
+            } else {
+                rc = array_store(a, key, strlen(key), f, strlen(f));
+                key = NULL;
+            }
+        }
+    }
+    if (rc == 0 && key) rc = array_store(a, key, strlen(key), "", 0);
+    argv_free(&fields);
+    return rc;
+}
+
+// Perform an assignment word: NAME=value, NAME+=value, NAME[sub]=value,
+// NAME[sub]+=value, or NAME=(...) and NAME+=(...) for a whole array. A
+// new array is built before the old value is replaced, so the elements
+// may refer to it.
+int assign_word(const char *word, size_t len, Arena *arena) {
+    size_t n = 0;
+    while (n < len && (isalnum((unsigned char)word[n]) || word[n] == '_')) n++;
+
+    size_t i = n;
+    const char *sub = NULL;
+    size_t sub_len = 0;
+    if (i < len && word[i] == '[') {
+        sub = word + i + 1;
+        sub_len = skip_subscript(sub, len - i - 1);
+        i += sub_len + 2;
+    }
+    int append = i < len && word[i] == '+';
+    if (append) i++;
+    if (i >= len || word[i] != '=' || !is_valid_name(word, n)) {
+        print_error("%.*s: not a valid identifier", (int)(i < len ? i : len), word);
+        return -1;
+    }
+    const char *value = word + i + 1;
+    size_t vlen = len - i - 1;
+
+    if (!sub && vlen >= 2 && value[0] == '(' && value[vlen - 1] == ')') {
+        if (append) {
+            Array *a = var_make_array(word, n, 0);
+            return a ? assign_elements(a, value + 1, vlen - 2, arena) : -1;
+        }
+        Array *old = var_array(word, n);
+        Array *a = array_new(old && array_is_assoc(old));
+        if (!a) return -1;
+        if (assign_elements(a, value + 1, vlen - 2, arena) != 0) {
+            array_free(a);
+            return -1;
+        }
+        return var_set_array(word, n, a);
+    }
+
+    char *text = expand_string(value, vlen, arena);
+    if (!text) return -1;
+
+    if (sub) {
+        Array *a = var_make_array(word, n, 0);
+        long long index;
+        return a ? assign_element(a, sub, sub_len, text, append, arena, &index) : -1;
+    }
+    if (append) {
+        const char *old = var_lookup(word, n);
+        size_t olen = old ? strlen(old) : 0, tlen = strlen(text);
+        char *joined = arena_alloc(arena, olen + tlen + 1);
+        if (!joined) return -1;
+        memcpy(joined, old ? old : "", olen);
+        memcpy(joined + olen, text, tlen + 1);
+        text = joined;
+    }
+    return var_assign(word, n, text, 0);
+}
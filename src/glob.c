@@ -0,0 +1,613 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "shell.h"
+
+// Pathname expansion.
+//
+// A pattern is split at '/' into segments. Literal segments are appended
+// to the path without touching the filesystem; pattern segments match
+// the names of one directory listing, read with getdents64 in large
+// batches. Listings read by the main thread are kept for the rest of the
+// command, so "*.c *.h" or "src/*.c src/*.h" read each directory once.
+//
+// "**" matches any number of directories. It is walked from a queue of
+// pending directories: the shell starts alone and, once the tree turns
+// out to be large, hands the queue to helper threads. Every walker
+// collects its own matches and sorts them, and the sorted runs are
+// merged into argv.
+
+#define GLOB_DENTS_SIZE    (64 * 1024)
+#define GLOB_CACHE_SIZE    32
+#define GLOB_MAX_THREADS   16
+#define GLOB_PARALLEL_DIRS 64   // directories walked alone before helpers start
+
+typedef struct {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} Dirent64;
+
+typedef struct {
+    uint32_t name;          // offset into Listing.names
+    uint16_t len;
+    uint8_t type;           // DT_* from getdents64
+} DirEntry;
+
+typedef struct {
+    char *path;
+    StrBuf names;
+    DirEntry *entries;
+    size_t count;
+    size_t cap;
+    int cached;
+} Listing;
+
+typedef struct {
+    char *text;             // literal name, or pattern text
+    size_t len;
+    Pattern *pattern;       // NULL for a literal segment
+    int globstar;           // "**"
+    int dot;                // may match names starting with '.'
+} Segment;
+
+typedef struct {
+    Segment *segs;
+    int count;
+    int absolute;           // pattern starts with '/'
+    int dirs_only;          // pattern ends in '/'
+} GlobPlan;
+
+// Matches collected by one walker, as NUL-terminated paths
+typedef struct {
+    StrBuf names;
+    size_t *offsets;
+    size_t count;
+    size_t cap;
+} GlobResults;
+
+typedef struct {
+    const GlobPlan *plan;
+    StrBuf path;
+    GlobResults res;
+    char *dents;
+    int main;               // the shell's own thread: may cache and spawn
+    GlobResults *runs;      // sorted results handed back by helpers
+    int nruns;
+} GlobWalker;
+
+// Directories still to be walked below a "**"
+typedef struct {
+    int seg;
+    char **pending;
+    size_t count;
+    size_t cap;
+    int busy;               // walkers inside a directory
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} WalkQueue;
+
+typedef struct {
+    GlobWalker walker;
+    WalkQueue *queue;
+    pthread_t thread;
+} GlobHelper;
+
+static Listing *dir_cache[GLOB_CACHE_SIZE];
+static int dir_cache_count;
+
+static void glob_walk(GlobWalker *w, int k);
+
+static void listing_free(Listing *l) {
+    if (!l) return;
+    free(l->path);
+    strbuf_free(&l->names);
+    free(l->entries);
+    free(l);
+}
+
+// Drop the directory listings cached for the current command
+void glob_cache_clear(void) {
+    for (int k = 0; k < dir_cache_count; k++) listing_free(dir_cache[k]);
+    dir_cache_count = 0;
+}
+
+static Listing *listing_read(GlobWalker *w, const char *path) {
+    int fd = open(*path ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    Listing *l = calloc(1, sizeof(Listing));
+    if (!l) goto fail;
+
+    for (;;) {
+        long n = syscall(SYS_getdents64, fd, w->dents, GLOB_DENTS_SIZE);
+        if (n <= 0) break;
+        for (long off = 0; off < n;) {
+            Dirent64 *d = (Dirent64 *)(w->dents + off);
+            off += d->d_reclen;
+
+            const char *name = d->d_name;
+            if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))) continue;
+
+            if (l->count == l->cap) {
+                size_t cap = l->cap ? l->cap * 2 : 64;
+                DirEntry *entries = realloc(l->entries, cap * sizeof(DirEntry));
+                if (!entries) goto fail;
+                l->entries = entries;
+                l->cap = cap;
+            }
+            size_t len = strlen(name);
+            DirEntry *e = &l->entries[l->count++];
+            e->name = (uint32_t)l->names.len;
+            e->len = (uint16_t)len;
+            e->type = d->d_type;
+            if (strbuf_append(&l->names, name, len + 1) != 0) goto fail;
+        }
+    }
+    close(fd);
+    return l;
+
+fail:
+    close(fd);
+    listing_free(l);
+    return NULL;
+}
+
+// The listing of the directory at w->path, from the cache if possible
+static Listing *listing_get(GlobWalker *w) {
+    const char *path = w->path.data ? w->path.data : "";
+    if (w->main) {
+        for (int k = 0; k < dir_cache_count; k++) {
+            if (strcmp(dir_cache[k]->path, path) == 0) return dir_cache[k];
+        }
+    }
+
+    Listing *l = listing_read(w, path);
+    if (l && w->main && dir_cache_count < GLOB_CACHE_SIZE && (l->path = strdup(path))) {
+        l->cached = 1;
+        dir_cache[dir_cache_count++] = l;
+    }
+    return l;
+}
+
+static void listing_put(Listing *l) {
+    if (!l->cached) listing_free(l);
+}
+
+static int results_add(GlobResults *r, const char *path, size_t len) {
+    if (r->count == r->cap) {
+        size_t cap = r->cap ? r->cap * 2 : 64;
+        size_t *offsets = realloc(r->offsets, cap * sizeof(size_t));
+        if (!offsets) return -1;
+        r->offsets = offsets;
+        r->cap = cap;
+    }
+    r->offsets[r->count] = r->names.len;
+    if (strbuf_append(&r->names, path, len) != 0 || strbuf_putc(&r->names, '\0') != 0) return -1;
+    r->count++;
+    return 0;
+}
+
+static void results_free(GlobResults *r) {
+    strbuf_free(&r->names);
+    free(r->offsets);
+}
+
+static int compare_offsets(const void *a, const void *b, void *names) {
+    return strcmp((char *)names + *(const size_t *)a, (char *)names + *(const size_t *)b);
+}
+
+static void results_sort(GlobResults *r) {
+    if (r->count > 1) qsort_r(r->offsets, r->count, sizeof(size_t), compare_offsets, r->names.data);
+}
+
+// Append name to the walker's path
+static int path_push(GlobWalker *w, const char *name, size_t len, int slash) {
+    if (strbuf_append(&w->path, name, len) != 0) return -1;
+    if (slash && strbuf_putc(&w->path, '/') != 0) return -1;
+    return strbuf_reserve(&w->path, 0);
+}
+
+static void path_pop(GlobWalker *w, size_t len) {
+    w->path.len = len;
+    if (w->path.data) w->path.data[len] = '\0';
+}
+
+// Is the entry a directory? Symbolic links are followed only if asked.
+static int entry_is_dir(GlobWalker *w, const Listing *l, const DirEntry *e, int follow) {
+    if (e->type == DT_DIR) return 1;
+    if (e->type != DT_UNKNOWN && (e->type != DT_LNK || !follow)) return 0;
+
+    size_t len = w->path.len;
+    struct stat st;
+    int rc = -1;
+    if (path_push(w, l->names.data + e->name, e->len, 0) == 0) {
+        rc = follow ? stat(w->path.data, &st) : lstat(w->path.data, &st);
+    }
+    path_pop(w, len);
+    return rc == 0 && S_ISDIR(st.st_mode);
+}
+
+static int visible(const Segment *s, const Listing *l, const DirEntry *e) {
+    return s->dot || l->names.data[e->name] != '.';
+}
+
+// Record w->path + name as a match
+static void add_match(GlobWalker *w, const char *name, size_t len, int slash) {
+    size_t base = w->path.len;
+    if (path_push(w, name, len, slash) == 0) results_add(&w->res, w->path.data, w->path.len);
+    path_pop(w, base);
+}
+
+// Apply segment k to the entries of the directory at w->path
+static void match_listing(GlobWalker *w, int k, const Listing *l) {
+    const GlobPlan *plan = w->plan;
+    const Segment *s = &plan->segs[k];
+    int last = k + 1 == plan->count;
+
+    for (size_t i = 0; i < l->count; i++) {
+        const DirEntry *e = &l->entries[i];
+        const char *name = l->names.data + e->name;
+
+        if (s->pattern) {
+            if (!visible(s, l, e) || !pattern_match(s->pattern, name, e->len)) continue;
+        } else if (e->len != s->len || memcmp(name, s->text, s->len) != 0) {
+            continue;
+        }
+
+        if (last && !plan->dirs_only) {
+            add_match(w, name, e->len, 0);
+        } else if (entry_is_dir(w, l, e, 1)) {
+            if (last) {
+                add_match(w, name, e->len, 1);
+                continue;
+            }
+            size_t base = w->path.len;
+            if (path_push(w, name, e->len, 1) == 0) glob_walk(w, k + 1);
+            path_pop(w, base);
+        }
+    }
+}
+
+static int queue_push(WalkQueue *q, char **dirs, size_t n) {
+    pthread_mutex_lock(&q->lock);
+    if (q->count + n > q->cap) {
+        size_t cap = q->cap ? q->cap * 2 : 64;
+        while (cap < q->count + n) cap *= 2;
+        char **pending = realloc(q->pending, cap * sizeof(char *));
+        if (!pending) {
+            pthread_mutex_unlock(&q->lock);
+            return -1;
+        }
+        q->pending = pending;
+        q->cap = cap;
+    }
+    memcpy(q->pending + q->count, dirs, n * sizeof(char *));
+    q->count += n;
+    if (n > 1) {
+        pthread_cond_broadcast(&q->cond);
+    } else {
+        pthread_cond_signal(&q->cond);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+// Walk one directory below a "**": match the following segment against
+// its entries, then queue its subdirectories. Hidden directories and
+// symbolic links are not descended into.
+static void star_visit(GlobWalker *w, WalkQueue *q, char *dir) {
+    const GlobPlan *plan = w->plan;
+    path_pop(w, 0);
+    if (path_push(w, dir, strlen(dir), 0) != 0) return;
+
+    Listing *l = listing_read(w, w->path.data);
+    if (!l) return;
+
+    if (q->seg + 1 < plan->count) {
+        match_listing(w, q->seg + 1, l);
+    } else {
+        // A trailing "**" matches everything below
+        for (size_t i = 0; i < l->count; i++) {
+            const DirEntry *e = &l->entries[i];
+            if (l->names.data[e->name] == '.') continue;
+            if (!plan->dirs_only) {
+                add_match(w, l->names.data + e->name, e->len, 0);
+            } else if (entry_is_dir(w, l, e, 1)) {
+                add_match(w, l->names.data + e->name, e->len, 1);
+            }
+        }
+    }
+
+    char *batch[64];
+    size_t n = 0;
+    for (size_t i = 0; i < l->count; i++) {
+        const DirEntry *e = &l->entries[i];
+        if (l->names.data[e->name] == '.' || !entry_is_dir(w, l, e, 0)) continue;
+
+        size_t base = w->path.len;
+        char *sub = NULL;
+        if (path_push(w, l->names.data + e->name, e->len, 1) == 0) sub = strdup(w->path.data);
+        path_pop(w, base);
+        if (!sub) continue;
+
+        batch[n++] = sub;
+        if (n == sizeof(batch) / sizeof(batch[0])) {
+            if (queue_push(q, batch, n) != 0) {
+                while (n) free(batch[--n]);
+            }
+            n = 0;
+        }
+    }
+    if (n && queue_push(q, batch, n) != 0) {
+        while (n) free(batch[--n]);
+    }
+    listing_free(l);
+}
+
+static void start_helpers(GlobWalker *w, WalkQueue *q, GlobHelper *helpers, int *nhelpers);
+
+// Take directories from the queue until it is empty and no walker can
+// add more
+static void star_work(GlobWalker *w, WalkQueue *q, GlobHelper *helpers, int *nhelpers) {
+    int visited = 0;
+
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        if (q->count > 0) {
+            char *dir = q->pending[--q->count];
+            q->busy++;
+            pthread_mutex_unlock(&q->lock);
+
+            star_visit(w, q, dir);
+            free(dir);
+            if (helpers && !*nhelpers && ++visited == GLOB_PARALLEL_DIRS) {
+                start_helpers(w, q, helpers, nhelpers);
+            }
+
+            pthread_mutex_lock(&q->lock);
+            q->busy--;
+            continue;
+        }
+        if (q->busy == 0) break;
+        pthread_cond_wait(&q->cond, &q->lock);
+    }
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void *helper_main(void *arg) {
+    GlobHelper *h = arg;
+    star_work(&h->walker, h->queue, NULL, NULL);
+    results_sort(&h->walker.res);
+    return NULL;
+}
+
+static void start_helpers(GlobWalker *w, WalkQueue *q, GlobHelper *helpers, int *nhelpers) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int want = cpus > GLOB_MAX_THREADS ? GLOB_MAX_THREADS - 1 : (int)cpus - 1;
+
+    for (int k = 0; k < want; k++) {
+        GlobHelper *h = &helpers[*nhelpers];
+        memset(h, 0, sizeof(*h));
+        h->walker.plan = w->plan;
+        h->walker.dents = malloc(GLOB_DENTS_SIZE);
+        h->queue = q;
+        if (!h->walker.dents) break;
+        if (pthread_create(&h->thread, NULL, helper_main, h) != 0) {
+            free(h->walker.dents);
+            break;
+        }
+        (*nhelpers)++;
+    }
+}
+
+// Segment k is "**": walk every directory below w->path
+static void walk_globstar(GlobWalker *w, int k) {
+    WalkQueue q = {0};
+    q.seg = k;
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.cond, NULL);
+
+    // Every directory walked replaces the path; keep the caller's
+    size_t base = w->path.len;
+    char *prefix = strdup(w->path.data);
+    char *top = prefix ? strdup(prefix) : NULL;
+    if (top && queue_push(&q, &top, 1) != 0) free(top);
+
+    // Only the outermost "**" of the shell's own walk may go parallel
+    GlobHelper helpers[GLOB_MAX_THREADS];
+    int nhelpers = 0;
+    int parallel = w->main;
+    w->main = 0;
+    star_work(w, &q, parallel ? helpers : NULL, &nhelpers);
+    w->main = parallel;
+
+    for (int h = 0; h < nhelpers; h++) {
+        pthread_join(helpers[h].thread, NULL);
+        free(helpers[h].walker.dents);
+        strbuf_free(&helpers[h].walker.path);
+
+        GlobResults *runs = realloc(w->runs, (w->nruns + 1) * sizeof(GlobResults));
+        if (!runs) {
+            results_free(&helpers[h].walker.res);
+            continue;
+        }
+        w->runs = runs;
+        w->runs[w->nruns++] = helpers[h].walker.res;
+    }
+
+    while (q.count) free(q.pending[--q.count]);
+    free(q.pending);
+    pthread_mutex_destroy(&q.lock);
+    pthread_cond_destroy(&q.cond);
+
+    path_pop(w, 0);
+    if (prefix) path_push(w, prefix, base, 0);
+    free(prefix);
+}
+
+// Match segments k.. below the directory at w->path
+static void glob_walk(GlobWalker *w, int k) {
+    const GlobPlan *plan = w->plan;
+    const Segment *s = &plan->segs[k];
+    int last = k + 1 == plan->count;
+
+    if (s->globstar) {
+        walk_globstar(w, k);
+        return;
+    }
+
+    if (!s->pattern) {
+        size_t base = w->path.len;
+        if (path_push(w, s->text, s->len, !last || plan->dirs_only) != 0) return;
+        if (!last) {
+            glob_walk(w, k + 1);
+        } else {
+            struct stat st;
+            int rc = plan->dirs_only ? stat(w->path.data, &st) : lstat(w->path.data, &st);
+            if (rc == 0 && (!plan->dirs_only || S_ISDIR(st.st_mode))) {
+                results_add(&w->res, w->path.data, w->path.len);
+            }
+        }
+        path_pop(w, base);
+        return;
+    }
+
+    Listing *l = listing_get(w);
+    if (!l) return;
+    match_listing(w, k, l);
+    listing_put(l);
+}
+
+// Remove backslash escapes from a literal segment
+static size_t unescape(char *dst, const char *src, size_t len) {
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (src[i] == '\\' && i + 1 < len) i++;
+        dst[n++] = src[i];
+    }
+    dst[n] = '\0';
+    return n;
+}
+
+static void plan_free(GlobPlan *plan) {
+    for (int k = 0; k < plan->count; k++) {
+        free(plan->segs[k].text);
+        pattern_free(plan->segs[k].pattern);
+    }
+    free(plan->segs);
+}
+
+// Split a pattern into segments at each run of '/'
+static int plan_compile(GlobPlan *plan, const char *pat, size_t len) {
+    memset(plan, 0, sizeof(*plan));
+    plan->segs = calloc(len / 2 + 2, sizeof(Segment));
+    if (!plan->segs) return -1;
+
+    size_t i = 0;
+    plan->absolute = pat[0] == '/';
+    while (i < len && pat[i] == '/') i++;
+
+    while (i < len) {
+        size_t start = i;
+        while (i < len && pat[i] != '/') i += (pat[i] == '\\' && i + 1 < len) ? 2 : 1;
+        size_t n = i - start;
+        while (i < len && pat[i] == '/') i++;
+        if (i == len && pat[len - 1] == '/') plan->dirs_only = 1;
+
+        const char *text = pat + start;
+        int globstar = n == 2 && text[0] == '*' && text[1] == '*';
+        if (globstar && plan->count > 0 && plan->segs[plan->count - 1].globstar) continue;
+
+        Segment *s = &plan->segs[plan->count++];
+        s->globstar = globstar;
+        s->dot = text[0] == '.' || (n > 1 && text[0] == '\\' && text[1] == '.');
+        if (globstar) continue;
+
+        if (pattern_has_magic(text, n)) {
+            s->pattern = pattern_compile(text, n, 0);
+            if (!s->pattern) return -1;
+        } else {
+            s->text = malloc(n + 1);
+            if (!s->text) return -1;
+            s->len = unescape(s->text, text, n);
+        }
+    }
+    return 0;
+}
+
+// Expand a pattern into the sorted list of matching paths, pushed onto
+// out. Returns the number of matches, 0 if the caller should keep the
+// word as it is, or -1 on error.
+int glob_expand(const char *pat, size_t len, Arena *arena, ArgvBuilder *out) {
+    if (len == 0 || !pattern_has_magic(pat, len)) return 0;
+
+    GlobPlan plan;
+    GlobWalker w = {0};
+    int count = -1;
+
+    if (plan_compile(&plan, pat, len) != 0 || plan.count == 0) goto done;
+    w.plan = &plan;
+    w.main = 1;
+    w.dents = malloc(GLOB_DENTS_SIZE);
+    if (!w.dents || path_push(&w, "/", plan.absolute, 0) != 0) goto done;
+    glob_walk(&w, 0);
+    results_sort(&w.res);
+
+    // Merge the sorted runs: the shell's own matches and each helper's
+    int nruns = w.nruns + 1;
+    GlobResults **runs = malloc(nruns * sizeof(GlobResults *));
+    size_t *next = calloc(nruns, sizeof(size_t));
+    if (!runs || !next) {
+        free(runs);
+        free(next);
+        goto done;
+    }
+    runs[0] = &w.res;
+    for (int r = 1; r < nruns; r++) runs[r] = &w.runs[r - 1];
+
+    count = 0;
+    for (;;) {
+        int best = -1;
+        const char *best_name = NULL;
+        for (int r = 0; r < nruns; r++) {
+            if (next[r] == runs[r]->count) continue;
+            const char *name = runs[r]->names.data + runs[r]->offsets[next[r]];
+            if (!best_name || strcmp(name, best_name) < 0) {
+                best = r;
+                best_name = name;
+            }
+        }
+        if (best < 0) break;
+        next[best]++;
+
+        char *arg = arena_strndup(arena, best_name, strlen(best_name));
+        if (!arg || argv_push(out, arg) != 0) {
+            count = -1;
+            break;
+        }
+        count++;
+    }
+    free(runs);
+    free(next);
+
+done:
+    for (int r = 0; r < w.nruns; r++) results_free(&w.runs[r]);
+    free(w.runs);
+    results_free(&w.res);
+    strbuf_free(&w.path);
+    free(w.dents);
+    plan_free(&plan);
+    return count;
+}
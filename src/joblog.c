@@ -0,0 +1,344 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include "shell.h"
+
+// Job logs: captured output of background jobs.
+//
+// With XSH_JOBLOG set, a background job's standard output and error go
+// to a pipe instead of the terminal. The shell drains the pipe whenever
+// it waits: for a key at the prompt, for a foreground command, or in
+// joblog -f. The last JOBLOG_RING bytes are kept in a ring in memory;
+// older bytes are moved to an unlinked spill file in $TMPDIR, so a job
+// that writes a lot costs disk rather than memory. If no spill file can
+// be made the oldest bytes are dropped instead. joblog prints a log,
+// its last lines, or follows it until the job closes its output. The
+// same waits let the command queue move on, see queue.c.
+//
+// A log lasts as long as its job's entry in the job table. Once the job
+// is done and its output read to the end, what is left in the ring is
+// moved out to the spill file too, so finished jobs keep their output
+// on disk and none of it in memory.
+
+#define JOBLOG_RING    (64 * 1024)
+#define JOBLOG_PIPE    (256 * 1024)    // pipe size asked for, to ride out busy spells
+#define JOBLOG_CHUNK   16384
+
+struct JobLog {
+    int fd;             // read end of the job's pipe, -1 after end of file
+    char *ring;         // allocated at the first output
+    size_t start;       // offset of the oldest byte in the ring
+    size_t end;         // bytes received
+    int spill;          // spill file with bytes [0, start), or -1
+    size_t dropped;     // bytes [0, dropped) lost when there was no spill file
+};
+
+// Whether new background jobs should be captured
+int joblog_wanted(void) {
+    const char *v = var_lookup("XSH_JOBLOG", 10);
+    return v && *v;
+}
+
+// Make a log and the pipe for it. Returns the log and sets *write_fd to
+// the end the job should write to, or returns NULL.
+JobLog *joblog_create(int *write_fd) {
+    int p[2];
+    JobLog *log = calloc(1, sizeof(JobLog));
+    if (!log) return NULL;
+    if (pipe2(p, O_CLOEXEC) != 0) {
+        print_error("joblog: pipe: %s", strerror(errno));
+        free(log);
+        return NULL;
+    }
+    fcntl(p[0], F_SETFL, O_NONBLOCK);
+    fcntl(p[0], F_SETPIPE_SZ, JOBLOG_PIPE);
+    log->fd = p[0];
+    log->spill = -1;
+    *write_fd = p[1];
+    return log;
+}
+
+void joblog_free(JobLog *log) {
+    if (!log) return;
+    if (log->fd >= 0) close(log->fd);
+    if (log->spill >= 0) close(log->spill);
+    free(log->ring);
+    free(log);
+}
+
+// Make the spill file unless there is one, or making one failed before.
+// Returns whether there is one.
+static int joblog_spill_file(JobLog *log) {
+    if (log->spill < 0 && log->dropped == 0) {
+        const char *dir = getenv("TMPDIR");
+        log->spill = open(dir && *dir ? dir : "/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    }
+    return log->spill >= 0;
+}
+
+// Move the oldest n bytes of the ring out to the spill file
+static void joblog_spill(JobLog *log, size_t n) {
+    joblog_spill_file(log);
+    while (n > 0) {
+        size_t at = log->start % JOBLOG_RING;
+        size_t len = n < JOBLOG_RING - at ? n : JOBLOG_RING - at;
+        if (log->spill >= 0 && pwrite(log->spill, log->ring + at, len, log->start) != (ssize_t)len) {
+            close(log->spill);
+            log->spill = -1;
+        }
+        log->start += len;
+        n -= len;
+        if (log->spill < 0) log->dropped = log->start;
+    }
+}
+
+static void joblog_append(JobLog *log, const char *data, size_t n) {
+    if (n > JOBLOG_RING) {
+        // Only the tail of a large chunk can stay in memory; the rest
+        // goes after what is already in the ring
+        size_t head = n - JOBLOG_RING;
+        joblog_append(log, data, head);
+        data += head;
+        n -= head;
+    }
+    if (!log->ring && !(log->ring = malloc(JOBLOG_RING))) return;
+    if (log->end + n - log->start > JOBLOG_RING) joblog_spill(log, log->end + n - log->start - JOBLOG_RING);
+    while (n > 0) {
+        size_t at = log->end % JOBLOG_RING;
+        size_t len = n < JOBLOG_RING - at ? n : JOBLOG_RING - at;
+        memcpy(log->ring + at, data, len);
+        log->end += len;
+        data += len;
+        n -= len;
+    }
+}
+
+// Read what the job has written so far
+static void joblog_drain(JobLog *log) {
+    char buf[JOBLOG_CHUNK];
+    while (log->fd >= 0) {
+        ssize_t n = read(log->fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) break;
+        if (n == 0) {
+            close(log->fd);
+            log->fd = -1;
+            break;
+        }
+        joblog_append(log, buf, n);
+    }
+}
+
+// Read logical bytes [off, off + len) of the log into buf. Returns the
+// number read, which is short only at the end of the log.
+static size_t joblog_read(JobLog *log, size_t off, char *buf, size_t len) {
+    size_t done = 0;
+    if (off < log->start && log->spill >= 0) {
+        size_t want = log->start - off < len ? log->start - off : len;
+        ssize_t n = pread(log->spill, buf, want, off);
+        if (n <= 0) return 0;
+        done = n;
+        off += n;
+    }
+    while (done < len && off >= log->start && off < log->end) {
+        size_t at = off % JOBLOG_RING;
+        size_t n = len - done;
+        if (n > log->end - off) n = log->end - off;
+        if (n > JOBLOG_RING - at) n = JOBLOG_RING - at;
+        memcpy(buf + done, log->ring + at, n);
+        done += n;
+        off += n;
+    }
+    return done;
+}
+
+// Move the rest of the logs of finished jobs out of memory. A log whose
+// spill file cannot be made keeps its ring.
+void joblog_trim(void) {
+    for (int i = 0; i < config.job_count; i++) {
+        Job *job = &config.jobs[i];
+        JobLog *log = job->log;
+        if (!log || !log->ring || job->running || log->fd >= 0 || !joblog_spill_file(log)) continue;
+        joblog_spill(log, log->end - log->start);
+        free(log->ring);
+        log->ring = NULL;
+    }
+}
+
+void joblog_pump(void) {
+    for (int i = 0; i < config.job_count; i++) {
+        if (config.jobs[i].log) joblog_drain(config.jobs[i].log);
+    }
+}
+
+static int joblog_open_count(void) {
+    int count = 0;
+    for (int i = 0; i < config.job_count; i++) {
+        if (config.jobs[i].log && config.jobs[i].log->fd >= 0) count++;
+    }
+    return count;
+}
+
+// Is there job output to read or a queue to move while the shell waits?
+static int joblog_busy(void) {
+    return joblog_open_count() > 0 || queue_active();
+}
+
+// Wait for fd to become readable while draining the logs and moving the
+// queue. fd may be -1 to wait for log output only. Returns 1 if fd is
+// ready, 0 if only something else was, and -1 if interrupted or if there
+// is nothing to wait for.
+int joblog_poll(int fd, int timeout) {
+    int count = joblog_open_count();
+    if (count == 0 && fd < 0) return -1;
+    int slots = count + 1 + queue_active();
+    struct pollfd *pfds = malloc(slots * sizeof(struct pollfd));
+    if (!pfds) return -1;
+    nfds_t n = 0;
+    if (fd >= 0) pfds[n++] = (struct pollfd){fd, POLLIN, 0};
+    for (int i = 0; i < config.job_count; i++) {
+        JobLog *log = config.jobs[i].log;
+        if (log && log->fd >= 0) pfds[n++] = (struct pollfd){log->fd, POLLIN, 0};
+    }
+    n += queue_pollfds(pfds + n, slots - n, &timeout);
+    int rc = poll(pfds, n, timeout);
+    int ready = fd >= 0 && rc > 0 && pfds[0].revents;
+    free(pfds);
+    if (rc < 0) return -1;
+    joblog_pump();
+    queue_pump();
+    return ready;
+}
+
+// Wait for pid to exit, reading job output and moving the queue
+// meanwhile. The caller reaps.
+void joblog_wait(pid_t pid) {
+    if (!joblog_busy()) return;
+    int pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd < 0) return;
+    while (joblog_poll(pidfd, -1) == 0) continue;
+    close(pidfd);
+}
+
+// Readline's getc: logs are drained while the prompt waits for a key
+int joblog_getc(FILE *stream) {
+    while (joblog_busy() && joblog_poll(fileno(stream), -1) == 0) continue;
+    return rl_getc(stream);
+}
+
+// Forget the logs in a forked child: they are read by the parent
+void joblog_forget(void) {
+    for (int i = 0; i < config.job_count; i++) {
+        JobLog *log = config.jobs[i].log;
+        if (log && log->fd >= 0) {
+            close(log->fd);
+            log->fd = -1;
+        }
+    }
+}
+
+size_t joblog_size(JobLog *log) {
+    return log->end;
+}
+
+// Write bytes [from, log->end) to standard output. Returns where it
+// stopped.
+static size_t joblog_print(JobLog *log, size_t from) {
+    char buf[JOBLOG_CHUNK];
+    if (from < log->dropped) {
+        print_error("joblog: first %zu bytes dropped", log->dropped);
+        from = log->dropped;
+    }
+    while (from < log->end) {
+        size_t n = joblog_read(log, from, buf, sizeof(buf));
+        if (n == 0) break;
+        out_write(STDOUT_FILENO, buf, n);
+        from += n;
+    }
+    out_flush();
+    return from;
+}
+
+// Offset of the start of the last lines lines of the log
+static size_t joblog_tail(JobLog *log, long lines) {
+    char buf[JOBLOG_CHUNK];
+    size_t off = log->end;
+    if (lines == 0) return off;
+    // A newline that ends the log does not begin another line
+    if (off > 0 && joblog_read(log, off - 1, buf, 1) == 1 && buf[0] == '\n') off--;
+    while (off > log->dropped) {
+        size_t len = off - log->dropped < sizeof(buf) ? off - log->dropped : sizeof(buf);
+        if (joblog_read(log, off - len, buf, len) != len) break;
+        for (size_t k = len; k > 0; k--) {
+            if (buf[k - 1] == '\n' && --lines == 0) return off - len + k;
+        }
+        off -= len;
+    }
+    return log->dropped;
+}
+
+// joblog [-n lines] [-f] [%job|n]
+int cmd_joblog(char **args) {
+    long lines = -1;
+    int follow = 0, i = 1;
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        if (strcmp(args[i], "-f") == 0) {
+            follow = 1;
+        } else if (strncmp(args[i], "-n", 2) == 0) {
+            const char *value = args[i][2] ? args[i] + 2 : args[++i];
+            char *end;
+            lines = value ? strtol(value, &end, 10) : -1;
+            if (!value || *end || lines < 0) {
+                print_error("joblog: %s: invalid line count", value ? value : "-n");
+                return EXIT_USAGE;
+            }
+        } else {
+            print_error("joblog: %s: invalid option", args[i]);
+            return EXIT_USAGE;
+        }
+    }
+    if (args[i] && args[i + 1]) {
+        print_error("joblog: usage: joblog [-n lines] [-f] [%%job]");
+        return EXIT_USAGE;
+    }
+
+    update_jobs();
+    Job *job = NULL;
+    if (!args[i]) {
+        // The most recent job with a log
+        for (int k = config.job_count; k > 0 && !job; k--) {
+            if (config.jobs[k - 1].log) job = &config.jobs[k - 1];
+        }
+    } else {
+        const char *spec = args[i] + (args[i][0] == '%');
+        char *end;
+        long id = strtol(spec, &end, 10);
+        if (*spec && !*end && id > 0 && id <= INT_MAX) job = get_job((int)id);
+        if (!job) {
+            print_error("joblog: %s: no such job", args[i]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (!job || !job->log) {
+        print_error("joblog: %s: output not captured; set XSH_JOBLOG before starting jobs",
+                    args[i] ? args[i] : "no job");
+        return EXIT_FAILURE;
+    }
+    JobLog *log = job->log;
+
+    size_t from = lines >= 0 ? joblog_tail(log, lines) : 0;
+    size_t pos = joblog_print(log, from);
+    while (follow && log->fd >= 0) {
+        if (joblog_poll(-1, -1) < 0) return 128 + SIGINT;
+        pos = joblog_print(log, pos);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,583 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "shell.h"
+
+// Lexer: turns shell input into word, operator and newline tokens.
+// Tokens are spans into the input (or into an alias value being
+// expanded); nothing is copied here. Each word carries flags telling the
+// expander whether it needs any work at all.
+
+// Find the end of a ${...} body. s points just past "${". Returns the
+// index of the closing brace, or len if unterminated.
+size_t skip_param_braces(const char *s, size_t len) {
+    int depth = 1;
+    size_t i = 0;
+
+    while (i < len) {
+        char c = s[i];
+        if (c == '\\') {
+            i += 2;
+            continue;
+        }
+        if (c == '\'') {
+            const char *close = memchr(s + i + 1, '\'', len - i - 1);
+            if (!close) return len;
+            i = close - s + 1;
+            continue;
+        }
+        if (c == '"') {
+            i++;
+            while (i < len && s[i] != '"') {
+                if (s[i] == '\\') i++;
+                i++;
+            }
+            i++;
+            continue;
+        }
+        if (c == '$' && i + 1 < len && s[i + 1] == '{') {
+            depth++;
+            i += 2;
+            continue;
+        }
+        if (c == '$' && i + 1 < len && s[i + 1] == '(') {
+            size_t end = skip_subst_parens(s + i + 2, len - i - 2);
+            if (end >= len - i - 2) return len;
+            i += end + 3;
+            continue;
+        }
+        if (c == '}' && --depth == 0) return i;
+        i++;
+    }
+    return len;
+}
+
+// Find the end of an array subscript. s points just past "[". Returns the
+// index of the matching ']', or len if unterminated.
+size_t skip_subscript(const char *s, size_t len) {
+    int depth = 1;
+    size_t i = 0;
+
+    while (i < len) {
+        char c = s[i];
+        if (c == '\\') {
+            i += 2;
+            continue;
+        }
+        if (c == '\'' || c == '"') {
+            const char *close = memchr(s + i + 1, c, len - i - 1);
+            if (!close) return len;
+            i = close - s + 1;
+            continue;
+        }
+        if (c == '$' && i + 1 < len && (s[i + 1] == '{' || s[i + 1] == '(')) {
+            size_t end = s[i + 1] == '{' ? skip_param_braces(s + i + 2, len - i - 2)
+                                         : skip_subst_parens(s + i + 2, len - i - 2);
+            if (end >= len - i - 2) return len;
+            i += end + 3;
+            continue;
+        }
+        if (c == '[') depth++;
+        if (c == ']' && --depth == 0) return i;
+        i++;
+    }
+    return len;
+}
+
+// Find the end of a `...` body. s points just past the opening backquote.
+// Returns the index of the closing one, or len if unterminated.
+size_t skip_backquote(const char *s, size_t len) {
+    size_t i = 0;
+    while (i < len && s[i] != '`') {
+        if (s[i] == '\\') i++;
+        i++;
+    }
+    return i < len ? i : len;
+}
+
+// Is the reserved word kw at s[i], delimited on both sides?
+static int keyword_at(const char *s, size_t i, size_t len, const char *kw) {
+    size_t n = strlen(kw);
+    if (i > 0 && !strchr(" \t\n;(|&", s[i - 1])) return 0;
+    if (i + n > len || strncmp(s + i, kw, n) != 0) return 0;
+    return i + n == len || strchr(" \t\n;)", s[i + n]);
+}
+
+#define SUBST_MAX_CASE 16
+
+// Find the end of a $(...) body. s points just past "$(". Returns the
+// index of the closing parenthesis, or len if unterminated. The ')'
+// ending a case pattern is not counted as closing anything.
+size_t skip_subst_parens(const char *s, size_t len) {
+    int depth = 1;
+    int case_depth[SUBST_MAX_CASE];
+    int ncase = 0;
+    size_t i = 0;
+
+    while (i < len) {
+        char c = s[i];
+        if (c == '\\') {
+            i += 2;
+            continue;
+        }
+        if (c == '\'') {
+            const char *close = memchr(s + i + 1, '\'', len - i - 1);
+            if (!close) return len;
+            i = close - s + 1;
+            continue;
+        }
+        if (c == '"') {
+            i++;
+            while (i < len && s[i] != '"') {
+                if (s[i] == '\\') i++;
+                i++;
+            }
+            i++;
+            continue;
+        }
+        if (c == '`') {
+            i += skip_backquote(s + i + 1, len - i - 1) + 2;
+            continue;
+        }
+        if (c == '#' && (i == 0 || isspace((unsigned char)s[i - 1]))) {
+            while (i < len && s[i] != '\n') i++;
+            continue;
+        }
+        if (keyword_at(s, i, len, "case") && ncase < SUBST_MAX_CASE) {
+            case_depth[ncase++] = depth;
+            i += 4;
+            continue;
+        }
+        if (keyword_at(s, i, len, "esac") && ncase > 0) {
+            ncase--;
+            i += 4;
+            continue;
+        }
+        if (c == '(') depth++;
+        if (c == ')') {
+            if (ncase > 0 && case_depth[ncase - 1] == depth) {
+                i++;
+                continue;
+            }
+            if (--depth == 0) return i;
+        }
+        i++;
+    }
+    return len;
+}
+
+void lexer_init(Lexer *lx, const char *src, size_t len) {
+    memset(lx, 0, sizeof(*lx));
+    lx->stack[0].src = src;
+    lx->stack[0].len = len;
+    lx->depth = 1;
+    lx->lineno = 1;
+}
+
+// Expand an alias by pushing its value as a new input source
+int lexer_push_alias(Lexer *lx, const char *name, const char *value) {
+    if (lx->depth >= LEX_MAX_DEPTH) return -1;
+    for (int i = 1; i < lx->depth; i++) {
+        if (strcmp(lx->stack[i].alias, name) == 0) return -1;  // recursive
+    }
+    LexSource *s = &lx->stack[lx->depth++];
+    s->src = value;
+    s->len = strlen(value);
+    s->pos = 0;
+    s->alias = name;
+    return 0;
+}
+
+// Is this alias currently being expanded?
+int lexer_in_alias(const Lexer *lx, const char *name) {
+    for (int i = 1; i < lx->depth; i++) {
+        if (strcmp(lx->stack[i].alias, name) == 0) return 1;
+    }
+    return 0;
+}
+
+static int is_operator_char(char c) {
+    return c == '|' || c == '&' || c == ';' || c == '<' || c == '>' || c == '(' || c == ')';
+}
+
+// Is s the part of an assignment word before '=': NAME, NAME+, NAME[sub]
+// or NAME[sub]+?
+static int is_assign_prefix(const char *s, size_t len) {
+    if (len > 0 && s[len - 1] == '+') len--;
+    if (len > 0 && s[len - 1] == ']') {
+        const char *open = memchr(s, '[', len);
+        if (!open || skip_subscript(open + 1, len - (open - s) - 1) != len - (open - s) - 2) return 0;
+        len = open - s;
+    }
+    return is_valid_name(s, len);
+}
+
+// Index of the ')' closing the extended pattern group opened at
+// line[open], or 0 if it is not closed. Quotes inside the group are
+// noted in *flags.
+static size_t pattern_group_end(const char *line, size_t len, size_t open, unsigned *flags) {
+    int depth = 0;
+    for (size_t i = open; i < len; i++) {
+        char c = line[i];
+        if (c == '\\') {
+            *flags |= WORD_QUOTED;
+            i++;
+        } else if (c == '\'' || c == '"') {
+            const char *close = memchr(line + i + 1, c, len - i - 1);
+            if (!close) return 0;
+            *flags |= WORD_QUOTED;
+            i = close - line;
+        } else if (c == '(') {
+            depth++;
+        } else if (c == ')' && --depth == 0) {
+            return i;
+        } else if (c == '\n' || c == '$' || c == '`') {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+// Scan one word. Returns 0, or -1 if the input ends inside a quote or
+// substitution.
+static int scan_word(Lexer *lx, LexSource *s, Token *tok) {
+    const char *line = s->src;
+    size_t len = s->len;
+    size_t i = s->pos;
+    unsigned flags = 0;
+    int braces = 0;         // 1: seen '{', 2: then ',' or ".."
+    int groups = 0;         // open parentheses in a =~ regex
+
+    tok->type = TOK_WORD;
+    tok->text = line + i;
+
+    if (line[i] == '~') flags |= WORD_TILDE;
+
+    while (i < len) {
+        char c = line[i];
+        size_t group;
+
+        // A regex may use ( ) | < > unquoted, and blanks inside a group
+        if (lx->regex && ((c && strchr("(|<>", c)) || (c == ')' && groups > 0) ||
+                          (groups > 0 && (c == ' ' || c == '\t')))) {
+            if (c == '(') groups++;
+            if (c == ')') groups--;
+            i++;
+            continue;
+        }
+        if (isspace((unsigned char)c) || is_operator_char(c)) break;
+
+        if (c == '\\') {
+            if (i + 1 < len && line[i + 1] == '\n') {
+                lx->lineno++;
+            }
+            flags |= WORD_QUOTED;
+            i += (i + 1 < len) ? 2 : 1;
+        } else if (c == '\'') {
+            flags |= WORD_QUOTED;
+            const char *close = memchr(line + i + 1, '\'', len - i - 1);
+            if (!close) return -1;
+            i = close - line + 1;
+        } else if (c == '"') {
+            flags |= WORD_QUOTED;
+            i++;
+            while (i < len && line[i] != '"') {
+                if (line[i] == '\\' && i + 1 < len) {
+                    i += 2;
+                } else if (line[i] == '$' && i + 1 < len && line[i + 1] == '{') {
+                    flags |= WORD_DOLLAR;
+                    size_t end = skip_param_braces(line + i + 2, len - i - 2);
+                    if (i + 2 + end >= len) return -1;
+                    i += 2 + end + 1;
+                } else if (line[i] == '$' && i + 1 < len && line[i + 1] == '(') {
+                    flags |= WORD_DOLLAR;
+                    size_t end = skip_subst_parens(line + i + 2, len - i - 2);
+                    if (i + 2 + end >= len) return -1;
+                    i += 2 + end + 1;
+                } else if (line[i] == '`') {
+                    flags |= WORD_DOLLAR;
+                    size_t end = skip_backquote(line + i + 1, len - i - 1);
+                    if (i + 1 + end >= len) return -1;
+                    i += 1 + end + 1;
+                } else {
+                    if (line[i] == '$') flags |= WORD_DOLLAR;
+                    i++;
+                }
+            }
+            if (i >= len) return -1;
+            i++;
+        } else if (c == '$' && i + 1 < len && line[i + 1] == '{') {
+            flags |= WORD_DOLLAR;
+            size_t end = skip_param_braces(line + i + 2, len - i - 2);
+            if (i + 2 + end >= len) return -1;
+            i += 2 + end + 1;
+        } else if (c == '$' && i + 1 < len && line[i + 1] == '(') {
+            flags |= WORD_DOLLAR;
+            size_t end = skip_subst_parens(line + i + 2, len - i - 2);
+            if (i + 2 + end >= len) return -1;
+            i += 2 + end + 1;
+        } else if (c == '`') {
+            flags |= WORD_DOLLAR;
+            size_t end = skip_backquote(line + i + 1, len - i - 1);
+            if (i + 1 + end >= len) return -1;
+            i += 1 + end + 1;
+        } else if (c && strchr("?*+@!", c) && i + 1 < len && line[i + 1] == '(' &&
+                   (group = pattern_group_end(line, len, i + 1, &flags)) != 0) {
+            // Extended pattern such as @(a|b): the group belongs to the word
+            flags |= WORD_GLOB;
+            i = group + 1;
+        } else {
+            if (c == '$') flags |= WORD_DOLLAR;
+            if (c == '*' || c == '?' || c == '[') flags |= WORD_GLOB;
+            if (c == '{') {
+                braces |= 1;
+            } else if ((braces & 1) && (c == ',' || (c == '.' && i + 1 < len && line[i + 1] == '.'))) {
+                braces |= 2;
+            } else if (c == '}' && braces == 3) {
+                flags |= WORD_BRACE;
+            }
+            if (c == '=' && !(flags & WORD_ASSIGN) &&
+                is_assign_prefix(tok->text, line + i - tok->text)) {
+                flags |= WORD_ASSIGN;
+                if (i + 1 < len && line[i + 1] == '(') {
+                    // Compound array value NAME=(...): the list is part
+                    // of the word and is split up when it is assigned
+                    size_t end = skip_subst_parens(line + i + 2, len - i - 2);
+                    if (i + 2 + end >= len) return -1;
+                    i += 2 + end;
+                }
+            }
+            i++;
+        }
+    }
+
+    for (const char *p = tok->text; p < line + i; p++) {
+        if (*p == '\n') lx->lineno++;
+    }
+
+    tok->len = line + i - tok->text;
+    tok->flags = flags;
+    s->pos = i;
+    return 0;
+}
+
+// Scan an operator at s->pos into tok
+static void scan_operator(LexSource *s, Token *tok) {
+    static const struct {
+        const char *text;
+        int op;
+    } ops[] = {
+        {"<<<", OP_TLESS}, {"<<-", OP_DLESSDASH}, {"&>>", OP_ANDDGREAT}, {";;&", OP_DSEMIAND},
+        {"&&", OP_AND_IF}, {"||", OP_OR_IF}, {";;", OP_DSEMI}, {";&", OP_SEMIAND},
+        {"<<", OP_DLESS}, {">>", OP_DGREAT}, {"<&", OP_LESSAND}, {">&", OP_GREATAND},
+        {"<>", OP_LESSGREAT}, {">|", OP_CLOBBER}, {"&>", OP_ANDGREAT},
+        {"|", OP_PIPE}, {"&", OP_AMP}, {";", OP_SEMI}, {"<", OP_LESS}, {">", OP_GREAT},
+        {"(", OP_LPAREN}, {")", OP_RPAREN},
+    };
+    const char *p = s->src + s->pos;
+    size_t left = s->len - s->pos;
+
+    for (size_t k = 0; k < sizeof(ops) / sizeof(ops[0]); k++) {
+        size_t n = strlen(ops[k].text);
+        if (n <= left && strncmp(p, ops[k].text, n) == 0) {
+            tok->type = TOK_OP;
+            tok->op = ops[k].op;
+            tok->text = p;
+            tok->len = n;
+            s->pos += n;
+            return;
+        }
+    }
+}
+
+// Produce the next token. Returns 0, or -1 on error; lx->incomplete is
+// set when the error is that the input ended early.
+int lex_next(Lexer *lx, Token *tok) {
+    memset(tok, 0, sizeof(*tok));
+    tok->fd = -1;
+
+    for (;;) {
+        LexSource *s = &lx->stack[lx->depth - 1];
+
+        // Skip blanks and line continuations
+        while (s->pos < s->len) {
+            char c = s->src[s->pos];
+            if (c == ' ' || c == '\t' || c == '\r') {
+                s->pos++;
+            } else if (c == '\\' && s->pos + 1 < s->len && s->src[s->pos + 1] == '\n') {
+                s->pos += 2;
+                lx->lineno++;
+            } else if (c == '#') {
+                while (s->pos < s->len && s->src[s->pos] != '\n') s->pos++;
+            } else {
+                break;
+            }
+        }
+
+        if (s->pos >= s->len) {
+            if (lx->depth > 1) {
+                lx->depth--;  // end of alias value
+                continue;
+            }
+            tok->type = TOK_EOF;
+            tok->text = s->src + s->pos;
+            return 0;
+        }
+
+        const char *p = s->src + s->pos;
+        size_t left = s->len - s->pos;
+        tok->lineno = lx->lineno;
+
+        if (*p == '\n') {
+            tok->type = TOK_NEWLINE;
+            tok->text = p;
+            tok->len = 1;
+            s->pos++;
+            lx->lineno++;
+            return 0;
+        }
+
+        if (lx->regex && *p && strchr("(|<>", *p)) {
+            if (scan_word(lx, s, tok) != 0) {
+                lx->incomplete = 1;
+                return -1;
+            }
+            return 0;
+        }
+
+        // (( arithmetic ))
+        if (left >= 2 && p[0] == '(' && p[1] == '(') {
+            int depth = 0;
+            size_t i = 2;
+            for (; i < left; i++) {
+                if (p[i] == '(') {
+                    depth++;
+                } else if (p[i] == ')') {
+                    if (depth == 0) break;
+                    depth--;
+                }
+            }
+            if (i + 1 >= left || p[i + 1] != ')') {
+                if (i + 1 >= left) {
+                    lx->incomplete = 1;
+                    return -1;
+                }
+            } else {
+                tok->type = TOK_ARITH;
+                tok->text = p + 2;
+                tok->len = i - 2;
+                s->pos += i + 2;
+                return 0;
+            }
+        }
+
+        // IO number: digits immediately followed by a redirection
+        size_t digits = 0;
+        while (digits < left && isdigit((unsigned char)p[digits])) digits++;
+        if (digits > 0 && digits < left && (p[digits] == '<' || p[digits] == '>') && digits < 4) {
+            int fd = atoi(p);
+            s->pos += digits;
+            scan_operator(s, tok);
+            tok->fd = fd;
+            return 0;
+        }
+
+        if (is_operator_char(*p)) {
+            scan_operator(s, tok);
+            return 0;
+        }
+
+        if (scan_word(lx, s, tok) != 0) {
+            if (lx->depth == 1) {
+                lx->incomplete = 1;
+            } else {
+                print_error("syntax error: unterminated quote in alias");
+            }
+            return -1;
+        }
+        return 0;
+    }
+}
+
+// Read a here-document body from the base input, which must be positioned
+// at the start of the line following the redirection. The body is copied
+// into the arena, with leading tabs removed for <<-.
+int lex_heredoc(Lexer *lx, const char *delim, size_t dlen, int strip_tabs,
+                Arena *arena, char **body, size_t *blen) {
+    LexSource *s = &lx->stack[0];
+    size_t start = s->pos;
+    StrBuf buf = {0};
+
+    while (s->pos < s->len) {
+        const char *line = s->src + s->pos;
+        const char *nl = memchr(line, '\n', s->len - s->pos);
+        size_t line_len = nl ? (size_t)(nl - line) : s->len - s->pos;
+        size_t skip = 0;
+        if (strip_tabs) {
+            while (skip < line_len && line[skip] == '\t') skip++;
+        }
+
+        s->pos += line_len + (nl ? 1 : 0);
+        lx->lineno++;
+
+        if (line_len - skip == dlen && strncmp(line + skip, delim, dlen) == 0) {
+            *body = arena_strndup(arena, buf.data ? buf.data : "", buf.len);
+            *blen = buf.len;
+            strbuf_free(&buf);
+            return *body ? 0 : -1;
+        }
+
+        if (strbuf_append(&buf, line + skip, line_len - skip) != 0 ||
+            strbuf_putc(&buf, '\n') != 0) {
+            strbuf_free(&buf);
+            return -1;
+        }
+    }
+
+    // Ran out of input before the delimiter
+    s->pos = start;
+    strbuf_free(&buf);
+    lx->incomplete = 1;
+    return -1;
+}
+
+static int token_push(TokenList *list, const Token *tok) {
+    if (list->count == list->capacity) {
+        int cap = list->capacity ? list->capacity * 2 : 32;
+        Token *items = realloc(list->items, cap * sizeof(Token));
+        if (!items) return -1;
+        list->items = items;
+        list->capacity = cap;
+    }
+    list->items[list->count++] = *tok;
+    return 0;
+}
+
+// Split a line into tokens. The list is reset first and can be reused.
+int lex_line(const char *line, size_t len, TokenList *list) {
+    Lexer lx;
+    lexer_init(&lx, line, len);
+    list->count = 0;
+
+    for (;;) {
+        Token tok;
+        if (lex_next(&lx, &tok) != 0) {
+            print_error("syntax error: unterminated quote");
+            return -1;
+        }
+        if (tok.type == TOK_EOF) break;
+        if (token_push(list, &tok) != 0) {
+            print_error("malloc: failed to allocate memory");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void token_list_free(TokenList *list) {
+    free(list->items);
+    list->items = NULL;
+    list->count = 0;
+    list->capacity = 0;
+}
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <pwd.h>
@@ -31,6 +32,9 @@ const char *standard_paths[] = {
 
 // Initialize shell
 void initialize_shell(void) {
+    // The spawner is forked first, while the shell is still small
+    zygote_start();
+
     struct passwd *pw = getpwuid(getuid());
     if (pw) {
         strncpy(current_user, pw->pw_name, sizeof(current_user) - 1);
@@ -47,6 +51,7 @@ void initialize_shell(void) {
     // Initialize readline with custom completion
     rl_initialize();
     rl_attempted_completion_function = xsh_completion;
+    rl_getc_function = joblog_getc;
 
     // Load history
     char history_path[MAX_PATH_LENGTH];
@@ -58,6 +63,10 @@ void initialize_shell(void) {
     signal(SIGTERM, handle_signal);
     signal(SIGQUIT, handle_signal);
 
+    // Import environment into the variable store
+    vars_init();
+    config.shell_pid = getpid();
+
     // Initialize config
     config.color_prompt = 1;
     config.history_size = MAX_HISTORY;
@@ -65,6 +74,9 @@ void initialize_shell(void) {
     config.job_count = 0;
 
     setlocale(LC_ALL, "");
+
+    // Builtin output still buffered when the shell exits
+    atexit(out_flush);
 }
 
 // Find command in PATH
@@ -73,7 +85,7 @@ char *find_command(const char *cmd) {
     
     // If cmd contains '/', treat as path
     if (strchr(cmd, '/')) {
-        if (access(cmd, X_OK) == 0) {
+        if (is_executable(cmd)) {
             return strdup(cmd);
         }
         return NULL;
@@ -88,8 +100,12 @@ char *find_command(const char *cmd) {
     
     // Add standard paths to search
     size_t total_len = strlen(path);
+    const char *home_env = getenv("HOME");
     for (int i = 0; standard_paths[i]; i++) {
         total_len += strlen(standard_paths[i]) + 1;  // +1 for ':'
+        if (standard_paths[i][0] == '~' && home_env) {
+            total_len += strlen(home_env);  // '~' is expanded below
+        }
     }
     
     char *new_path = malloc(total_len + 1);
@@ -125,7 +141,7 @@ char *find_command(const char *cmd) {
     
     while (dir) {
         snprintf(full_path, sizeof(full_path), "%s/%s", dir, cmd);
-        if (access(full_path, X_OK) == 0) {
+        if (is_executable(full_path)) {
             free(path);
             return strdup(full_path);
         }
@@ -165,37 +181,154 @@ int cmd_cd(char **args) {
 
 int cmd_pwd(char **args) {
     (void)args;
-    printf("%s\n", current_dir);
+    out_printf(STDOUT_FILENO, "%s\n", current_dir);
     return EXIT_SUCCESS;
 }
 
 int cmd_exit(char **args) {
-    (void)args;
+    int status = config.last_status;
+    if (args[1]) {
+        char *end;
+        long n = strtol(args[1], &end, 10);
+        if (*end || end == args[1]) {
+            print_error("exit: %s: numeric argument required", args[1]);
+            n = EXIT_USAGE;
+        }
+        status = (int)(n & 0xff);
+    }
     running = 0;
+    return status;
+}
+
+// Print one echo -e argument, interpreting escapes. Returns 1 after \c.
+static int echo_escaped(const char *s) {
+    for (; *s; s++) {
+        if (*s != '\\' || !s[1]) {
+            out_putc(STDOUT_FILENO, *s);
+            continue;
+        }
+        int c = *++s;
+        switch (c) {
+            case 'a': out_putc(STDOUT_FILENO, '\a'); break;
+            case 'b': out_putc(STDOUT_FILENO, '\b'); break;
+            case 'c': return 1;
+            case 'e': out_putc(STDOUT_FILENO, '\033'); break;
+            case 'f': out_putc(STDOUT_FILENO, '\f'); break;
+            case 'n': out_putc(STDOUT_FILENO, '\n'); break;
+            case 'r': out_putc(STDOUT_FILENO, '\r'); break;
+            case 't': out_putc(STDOUT_FILENO, '\t'); break;
+            case 'v': out_putc(STDOUT_FILENO, '\v'); break;
+            case '\\': out_putc(STDOUT_FILENO, '\\'); break;
+            case '0': {
+                int v = 0;
+                for (int k = 0; k < 3 && s[1] >= '0' && s[1] <= '7'; k++) v = v * 8 + (*++s - '0');
+                out_putc(STDOUT_FILENO, v);
+                break;
+            }
+            case 'x': {
+                int v = 0, k = 0;
+                for (; k < 2 && isxdigit((unsigned char)s[1]); k++) {
+                    c = *++s;
+                    v = v * 16 + (isdigit(c) ? c - '0' : tolower(c) - 'a' + 10);
+                }
+                if (k == 0) out_puts(STDOUT_FILENO, "\\x");
+                else out_putc(STDOUT_FILENO, v);
+                break;
+            }
+            default:
+                out_putc(STDOUT_FILENO, '\\');
+                out_putc(STDOUT_FILENO, c);
+        }
+    }
+    return 0;
+}
+
+int cmd_echo(char **args) {
+    int newline = 1, escapes = 0;
+    int i = 1;
+
+    // Options: any mix of -n, -e and -E, as long as nothing else follows
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        const char *p = args[i] + 1;
+        if (strspn(p, "neE") != strlen(p)) break;
+        for (; *p; p++) {
+            if (*p == 'n') newline = 0;
+            else escapes = *p == 'e';
+        }
+    }
+
+    for (int first = i; args[i]; i++) {
+        if (i > first) out_putc(STDOUT_FILENO, ' ');
+        if (escapes) {
+            if (echo_escaped(args[i])) return EXIT_SUCCESS;
+        } else {
+            out_puts(STDOUT_FILENO, args[i]);
+        }
+    }
+    if (newline) out_putc(STDOUT_FILENO, '\n');
+    return EXIT_SUCCESS;
+}
+
+static int cmd_true(char **args) {
+    (void)args;
     return EXIT_SUCCESS;
 }
 
+static int cmd_false(char **args) {
+    (void)args;
+    return EXIT_FAILURE;
+}
+
 int cmd_clear(char **args) {
     (void)args;
-    printf("\033[H\033[J");  // Clear screen using ANSI escape codes
+    out_puts(STDOUT_FILENO, "\033[H\033[J");  // Clear screen using ANSI escape codes
     return EXIT_SUCCESS;
 }
 
 int cmd_help(char **args) {
     (void)args;
-    printf("\nAvailable built-in commands:\n");
-    printf("  cd [dir]     - Change directory\n");
-    printf("  pwd          - Print working directory\n");
-    printf("  clear        - Clear screen\n");
-    printf("  history      - Show command history\n");
-    printf("  alias        - Show/set aliases\n");
-    printf("  help         - Show this help\n");
-    printf("  exit         - Exit shell\n");
-    printf("\nExternal commands are searched in:\n");
+    out_puts(STDOUT_FILENO, "\nAvailable built-in commands:\n");
+    out_puts(STDOUT_FILENO, "  cd [dir]     - Change directory\n");
+    out_puts(STDOUT_FILENO, "  pwd          - Print working directory\n");
+    out_puts(STDOUT_FILENO, "  echo [-neE]  - Print arguments\n");
+    out_puts(STDOUT_FILENO, "  cat [file]   - Copy files or input to output\n");
+    out_puts(STDOUT_FILENO, "  tee [-a] file - Copy input to output and files\n");
+    out_puts(STDOUT_FILENO, "  cp [-rv] [-j n] src... dst - Copy files, n at a time\n");
+    out_puts(STDOUT_FILENO, "  clear        - Clear screen\n");
+    out_puts(STDOUT_FILENO, "  history      - Show command history\n");
+    out_puts(STDOUT_FILENO, "  alias        - Show/set aliases\n");
+    out_puts(STDOUT_FILENO, "  set [-- ...] - Show variables or set positional parameters\n");
+    out_puts(STDOUT_FILENO, "  unset name   - Remove variables\n");
+    out_puts(STDOUT_FILENO, "  export [n=v] - Export variables to the environment\n");
+    out_puts(STDOUT_FILENO, "  local [n=v]  - Declare function-local variables\n");
+    out_puts(STDOUT_FILENO, "  declare [-aAprx] [n=v] - Declare variables and arrays\n");
+    out_puts(STDOUT_FILENO, "  source file  - Run commands from a file\n");
+    out_puts(STDOUT_FILENO, "  break, continue, return - Loop and function control\n");
+    out_puts(STDOUT_FILENO, "  jobs [-l]    - List background jobs, with pids and cgroup usage\n");
+    out_puts(STDOUT_FILENO, "  joblog [-n lines] [-f] [%job] - Show or follow a job's output captured with XSH_JOBLOG set\n");
+    out_puts(STDOUT_FILENO, "  queue [-p n] cmd - Queue cmd to run when a slot is free; batch also waits on load\n");
+    out_puts(STDOUT_FILENO, "  queue -P n | -w - Set the number of slots, or wait for the queue to drain\n");
+    out_puts(STDOUT_FILENO, "  renice-job [-c cpus] [-n nice] [-s policy] [-i io] %job - Reschedule a running job\n");
+    out_puts(STDOUT_FILENO, "  timeout [-s sig] [-k t] t cmd - Signal cmd after t, then kill it after another k\n");
+    out_puts(STDOUT_FILENO, "  watch [-n secs] [-t] [-g] cmd - Rerun cmd on a fixed schedule, redrawing changed lines\n");
+    out_puts(STDOUT_FILENO, "  on-change [-d ms] [-n runs] path... -- cmd - Rerun cmd when files change\n");
+    out_puts(STDOUT_FILENO, "  help         - Show this help\n");
+    out_puts(STDOUT_FILENO, "  exit [n]     - Exit shell\n");
+    out_puts(STDOUT_FILENO, "\nControl flow: if/elif/else, while, until, for ... in, for ((;;)), case\n");
+    out_puts(STDOUT_FILENO, "Tests: [[ -f file && $s == pat* && $s =~ regex && n -lt m ]], (( expr ))\n");
+    out_puts(STDOUT_FILENO, "Functions: name() { ...; }\n");
+    out_puts(STDOUT_FILENO, "Arrays: a=(x y) a[i]=v ${a[i]} \"${a[@]}\" ${#a[@]} ${!a[@]}; declare -A for keys\n");
+    out_puts(STDOUT_FILENO, "Parallel: for -P jobs [-u] name in ...; output per iteration, status counts failures\n");
+    out_puts(STDOUT_FILENO, "Batches: chunk [-P jobs] [-n max] [-k words] cmd args... splits args to fit ARG_MAX\n");
+    out_puts(STDOUT_FILENO, "Scheduling: pin [-n nice] [-s policy[:prio]] [-i class[:level]] [cpus|nodeN] cmd...\n");
+    out_puts(STDOUT_FILENO, "Limits: limit [-m mem] [-c cpus] [-r rate] [-w rate] [-p procs] [-v] cmd... in a cgroup\n");
+    out_puts(STDOUT_FILENO, "Tables: files [-aR] [path...] | where col -gt 1M | sort-by [-r] col | select col... | group-by col [sum-col...]\n");
+    out_puts(STDOUT_FILENO, "Spawner: start xsh with XSH_ZYGOTE=1 to launch commands from a small helper process\n");
+    out_puts(STDOUT_FILENO, "\nExternal commands are searched in:\n");
     for (int i = 0; standard_paths[i]; i++) {
-        printf("  %s\n", standard_paths[i]);
+        out_printf(STDOUT_FILENO, "  %s\n", standard_paths[i]);
     }
-    printf("  And any directory in $PATH\n");
+    out_puts(STDOUT_FILENO, "  And any directory in $PATH\n");
     return EXIT_SUCCESS;
 }
 
@@ -205,7 +338,7 @@ int cmd_history(char **args) {
     if (!hist_list) return EXIT_SUCCESS;
 
     for (int i = 0; hist_list[i]; i++) {
-        printf("%5d  %s\n", i + 1, hist_list[i]->line);
+        out_printf(STDOUT_FILENO, "%5d  %s\n", i + 1, hist_list[i]->line);
     }
     return EXIT_SUCCESS;
 }
@@ -213,7 +346,7 @@ int cmd_history(char **args) {
 int cmd_alias(char **args) {
     if (!args[1]) {
         for (int i = 0; i < config.alias_count; i++) {
-            printf("alias %s='%s'\n", config.aliases[i].name, config.aliases[i].value);
+            out_printf(STDOUT_FILENO, "alias %s='%s'\n", config.aliases[i].name, config.aliases[i].value);
         }
         return EXIT_SUCCESS;
     }
@@ -224,24 +357,90 @@ int cmd_alias(char **args) {
         return EXIT_FAILURE;
     }
 
-    *equals = '\0';
-    add_alias(args[1], equals + 1);
+    // Arguments may point into a stored function body: do not modify them
+    char *name = strndup(args[1], equals - args[1]);
+    if (!name) return EXIT_FAILURE;
+    add_alias(name, equals + 1);
+    free(name);
     return EXIT_SUCCESS;
 }
 
-// Execute built-in command
-int execute_builtin(char **args) {
-    if (!args[0]) return EXIT_SUCCESS;
+int cmd_jobs(char **args) {
+    int long_format = 0;
+    for (int i = 1; args[i]; i++) {
+        if (strcmp(args[i], "-l") != 0) {
+            print_error("jobs: %s: invalid option", args[i]);
+            return EXIT_USAGE;
+        }
+        long_format = 1;
+    }
+    update_jobs();
+    show_jobs(long_format);
+    return EXIT_SUCCESS;
+}
+
+// Built-in command table
+typedef struct {
+    const char *name;
+    BuiltinFn fn;
+} Builtin;
+
+static const Builtin builtins[] = {
+    {"cd", cmd_cd},
+    {"pwd", cmd_pwd},
+    {"echo", cmd_echo},
+    {"cat", cmd_cat},
+    {"tee", cmd_tee},
+    {"cp", cmd_cp},
+    {"exit", cmd_exit},
+    {"clear", cmd_clear},
+    {"help", cmd_help},
+    {"history", cmd_history},
+    {"alias", cmd_alias},
+    {"set", cmd_set},
+    {"unset", cmd_unset},
+    {"export", cmd_export},
+    {"local", cmd_local},
+    {"declare", cmd_declare},
+    {"typeset", cmd_declare},
+    {"source", cmd_source},
+    {".", cmd_source},
+    {"break", cmd_break},
+    {"continue", cmd_continue},
+    {"return", cmd_return},
+    {"jobs", cmd_jobs},
+    {"joblog", cmd_joblog},
+    {"queue", cmd_queue},
+    {"batch", cmd_queue},
+    {"renice-job", cmd_renice_job},
+    {"timeout", cmd_timeout},
+    {"watch", cmd_watch},
+    {"on-change", cmd_on_change},
+    {"files", cmd_files},
+    {"where", cmd_where},
+    {"sort-by", cmd_sort_by},
+    {"select", cmd_select},
+    {"group-by", cmd_group_by},
+    {":", cmd_true},
+    {"true", cmd_true},
+    {"false", cmd_false},
+    {NULL, NULL}
+};
 
-    if (strcmp(args[0], "cd") == 0) return cmd_cd(args);
-    if (strcmp(args[0], "pwd") == 0) return cmd_pwd(args);
-    if (strcmp(args[0], "exit") == 0) return cmd_exit(args);
-    if (strcmp(args[0], "clear") == 0) return cmd_clear(args);
-    if (strcmp(args[0], "help") == 0) return cmd_help(args);
-    if (strcmp(args[0], "history") == 0) return cmd_history(args);
-    if (strcmp(args[0], "alias") == 0) return cmd_alias(args);
+// Find built-in command, or NULL if name is not one
+BuiltinFn find_builtin(const char *name) {
+    for (const Builtin *b = builtins; b->name; b++) {
+        if (strcmp(name, b->name) == 0) return b->fn;
+    }
+    return NULL;
+}
 
-    return EXIT_NOT_FOUND;
+// Execute built-in command. Returns EXIT_DEFER if the builtin leaves
+// the command to the external one.
+int execute_builtin(BuiltinFn fn, char **args) {
+    int status = fn(args);
+    out_done();
+    return status;
 }
 
 // Execute external command
@@ -255,9 +454,18 @@ int execute_external(char **args) {
         return EXIT_NOT_FOUND;
     }
 
-    pid_t pid = fork();
+    out_flush();
+    pid_t pid = zygote_spawn(cmd_path, args);
+    if (pid > 0) {
+        free(cmd_path);
+        return wait_for(pid);
+    }
+    pid = fork();
     if (pid == 0) {
         // Child process
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
         execv(cmd_path, args);
         print_error("%s: execution failed: %s", args[0], strerror(errno));
         free(cmd_path);
@@ -271,12 +479,7 @@ int execute_external(char **args) {
 
     // Parent process
     free(cmd_path);
-    int status;
-    do {
-        waitpid(pid, &status, WUNTRACED);
-    } while (!WIFEXITED(status) && !WIFSIGNALED(status));
-
-    return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+    return wait_for(pid);
 }
 
 // Execute command
@@ -286,40 +489,7 @@ int execute_command(char *command) {
     // Add to history
     add_to_history(command);
 
-    // Parse command
-    int argc;
-    char **args = parse_command(command, &argc);
-    if (!args) return EXIT_FAILURE;
-
-    // Check for alias
-    if (args[0]) {
-        char *alias_value = get_alias(args[0]);
-        if (alias_value) {
-            // Free old command
-            for (int i = 0; args[i]; i++) {
-                free(args[i]);
-            }
-            free(args);
-            
-            // Parse alias
-            args = parse_command(alias_value, &argc);
-            if (!args) return EXIT_FAILURE;
-        }
-    }
-
-    // Execute command
-    int status;
-    if ((status = execute_builtin(args)) == EXIT_NOT_FOUND) {
-        status = execute_external(args);
-    }
-
-    // Cleanup
-    for (int i = 0; args[i]; i++) {
-        free(args[i]);
-    }
-    free(args);
-
-    return status;
+    return run_script(command, strlen(command));
 }
 
 // Generate prompt
@@ -351,27 +521,92 @@ void cleanup_shell(void) {
     printf("\n%sGoodbye!%s\n", COLOR_GREEN, COLOR_RESET);
 }
 
+// Run a script file with the remaining arguments as positional parameters
+static int run_file(const char *path, int argc, char **argv) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        print_error("%s: %s", path, strerror(errno));
+        return EXIT_NOT_FOUND;
+    }
+
+    StrBuf text = {0};
+    char chunk[8192];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        if (strbuf_append(&text, chunk, n) != 0) break;
+    }
+    fclose(f);
+
+    set_shell_name(path);
+    set_positional(argc, argv);
+    run_script(text.data ? text.data : "", text.len);
+    strbuf_free(&text);
+    return config.last_status;
+}
+
+// Read commands from the terminal. Input that ends inside a compound
+// command or quote is continued on the next line.
+static void run_interactive(void) {
+    StrBuf input = {0};
+    char *line;
+
+    config.interactive = isatty(STDIN_FILENO);
+    while (running && (line = readline(input.len ? "> " : generate_prompt()))) {
+        if (input.len == 0) {
+            char *trimmed = trim_whitespace(line);
+            if (!*trimmed) {
+                free(line);
+                continue;
+            }
+            strbuf_append(&input, trimmed, strlen(trimmed));
+        } else {
+            strbuf_putc(&input, '\n');
+            strbuf_append(&input, line, strlen(line));
+        }
+        free(line);
+
+        int status;
+        if (run_input(input.data, input.len, &status) == PARSE_INCOMPLETE) continue;
+        strbuf_reset(&input);
+        update_jobs();
+        out_flush();
+    }
+
+    if (input.len) print_error("syntax error: unexpected end of file");
+    strbuf_free(&input);
+}
+
 int main(int argc, char *argv[]) {
-    (void)argc;
-    (void)argv;
+    // A client hands its script to a server without starting up itself
+    if (argc > 2 && strcmp(argv[1], "--client") == 0) {
+        return client_run(argv[2], argc - 3, argv + 3);
+    }
 
     initialize_shell();
 
-    printf("\n%sWelcome to XShell!%s\n", COLOR_GREEN, COLOR_RESET);
-    printf("Type 'help' to see available commands\n\n");
+    if (argc > 2 && strcmp(argv[1], "--server") == 0) {
+        // xsh --server socket [setup-script]
+        return server_run(argv[2], argc > 3 ? argv[3] : NULL);
+    }
 
-    char *command;
-    while (running && (command = readline(generate_prompt()))) {
-        if (command && *command) {
-            char *trimmed = trim_whitespace(command);
-            if (*trimmed) {
-                execute_command(trimmed);
-                update_jobs();
-            }
+    if (argc > 2 && strcmp(argv[1], "-c") == 0) {
+        // xsh -c 'commands' [name [args...]]
+        if (argc > 3) {
+            set_shell_name(argv[3]);
+            set_positional(argc - 4, argv + 4);
         }
-        free(command);
+        run_script(argv[2], strlen(argv[2]));
+        return config.last_status;
+    }
+    if (argc > 1) {
+        return run_file(argv[1], argc - 2, argv + 2);
     }
 
+    printf("\n%sWelcome to XShell!%s\n", COLOR_GREEN, COLOR_RESET);
+    printf("Type 'help' to see available commands\n\n");
+
+    run_interactive();
+
     cleanup_shell();
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+    return config.last_status;
+}
@@ -0,0 +1,284 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include "shell.h"
+
+// on-change: run a command whenever files change.
+//
+// Directories are watched with inotify together with everything below
+// them, except hidden directories such as .git, and directories created
+// later are added as they appear. A file is watched through its
+// directory, so editors that save by renaming a new file over the old
+// one are still seen. The command runs once at the start and again
+// when changes have stopped arriving for the debounce delay; a change
+// during a run stops the run with SIGTERM and starts it over. Each run
+// has a process group of its own, given the terminal if the shell has
+// it, and the signals go to all of it, so nothing a cancelled run
+// started overlaps the next one. A run that dies of SIGINT, as from ^C
+// on the terminal, stops on-change as well. The shell
+// waits in poll the whole time, on the inotify descriptor, a timerfd
+// for the delay and a pidfd of the running command.
+
+#define ON_CHANGE_DEBOUNCE_MS 100
+#define ON_CHANGE_KILL_MS     2000    // from SIGTERM to SIGKILL when on-change stops
+#define ON_CHANGE_EVENTS      (IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | \
+                               IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+typedef struct {
+    int wd;
+    char *dir;
+    char *name;         // the file watched in dir, or NULL for all of it
+} Watch;
+
+typedef struct {
+    int fd;
+    Watch *watches;
+    size_t count, cap;
+} Watcher;
+
+static int watch_add(Watcher *w, const char *dir, const char *name) {
+    int wd = inotify_add_watch(w->fd, dir, ON_CHANGE_EVENTS | IN_ONLYDIR | IN_MASK_ADD);
+    if (wd < 0) {
+        print_error("on-change: %s: %s", dir, strerror(errno));
+        return -1;
+    }
+    if (w->count == w->cap) {
+        size_t cap = w->cap ? w->cap * 2 : 16;
+        Watch *grown = realloc(w->watches, cap * sizeof(Watch));
+        if (!grown) return -1;
+        w->watches = grown;
+        w->cap = cap;
+    }
+    Watch *e = &w->watches[w->count];
+    e->wd = wd;
+    e->dir = strdup(dir);
+    e->name = name ? strdup(name) : NULL;
+    if (!e->dir || (name && !e->name)) {
+        free(e->dir);
+        free(e->name);
+        return -1;
+    }
+    w->count++;
+    return 0;
+}
+
+// Watch dir and the directories below it
+static int watch_tree(Watcher *w, const char *dir) {
+    if (watch_add(w, dir, NULL) != 0) return -1;
+    DIR *d = opendir(dir);
+    if (!d) return 0;
+    struct dirent *ent;
+    while ((ent = readdir(d))) {
+        if (ent->d_name[0] == '.') continue;
+        char path[PATH_MAX];
+        struct stat st;
+        if (snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name) >= (int)sizeof(path)) continue;
+        if (ent->d_type != DT_DIR && (ent->d_type != DT_UNKNOWN || lstat(path, &st) != 0 || !S_ISDIR(st.st_mode))) {
+            continue;
+        }
+        watch_tree(w, path);
+    }
+    closedir(d);
+    return 0;
+}
+
+static int watch_path(Watcher *w, const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        print_error("on-change: %s: %s", path, strerror(errno));
+        return -1;
+    }
+    if (S_ISDIR(st.st_mode)) return watch_tree(w, path);
+
+    char dir[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    if (!slash) return watch_add(w, ".", path);
+    snprintf(dir, sizeof(dir), "%.*s", slash == path ? 1 : (int)(slash - path), path);
+    return watch_add(w, dir, slash + 1);
+}
+
+static void watcher_free(Watcher *w) {
+    for (size_t k = 0; k < w->count; k++) {
+        free(w->watches[k].dir);
+        free(w->watches[k].name);
+    }
+    free(w->watches);
+    close(w->fd);
+}
+
+// Read the pending events. Returns 1 if any of them is a change to
+// something watched.
+static int watch_read(Watcher *w) {
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+    for (;;) {
+        ssize_t n = read(w->fd, buf, sizeof(buf));
+        if (n <= 0) break;
+        for (char *p = buf; p < buf + n;) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(*ev) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                changed = 1;
+                continue;
+            }
+            // The entries grow while directories are added below
+            size_t count = w->count;
+            for (size_t k = 0; k < count; k++) {
+                Watch *e = &w->watches[k];
+                if (e->wd != ev->wd) continue;
+                if (e->name && (!ev->len || strcmp(e->name, ev->name) != 0)) continue;
+                changed = 1;
+                if (!e->name && ev->len && ev->name[0] != '.' && (ev->mask & IN_ISDIR) &&
+                    (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+                    char path[PATH_MAX];
+                    if (snprintf(path, sizeof(path), "%s/%s", e->dir, ev->name) < (int)sizeof(path)) {
+                        watch_tree(w, path);
+                    }
+                }
+            }
+        }
+    }
+    return changed;
+}
+
+// Signal a run's process group, and wake it in case it is stopped, as
+// by SIGTTIN, so that it acts on the signal
+static void signal_run(pid_t pid, int sig) {
+    kill(-pid, sig);
+    kill(-pid, SIGCONT);
+}
+
+// Stop a run for good: SIGTERM, then SIGKILL if it has not gone after
+// ON_CHANGE_KILL_MS
+static void stop_run(pid_t pid, int pidfd) {
+    signal_run(pid, SIGTERM);
+    int gone = 0;
+    if (pidfd >= 0) {
+        struct pollfd pfd = {pidfd, POLLIN, 0};
+        poll(&pfd, 1, ON_CHANGE_KILL_MS);
+    } else {
+        for (int waited = 0; !gone && waited < ON_CHANGE_KILL_MS; waited += 10) {
+            gone = waitpid(pid, NULL, WNOHANG) != 0;
+            if (!gone) usleep(10000);
+        }
+    }
+    if (!gone && waitpid(pid, NULL, WNOHANG) == 0) {
+        signal_run(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+    terminal_reclaim();
+}
+
+static void arm_ms(int tfd, long ms) {
+    struct itimerspec its = {{0, 0}, {ms / 1000, (ms % 1000) * 1000000 + (ms ? 0 : 1)}};
+    timerfd_settime(tfd, 0, &its, NULL);
+}
+
+// on-change [-d ms] [-n runs] path... -- command [args...]
+int cmd_on_change(char **args) {
+    long debounce = ON_CHANGE_DEBOUNCE_MS, max_runs = 0;
+    int i = 1;
+    for (; args[i] && args[i][0] == '-' && (args[i][1] == 'd' || args[i][1] == 'n'); i++) {
+        const char *opt = args[i];
+        const char *value = opt[2] ? opt + 2 : args[++i];
+        char *end;
+        long v = value ? strtol(value, &end, 10) : -1;
+        if (!value || *end || v < 0 || v > INT_MAX) {
+            print_error("on-change: %s: invalid number", value ? value : opt);
+            return EXIT_USAGE;
+        }
+        if (opt[1] == 'd') debounce = v;
+        else max_runs = v;
+    }
+    int first_path = i;
+    while (args[i] && strcmp(args[i], "--") != 0) i++;
+    if (i == first_path || !args[i] || !args[i + 1]) {
+        print_error("on-change: usage: on-change [-d ms] [-n runs] path... -- command [args...]");
+        return EXIT_USAGE;
+    }
+    char **command = args + i + 1;
+
+    Watcher w = {inotify_init1(IN_NONBLOCK | IN_CLOEXEC), NULL, 0, 0};
+    if (w.fd < 0) {
+        print_error("on-change: inotify_init1: %s", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    int status = EXIT_FAILURE;
+    if (tfd < 0) {
+        print_error("on-change: timerfd_create: %s", strerror(errno));
+        goto out;
+    }
+    for (int k = first_path; k < i; k++) {
+        if (watch_path(&w, args[k]) != 0) goto out;
+    }
+
+    pid_t pid = -1;
+    int pidfd = -1, due = 1, cancelled = 0;
+    long runs = 0;
+    status = EXIT_SUCCESS;
+    for (;;) {
+        if (due && pid < 0) {
+            due = cancelled = 0;
+            pid = fork_argv(command, 1);
+            if (pid < 0) {
+                status = EXIT_FAILURE;
+                break;
+            }
+            pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+            if (pidfd >= 0) fcntl(pidfd, F_SETFD, FD_CLOEXEC);
+        }
+
+        struct pollfd pfds[3] = {{w.fd, POLLIN, 0}, {tfd, POLLIN, 0}, {pidfd, POLLIN, 0}};
+        // Without a pidfd, look for the exit now and then
+        int rc = poll(pfds, pid >= 0 && pidfd >= 0 ? 3 : 2, pid >= 0 && pidfd < 0 ? 10 : -1);
+        if (rc < 0 && errno == EINTR) break;
+
+        if (pfds[0].revents & POLLIN && watch_read(&w)) {
+            arm_ms(tfd, debounce);
+            due = 0;
+            if (pid >= 0 && !cancelled) {
+                signal_run(pid, SIGTERM);
+                cancelled = 1;
+            }
+        }
+        if (pfds[1].revents & POLLIN) {
+            uint64_t ticks;
+            if (read(tfd, &ticks, sizeof(ticks)) == sizeof(ticks)) due = 1;
+            // A run stopped for a change that will not go
+            if (pid >= 0 && cancelled) signal_run(pid, SIGKILL);
+        }
+        int wstatus;
+        if (pid >= 0 && waitpid(pid, &wstatus, WNOHANG) == pid) {
+            if (pidfd >= 0) close(pidfd);
+            pid = pidfd = -1;
+            terminal_reclaim();
+            if (!cancelled) {
+                status = WIFSIGNALED(wstatus) ? 128 + WTERMSIG(wstatus) : WEXITSTATUS(wstatus);
+                if (WIFSIGNALED(wstatus) && WTERMSIG(wstatus) == SIGINT) break;
+                if (max_runs && ++runs >= max_runs) break;
+            }
+        }
+    }
+    if (pid >= 0) stop_run(pid, pidfd);
+    if (pidfd >= 0) close(pidfd);
+
+out:
+    if (tfd >= 0) close(tfd);
+    watcher_free(&w);
+    return status;
+}
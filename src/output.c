@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include "shell.h"
+
+// Builtin output.
+//
+// Builtins and shell messages write through one shell-owned buffer
+// rather than stdio. It holds output for a single descriptor at a time
+// and is written out with writev when a builtin returns, before the
+// shell forks or changes its redirections, when it fills up, or when
+// output switches to the other descriptor, so nothing is reordered
+// against child processes or between stdout and stderr. A write too
+// large for the buffer goes out in the same writev as what is buffered,
+// without being copied.
+//
+// During an in-process command substitution standard output goes
+// straight into the capture buffer instead.
+
+#define OUT_BUFFER_SIZE 65536
+
+static char out_buf[OUT_BUFFER_SIZE];
+static size_t out_len;
+static int out_fd = STDOUT_FILENO;
+static StrBuf *out_target;
+
+// Write all of iov to fd, resuming after partial writes
+static void write_all(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;  // nowhere to report it; the output is lost
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+// Write out the buffer, together with extra data if given
+static void out_drain(const char *extra, size_t n) {
+    struct iovec iov[2];
+    int count = 0;
+    if (out_len > 0) iov[count++] = (struct iovec){out_buf, out_len};
+    if (n > 0) iov[count++] = (struct iovec){(void *)extra, n};
+    write_all(out_fd, iov, count);
+    out_len = 0;
+}
+
+// Point the buffer at fd, writing out what it holds for another one
+static void out_select(int fd) {
+    if (fd == out_fd) return;
+    if (out_len > 0) out_drain(NULL, 0);
+    out_fd = fd;
+}
+
+void out_write(int fd, const char *s, size_t n) {
+    if (fd == STDOUT_FILENO && out_target) {
+        strbuf_append(out_target, s, n);
+        return;
+    }
+    out_select(fd);
+    if (out_len + n <= OUT_BUFFER_SIZE) {
+        memcpy(out_buf + out_len, s, n);
+        out_len += n;
+    } else {
+        out_drain(s, n);
+    }
+}
+
+void out_puts(int fd, const char *s) {
+    out_write(fd, s, strlen(s));
+}
+
+void out_putc(int fd, char c) {
+    if ((fd != STDOUT_FILENO || !out_target) && fd == out_fd && out_len < OUT_BUFFER_SIZE) {
+        out_buf[out_len++] = c;
+        return;
+    }
+    out_write(fd, &c, 1);
+}
+
+void out_vprintf(int fd, const char *format, va_list args) {
+    va_list copy;
+    va_copy(copy, args);
+
+    if (fd == STDOUT_FILENO && out_target) {
+        StrBuf *b = out_target;
+        int n = vsnprintf(NULL, 0, format, args);
+        if (n >= 0 && strbuf_reserve(b, n + 1) == 0) {
+            vsnprintf(b->data + b->len, n + 1, format, copy);
+            b->len += n;
+        }
+        va_end(copy);
+        return;
+    }
+
+    // Format in place; if it does not fit, make room and try again
+    out_select(fd);
+    size_t room = OUT_BUFFER_SIZE - out_len;
+    int n = vsnprintf(out_buf + out_len, room, format, args);
+    if (n >= 0 && (size_t)n < room) {
+        out_len += n;
+    } else if (n >= 0 && n < OUT_BUFFER_SIZE) {
+        out_drain(NULL, 0);
+        out_len = vsnprintf(out_buf, OUT_BUFFER_SIZE, format, copy);
+    } else if (n >= 0) {
+        char *text = malloc(n + 1);
+        if (text) {
+            vsnprintf(text, n + 1, format, copy);
+            out_drain(text, n);
+            free(text);
+        }
+    }
+    va_end(copy);
+}
+
+void out_printf(int fd, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    out_vprintf(fd, format, args);
+    va_end(args);
+}
+
+// Write out everything buffered for the terminal or redirections,
+// including anything stdio holds for stdout
+void out_flush(void) {
+    fflush(stdout);
+    if (out_len > 0) out_drain(NULL, 0);
+}
+
+// A builtin has returned: write out its output, so that whatever runs
+// next, in the shell or not, sees it in the file or pipe
+void out_done(void) {
+    if (out_len > 0) out_drain(NULL, 0);
+}
+
+// Prepare for a builtin to write to fd itself, past the buffer. Returns
+// -1 if standard output is being captured, and so has to go through
+// out_write after all.
+int out_direct(int fd) {
+    if (fd == STDOUT_FILENO && out_target) return -1;
+    if (fd == out_fd && out_len > 0) out_drain(NULL, 0);
+    if (fd == STDOUT_FILENO) fflush(stdout);
+    return 0;
+}
+
+// Send standard output to target, or back to the descriptor if it is
+// NULL. Returns the previous target.
+StrBuf *out_capture(StrBuf *target) {
+    StrBuf *prev = out_target;
+    if (out_fd == STDOUT_FILENO && out_len > 0) out_drain(NULL, 0);
+    out_target = target;
+    return prev;
+}
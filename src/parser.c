@@ -0,0 +1,1053 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "shell.h"
+
+// Recursive-descent parser producing an AST.
+//
+// Each top-level command is parsed into its own Script, an arena that
+// owns every node and word in it. Scripts are reference counted so a
+// function definition can keep its pre-parsed body alive after the
+// command that defined it has finished.
+
+#define PARSE_MAX_HEREDOCS 16
+
+static Node *parse_and_or(Parser *p);
+static Node *parse_compound_list(Parser *p, int allow_empty);
+static Node *parse_command_node(Parser *p);
+
+Script *script_new(void) {
+    Script *s = calloc(1, sizeof(Script));
+    if (!s) {
+        print_error("malloc: failed to allocate memory");
+        return NULL;
+    }
+    s->refs = 1;
+    return s;
+}
+
+void script_retain(Script *s) {
+    if (s) s->refs++;
+}
+
+void script_release(Script *s) {
+    if (!s || --s->refs > 0) return;
+    for (ScriptCleanup *c = s->cleanups; c; c = c->next) {
+        c->fn(c->ptr);
+    }
+    arena_free(&s->arena);
+    free(s);
+}
+
+// Register memory owned by the script that is not in its arena, such as
+// compiled expressions cached on nodes
+void script_attach(Script *s, void *ptr, void (*fn)(void *)) {
+    ScriptCleanup *c = arena_alloc(&s->arena, sizeof(ScriptCleanup));
+    if (!c) return;
+    c->ptr = ptr;
+    c->fn = fn;
+    c->next = s->cleanups;
+    s->cleanups = c;
+}
+
+void parser_init(Parser *p, const char *src, size_t len) {
+    memset(p, 0, sizeof(*p));
+    lexer_init(&p->lx, src, len);
+    p->status = PARSE_OK;
+}
+
+// Mark a parse failure. Running out of input is reported as incomplete
+// so interactive callers can ask for another line.
+static void parse_fail(Parser *p, const char *what) {
+    if (p->status != PARSE_OK) return;
+    if (p->lx.incomplete || p->tok.type == TOK_EOF) {
+        p->status = PARSE_INCOMPLETE;
+        return;
+    }
+    p->status = PARSE_ERROR;
+    if (what) {
+        print_error("syntax error: %s", what);
+    } else if (p->tok.type == TOK_NEWLINE) {
+        print_error("syntax error near unexpected newline");
+    } else {
+        print_error("syntax error near unexpected token `%.*s'", (int)p->tok.len, p->tok.text);
+    }
+}
+
+static int read_heredocs(Parser *p);
+
+// Current token, fetching it if needed
+static Token *cur(Parser *p) {
+    if (!p->have_tok && p->status == PARSE_OK) {
+        if (lex_next(&p->lx, &p->tok) != 0) {
+            p->tok.type = TOK_EOF;
+            parse_fail(p, NULL);
+        } else {
+            p->have_tok = 1;
+            if (p->tok.type == TOK_NEWLINE && p->npending > 0) read_heredocs(p);
+        }
+    }
+    return &p->tok;
+}
+
+static void advance(Parser *p) {
+    if (p->have_tok && p->lx.depth == 1) p->last_end = p->tok.text + p->tok.len;
+    p->have_tok = 0;
+}
+
+static int is_op(Parser *p, int op) {
+    Token *t = cur(p);
+    return t->type == TOK_OP && t->op == op;
+}
+
+// Is the current token the given reserved word?
+static int is_keyword(Parser *p, const char *word) {
+    Token *t = cur(p);
+    return t->type == TOK_WORD && t->flags == 0 && t->len == strlen(word) &&
+           strncmp(t->text, word, t->len) == 0;
+}
+
+static int expect_keyword(Parser *p, const char *word) {
+    if (!is_keyword(p, word)) {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "expected `%s'", word);
+        parse_fail(p, cur(p)->type == TOK_EOF ? NULL : msg);
+        return -1;
+    }
+    advance(p);
+    return 0;
+}
+
+static void skip_newlines(Parser *p) {
+    while (cur(p)->type == TOK_NEWLINE) advance(p);
+}
+
+static Node *new_node(Parser *p, int type) {
+    Node *n = arena_alloc(&p->script->arena, sizeof(Node));
+    if (!n) {
+        p->status = PARSE_ERROR;
+        return NULL;
+    }
+    memset(n, 0, sizeof(*n));
+    n->type = type;
+    n->owner = p->script;
+    n->lineno = p->tok.lineno;
+    return n;
+}
+
+// Copy the current word token into the script
+static int take_word(Parser *p, Word *w) {
+    Token *t = cur(p);
+    w->text = arena_strndup(&p->script->arena, t->text, t->len);
+    w->len = t->len;
+    w->flags = t->flags;
+    advance(p);
+    return w->text ? 0 : -1;
+}
+
+// Growable array used while collecting children; copied into the arena
+typedef struct {
+    void *items;
+    int count;
+    int capacity;
+    size_t size;
+} Vec;
+
+static void *vec_push(Vec *v) {
+    if (v->count == v->capacity) {
+        int cap = v->capacity ? v->capacity * 2 : 8;
+        void *items = realloc(v->items, cap * v->size);
+        if (!items) return NULL;
+        v->items = items;
+        v->capacity = cap;
+    }
+    return (char *)v->items + v->size * v->count++;
+}
+
+static void *vec_finish(Parser *p, Vec *v) {
+    void *copy = NULL;
+    if (v->count) {
+        copy = arena_alloc(&p->script->arena, v->size * v->count);
+        if (copy) memcpy(copy, v->items, v->size * v->count);
+    }
+    free(v->items);
+    v->items = NULL;
+    return copy;
+}
+
+// Read pending here-document bodies after a newline
+static int read_heredocs(Parser *p) {
+    for (int i = 0; i < p->npending; i++) {
+        Redirect *r = p->pending[i];
+        char *body;
+        size_t blen;
+        if (lex_heredoc(&p->lx, r->target.text, r->target.len, r->strip_tabs,
+                        &p->script->arena, &body, &blen) != 0) {
+            parse_fail(p, NULL);
+            return -1;
+        }
+        r->target.text = body;
+        r->target.len = blen;
+    }
+    p->npending = 0;
+    return 0;
+}
+
+// Remove quotes from a here-document delimiter
+static void unquote_delimiter(Word *w, int *quoted) {
+    char *out = w->text;
+    *quoted = 0;
+    for (size_t i = 0; i < w->len; i++) {
+        char c = w->text[i];
+        if (c == '\'' || c == '"') {
+            *quoted = 1;
+        } else if (c == '\\' && i + 1 < w->len) {
+            *quoted = 1;
+            *out++ = w->text[++i];
+        } else {
+            *out++ = c;
+        }
+    }
+    *out = '\0';
+    w->len = out - w->text;
+}
+
+// Parse a redirection operator and its target
+static Redirect *parse_redirect(Parser *p) {
+    Token *t = cur(p);
+    Redirect *r = arena_alloc(&p->script->arena, sizeof(Redirect));
+    if (!r) return NULL;
+    memset(r, 0, sizeof(*r));
+
+    int op = t->op;
+    int fd = t->fd;
+    switch (op) {
+        case OP_LESS:       r->type = REDIR_IN;         r->fd = 0; break;
+        case OP_GREAT:      r->type = REDIR_OUT;        r->fd = 1; break;
+        case OP_DGREAT:     r->type = REDIR_APPEND;     r->fd = 1; break;
+        case OP_CLOBBER:    r->type = REDIR_OUT;        r->fd = 1; break;
+        case OP_LESSGREAT:  r->type = REDIR_RDWR;       r->fd = 0; break;
+        case OP_LESSAND:    r->type = REDIR_DUP;        r->fd = 0; break;
+        case OP_GREATAND:   r->type = REDIR_DUP;        r->fd = 1; break;
+        case OP_DLESS:      r->type = REDIR_HEREDOC;    r->fd = 0; break;
+        case OP_DLESSDASH:  r->type = REDIR_HEREDOC;    r->fd = 0; r->strip_tabs = 1; break;
+        case OP_TLESS:      r->type = REDIR_HERESTRING; r->fd = 0; break;
+        case OP_ANDGREAT:   r->type = REDIR_BOTH;       r->fd = 1; break;
+        case OP_ANDDGREAT:  r->type = REDIR_BOTH_APPEND; r->fd = 1; break;
+        default:
+            parse_fail(p, NULL);
+            return NULL;
+    }
+    if (fd >= 0) r->fd = fd;
+    advance(p);
+
+    if (cur(p)->type != TOK_WORD) {
+        parse_fail(p, NULL);
+        return NULL;
+    }
+    if (take_word(p, &r->target) != 0) return NULL;
+
+    if (r->type == REDIR_HEREDOC) {
+        unquote_delimiter(&r->target, &r->literal);
+        if (p->npending >= PARSE_MAX_HEREDOCS) {
+            parse_fail(p, "too many here-documents");
+            return NULL;
+        }
+        p->pending[p->npending++] = r;
+    }
+    return r;
+}
+
+static int is_redirect_op(Parser *p) {
+    Token *t = cur(p);
+    if (t->type != TOK_OP) return 0;
+    switch (t->op) {
+        case OP_LESS: case OP_GREAT: case OP_DGREAT: case OP_CLOBBER:
+        case OP_LESSGREAT: case OP_LESSAND: case OP_GREATAND: case OP_DLESS:
+        case OP_DLESSDASH: case OP_TLESS: case OP_ANDGREAT: case OP_ANDDGREAT:
+            return 1;
+    }
+    return 0;
+}
+
+// Parse trailing redirections, appending to *list
+static int parse_redirect_list(Parser *p, Redirect **list) {
+    while (*list) list = &(*list)->next;
+    while (is_redirect_op(p)) {
+        Redirect *r = parse_redirect(p);
+        if (!r) return -1;
+        *list = r;
+        list = &r->next;
+    }
+    return 0;
+}
+
+// Words that end a compound list
+static int at_list_terminator(Parser *p) {
+    static const char *terminators[] = {
+        "then", "else", "elif", "fi", "do", "done", "esac", "}", NULL
+    };
+    Token *t = cur(p);
+    if (t->type == TOK_EOF) return 1;
+    if (t->type == TOK_OP) {
+        return t->op == OP_RPAREN || t->op == OP_DSEMI || t->op == OP_SEMIAND ||
+               t->op == OP_DSEMIAND;
+    }
+    for (int i = 0; terminators[i]; i++) {
+        if (is_keyword(p, terminators[i])) return 1;
+    }
+    return 0;
+}
+
+// Copy the source text of a command for job listings
+static char *source_text(Parser *p, const char *start) {
+    const LexSource *base = &p->lx.stack[0];
+    if (!start || !p->last_end || start < base->src || p->last_end > base->src + base->len ||
+        p->last_end < start) {
+        return NULL;
+    }
+    return arena_strndup(&p->script->arena, start, p->last_end - start);
+}
+
+// compound_list: and_or items separated by ';', '&' or newlines
+static Node *parse_compound_list(Parser *p, int allow_empty) {
+    Vec items = {NULL, 0, 0, sizeof(Node *)};
+
+    skip_newlines(p);
+    while (p->status == PARSE_OK && !at_list_terminator(p)) {
+        const char *start = cur(p)->text;
+        Node *n = parse_and_or(p);
+        if (!n) break;
+        Node **slot = vec_push(&items);
+        if (!slot) break;
+        *slot = n;
+
+        if (is_op(p, OP_AMP)) {
+            n->flags |= NODE_BACKGROUND;
+            advance(p);
+            n->text = source_text(p, start);
+        } else if (is_op(p, OP_SEMI)) {
+            advance(p);
+        } else if (cur(p)->type != TOK_NEWLINE && !at_list_terminator(p)) {
+            parse_fail(p, NULL);
+            break;
+        }
+        skip_newlines(p);
+    }
+
+    if (p->status != PARSE_OK) {
+        free(items.items);
+        return NULL;
+    }
+    if (items.count == 0) {
+        free(items.items);
+        if (allow_empty) return new_node(p, NODE_LIST);
+        parse_fail(p, NULL);
+        return NULL;
+    }
+    if (items.count == 1 && !(((Node **)items.items)[0]->flags & NODE_BACKGROUND)) {
+        Node *only = ((Node **)items.items)[0];
+        free(items.items);
+        return only;
+    }
+
+    Node *list = new_node(p, NODE_LIST);
+    if (!list) {
+        free(items.items);
+        return NULL;
+    }
+    list->u.list.count = items.count;
+    list->u.list.items = vec_finish(p, &items);
+    return list;
+}
+
+// and_or: pipelines joined by && and ||
+static Node *parse_and_or(Parser *p) {
+    Node *left = parse_pipeline(p);
+    while (left && (is_op(p, OP_AND_IF) || is_op(p, OP_OR_IF))) {
+        int type = is_op(p, OP_AND_IF) ? NODE_AND : NODE_OR;
+        advance(p);
+        skip_newlines(p);
+        Node *right = parse_pipeline(p);
+        if (!right) return NULL;
+        Node *n = new_node(p, type);
+        if (!n) return NULL;
+        n->u.binary.left = left;
+        n->u.binary.right = right;
+        left = n;
+    }
+    return left;
+}
+
+// pipeline: [!] command (| command)*
+Node *parse_pipeline(Parser *p) {
+    int negate = 0;
+    if (is_keyword(p, "!")) {
+        negate = 1;
+        advance(p);
+    }
+
+    Vec stages = {NULL, 0, 0, sizeof(Node *)};
+    for (;;) {
+        Node *cmd = parse_command_node(p);
+        Node **slot = cmd ? vec_push(&stages) : NULL;
+        if (!slot) {
+            free(stages.items);
+            return NULL;
+        }
+        *slot = cmd;
+        if (!is_op(p, OP_PIPE)) break;
+        advance(p);
+        skip_newlines(p);
+    }
+
+    Node *n;
+    if (stages.count == 1) {
+        n = ((Node **)stages.items)[0];
+        free(stages.items);
+    } else {
+        n = new_node(p, NODE_PIPELINE);
+        if (!n) {
+            free(stages.items);
+            return NULL;
+        }
+        n->u.list.count = stages.count;
+        n->u.list.items = vec_finish(p, &stages);
+    }
+    if (negate) n->flags |= NODE_NEGATE;
+    return n;
+}
+
+// if list then list [elif list then list]... [else list] fi
+static Node *parse_if(Parser *p) {
+    Node *n = new_node(p, NODE_IF);
+    if (!n) return NULL;
+    advance(p);  // 'if' or 'elif'
+
+    if (!(n->u.if_.cond = parse_compound_list(p, 0))) return NULL;
+    if (expect_keyword(p, "then") != 0) return NULL;
+    if (!(n->u.if_.then_part = parse_compound_list(p, 0))) return NULL;
+
+    if (is_keyword(p, "elif")) {
+        n->u.if_.else_part = parse_if(p);
+        return n->u.if_.else_part ? n : NULL;
+    }
+    if (is_keyword(p, "else")) {
+        advance(p);
+        if (!(n->u.if_.else_part = parse_compound_list(p, 0))) return NULL;
+    }
+    if (expect_keyword(p, "fi") != 0) return NULL;
+    return n;
+}
+
+// do list done
+static Node *parse_do_group(Parser *p) {
+    if (expect_keyword(p, "do") != 0) return NULL;
+    Node *body = parse_compound_list(p, 0);
+    if (!body || expect_keyword(p, "done") != 0) return NULL;
+    return body;
+}
+
+// while/until list do list done
+static Node *parse_loop(Parser *p, int type) {
+    Node *n = new_node(p, type);
+    if (!n) return NULL;
+    advance(p);
+    if (!(n->u.loop.cond = parse_compound_list(p, 0))) return NULL;
+    if (!(n->u.loop.body = parse_do_group(p))) return NULL;
+    return n;
+}
+
+// Copy the text of an arithmetic expression into a word
+static int arith_word(Parser *p, Word *w, const char *text, size_t len) {
+    w->text = arena_strndup(&p->script->arena, text, len);
+    w->len = len;
+    w->flags = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (text[i] == '$' || text[i] == '`') w->flags |= WORD_DOLLAR;
+        if (text[i] == '\'' || text[i] == '"' || text[i] == '\\') w->flags |= WORD_QUOTED;
+    }
+    return w->text ? 0 : -1;
+}
+
+// Split the text of for ((init; cond; step)) into its three parts
+static int split_arith_for(Parser *p, Node *n, const Token *t) {
+    const char *s = t->text;
+    size_t start = 0;
+    int part = 0, depth = 0;
+
+    for (size_t i = 0; i <= t->len; i++) {
+        if (i < t->len && s[i] == '(') depth++;
+        if (i < t->len && s[i] == ')') depth--;
+        if (i == t->len || (s[i] == ';' && depth == 0)) {
+            if (part > 2) break;
+            if (arith_word(p, &n->u.arith_for.expr[part++], s + start, i - start) != 0) return -1;
+            start = i + 1;
+        }
+    }
+    if (part != 3) {
+        parse_fail(p, "expected `((init; condition; step))'");
+        return -1;
+    }
+    return 0;
+}
+
+// for [-P jobs [-u]] name [in words]; do list done  |  for ((init; cond; step)) do list done
+static Node *parse_for(Parser *p) {
+    advance(p);  // 'for'
+
+    if (cur(p)->type == TOK_ARITH) {
+        Node *n = new_node(p, NODE_ARITH_FOR);
+        if (!n || split_arith_for(p, n, cur(p)) != 0) return NULL;
+        advance(p);
+        if (is_op(p, OP_SEMI)) advance(p);
+        skip_newlines(p);
+        if (!(n->u.arith_for.body = parse_do_group(p))) return NULL;
+        return n;
+    }
+
+    Node *n = new_node(p, NODE_FOR);
+    if (!n) return NULL;
+
+    // for -P jobs [-u] name ...
+    while (cur(p)->type == TOK_WORD && cur(p)->len >= 2 && cur(p)->text[0] == '-') {
+        Token *o = cur(p);
+        if (o->len == 2 && o->text[1] == 'u') {
+            n->u.for_.unordered = 1;
+            advance(p);
+        } else if (o->text[1] == 'P' && o->len > 2) {
+            Word *w = &n->u.for_.jobs;
+            w->len = o->len - 2;
+            w->flags = o->flags;
+            if (!(w->text = arena_strndup(&p->script->arena, o->text + 2, w->len))) return NULL;
+            advance(p);
+        } else if (o->text[1] == 'P' && o->len == 2) {
+            advance(p);
+            if (cur(p)->type != TOK_WORD) {
+                parse_fail(p, "expected a job count after `for -P'");
+                return NULL;
+            }
+            if (take_word(p, &n->u.for_.jobs) != 0) return NULL;
+        } else {
+            parse_fail(p, "expected a variable name after `for'");
+            return NULL;
+        }
+    }
+
+    Token *t = cur(p);
+    if (t->type != TOK_WORD || !is_valid_name(t->text, t->len)) {
+        parse_fail(p, t->type == TOK_EOF ? NULL : "expected a variable name after `for'");
+        return NULL;
+    }
+    if (take_word(p, &n->u.for_.name) != 0) return NULL;
+
+    skip_newlines(p);
+    if (is_keyword(p, "in")) {
+        advance(p);
+        n->u.for_.has_in = 1;
+
+        Vec words = {NULL, 0, 0, sizeof(Word)};
+        while (cur(p)->type == TOK_WORD) {
+            Word *w = vec_push(&words);
+            if (!w || take_word(p, w) != 0) {
+                free(words.items);
+                return NULL;
+            }
+        }
+        n->u.for_.count = words.count;
+        n->u.for_.words = vec_finish(p, &words);
+
+        if (is_op(p, OP_SEMI)) {
+            advance(p);
+        } else if (cur(p)->type != TOK_NEWLINE) {
+            parse_fail(p, NULL);
+            return NULL;
+        }
+    } else if (is_op(p, OP_SEMI)) {
+        advance(p);
+    }
+    skip_newlines(p);
+
+    if (!(n->u.for_.body = parse_do_group(p))) return NULL;
+    return n;
+}
+
+// case word in [(]pattern[|pattern]...) list ;; ... esac
+static Node *parse_case(Parser *p) {
+    Node *n = new_node(p, NODE_CASE);
+    if (!n) return NULL;
+    advance(p);  // 'case'
+
+    if (cur(p)->type != TOK_WORD) {
+        parse_fail(p, NULL);
+        return NULL;
+    }
+    if (take_word(p, &n->u.case_.subject) != 0) return NULL;
+    skip_newlines(p);
+    if (expect_keyword(p, "in") != 0) return NULL;
+    skip_newlines(p);
+
+    Vec items = {NULL, 0, 0, sizeof(CaseItem)};
+    while (p->status == PARSE_OK && !is_keyword(p, "esac")) {
+        CaseItem *item = vec_push(&items);
+        if (!item) break;
+        memset(item, 0, sizeof(*item));
+
+        if (is_op(p, OP_LPAREN)) advance(p);
+
+        Vec patterns = {NULL, 0, 0, sizeof(Word)};
+        for (;;) {
+            Word *w = cur(p)->type == TOK_WORD ? vec_push(&patterns) : NULL;
+            if (!w) {
+                parse_fail(p, NULL);
+                break;
+            }
+            if (take_word(p, w) != 0) break;
+            if (!is_op(p, OP_PIPE)) break;
+            advance(p);
+        }
+        item->count = patterns.count;
+        item->patterns = vec_finish(p, &patterns);
+        if (p->status != PARSE_OK) break;
+
+        if (!is_op(p, OP_RPAREN)) {
+            parse_fail(p, NULL);
+            break;
+        }
+        advance(p);
+
+        if (!(item->body = parse_compound_list(p, 1))) break;
+
+        if (is_op(p, OP_DSEMI)) {
+            advance(p);
+        } else if (is_op(p, OP_SEMIAND)) {
+            item->fallthrough = CASE_FALLTHROUGH;
+            advance(p);
+        } else if (is_op(p, OP_DSEMIAND)) {
+            item->fallthrough = CASE_CONTINUE;
+            advance(p);
+        } else if (!is_keyword(p, "esac")) {
+            parse_fail(p, NULL);
+            break;
+        }
+        skip_newlines(p);
+    }
+
+    n->u.case_.count = items.count;
+    n->u.case_.items = vec_finish(p, &items);
+    if (p->status != PARSE_OK || expect_keyword(p, "esac") != 0) return NULL;
+    return n;
+}
+
+// { list } or ( list )
+static Node *parse_group(Parser *p, int type) {
+    Node *n = new_node(p, type);
+    if (!n) return NULL;
+    advance(p);
+
+    if (!(n->u.group.body = parse_compound_list(p, 0))) return NULL;
+    if (type == NODE_GROUP) {
+        if (expect_keyword(p, "}") != 0) return NULL;
+    } else {
+        if (!is_op(p, OP_RPAREN)) {
+            parse_fail(p, NULL);
+            return NULL;
+        }
+        advance(p);
+    }
+    return n;
+}
+
+// [[ expression ]]
+//
+// Operands are words; && || ! ( ) group them. The lexer is told when
+// the next word is a =~ regex so it can keep ( ) | < > in it.
+
+static CondExpr *parse_cond_or(Parser *p);
+
+// Is the current token [[ ? It is lexed as a pattern word.
+static int at_cond_start(Parser *p) {
+    Token *t = cur(p);
+    return t->type == TOK_WORD && (t->flags & ~WORD_GLOB) == 0 && t->len == 2 &&
+           strncmp(t->text, "[[", 2) == 0;
+}
+
+static CondExpr *new_cond(Parser *p, int type) {
+    CondExpr *e = arena_alloc(&p->script->arena, sizeof(CondExpr));
+    if (!e) {
+        p->status = PARSE_ERROR;
+        return NULL;
+    }
+    memset(e, 0, sizeof(*e));
+    e->type = type;
+    return e;
+}
+
+// Letter of a unary test operator such as -f, or 0
+static int cond_unary_op(Parser *p) {
+    Token *t = cur(p);
+    if (t->type != TOK_WORD || t->flags || t->len != 2 || t->text[0] != '-') return 0;
+    char c = t->text[1];
+    return c && strchr("abcdefghknprstuvwxzGLNOS", c) ? c : 0;
+}
+
+// Code of a binary operator, or 0
+static int cond_binary_op(Parser *p) {
+    static const struct {
+        const char *text;
+        int op;
+    } ops[] = {
+        {"==", COND_STR_EQ}, {"=", COND_STR_EQ}, {"!=", COND_STR_NE}, {"=~", COND_MATCH},
+        {"-eq", COND_INT_EQ}, {"-ne", COND_INT_NE}, {"-lt", COND_INT_LT}, {"-le", COND_INT_LE},
+        {"-gt", COND_INT_GT}, {"-ge", COND_INT_GE}, {"-nt", COND_NEWER}, {"-ot", COND_OLDER},
+        {"-ef", COND_SAME_FILE},
+    };
+    Token *t = cur(p);
+    if (t->type == TOK_OP) {
+        if (t->fd >= 0) return 0;
+        return t->op == OP_LESS ? COND_STR_LT : t->op == OP_GREAT ? COND_STR_GT : 0;
+    }
+    if (t->type != TOK_WORD || t->flags) return 0;
+    for (size_t k = 0; k < sizeof(ops) / sizeof(ops[0]); k++) {
+        if (t->len == strlen(ops[k].text) && strncmp(t->text, ops[k].text, t->len) == 0) {
+            return ops[k].op;
+        }
+    }
+    return 0;
+}
+
+static int cond_operand(Parser *p, Word *w) {
+    if (cur(p)->type != TOK_WORD || is_keyword(p, "]]")) {
+        parse_fail(p, cur(p)->type == TOK_EOF ? NULL : "unexpected token in conditional expression");
+        return -1;
+    }
+    return take_word(p, w);
+}
+
+// ! term | ( expression ) | -op word | word [op word]
+static CondExpr *parse_cond_term(Parser *p) {
+    CondExpr *e;
+    skip_newlines(p);
+
+    if (is_keyword(p, "!")) {
+        advance(p);
+        if (!(e = new_cond(p, COND_NOT))) return NULL;
+        return (e->left = parse_cond_term(p)) ? e : NULL;
+    }
+    if (is_op(p, OP_LPAREN)) {
+        advance(p);
+        e = parse_cond_or(p);
+        skip_newlines(p);
+        if (!e || !is_op(p, OP_RPAREN)) {
+            parse_fail(p, NULL);
+            return NULL;
+        }
+        advance(p);
+        return e;
+    }
+
+    int op = cond_unary_op(p);
+    if (op) {
+        advance(p);
+        if (!(e = new_cond(p, COND_UNARY))) return NULL;
+        e->op = op;
+        return cond_operand(p, &e->word[0]) == 0 ? e : NULL;
+    }
+
+    if (!(e = new_cond(p, COND_WORD)) || cond_operand(p, &e->word[0]) != 0) return NULL;
+    if (!(op = cond_binary_op(p))) return e;
+    advance(p);
+    e->type = COND_BINARY;
+    e->op = op;
+    p->lx.regex = op == COND_MATCH;
+    int rc = cond_operand(p, &e->word[1]);
+    p->lx.regex = 0;
+    return rc == 0 ? e : NULL;
+}
+
+static CondExpr *parse_cond_and(Parser *p) {
+    CondExpr *left = parse_cond_term(p);
+    while (left && is_op(p, OP_AND_IF)) {
+        advance(p);
+        CondExpr *e = new_cond(p, COND_AND);
+        if (!e || !(e->right = parse_cond_term(p))) return NULL;
+        e->left = left;
+        left = e;
+    }
+    return left;
+}
+
+static CondExpr *parse_cond_or(Parser *p) {
+    CondExpr *left = parse_cond_and(p);
+    while (left && is_op(p, OP_OR_IF)) {
+        advance(p);
+        CondExpr *e = new_cond(p, COND_OR);
+        if (!e || !(e->right = parse_cond_and(p))) return NULL;
+        e->left = left;
+        left = e;
+    }
+    return left;
+}
+
+static Node *parse_cond(Parser *p) {
+    Node *n = new_node(p, NODE_COND);
+    if (!n) return NULL;
+    advance(p);  // '[['
+    if (!(n->u.cond.expr = parse_cond_or(p))) return NULL;
+    skip_newlines(p);
+    if (expect_keyword(p, "]]") != 0) return NULL;
+    return n;
+}
+
+static int at_compound_start(Parser *p) {
+    return is_keyword(p, "if") || is_keyword(p, "while") || is_keyword(p, "until") ||
+           is_keyword(p, "for") || is_keyword(p, "case") || is_keyword(p, "{") ||
+           at_cond_start(p) || is_op(p, OP_LPAREN);
+}
+
+static Node *parse_compound(Parser *p) {
+    if (is_keyword(p, "if")) return parse_if(p);
+    if (is_keyword(p, "while")) return parse_loop(p, NODE_WHILE);
+    if (is_keyword(p, "until")) return parse_loop(p, NODE_UNTIL);
+    if (is_keyword(p, "for")) return parse_for(p);
+    if (is_keyword(p, "case")) return parse_case(p);
+    if (is_keyword(p, "{")) return parse_group(p, NODE_GROUP);
+    if (at_cond_start(p)) return parse_cond(p);
+    if (is_op(p, OP_LPAREN)) return parse_group(p, NODE_SUBSHELL);
+    parse_fail(p, NULL);
+    return NULL;
+}
+
+// Function body: a compound command with optional redirections
+static Node *parse_function_body(Parser *p, Word *name) {
+    Node *n = new_node(p, NODE_FUNCTION);
+    if (!n) return NULL;
+    n->u.func.name = name->text;
+
+    skip_newlines(p);
+    if (!at_compound_start(p)) {
+        parse_fail(p, cur(p)->type == TOK_EOF ? NULL : "function body must be a compound command");
+        return NULL;
+    }
+    Node *body = parse_compound(p);
+    if (!body || parse_redirect_list(p, &body->redirects) != 0) return NULL;
+    n->u.func.body = body;
+    return n;
+}
+
+// Expand an alias at the current token if it names one
+static int try_alias(Parser *p) {
+    Token *t = cur(p);
+    if (t->type != TOK_WORD || (t->flags & ~WORD_TILDE) || t->len >= 256) return 0;
+
+    char name[256];
+    memcpy(name, t->text, t->len);
+    name[t->len] = '\0';
+
+    char *value = get_alias(name);
+    if (!value || lexer_in_alias(&p->lx, name)) return 0;
+
+    // Resolve the stored alias name so the lexer can reference it
+    for (int i = 0; i < config.alias_count; i++) {
+        if (strcmp(config.aliases[i].name, name) == 0) {
+            advance(p);
+            return lexer_push_alias(&p->lx, config.aliases[i].name, value) == 0;
+        }
+    }
+    return 0;
+}
+
+// Simple command, possibly a function definition
+static Node *parse_simple(Parser *p) {
+    Node *n = new_node(p, NODE_COMMAND);
+    if (!n) return NULL;
+
+    Vec words = {NULL, 0, 0, sizeof(Word)};
+    Redirect **rtail = &n->redirects;
+
+    while (p->status == PARSE_OK && try_alias(p)) {
+        // alias values may expand to further aliases
+    }
+
+    for (;;) {
+        if (is_redirect_op(p)) {
+            Redirect *r = parse_redirect(p);
+            if (!r) break;
+            *rtail = r;
+            rtail = &r->next;
+            continue;
+        }
+        if (cur(p)->type != TOK_WORD) break;
+
+        Word *w = vec_push(&words);
+        if (!w || take_word(p, w) != 0) break;
+
+        // name () compound-command
+        if (words.count == 1 && !n->redirects && is_op(p, OP_LPAREN)) {
+            advance(p);
+            if (!is_op(p, OP_RPAREN)) {
+                parse_fail(p, NULL);
+                break;
+            }
+            advance(p);
+            Word name = *(Word *)words.items;
+            free(words.items);
+            return parse_function_body(p, &name);
+        }
+    }
+
+    if (p->status != PARSE_OK) {
+        free(words.items);
+        return NULL;
+    }
+    if (words.count == 0 && !n->redirects) {
+        free(words.items);
+        parse_fail(p, NULL);
+        return NULL;
+    }
+
+    n->u.cmd.count = words.count;
+    n->u.cmd.words = vec_finish(p, &words);
+    return n;
+}
+
+static Node *parse_command_node(Parser *p) {
+    if (p->status != PARSE_OK) return NULL;
+
+    if (is_keyword(p, "function")) {
+        advance(p);
+        Token *t = cur(p);
+        if (t->type != TOK_WORD) {
+            parse_fail(p, NULL);
+            return NULL;
+        }
+        Word name;
+        if (take_word(p, &name) != 0) return NULL;
+        if (is_op(p, OP_LPAREN)) {
+            advance(p);
+            if (!is_op(p, OP_RPAREN)) {
+                parse_fail(p, NULL);
+                return NULL;
+            }
+            advance(p);
+        }
+        return parse_function_body(p, &name);
+    }
+
+    if (at_compound_start(p)) {
+        Node *n = parse_compound(p);
+        if (!n || parse_redirect_list(p, &n->redirects) != 0) return NULL;
+        return n;
+    }
+
+    Token *t = cur(p);
+    if (t->type == TOK_ARITH) {
+        Node *n = new_node(p, NODE_ARITH);
+        if (!n || arith_word(p, &n->u.arith.expr, t->text, t->len) != 0) return NULL;
+        advance(p);
+        if (parse_redirect_list(p, &n->redirects) != 0) return NULL;
+        return n;
+    }
+    if (t->type != TOK_WORD && !is_redirect_op(p)) {
+        parse_fail(p, NULL);
+        return NULL;
+    }
+    return parse_simple(p);
+}
+
+// Parse the next complete top-level command. Returns NULL at end of
+// input or on error; p->status tells which. The caller owns one
+// reference to the returned node's script.
+Node *parse_next(Parser *p) {
+    if (p->status != PARSE_OK) return NULL;
+
+    skip_newlines(p);
+    if (p->status != PARSE_OK) return NULL;
+    if (cur(p)->type == TOK_EOF) {
+        p->status = PARSE_EOF;
+        return NULL;
+    }
+
+    p->script = script_new();
+    if (!p->script) {
+        p->status = PARSE_ERROR;
+        return NULL;
+    }
+
+    Vec items = {NULL, 0, 0, sizeof(Node *)};
+    Node *result = NULL;
+
+    while (p->status == PARSE_OK) {
+        const char *start = cur(p)->text;
+        Node *n = parse_and_or(p);
+        if (!n) break;
+        Node **slot = vec_push(&items);
+        if (!slot) break;
+        *slot = n;
+
+        if (is_op(p, OP_AMP) || is_op(p, OP_SEMI)) {
+            if (is_op(p, OP_AMP)) {
+                n->flags |= NODE_BACKGROUND;
+                advance(p);
+                n->text = source_text(p, start);
+            } else {
+                advance(p);
+            }
+            Token *t = cur(p);
+            if (t->type == TOK_NEWLINE || t->type == TOK_EOF) break;
+            continue;
+        }
+        if (cur(p)->type == TOK_NEWLINE || cur(p)->type == TOK_EOF) break;
+        parse_fail(p, NULL);
+    }
+
+    if (p->status == PARSE_OK && cur(p)->type == TOK_NEWLINE) advance(p);
+    if (p->status == PARSE_OK && p->npending > 0) {
+        // Here-document started on the last line without a newline
+        parse_fail(p, NULL);
+    }
+
+    if (p->status == PARSE_OK) {
+        if (items.count == 1 && !(((Node **)items.items)[0]->flags & NODE_BACKGROUND)) {
+            result = ((Node **)items.items)[0];
+            free(items.items);
+        } else {
+            result = new_node(p, NODE_LIST);
+            if (result) {
+                result->u.list.count = items.count;
+                result->u.list.items = vec_finish(p, &items);
+            }
+        }
+    } else {
+        free(items.items);
+    }
+
+    if (!result) {
+        script_release(p->script);
+        p->script = NULL;
+        if (p->status == PARSE_OK) p->status = PARSE_ERROR;
+    }
+    return result;
+}
+
+// Parse all of the input into a single tree owned by one script, for
+// text such as a command substitution body that is cached and run
+// repeatedly. Returns NULL on a syntax error.
+Node *parse_program(const char *src, size_t len) {
+    Parser p;
+    parser_init(&p, src, len);
+    p.script = script_new();
+    if (!p.script) return NULL;
+
+    Node *n = parse_compound_list(&p, 1);
+    if (n && cur(&p)->type != TOK_EOF) parse_fail(&p, NULL);
+    if (n && p.status == PARSE_OK && p.npending > 0) parse_fail(&p, NULL);
+    if (p.status == PARSE_INCOMPLETE) print_error("syntax error: unexpected end of file");
+
+    if (!n || p.status != PARSE_OK) {
+        script_release(p.script);
+        return NULL;
+    }
+    return n;
+}
@@ -0,0 +1,647 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include "shell.h"
+
+// Shell pattern matcher.
+//
+// Patterns are compiled into a Glushkov position automaton: every
+// character-consuming element of the pattern is a position, and the
+// automaton state is the set of positions that can have matched the last
+// character. Sets are bitsets, so matching is a single left-to-right pass
+// over the subject with no backtracking, regardless of how many '*' the
+// pattern contains.
+//
+// The extended forms ?(a|b), *(a|b), +(a|b) and @(a|b) are regular and
+// compile into the same automaton. !(a|b) is not: a pattern that uses it
+// at the top level is split into pieces around each negation, and the
+// pieces are matched by trying every split point of the subject.
+
+enum {
+    PN_LEAF,     // one character from a set
+    PN_CAT,      // children in sequence
+    PN_STAR,     // zero or more repetitions of the child
+    PN_PLUS,     // one or more repetitions of the child
+    PN_OPT,      // the child or nothing
+    PN_ALT       // any one of the children
+};
+
+typedef struct {
+    int type;
+    int child;              // first child (CAT/STAR)
+    int next;               // next sibling
+    int pos;                // position number (LEAF)
+    unsigned char set[32];  // accepted bytes (LEAF)
+} PatNode;
+
+typedef struct {
+    PatNode *nodes;
+    int count;
+    int capacity;
+    int positions;
+    const char *pat;
+    size_t len;
+    size_t i;
+    int flags;
+} PatParser;
+
+typedef struct {
+    Pattern *pattern;
+    int negate;             // matches whatever the pattern does not
+} PatPiece;
+
+struct Pattern {
+    int positions;
+    int nwords;
+    int nullable;
+    uint64_t *follow;       // (positions + 1) * nwords; row 0 is the start state
+    uint64_t *final;        // nwords
+    uint64_t *chars;        // 256 * nwords; positions accepting each byte
+    PatPiece *pieces;       // set when the pattern contains !(...)
+    int npieces;
+};
+
+#define BIT_SET(bs, n) ((bs)[(n) >> 6] |= (uint64_t)1 << ((n) & 63))
+
+static int new_node(PatParser *pp, int type) {
+    if (pp->count == pp->capacity) {
+        int cap = pp->capacity ? pp->capacity * 2 : 16;
+        PatNode *nodes = realloc(pp->nodes, cap * sizeof(PatNode));
+        if (!nodes) return -1;
+        pp->nodes = nodes;
+        pp->capacity = cap;
+    }
+    PatNode *n = &pp->nodes[pp->count];
+    memset(n, 0, sizeof(*n));
+    n->type = type;
+    n->child = -1;
+    n->next = -1;
+    return pp->count++;
+}
+
+static int new_leaf(PatParser *pp) {
+    int id = new_node(pp, PN_LEAF);
+    if (id >= 0) pp->nodes[id].pos = ++pp->positions;
+    return id;
+}
+
+// Match a POSIX character class name such as "alpha" in [[:alpha:]]
+static int class_matches(const char *name, size_t len, int c) {
+    static const struct {
+        const char *name;
+        int (*fn)(int);
+    } classes[] = {
+        {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank},
+        {"cntrl", iscntrl}, {"digit", isdigit}, {"graph", isgraph},
+        {"lower", islower}, {"print", isprint}, {"punct", ispunct},
+        {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit},
+    };
+    for (size_t k = 0; k < sizeof(classes) / sizeof(classes[0]); k++) {
+        if (strlen(classes[k].name) == len && strncmp(classes[k].name, name, len) == 0) {
+            return classes[k].fn(c) != 0;
+        }
+    }
+    return 0;
+}
+
+// Parse a bracket expression starting at '['. Returns 0 if the bracket is
+// not terminated, in which case the caller treats '[' as a literal.
+static int parse_bracket(PatParser *pp, unsigned char *set) {
+    const char *p = pp->pat;
+    size_t j = pp->i + 1;
+    int negate = 0;
+    unsigned char tmp[32] = {0};
+
+    if (j < pp->len && (p[j] == '!' || p[j] == '^')) {
+        negate = 1;
+        j++;
+    }
+
+    int first = 1;
+    while (j < pp->len && (p[j] != ']' || first)) {
+        first = 0;
+        if (p[j] == '[' && j + 1 < pp->len && p[j + 1] == ':') {
+            size_t k = j + 2;
+            while (k + 1 < pp->len && !(p[k] == ':' && p[k + 1] == ']')) k++;
+            if (k + 1 < pp->len) {
+                for (int c = 0; c < 256; c++) {
+                    if (class_matches(p + j + 2, k - (j + 2), c)) tmp[c >> 3] |= 1 << (c & 7);
+                }
+                j = k + 2;
+                continue;
+            }
+        }
+
+        unsigned char lo = (unsigned char)p[j];
+        if (lo == '\\' && j + 1 < pp->len) lo = (unsigned char)p[++j];
+        j++;
+
+        unsigned char hi = lo;
+        if (j + 1 < pp->len && p[j] == '-' && p[j + 1] != ']') {
+            hi = (unsigned char)p[j + 1];
+            if (hi == '\\' && j + 2 < pp->len) {
+                hi = (unsigned char)p[j + 2];
+                j++;
+            }
+            j += 2;
+        }
+        for (int c = lo; c <= hi; c++) tmp[c >> 3] |= 1 << (c & 7);
+    }
+
+    if (j >= pp->len) return 0;
+
+    for (int k = 0; k < 32; k++) set[k] = negate ? (unsigned char)~tmp[k] : tmp[k];
+    pp->i = j + 1;
+    return 1;
+}
+
+// Append node to a CAT node's child list
+static void cat_append(PatParser *pp, int cat, int *tail, int node) {
+    if (*tail < 0) {
+        pp->nodes[cat].child = node;
+    } else {
+        pp->nodes[*tail].next = node;
+    }
+    *tail = node;
+}
+
+// Index of the ')' closing the group whose '(' is at pat[open], or 0 if
+// the group is not terminated
+static size_t group_end(const char *pat, size_t len, size_t open) {
+    int depth = 0;
+    for (size_t i = open; i < len; i++) {
+        if (pat[i] == '\\') {
+            i++;
+        } else if (pat[i] == '(') {
+            depth++;
+        } else if (pat[i] == ')' && --depth == 0) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+static int parse_sequence(PatParser *pp, int nested);
+
+// Parse an extended group such as +(a|b) ending at pat[end]
+static int parse_group(PatParser *pp, char kind, size_t end) {
+    int alt = new_node(pp, PN_ALT);
+    int tail = -1;
+    if (alt < 0) return -1;
+
+    pp->i += 2;
+    for (;;) {
+        int seq = parse_sequence(pp, 1);
+        if (seq < 0) return -1;
+        cat_append(pp, alt, &tail, seq);
+        if (pp->i >= end || pp->pat[pp->i] != '|') break;
+        pp->i++;
+    }
+    pp->i = end + 1;
+
+    if (kind == '@') return alt;
+    int wrap = new_node(pp, kind == '?' ? PN_OPT : kind == '*' ? PN_STAR : PN_PLUS);
+    if (wrap < 0) return -1;
+    pp->nodes[wrap].child = alt;
+    return wrap;
+}
+
+// Parse a pattern sequence into a CAT node. Inside a group the sequence
+// ends at the next '|' or ')'.
+static int parse_sequence(PatParser *pp, int nested) {
+    int cat = new_node(pp, PN_CAT);
+    int tail = -1;
+    if (cat < 0) return -1;
+
+    while (pp->i < pp->len) {
+        char c = pp->pat[pp->i];
+        int node;
+        size_t end = 0;
+
+        if (nested && (c == '|' || c == ')')) break;
+
+        if (c && strchr("?*+@", c) && pp->i + 1 < pp->len && pp->pat[pp->i + 1] == '(' &&
+            (end = group_end(pp->pat, pp->len, pp->i + 1)) != 0) {
+            node = parse_group(pp, c, end);
+            if (node < 0) return -1;
+        } else if (c == '*') {
+            while (pp->i < pp->len && pp->pat[pp->i] == '*') pp->i++;
+            int star = new_node(pp, PN_STAR);
+            int any = new_leaf(pp);
+            if (star < 0 || any < 0) return -1;
+            memset(pp->nodes[any].set, 0xff, 32);
+            pp->nodes[star].child = any;
+            node = star;
+        } else {
+            node = new_leaf(pp);
+            if (node < 0) return -1;
+            unsigned char *set = pp->nodes[node].set;
+            if (c == '?') {
+                memset(set, 0xff, 32);
+                pp->i++;
+            } else if (c == '[' && parse_bracket(pp, set)) {
+                // bracket consumed
+            } else {
+                if (c == '\\' && pp->i + 1 < pp->len) c = pp->pat[++pp->i];
+                set[(unsigned char)c >> 3] |= 1 << ((unsigned char)c & 7);
+                pp->i++;
+            }
+        }
+        cat_append(pp, cat, &tail, node);
+    }
+    return cat;
+}
+
+// Reverse the order of every sequence so the automaton reads right to left
+static void reverse_node(PatParser *pp, int id) {
+    PatNode *n = &pp->nodes[id];
+    if (n->type == PN_LEAF) return;
+
+    int prev = -1, cur = n->child;
+    while (cur >= 0) {
+        int next = pp->nodes[cur].next;
+        reverse_node(pp, cur);
+        if (n->type == PN_CAT) pp->nodes[cur].next = prev;
+        prev = cur;
+        cur = next;
+    }
+    if (n->type == PN_CAT) pp->nodes[id].child = prev;
+}
+
+// Compute Glushkov first/last sets for a node, filling in follow sets.
+// Returns nullability.
+static int glushkov(PatParser *pp, Pattern *p, int id, uint64_t *first, uint64_t *last) {
+    PatNode *n = &pp->nodes[id];
+    int nw = p->nwords;
+
+    memset(first, 0, nw * sizeof(uint64_t));
+    memset(last, 0, nw * sizeof(uint64_t));
+
+    if (n->type == PN_LEAF) {
+        BIT_SET(first, n->pos);
+        BIT_SET(last, n->pos);
+        return 0;
+    }
+
+    uint64_t *cf = malloc(2 * nw * sizeof(uint64_t));
+    if (!cf) return 0;
+    uint64_t *cl = cf + nw;
+    int nullable;
+
+    if (n->type == PN_STAR || n->type == PN_PLUS || n->type == PN_OPT) {
+        nullable = glushkov(pp, p, n->child, first, last);
+        // Every last position may be followed by every first position
+        for (int q = 1; n->type != PN_OPT && q <= p->positions; q++) {
+            if (last[q >> 6] & ((uint64_t)1 << (q & 63))) {
+                for (int w = 0; w < nw; w++) p->follow[q * nw + w] |= first[w];
+            }
+        }
+        if (n->type != PN_PLUS) nullable = 1;
+    } else if (n->type == PN_ALT) {
+        nullable = 0;
+        for (int c = n->child; c >= 0; c = pp->nodes[c].next) {
+            nullable |= glushkov(pp, p, c, cf, cl);
+            for (int w = 0; w < nw; w++) {
+                first[w] |= cf[w];
+                last[w] |= cl[w];
+            }
+        }
+    } else {
+        nullable = 1;
+        for (int c = n->child; c >= 0; c = pp->nodes[c].next) {
+            int cn = glushkov(pp, p, c, cf, cl);
+            // Positions that can end the prefix so far are followed by c's first
+            for (int q = 1; q <= p->positions; q++) {
+                if (last[q >> 6] & ((uint64_t)1 << (q & 63))) {
+                    for (int w = 0; w < nw; w++) p->follow[q * nw + w] |= cf[w];
+                }
+            }
+            for (int w = 0; w < nw; w++) {
+                if (nullable) first[w] |= cf[w];
+                last[w] = cn ? (last[w] | cl[w]) : cl[w];
+            }
+            nullable = nullable && cn;
+        }
+    }
+
+    free(cf);
+    return nullable;
+}
+
+// Does the pattern use !(...) outside any other group?
+static int has_negation(const char *pat, size_t len) {
+    for (size_t i = 0; i + 1 < len; i++) {
+        size_t end;
+        if (pat[i] == '\\') {
+            i++;
+        } else if (pat[i + 1] == '(' && strchr("?*+@!", pat[i]) &&
+                   (end = group_end(pat, len, i + 1)) != 0) {
+            if (pat[i] == '!') return 1;
+            i = end;
+        }
+    }
+    return 0;
+}
+
+static int add_piece(Pattern *p, const char *text, size_t len, int negate) {
+    PatPiece *pieces = realloc(p->pieces, (p->npieces + 1) * sizeof(PatPiece));
+    if (!pieces) return -1;
+    p->pieces = pieces;
+    pieces[p->npieces].pattern = pattern_compile(text, len, 0);
+    pieces[p->npieces].negate = negate;
+    return pieces[p->npieces++].pattern ? 0 : -1;
+}
+
+// Split a pattern around its top-level !(...) groups. Each negation is
+// compiled as the equivalent @(...) and inverted when matching.
+static Pattern *compile_pieces(const char *pat, size_t len) {
+    Pattern *p = calloc(1, sizeof(Pattern));
+    if (!p) return NULL;
+
+    size_t start = 0, i = 0;
+    while (i < len) {
+        size_t end;
+        if (pat[i] == '\\') {
+            i += 2;
+        } else if (i + 1 < len && pat[i + 1] == '(' && strchr("?*+@!", pat[i]) &&
+                   (end = group_end(pat, len, i + 1)) != 0) {
+            if (pat[i] == '!') {
+                if (i > start && add_piece(p, pat + start, i - start, 0) != 0) goto fail;
+                char *alt = malloc(end - i + 1);
+                if (!alt) goto fail;
+                memcpy(alt, pat + i, end - i + 1);
+                alt[0] = '@';
+                int rc = add_piece(p, alt, end - i + 1, 1);
+                free(alt);
+                if (rc != 0) goto fail;
+                start = end + 1;
+            }
+            i = end + 1;
+        } else {
+            i++;
+        }
+    }
+    if (len > start && add_piece(p, pat + start, len - start, 0) != 0) goto fail;
+    return p;
+
+fail:
+    pattern_free(p);
+    return NULL;
+}
+
+// Compile a shell pattern
+Pattern *pattern_compile(const char *pat, size_t len, int flags) {
+    if (has_negation(pat, len)) return compile_pieces(pat, len);
+
+    PatParser pp = {0};
+    pp.pat = pat;
+    pp.len = len;
+    pp.flags = flags;
+
+    int root = parse_sequence(&pp, 0);
+    if (root < 0) {
+        free(pp.nodes);
+        return NULL;
+    }
+    if (flags & PATTERN_REVERSE) reverse_node(&pp, root);
+
+    Pattern *p = calloc(1, sizeof(Pattern));
+    if (!p) {
+        free(pp.nodes);
+        return NULL;
+    }
+    p->positions = pp.positions;
+    p->nwords = (pp.positions + 1 + 63) / 64;
+
+    int nw = p->nwords;
+    p->follow = calloc((size_t)(p->positions + 1) * nw, sizeof(uint64_t));
+    p->final = calloc(nw, sizeof(uint64_t));
+    p->chars = calloc((size_t)256 * nw, sizeof(uint64_t));
+    uint64_t *first = calloc(nw, sizeof(uint64_t));
+    if (!p->follow || !p->final || !p->chars || !first) {
+        free(first);
+        free(pp.nodes);
+        pattern_free(p);
+        return NULL;
+    }
+
+    p->nullable = glushkov(&pp, p, root, first, p->final);
+    memcpy(p->follow, first, nw * sizeof(uint64_t));
+    if (p->nullable) BIT_SET(p->final, 0);
+    free(first);
+
+    for (int k = 0; k < pp.count; k++) {
+        PatNode *n = &pp.nodes[k];
+        if (n->type != PN_LEAF) continue;
+        for (int c = 0; c < 256; c++) {
+            if (n->set[c >> 3] & (1 << (c & 7))) BIT_SET(&p->chars[c * nw], n->pos);
+        }
+    }
+
+    free(pp.nodes);
+    return p;
+}
+
+void pattern_free(Pattern *p) {
+    if (!p) return;
+    for (int k = 0; k < p->npieces; k++) pattern_free(p->pieces[k].pattern);
+    free(p->pieces);
+    free(p->follow);
+    free(p->final);
+    free(p->chars);
+    free(p);
+}
+
+// Advance the state set by one byte. Returns 0 if no position survives.
+static int pattern_step(const Pattern *p, uint64_t *state, uint64_t *next, unsigned char c) {
+    int nw = p->nwords;
+    const uint64_t *accept = &p->chars[c * nw];
+    int alive = 0;
+
+    if (nw == 1) {
+        uint64_t s = state[0], n = 0;
+        while (s) {
+            int q = __builtin_ctzll(s);
+            n |= p->follow[q];
+            s &= s - 1;
+        }
+        state[0] = n & accept[0];
+        return state[0] != 0;
+    }
+
+    memset(next, 0, nw * sizeof(uint64_t));
+    for (int w = 0; w < nw; w++) {
+        uint64_t s = state[w];
+        while (s) {
+            int q = w * 64 + __builtin_ctzll(s);
+            const uint64_t *f = &p->follow[q * nw];
+            for (int k = 0; k < nw; k++) next[k] |= f[k];
+            s &= s - 1;
+        }
+    }
+    for (int w = 0; w < nw; w++) {
+        state[w] = next[w] & accept[w];
+        if (state[w]) alive = 1;
+    }
+    return alive;
+}
+
+static int pattern_accepting(const Pattern *p, const uint64_t *state) {
+    for (int w = 0; w < p->nwords; w++) {
+        if (state[w] & p->final[w]) return 1;
+    }
+    return 0;
+}
+
+// Run the automaton over s, stepping forwards or backwards. Returns the
+// shortest or longest number of bytes consumed in an accepting state, or
+// -1. With anchored_end set, only a full-length match counts.
+static long pattern_run(const Pattern *p, const char *s, size_t len,
+                        int backwards, int longest, int anchored_end) {
+    uint64_t small[4];
+    uint64_t *state = small, *next = small + 2;
+    int nw = p->nwords;
+    if (nw > 1) {
+        state = malloc(2 * nw * sizeof(uint64_t));
+        if (!state) return -1;
+        next = state + nw;
+    }
+    memset(state, 0, nw * sizeof(uint64_t));
+    state[0] = 1;
+
+    long best = -1;
+    if (p->nullable && !anchored_end) {
+        best = 0;
+        if (!longest) goto done;
+    }
+
+    for (size_t k = 0; k < len; k++) {
+        unsigned char c = (unsigned char)(backwards ? s[len - 1 - k] : s[k]);
+        if (!pattern_step(p, state, next, c)) break;
+        if (!anchored_end && pattern_accepting(p, state)) {
+            best = (long)(k + 1);
+            if (!longest) break;
+        } else if (anchored_end && k + 1 == len && pattern_accepting(p, state)) {
+            best = (long)len;
+        }
+    }
+    if (anchored_end && len == 0 && p->nullable) best = 0;
+
+done:
+    if (state != small) free(state);
+    return best;
+}
+
+// Match pieces k.. of a split pattern against all of s. Only the last
+// piece is pinned to the end, so every earlier piece tries each length.
+static int pieces_match(const Pattern *p, int k, const char *s, size_t len) {
+    if (k == p->npieces) return len == 0;
+
+    const PatPiece *pc = &p->pieces[k];
+    for (size_t i = k + 1 == p->npieces ? len : 0; i <= len; i++) {
+        if (pattern_match(pc->pattern, s, i) != pc->negate &&
+            pieces_match(p, k + 1, s + i, len - i)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Prefix or suffix matching for split patterns: try each length in turn
+static long pieces_affix(const Pattern *p, const char *s, size_t len, int suffix, int longest) {
+    for (size_t k = 0; k <= len; k++) {
+        size_t n = longest ? len - k : k;
+        if (pieces_match(p, 0, suffix ? s + len - n : s, n)) return (long)n;
+    }
+    return -1;
+}
+
+// Does the pattern match the whole string?
+int pattern_match(const Pattern *p, const char *s, size_t len) {
+    if (!p) return 0;
+    if (p->pieces) return pieces_match(p, 0, s, len);
+    return pattern_run(p, s, len, 0, 1, 1) >= 0;
+}
+
+// Length of the shortest or longest prefix of s matched by p, or -1
+long pattern_match_prefix(const Pattern *p, const char *s, size_t len, int longest) {
+    if (!p) return -1;
+    if (p->pieces) return pieces_affix(p, s, len, 0, longest);
+    return pattern_run(p, s, len, 0, longest, 0);
+}
+
+// Length of the shortest or longest suffix of s matched by p, or -1.
+// p must have been compiled with PATTERN_REVERSE.
+long pattern_match_suffix(const Pattern *p, const char *s, size_t len, int longest) {
+    if (!p) return -1;
+    if (p->pieces) return pieces_affix(p, s, len, 1, longest);
+    return pattern_run(p, s, len, 1, longest, 0);
+}
+
+// Does the text contain unescaped pattern metacharacters? A '[' only
+// counts when a ']' follows it.
+int pattern_has_magic(const char *s, size_t len) {
+    for (size_t k = 0; k < len; k++) {
+        if (s[k] == '\\') {
+            k++;
+        } else if (s[k] == '*' || s[k] == '?') {
+            return 1;
+        } else if (s[k] == '[' && k + 2 < len && memchr(s + k + 2, ']', len - k - 2)) {
+            return 1;
+        } else if ((s[k] == '+' || s[k] == '@' || s[k] == '!') && k + 1 < len && s[k + 1] == '(') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Small cache of compiled patterns, keyed by text and flags, so loops
+// that apply the same ${var%pattern} don't recompile it every iteration.
+#define PATTERN_CACHE_SIZE 64
+
+typedef struct {
+    char *text;
+    size_t len;
+    int flags;
+    Pattern *pattern;
+    unsigned long last_used;
+} PatternCacheEntry;
+
+static PatternCacheEntry pattern_cache[PATTERN_CACHE_SIZE];
+static unsigned long pattern_clock;
+
+const Pattern *pattern_cached(const char *pat, size_t len, int flags) {
+    PatternCacheEntry *victim = &pattern_cache[0];
+
+    for (int k = 0; k < PATTERN_CACHE_SIZE; k++) {
+        PatternCacheEntry *e = &pattern_cache[k];
+        if (e->pattern && e->flags == flags && e->len == len && memcmp(e->text, pat, len) == 0) {
+            e->last_used = ++pattern_clock;
+            return e->pattern;
+        }
+        if (!e->pattern || (victim->pattern && e->last_used < victim->last_used)) {
+            victim = e;
+        }
+    }
+
+    Pattern *p = pattern_compile(pat, len, flags);
+    char *text = malloc(len + 1);
+    if (!p || !text) {
+        pattern_free(p);
+        free(text);
+        return NULL;
+    }
+    memcpy(text, pat, len);
+    text[len] = '\0';
+
+    free(victim->text);
+    pattern_free(victim->pattern);
+    victim->text = text;
+    victim->len = len;
+    victim->flags = flags;
+    victim->pattern = p;
+    victim->last_used = ++pattern_clock;
+    return p;
+}
@@ -0,0 +1,299 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include "shell.h"
+
+// Command queue: queue and batch.
+//
+// Commands wait in a queue that lives as long as the shell and start in
+// the background as slots free up, highest priority first and in order
+// of arrival among equals. The number of slots is the CPU count unless
+// set with queue -P. A command queued with batch also waits while the
+// one-minute load average is at or above the CPU count, unless nothing
+// from the queue is running, so a shared host is not oversubscribed.
+//
+// The queue advances whenever the shell runs a simple command, lists
+// jobs or waits with queue -w, and while it waits for a foreground
+// command or for input at the prompt, where the pidfds of the running
+// entries are polled along with job logs. Finished entries are kept
+// until jobs has listed them once; failures dropped that way are still
+// counted by the next queue -w.
+
+#define QUEUE_MAX_FAILURES 100
+#define QUEUE_LOAD_POLL_MS 1000
+#define QUEUE_POLL_MAX     64      // pidfds queue -w polls; the rest are looked at now and then
+
+enum { QUEUED, RUNNING, DONE };
+
+typedef struct {
+    unsigned id;
+    char **argv;
+    char *text;         // the command as listed by jobs
+    int priority;
+    int batch;          // waits for the load average to allow it
+    int state;
+    pid_t pid;
+    int pidfd;          // -1 if pidfd_open is not available
+    int status;
+    int waited;         // counted by queue -w already
+} QueueEntry;
+
+static QueueEntry *queue;
+static size_t queue_count, queue_cap;
+static size_t queue_head;       // entries before it are all done
+static size_t queue_waiting;    // entries in state QUEUED
+static size_t queue_running;
+static unsigned queue_next_id = 1;
+static int queue_limit;         // 0: one per CPU
+static int queue_dropped_failures;  // listed and dropped before queue -w saw them
+
+static void entry_free(QueueEntry *e) {
+    for (char **a = e->argv; a && *a; a++) free(*a);
+    free(e->argv);
+    free(e->text);
+    if (e->pidfd >= 0) close(e->pidfd);
+}
+
+static int queue_slots(void) {
+    if (queue_limit > 0) return queue_limit;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+// May a batch entry start now?
+static int load_allows(void) {
+    if (queue_running == 0) return 1;
+    double load;
+    if (getloadavg(&load, 1) != 1) return 1;
+    return load < sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+// The queued entry to start next, or NULL
+static QueueEntry *queue_pick(void) {
+    QueueEntry *best = NULL;
+    int load_checked = 0, load_ok = 0;
+    for (size_t i = queue_head; i < queue_count; i++) {
+        QueueEntry *e = &queue[i];
+        if (e->state != QUEUED || (best && e->priority <= best->priority)) continue;
+        if (e->batch) {
+            if (!load_checked) {
+                load_ok = load_allows();
+                load_checked = 1;
+            }
+            if (!load_ok) continue;
+        }
+        best = e;
+    }
+    return best;
+}
+
+static void queue_start(QueueEntry *e) {
+    queue_waiting--;
+    e->pid = fork_argv(e->argv, 0);
+    if (e->pid < 0) {
+        e->state = DONE;
+        e->status = EXIT_FAILURE;
+        return;
+    }
+    e->state = RUNNING;
+    e->pidfd = (int)syscall(SYS_pidfd_open, e->pid, 0);
+    queue_running++;
+}
+
+// Collect entries that have finished and start waiting ones in the
+// slots that are free
+void queue_pump(void) {
+    if (queue_running == 0 && queue_waiting == 0) return;
+
+    size_t seen = 0, started = queue_running;
+    for (size_t i = queue_head; i < queue_count && seen < started; i++) {
+        QueueEntry *e = &queue[i];
+        int status;
+        if (e->state != RUNNING) continue;
+        seen++;
+        if (waitpid(e->pid, &status, WNOHANG) != e->pid) continue;
+        e->state = DONE;
+        e->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        if (e->pidfd >= 0) {
+            close(e->pidfd);
+            e->pidfd = -1;
+        }
+        queue_running--;
+    }
+    while (queue_head < queue_count && queue[queue_head].state == DONE) queue_head++;
+
+    int slots = queue_slots();
+    while (queue_waiting > 0 && queue_running < (size_t)slots) {
+        QueueEntry *e = queue_pick();
+        if (!e) break;
+        queue_start(e);
+    }
+}
+
+// The number of entries queued or running
+int queue_active(void) {
+    return (int)(queue_running + queue_waiting);
+}
+
+// Put the pidfds of running entries in pfds, up to max, for a wait that
+// should also let the queue move. Lowers *timeout, in milliseconds or
+// -1 for none, to when the queue must be looked at again regardless.
+int queue_pollfds(struct pollfd *pfds, int max, int *timeout) {
+    int n = 0, again = -1;
+    for (size_t i = queue_head; i < queue_count; i++) {
+        QueueEntry *e = &queue[i];
+        if (e->state != RUNNING) continue;
+        if (e->pidfd >= 0 && n < max) pfds[n++] = (struct pollfd){e->pidfd, POLLIN, 0};
+        else again = 50;
+    }
+    // Batch entries held back by the load
+    if (queue_waiting > 0 && queue_running < (size_t)queue_slots() && again < 0) {
+        again = QUEUE_LOAD_POLL_MS;
+    }
+    if (again >= 0 && (*timeout < 0 || again < *timeout)) *timeout = again;
+    return n;
+}
+
+// Forget the queue in a forked child: its entries belong to the parent
+void queue_forget(void) {
+    for (size_t i = 0; i < queue_count; i++) {
+        if (queue[i].pidfd >= 0) close(queue[i].pidfd);
+        queue[i].pidfd = -1;
+    }
+    queue_count = queue_head = queue_waiting = queue_running = 0;
+}
+
+// List the queue for jobs, dropping finished entries once shown
+void queue_show(void) {
+    size_t kept = 0;
+    for (size_t i = 0; i < queue_count; i++) {
+        QueueEntry *e = &queue[i];
+        if (e->state == QUEUED) {
+            out_printf(STDOUT_FILENO, "[Q%u] %sQueued%s  (priority %d%s)  %s\n", e->id, COLOR_YELLOW,
+                       COLOR_RESET, e->priority, e->batch ? ", batch" : "", e->text);
+        } else {
+            out_printf(STDOUT_FILENO, "[Q%u] %s%s%s  %s  %s\n", e->id,
+                       e->state == RUNNING ? COLOR_GREEN : COLOR_RED,
+                       e->state == RUNNING ? "Running" : "Done", COLOR_RESET,
+                       e->state == RUNNING ? "" : (e->status == 0 ? "(success)" : "(failed)"), e->text);
+        }
+        if (e->state == DONE) {
+            if (!e->waited && e->status != 0) queue_dropped_failures++;
+            entry_free(e);
+        } else {
+            queue[kept++] = *e;
+        }
+    }
+    queue_count = kept;
+    queue_head = 0;
+}
+
+static int queue_add(char **args, int priority, int batch) {
+    if (queue_count == queue_cap) {
+        size_t cap = queue_cap ? queue_cap * 2 : 32;
+        QueueEntry *grown = realloc(queue, cap * sizeof(QueueEntry));
+        if (!grown) return -1;
+        queue = grown;
+        queue_cap = cap;
+    }
+
+    int argc = 0;
+    size_t len = 0;
+    while (args[argc]) len += strlen(args[argc++]) + 1;
+    QueueEntry e = {queue_next_id, calloc(argc + 1, sizeof(char *)), malloc(len), priority, batch,
+                    QUEUED, 0, -1, 0, 0};
+    if (!e.argv || !e.text) {
+        entry_free(&e);
+        return -1;
+    }
+    char *p = e.text;
+    for (int i = 0; i < argc; i++) {
+        if (!(e.argv[i] = strdup(args[i]))) {
+            entry_free(&e);
+            return -1;
+        }
+        size_t n = strlen(args[i]);
+        memcpy(p, args[i], n);
+        p += n;
+        *p++ = i + 1 < argc ? ' ' : '\0';
+    }
+    queue[queue_count++] = e;
+    queue_next_id++;
+    queue_waiting++;
+    return 0;
+}
+
+// Wait until every queued command has run. Returns the number that
+// failed since the last wait, up to QUEUE_MAX_FAILURES.
+static int queue_wait(void) {
+    queue_pump();
+    while (queue_active() > 0) {
+        struct pollfd pfds[QUEUE_POLL_MAX];
+        int timeout = -1;
+        int n = queue_pollfds(pfds, QUEUE_POLL_MAX, &timeout);
+        if (poll(pfds, n, timeout) < 0 && errno == EINTR) return 128 + SIGINT;
+        queue_pump();
+    }
+
+    int failed = queue_dropped_failures;
+    queue_dropped_failures = 0;
+    for (size_t i = 0; i < queue_count; i++) {
+        QueueEntry *e = &queue[i];
+        if (e->state == DONE && !e->waited && e->status != 0) failed++;
+        e->waited = 1;
+    }
+    return failed < QUEUE_MAX_FAILURES ? failed : QUEUE_MAX_FAILURES;
+}
+
+// queue [-p priority] command [args...]   batch [-p priority] command...
+// queue -P slots   queue -w   queue
+int cmd_queue(char **args) {
+    int batch = strcmp(args[0], "batch") == 0;
+    int priority = 0;
+    int i = 1;
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        const char *opt = args[i];
+        if (strcmp(opt, "--") == 0) {
+            i++;
+            break;
+        }
+        if (strcmp(opt, "-w") == 0) return queue_wait();
+        if ((opt[1] != 'p' && opt[1] != 'P') || (!opt[2] && !args[i + 1])) {
+            print_error("%s: %s: invalid option", args[0], opt);
+            return EXIT_USAGE;
+        }
+        const char *value = opt[2] ? opt + 2 : args[++i];
+        char *end;
+        long v = strtol(value, &end, 10);
+        if (!*value || *end || v < INT_MIN || v > INT_MAX || (opt[1] == 'P' && v < 0)) {
+            print_error("%s: %s: invalid number", args[0], value);
+            return EXIT_USAGE;
+        }
+        if (opt[1] == 'P') {
+            queue_limit = (int)v;
+            queue_pump();
+            if (!args[i + 1]) return EXIT_SUCCESS;
+        } else {
+            priority = (int)v;
+        }
+    }
+
+    if (!args[i]) {
+        queue_pump();
+        queue_show();
+        return EXIT_SUCCESS;
+    }
+    if (queue_add(args + i, priority, batch) != 0) {
+        print_error("malloc: failed to allocate memory");
+        return EXIT_FAILURE;
+    }
+    queue_pump();
+    return EXIT_SUCCESS;
+}
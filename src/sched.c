@@ -0,0 +1,264 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "shell.h"
+
+// Scheduling attributes: CPU affinity, scheduling policy, nice level
+// and I/O priority.
+//
+// The pin prefix sets them for the command it runs; they are applied in
+// the forked child just before exec, so no taskset, nice or ionice
+// process stands in between and the shell keeps its own. renice-job
+// changes them for a job that is already running: every thread of the
+// job and of the processes it has started so far. Processes the job
+// starts later inherit them as usual.
+
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+#define CPU_WORD_BITS      (8 * sizeof(unsigned long))
+#define NICE_DEFAULT       10
+
+enum { IO_CLASS_RT = 1, IO_CLASS_BE, IO_CLASS_IDLE };
+
+static int parse_int(const char *text, int min, int max, int *value) {
+    char *end;
+    errno = 0;
+    long v = strtol(text, &end, 10);
+    if (!*text || *end || errno || v < min || v > max) return -1;
+    *value = (int)v;
+    return 0;
+}
+
+// Add a list like 0-3,8,10-11 to the CPU set
+static int parse_cpu_list(SchedAttrs *a, const char *list) {
+    const char *p = list;
+    do {
+        char *end;
+        long lo = strtol(p, &end, 10), hi = lo;
+        if (end == p || lo < 0) return -1;
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+            if (end == p || hi < lo) return -1;
+        }
+        if (hi >= SCHED_MAX_CPUS) return -1;
+        for (long cpu = lo; cpu <= hi; cpu++) a->cpus[cpu / CPU_WORD_BITS] |= 1UL << (cpu % CPU_WORD_BITS);
+        p = end;
+    } while (*p == ',' && *++p);
+    return *p == '\0' || *p == '\n' ? 0 : -1;
+}
+
+// CPUs: a list, or nodeN for the CPUs of a NUMA node
+int sched_cpus(SchedAttrs *a, const char *cmd, const char *spec) {
+    memset(a->cpus, 0, sizeof(a->cpus));
+    int rc;
+    int node;
+    if (strncmp(spec, "node", 4) == 0 && parse_int(spec + 4, 0, INT_MAX, &node) == 0) {
+        char path[64], list[4096];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *f = fopen(path, "r");
+        if (!f) {
+            print_error("%s: %s: no such NUMA node", cmd, spec);
+            return -1;
+        }
+        rc = fgets(list, sizeof(list), f) ? parse_cpu_list(a, list) : -1;
+        fclose(f);
+    } else {
+        rc = parse_cpu_list(a, spec);
+    }
+    if (rc != 0) {
+        print_error("%s: %s: invalid CPU list", cmd, spec);
+        return -1;
+    }
+    a->set |= SCHED_SET_CPUS;
+    return 0;
+}
+
+// policy[:priority]: other, batch, idle, fifo or rr
+static int parse_policy(SchedAttrs *a, const char *text) {
+    static const struct { const char *name; int policy; } policies[] = {
+        {"other", SCHED_OTHER}, {"normal", SCHED_OTHER}, {"batch", SCHED_BATCH},
+        {"idle", SCHED_IDLE}, {"fifo", SCHED_FIFO}, {"rr", SCHED_RR},
+    };
+    const char *colon = strchr(text, ':');
+    size_t len = colon ? (size_t)(colon - text) : strlen(text);
+    for (size_t k = 0; k < sizeof(policies) / sizeof(policies[0]); k++) {
+        if (strlen(policies[k].name) != len || strncmp(text, policies[k].name, len) != 0) continue;
+        int policy = policies[k].policy;
+        int min = sched_get_priority_min(policy), max = sched_get_priority_max(policy);
+        a->policy = policy;
+        a->rt_priority = min > 0 ? min : 0;
+        if (colon && parse_int(colon + 1, min, max, &a->rt_priority) != 0) return -1;
+        return 0;
+    }
+    return -1;
+}
+
+// class[:level]: rt, be or idle, levels 0 (highest) to 7
+static int parse_io(SchedAttrs *a, const char *text) {
+    static const struct { const char *name; int io_class; } classes[] = {
+        {"rt", IO_CLASS_RT}, {"realtime", IO_CLASS_RT}, {"be", IO_CLASS_BE},
+        {"best-effort", IO_CLASS_BE}, {"idle", IO_CLASS_IDLE},
+    };
+    const char *colon = strchr(text, ':');
+    size_t len = colon ? (size_t)(colon - text) : strlen(text);
+    for (size_t k = 0; k < sizeof(classes) / sizeof(classes[0]); k++) {
+        if (strlen(classes[k].name) != len || strncmp(text, classes[k].name, len) != 0) continue;
+        a->io_class = classes[k].io_class;
+        a->io_level = a->io_class == IO_CLASS_IDLE ? 0 : 4;
+        if (colon && (a->io_class == IO_CLASS_IDLE || parse_int(colon + 1, 0, 7, &a->io_level) != 0)) {
+            return -1;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+// Take the value of option -c, -n, -s or -i. Returns -1 after printing
+// an error if either is invalid.
+int sched_option(SchedAttrs *a, const char *cmd, const char *opt, const char *value) {
+    if (!value) {
+        print_error("%s: %s: option requires an argument", cmd, opt);
+        return -1;
+    }
+    int rc;
+    switch (opt[1]) {
+        case 'c': return sched_cpus(a, cmd, value);
+        case 'n': rc = parse_int(value, -20, 19, &a->nice); a->set |= SCHED_SET_NICE; break;
+        case 's': rc = parse_policy(a, value); a->set |= SCHED_SET_POLICY; break;
+        case 'i': rc = parse_io(a, value); a->set |= SCHED_SET_IO; break;
+        default:
+            print_error("%s: %s: invalid option", cmd, opt);
+            return -1;
+    }
+    if (rc != 0) print_error("%s: %s: invalid value for %s", cmd, value, opt);
+    return rc;
+}
+
+// Apply the settings to one thread, 0 for the calling one. Returns the
+// name of the call that failed, with errno set, or NULL.
+static const char *apply_task(const SchedAttrs *a, pid_t tid) {
+    if (a->set & SCHED_SET_CPUS) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu = 0; cpu < SCHED_MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+            if (a->cpus[cpu / CPU_WORD_BITS] & (1UL << (cpu % CPU_WORD_BITS))) CPU_SET(cpu, &set);
+        }
+        if (sched_setaffinity(tid, sizeof(set), &set) != 0) return "sched_setaffinity";
+    }
+    if (a->set & SCHED_SET_POLICY) {
+        struct sched_param param = {.sched_priority = a->rt_priority};
+        if (sched_setscheduler(tid, a->policy, &param) != 0) return "sched_setscheduler";
+    }
+    if ((a->set & SCHED_SET_NICE) && setpriority(PRIO_PROCESS, tid, a->nice) != 0) return "setpriority";
+    if (a->set & SCHED_SET_IO) {
+        int prio = a->io_class << IOPRIO_CLASS_SHIFT | a->io_level;
+        if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, prio) != 0) return "ioprio_set";
+    }
+    return NULL;
+}
+
+// Apply the settings to the calling process, as a child does before it
+// runs its command
+int sched_apply(const SchedAttrs *a, const char *cmd) {
+    const char *failed = apply_task(a, 0);
+    if (!failed) return 0;
+    print_error("%s: %s: %s", cmd, failed, strerror(errno));
+    return -1;
+}
+
+// Apply the settings to every thread of pid and, through the children
+// files of its threads, to its descendants. Returns the number of
+// threads that could not be changed.
+static int apply_tree(const SchedAttrs *a, const char *cmd, pid_t pid, int depth) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task", (int)pid);
+    DIR *dir = opendir(path);
+    if (!dir) {
+        const char *failed = apply_task(a, pid);
+        if (!failed) return 0;
+        print_error("%s: %d: %s: %s", cmd, (int)pid, failed, strerror(errno));
+        return 1;
+    }
+
+    int errors = 0;
+    struct dirent *d;
+    while ((d = readdir(dir))) {
+        int tid;
+        if (parse_int(d->d_name, 1, INT_MAX, &tid) != 0) continue;
+        const char *failed = apply_task(a, tid);
+        if (failed && errno != ESRCH) {
+            print_error("%s: %d: %s: %s", cmd, tid, failed, strerror(errno));
+            errors++;
+        }
+        if (depth >= MAX_ARGS) continue;
+
+        char children[96];
+        snprintf(children, sizeof(children), "/proc/%d/task/%d/children", (int)pid, tid);
+        FILE *f = fopen(children, "r");
+        if (!f) continue;
+        int child;
+        while (fscanf(f, "%d", &child) == 1) errors += apply_tree(a, cmd, child, depth + 1);
+        fclose(f);
+    }
+    closedir(dir);
+    return errors;
+}
+
+// renice-job [-c cpus] [-n nice] [-s policy] [-i class] %job|pid...
+int cmd_renice_job(char **args) {
+    SchedAttrs a = {0};
+    int i = 1;
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        if (args[i][2] || !strchr("cnsi", args[i][1])) {
+            print_error("renice-job: %s: invalid option", args[i]);
+            return EXIT_USAGE;
+        }
+        if (sched_option(&a, "renice-job", args[i], args[i + 1]) != 0) return EXIT_USAGE;
+        i++;
+    }
+    if (!args[i]) {
+        print_error("renice-job: usage: renice-job [-c cpus] [-n nice] [-s policy] [-i class] %%job|pid...");
+        return EXIT_USAGE;
+    }
+    if (!a.set) {
+        a.nice = NICE_DEFAULT;
+        a.set = SCHED_SET_NICE;
+    }
+
+    update_jobs();
+    int status = EXIT_SUCCESS;
+    for (; args[i]; i++) {
+        int id;
+        pid_t pid;
+        if (args[i][0] == '%') {
+            Job *job = parse_int(args[i] + 1, 1, INT_MAX, &id) == 0 ? get_job(id) : NULL;
+            if (!job || !job->running) {
+                print_error("renice-job: %s: no such job", args[i]);
+                status = EXIT_FAILURE;
+                continue;
+            }
+            pid = job->pid;
+        } else if (parse_int(args[i], 1, INT_MAX, &id) == 0) {
+            pid = id;
+        } else {
+            print_error("renice-job: %s: not a job or process id", args[i]);
+            status = EXIT_FAILURE;
+            continue;
+        }
+        if (apply_tree(&a, "renice-job", pid, 0) != 0) status = EXIT_FAILURE;
+    }
+    return status;
+}
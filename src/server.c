@@ -0,0 +1,432 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "shell.h"
+
+// Server mode: xsh --server and xsh --client.
+//
+// A server is a shell that has started up once, run its setup script,
+// and then waits on a Unix socket. Each client connection is handed to
+// a worker forked from it, so the worker begins with the server's
+// functions, aliases and variables in place and pays for no startup of
+// its own. The client sends its standard input, output and error as
+// SCM_RIGHTS descriptors with a request holding the current directory,
+// the script, the positional parameters and the environment; the worker
+// takes these over, runs the script and sends back its exit status.
+// The script runs in a child of the worker, in a process group of its
+// own, while the worker watches the connection: if the client goes away
+// before the end, as when it is killed, the group gets SIGTERM and
+// SIGKILL after SERVER_KILL_MS more.
+//
+// Only processes of the server's own user are served, and the socket
+// is created accessible to that user alone. The server waits on the
+// socket and a signalfd together: finished workers are reaped as they
+// exit, and on SIGINT or SIGTERM the socket is removed before the
+// server dies of the signal.
+
+#define SERVER_MAGIC       0x31485358u     // "XSH1"
+#define SERVER_MAX_REQUEST (64 << 20)
+#define SERVER_BACKLOG     64
+#define SERVER_KILL_MS     2000
+
+typedef struct {
+    uint32_t magic;
+    uint32_t len;       // bytes of the request that follows
+} RequestHeader;
+
+extern char **environ;
+
+static int socket_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        print_error("%s: socket path too long", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+// Read exactly len bytes. Returns -1 on an error or an early end of
+// file.
+int read_full(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Send all of buf on a socket; a peer that has gone away is an error
+// rather than SIGPIPE
+int send_full(int sock, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(sock, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Receive the header and the client's three descriptors
+static int receive_header(int conn, RequestHeader *h, int fds[3]) {
+    union {
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {h, sizeof(*h)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t n;
+    while ((n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) continue;
+    struct cmsghdr *c = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (!c || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS ||
+        c->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(c), 3 * sizeof(int));
+    if ((size_t)n < sizeof(*h) && read_full(conn, (char *)h + n, sizeof(*h) - n) != 0) return -1;
+    return h->magic == SERVER_MAGIC && h->len <= SERVER_MAX_REQUEST ? 0 : -1;
+}
+
+// Make the client's environment the worker's: variables it does not
+// have are dropped, the others set and exported
+static void take_environment(char **env, int count) {
+    size_t names = 0;
+    for (char **e = environ; e && *e; e++) names++;
+    char **own = malloc((names + 1) * sizeof(char *));
+    size_t n = 0;
+    for (char **e = environ; own && e && *e; e++) {
+        const char *equals = strchr(*e, '=');
+        if (equals && (own[n] = strndup(*e, equals - *e))) n++;
+    }
+    for (size_t k = 0; k < n; k++) {
+        size_t len = strlen(own[k]);
+        int kept = 0;
+        for (int j = 0; j < count && !kept; j++) {
+            kept = strncmp(env[j], own[k], len) == 0 && env[j][len] == '=';
+        }
+        if (!kept) var_remove(own[k]);
+        free(own[k]);
+    }
+    free(own);
+
+    for (int j = 0; j < count; j++) {
+        char *equals = strchr(env[j], '=');
+        if (!equals || !is_valid_name(env[j], equals - env[j])) continue;
+        *equals = '\0';
+        var_set(env[j], equals + 1, VAR_EXPORT);
+        *equals = '=';
+    }
+}
+
+// The next NUL-terminated string of a request, or NULL past its end
+char *next_string(char **p, char *end) {
+    if (*p >= end) return NULL;
+    char *s = *p;
+    char *nul = memchr(s, '\0', end - s);
+    if (!nul) return NULL;
+    *p = nul + 1;
+    return s;
+}
+
+// Wait for the script run by pid to finish. If the client hangs up
+// first, its process group is stopped: SIGTERM, then SIGKILL for what
+// is left of it after SERVER_KILL_MS. Returns the script's exit status.
+static int watch_script(int conn, pid_t pid) {
+    int pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    int wstatus = 0, hung_up = 0, waited = 0;
+    for (;;) {
+        struct pollfd pfds[2] = {{hung_up ? -1 : conn, POLLRDHUP, 0}, {pidfd, POLLIN, 0}};
+        // Without a pidfd, or once signalled, look for the exit now and then
+        int rc = poll(pfds, 2, pidfd < 0 || hung_up ? 10 : -1);
+        if (waitpid(pid, &wstatus, WNOHANG) != 0) break;
+        if (!hung_up && pfds[0].revents) {
+            kill(-pid, SIGTERM);
+            kill(-pid, SIGCONT);
+            hung_up = 1;
+        } else if (hung_up && rc == 0 && (waited += 10) == SERVER_KILL_MS) {
+            kill(-pid, SIGKILL);
+        }
+    }
+    if (pidfd >= 0) close(pidfd);
+    // What it started may outlive it
+    for (; hung_up && waited < SERVER_KILL_MS && kill(-pid, 0) == 0; waited += 10) usleep(10000);
+    if (hung_up) kill(-pid, SIGKILL);
+    return WIFSIGNALED(wstatus) ? 128 + WTERMSIG(wstatus) : WEXITSTATUS(wstatus);
+}
+
+// Serve one connection in a worker forked for it
+static void serve(int conn) {
+    RequestHeader h;
+    int fds[3];
+    if (receive_header(conn, &h, fds) != 0) exit(EXIT_FAILURE);
+    char *request = malloc(h.len + 1);
+    if (!request || read_full(conn, request, h.len) != 0) exit(EXIT_FAILURE);
+    request[h.len] = '\0';
+
+    // cwd, script, name, argument count, arguments, environment
+    char *p = request, *end = request + h.len;
+    char *cwd = next_string(&p, end);
+    char *script = next_string(&p, end);
+    char *name = next_string(&p, end);
+    char *argc_text = next_string(&p, end);
+    if (!argc_text) exit(EXIT_FAILURE);
+    int argc = atoi(argc_text);
+    char **argv = calloc(argc + 1, sizeof(char *));
+    for (int k = 0; argv && k < argc; k++) {
+        if (!(argv[k] = next_string(&p, end))) exit(EXIT_FAILURE);
+    }
+    int env_count = 0;
+    char **env = NULL;
+    for (char *e; (e = next_string(&p, end)); env_count++) {
+        char **grown = realloc(env, (env_count + 1) * sizeof(char *));
+        if (!grown) exit(EXIT_FAILURE);
+        env = grown;
+        env[env_count] = e;
+    }
+    if (!argv) exit(EXIT_FAILURE);
+
+    out_flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        setpgid(0, 0);
+        close(conn);
+        for (int fd = 0; fd < 3; fd++) {
+            dup2(fds[fd], fd);
+            close(fds[fd]);
+        }
+        take_environment(env, env_count);
+        if (chdir(cwd) != 0 || !getcwd(current_dir, sizeof(current_dir))) {
+            print_error("%s: %s", cwd, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (name[0]) set_shell_name(name);
+        set_positional(argc, argv);
+        config.shell_pid = getpid();
+
+        run_script(script, strlen(script));
+        out_flush();
+        exit(config.last_status);
+    }
+    for (int fd = 0; fd < 3; fd++) close(fds[fd]);
+    if (pid < 0) exit(EXIT_FAILURE);
+    setpgid(pid, pid);
+
+    int32_t status = watch_script(conn, pid);
+    send_full(conn, &status, sizeof(status));
+    exit(status);
+}
+
+// Is the connection from a process of our own user?
+static int same_user(int conn) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    return getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+}
+
+// xsh --server socket [setup-script]
+int server_run(const char *path, const char *setup) {
+    struct sockaddr_un addr;
+    if (socket_address(path, &addr) != 0) return EXIT_USAGE;
+    if (setup) {
+        char *args[] = {"source", (char *)setup, NULL};
+        if (cmd_source(args) != EXIT_SUCCESS) return EXIT_FAILURE;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        print_error("socket: %s", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    // Replace a socket left by an earlier server, but nothing else
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            print_error("%s: exists and is not a socket", path);
+            close(fd);
+            return EXIT_FAILURE;
+        }
+        unlink(path);
+    }
+    mode_t mask = umask(077);
+    int rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (rc != 0 || listen(fd, SERVER_BACKLOG) != 0) {
+        print_error("%s: %s", path, strerror(errno));
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    // The server runs until it is signalled
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    sigset_t set, saved;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigprocmask(SIG_BLOCK, &set, &saved);
+    int sig_fd = signalfd(-1, &set, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (sig_fd < 0) {
+        print_error("signalfd: %s", strerror(errno));
+        sigprocmask(SIG_SETMASK, &saved, NULL);
+        close(fd);
+        unlink(path);
+        return EXIT_FAILURE;
+    }
+    int stop = 0;
+    while (!stop) {
+        struct pollfd fds[2] = {{fd, POLLIN, 0}, {sig_fd, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            print_error("poll: %s", strerror(errno));
+            break;
+        }
+        struct signalfd_siginfo info;
+        while (read(sig_fd, &info, sizeof(info)) == (ssize_t)sizeof(info)) {
+            if (info.ssi_signo != SIGCHLD) stop = (int)info.ssi_signo;
+        }
+        while (waitpid(-1, NULL, WNOHANG) > 0) continue;
+        if (stop || !(fds[0].revents & POLLIN)) continue;
+
+        int conn = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN) continue;
+            print_error("accept: %s", strerror(errno));
+            break;
+        }
+        if (!same_user(conn)) {
+            close(conn);
+            continue;
+        }
+        out_flush();
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fd);
+            close(sig_fd);
+            sigprocmask(SIG_SETMASK, &saved, NULL);
+            serve(conn);
+        }
+        if (pid < 0) print_error("fork: %s", strerror(errno));
+        close(conn);
+    }
+    close(sig_fd);
+    close(fd);
+    unlink(path);
+    if (stop) {
+        // Die of the signal, as the server did before it took them over
+        signal(stop, SIG_DFL);
+        sigprocmask(SIG_SETMASK, &saved, NULL);
+        raise(stop);
+    }
+    return EXIT_FAILURE;
+}
+
+// Add s to a request, with its NUL
+int add_string(StrBuf *b, const char *s) {
+    return strbuf_append(b, s, strlen(s) + 1);
+}
+
+// xsh --client socket -c script [name [args...]]
+// xsh --client socket file [args...]
+//
+// Runs without setting up a shell of its own: it only packs up the
+// request and waits for the status.
+int client_run(const char *path, int argc, char **argv) {
+    StrBuf script = {0}, request = {0};
+    const char *name = "";
+    int first_arg;
+    if (argc >= 2 && strcmp(argv[0], "-c") == 0) {
+        strbuf_append(&script, argv[1], strlen(argv[1]));
+        if (argc > 2) name = argv[2];
+        first_arg = argc > 2 ? 3 : 2;
+    } else if (argc >= 1) {
+        FILE *f = fopen(argv[0], "r");
+        if (!f) {
+            fprintf(stderr, "xsh: %s: %s\n", argv[0], strerror(errno));
+            return EXIT_NOT_FOUND;
+        }
+        char chunk[8192];
+        size_t n;
+        while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) strbuf_append(&script, chunk, n);
+        fclose(f);
+        name = argv[0];
+        first_arg = 1;
+    } else {
+        fprintf(stderr, "xsh: usage: xsh --client socket -c script [name [args...]] | file [args...]\n");
+        return EXIT_USAGE;
+    }
+
+    char cwd[MAX_PATH_LENGTH], count[16];
+    if (!getcwd(cwd, sizeof(cwd))) strcpy(cwd, "/");
+    snprintf(count, sizeof(count), "%d", argc - first_arg);
+    add_string(&request, cwd);
+    strbuf_append(&request, script.data ? script.data : "", script.len);
+    strbuf_putc(&request, '\0');
+    add_string(&request, name);
+    add_string(&request, count);
+    for (int k = first_arg; k < argc; k++) add_string(&request, argv[k]);
+    for (char **e = environ; e && *e; e++) add_string(&request, *e);
+    strbuf_free(&script);
+
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || socket_address(path, &addr) != 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "xsh: %s: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    RequestHeader h = {SERVER_MAGIC, (uint32_t)request.len};
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = {&h, sizeof(h)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(c), fds, sizeof(fds));
+
+    int32_t status;
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(h) ||
+        send_full(fd, request.data, request.len) != 0 || read_full(fd, &status, sizeof(status)) != 0) {
+        fprintf(stderr, "xsh: %s: request failed\n", path);
+        status = EXIT_FAILURE;
+    }
+    strbuf_free(&request);
+    close(fd);
+    return status;
+}
@@ -33,59 +33,23 @@ void handle_signal(int sig) {
 void print_error(const char *format, ...) {
     va_list args;
     va_start(args, format);
-    fprintf(stderr, "%sError:%s ", COLOR_RED, COLOR_RESET);
-    vfprintf(stderr, format, args);
-    fprintf(stderr, "\n");
+    out_printf(STDERR_FILENO, "%sError:%s ", COLOR_RED, COLOR_RESET);
+    out_vprintf(STDERR_FILENO, format, args);
+    out_putc(STDERR_FILENO, '\n');
     va_end(args);
+    out_flush();
 }
 
 // Print success message
 void print_success(const char *format, ...) {
     va_list args;
     va_start(args, format);
-    fprintf(stdout, "%sSuccess:%s ", COLOR_GREEN, COLOR_RESET);
-    vfprintf(stdout, format, args);
-    fprintf(stdout, "\n");
+    out_printf(STDOUT_FILENO, "%sSuccess:%s ", COLOR_GREEN, COLOR_RESET);
+    out_vprintf(STDOUT_FILENO, format, args);
+    out_putc(STDOUT_FILENO, '\n');
     va_end(args);
 }
 
-// Parse command into arguments
-char **parse_command(char *command, int *argc) {
-    if (!command || !argc) return NULL;
-    
-    char **args = malloc(MAX_ARGS * sizeof(char *));
-    if (!args) {
-        print_error("malloc: failed to allocate memory");
-        return NULL;
-    }
-    
-    *argc = 0;
-    char *cmd = strdup(command);
-    if (!cmd) {
-        free(args);
-        return NULL;
-    }
-
-    char *token = strtok(cmd, " \t\n\r");
-    while (token && *argc < MAX_ARGS - 1) {
-        args[*argc] = strdup(token);
-        if (!args[*argc]) {
-            for (int i = 0; i < *argc; i++) {
-                free(args[i]);
-            }
-            free(args);
-            free(cmd);
-            return NULL;
-        }
-        (*argc)++;
-        token = strtok(NULL, " \t\n\r");
-    }
-    args[*argc] = NULL;
-    
-    free(cmd);
-    return args;
-}
-
 // Get shortened path (replace home directory with ~)
 char *get_short_path(const char *path) {
     static char short_path[MAX_PATH_LENGTH];
@@ -172,6 +136,8 @@ void remove_alias(const char *name) {
 
 // Update background jobs
 void update_jobs(void) {
+    queue_pump();
+    joblog_pump();
     for (int i = 0; i < config.job_count; i++) {
         if (!config.jobs[i].running) continue;
 
@@ -183,46 +149,82 @@ void update_jobs(void) {
             continue;
         } else if (result == config.jobs[i].pid) {
             // Process finished
-            config.jobs[i].running = 0;
-            config.jobs[i].status = WEXITSTATUS(status);
-            
+            Job *job = &config.jobs[i];
+            job->running = 0;
+            job->status = WEXITSTATUS(status);
+
+            // Anything the job left behind keeps its cgroup alive
+            char usage[128] = "";
+            if (job->cgroup) {
+                cgroup_stats(job->cgroup, &job->usage);
+                cgroup_remove(job->cgroup);
+                cgroup_format(&job->usage, usage, sizeof(usage));
+            }
+
             // Print job completion status
-            printf("[%d] %s %s (%s)\n",
+            out_printf(STDOUT_FILENO, "[%d] %s %s (%s)%s%s\n",
                 i + 1,
-                config.jobs[i].command,
+                job->command,
                 "Done",
-                config.jobs[i].status == 0 ? "success" : "failed");
+                job->status == 0 ? "success" : "failed",
+                usage[0] ? "  " : "", usage);
         }
     }
+    joblog_trim();
+    cgroup_sweep();
 }
 
-// Show background jobs
-void show_jobs(void) {
+// Show background jobs; the long format adds the pid and the resources
+// used by the job's cgroup
+void show_jobs(int long_format) {
     for (int i = 0; i < config.job_count; i++) {
-        printf("[%d] %s%s%s  %s  %s\n",
+        Job *job = &config.jobs[i];
+        char pid[24] = "", usage[160] = "";
+        if (long_format) {
+            CgroupStats live;
+            snprintf(pid, sizeof(pid), "%d ", (int)job->pid);
+            if (job->running && job->cgroup && cgroup_stats(job->cgroup, &live) == 0) {
+                cgroup_format(&live, usage, sizeof(usage));
+            } else if (!job->running && job->cgroup) {
+                cgroup_format(&job->usage, usage, sizeof(usage));
+            }
+            if (job->log) {
+                size_t len = strlen(usage);
+                snprintf(usage + len, sizeof(usage) - len, "%slogged %s", len ? ", " : "",
+                         format_size((off_t)joblog_size(job->log)));
+            }
+        }
+        out_printf(STDOUT_FILENO, "[%d] %s%s%s%s  %s  %s%s%s\n",
                i + 1,
-               config.jobs[i].running ? COLOR_GREEN : COLOR_RED,
-               config.jobs[i].running ? "Running" : "Done",
+               pid,
+               job->running ? COLOR_GREEN : COLOR_RED,
+               job->running ? "Running" : "Done",
                COLOR_RESET,
-               config.jobs[i].running ? "" : (config.jobs[i].status == 0 ? "(success)" : "(failed)"),
-               config.jobs[i].command);
+               job->running ? "" : (job->status == 0 ? "(success)" : "(failed)"),
+               job->command,
+               usage[0] ? "  " : "", usage);
     }
+    queue_show();
 }
 
-// Add background job
-void add_job(pid_t pid, char *command) {
-    if (!command) return;
+// Add background job. Returns -1 if there is no room for it, which
+// exec_background checks for before it forks.
+int add_job(pid_t pid, char *command, unsigned cgroup, JobLog *log) {
+    if (!command) return -1;
 
     if (config.job_count >= MAX_ARGS) {
         print_error("Maximum number of background jobs reached");
-        return;
+        return -1;
     }
 
     config.jobs[config.job_count].pid = pid;
     config.jobs[config.job_count].command = strdup(command);
     config.jobs[config.job_count].running = 1;
     config.jobs[config.job_count].status = 0;
+    config.jobs[config.job_count].cgroup = cgroup;
+    config.jobs[config.job_count].log = log;
     config.job_count++;
+    return 0;
 }
 
 // Get background job by ID
@@ -240,7 +242,7 @@ char *command_generator(const char *text, int state) {
     static char **builtin_commands = NULL;
     static const char *builtin_list[] = {
         "cd", "pwd", "exit", "clear", "help", "history", "alias", "jobs",
-        NULL
+        "set", "unset", "export", NULL
     };
 
     // Initialize on first call
@@ -396,4 +398,168 @@ char *format_time(time_t t) {
     struct tm *tm = localtime(&t);
     strftime(buf, sizeof(buf), "%b %d %H:%M", tm);
     return buf;
-}
\ No newline at end of file
+}
+// Duplicate string, returning an empty string instead of NULL
+char *strdup_safe(const char *str) {
+    char *copy = strdup(str ? str : "");
+    if (!copy) {
+        print_error("malloc: failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    return copy;
+}
+
+// Free a NULL-terminated array of strings
+void free_array(char **array) {
+    if (!array) return;
+    for (int i = 0; array[i]; i++) {
+        free(array[i]);
+    }
+    free(array);
+}
+
+// Growable string buffer
+int strbuf_reserve(StrBuf *b, size_t extra) {
+    if (b->len + extra + 1 <= b->cap) return 0;
+
+    size_t cap = b->cap ? b->cap : 64;
+    while (cap < b->len + extra + 1) cap *= 2;
+    char *data = realloc(b->data, cap);
+    if (!data) {
+        print_error("malloc: failed to allocate memory");
+        return -1;
+    }
+    b->data = data;
+    b->cap = cap;
+    return 0;
+}
+
+int strbuf_append(StrBuf *b, const char *s, size_t n) {
+    if (strbuf_reserve(b, n) != 0) return -1;
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+    b->data[b->len] = '\0';
+    return 0;
+}
+
+int strbuf_putc(StrBuf *b, char c) {
+    if (strbuf_reserve(b, 1) != 0) return -1;
+    b->data[b->len++] = c;
+    b->data[b->len] = '\0';
+    return 0;
+}
+
+void strbuf_reset(StrBuf *b) {
+    b->len = 0;
+    if (b->data) b->data[0] = '\0';
+}
+
+void strbuf_free(StrBuf *b) {
+    free(b->data);
+    b->data = NULL;
+    b->len = 0;
+    b->cap = 0;
+}
+
+// Bump allocator for per-command strings. Resetting keeps the largest
+// block, so steady-state command execution does no malloc at all.
+#define ARENA_MIN_BLOCK 4096
+
+void *arena_alloc(Arena *a, size_t n) {
+    n = (n + 15) & ~(size_t)15;
+
+    ArenaBlock *block = a->head;
+    if (!block || block->size - block->used < n) {
+        size_t size = block ? block->size * 2 : ARENA_MIN_BLOCK;
+        while (size < n) size *= 2;
+        block = malloc(sizeof(ArenaBlock) + size);
+        if (!block) {
+            print_error("malloc: failed to allocate memory");
+            return NULL;
+        }
+        block->next = a->head;
+        block->size = size;
+        block->used = 0;
+        a->head = block;
+    }
+
+    void *p = block->data + block->used;
+    block->used += n;
+    return p;
+}
+
+char *arena_strndup(Arena *a, const char *s, size_t n) {
+    char *copy = arena_alloc(a, n + 1);
+    if (!copy) return NULL;
+    memcpy(copy, s, n);
+    copy[n] = '\0';
+    return copy;
+}
+
+void arena_reset(Arena *a) {
+    if (!a->head) return;
+    ArenaBlock *block = a->head->next;
+    while (block) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    a->head->next = NULL;
+    a->head->used = 0;
+}
+
+// Remember the current allocation point so nested commands can release
+// what they used without disturbing their caller's strings
+ArenaMark arena_mark(Arena *a) {
+    ArenaMark mark = {a->head, a->head ? a->head->used : 0};
+    return mark;
+}
+
+void arena_release(Arena *a, ArenaMark mark) {
+    if (!mark.block) {
+        arena_reset(a);
+        return;
+    }
+    while (a->head != mark.block) {
+        ArenaBlock *next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+    a->head->used = mark.used;
+}
+
+void arena_free(Arena *a) {
+    arena_reset(a);
+    free(a->head);
+    a->head = NULL;
+}
+
+// Argument vector builder; argv is kept NULL-terminated
+int argv_push(ArgvBuilder *b, char *arg) {
+    if (b->flush && !(arg = b->flush(b, arg))) return -1;
+    if (b->argc + 2 > b->capacity) {
+        int cap = b->capacity ? b->capacity * 2 : 16;
+        char **argv = realloc(b->argv, cap * sizeof(char *));
+        if (!argv) {
+            print_error("malloc: failed to allocate memory");
+            return -1;
+        }
+        b->argv = argv;
+        b->capacity = cap;
+    }
+    b->argv[b->argc++] = arg;
+    b->argv[b->argc] = NULL;
+    return 0;
+}
+
+void argv_reset(ArgvBuilder *b) {
+    b->argc = 0;
+    if (b->argv) b->argv[0] = NULL;
+}
+
+void argv_free(ArgvBuilder *b) {
+    free(b->argv);
+    b->argv = NULL;
+    b->argc = 0;
+    b->capacity = 0;
+}
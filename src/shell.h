@@ -13,6 +13,7 @@
 #include <time.h>
 #include <errno.h>
 #include <signal.h>
+#include <poll.h>
 #include <dirent.h>
 #include <termios.h>
 #include <stdarg.h>
@@ -65,7 +66,9 @@
 // Exit codes
 #define EXIT_SUCCESS 0
 #define EXIT_FAILURE 1
+#define EXIT_USAGE 2
 #define EXIT_NOT_FOUND 127
+#define EXIT_DEFER (-1)    // from a builtin: run the external command instead
 
 // Structures
 typedef struct {
@@ -73,6 +76,26 @@ typedef struct {
     char *value;
 } Alias;
 
+// Resource usage of a job's cgroup; -1 where unknown
+typedef struct {
+    long long usage_usec;
+    long long user_usec;
+    long long system_usec;
+    long long memory_peak;
+} CgroupStats;
+
+// Limits set by the limit prefix; 0 for none
+typedef struct {
+    long long memory;       // bytes
+    long long cpu_quota;    // microseconds per 100ms period
+    long long read_bps, write_bps;
+    dev_t io_dev;           // device the I/O limits apply to
+    long long pids;
+} CgroupLimits;
+
+// Captured output of a background job, see joblog.c
+typedef struct JobLog JobLog;
+
 typedef struct {
     pid_t pid;
     char *command;
@@ -80,6 +103,9 @@ typedef struct {
     int running;
     time_t start_time;
     char *cwd;
+    unsigned cgroup;        // 0 if the job has none
+    CgroupStats usage;      // read when the job is done
+    JobLog *log;            // NULL if the output is not captured
 } Job;
 
 typedef struct {
@@ -92,6 +118,10 @@ typedef struct {
     int color_prompt;
     int verbose_mode;
     int debug_mode;
+    int last_status;
+    pid_t shell_pid;
+    pid_t last_bg_pid;
+    int interactive;
 } Config;
 
 // IO redirection structure
@@ -103,14 +133,304 @@ typedef struct {
     int append_error;
 } Redirection;
 
-// Command structure
+// Growable string buffer
 typedef struct {
-    char **args;
+    char *data;
+    size_t len;
+    size_t cap;
+} StrBuf;
+
+// Bump allocator for per-command strings
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *head;
+} Arena;
+
+// NULL-terminated argument vector under construction. If flush is set
+// it sees every argument before it is pushed and may run and drop the
+// pending ones; it returns the argument to push, or NULL on error.
+typedef struct ArgvBuilder {
+    char **argv;
     int argc;
-    Redirection redirect;
-    int background;
-    char *raw_command;
-} Command;
+    int capacity;
+    char *(*flush)(struct ArgvBuilder *b, char *arg);
+    void *flush_ctx;
+} ArgvBuilder;
+
+// Lexer tokens are spans into the input
+#define TOK_WORD    1
+#define TOK_OP      2
+#define TOK_NEWLINE 3
+#define TOK_EOF     4
+#define TOK_ARITH   5   // body of (( ... ))
+
+#define WORD_QUOTED 0x01   // contains quotes or backslashes
+#define WORD_DOLLAR 0x02   // contains '$' or '`'
+#define WORD_TILDE  0x04   // starts with '~'
+#define WORD_ASSIGN 0x08   // NAME=value
+#define WORD_GLOB   0x10   // contains unquoted pattern characters
+#define WORD_BRACE  0x20   // may contain a brace expansion
+
+// Operators
+enum {
+    OP_PIPE, OP_AND_IF, OP_OR_IF, OP_AMP, OP_SEMI, OP_DSEMI, OP_SEMIAND, OP_DSEMIAND,
+    OP_LPAREN, OP_RPAREN,
+    OP_LESS, OP_GREAT, OP_DGREAT, OP_LESSAND, OP_GREATAND, OP_DLESS, OP_DLESSDASH,
+    OP_TLESS, OP_LESSGREAT, OP_CLOBBER, OP_ANDGREAT, OP_ANDDGREAT
+};
+
+typedef struct {
+    int type;
+    int op;             // TOK_OP
+    int fd;             // IO number before a redirection, or -1
+    unsigned flags;     // TOK_WORD
+    const char *text;
+    size_t len;
+    int lineno;
+} Token;
+
+typedef struct {
+    Token *items;
+    int count;
+    int capacity;
+} TokenList;
+
+// Input being lexed; aliases push their value on top of the base input
+typedef struct {
+    const char *src;
+    size_t len;
+    size_t pos;
+    const char *alias;  // alias name, for recursion checks
+} LexSource;
+
+#define LEX_MAX_DEPTH 16
+
+typedef struct {
+    LexSource stack[LEX_MAX_DEPTH];
+    int depth;
+    int incomplete;     // input ended inside a quote or construct
+    int lineno;
+    int regex;          // next word is the right side of =~
+} Lexer;
+
+// Syntax tree. Nodes and words live in the arena of the Script that
+// parsed them.
+typedef struct {
+    char *text;
+    size_t len;
+    unsigned flags;
+} Word;
+
+#define REDIR_IN          1   // <
+#define REDIR_OUT         2   // > and >|
+#define REDIR_APPEND      3   // >>
+#define REDIR_RDWR        4   // <>
+#define REDIR_DUP         5   // <& and >&
+#define REDIR_HEREDOC     6   // << and <<-
+#define REDIR_HERESTRING  7   // <<<
+#define REDIR_BOTH        8   // &>
+#define REDIR_BOTH_APPEND 9   // &>>
+
+typedef struct Redirect {
+    int type;
+    int fd;
+    Word target;        // file name, fd, or here-document body
+    int literal;        // here-document delimiter was quoted
+    int strip_tabs;
+    struct Redirect *next;
+} Redirect;
+
+typedef struct Node Node;
+typedef struct Script Script;
+typedef struct ArithExpr ArithExpr;
+
+// Compiled arithmetic expressions cached on a node: the word as written,
+// and the last expansion of it for words that need textual expansion
+typedef struct {
+    ArithExpr *raw;
+    int attached;
+    char *text;
+    size_t len;
+    ArithExpr *expr;
+} ArithCache;
+
+// [[ expression ]]
+#define COND_AND    1
+#define COND_OR     2
+#define COND_NOT    3
+#define COND_UNARY  4   // -op word
+#define COND_BINARY 5   // word op word
+#define COND_WORD   6   // true if non-empty
+
+// Binary operators; unary ones are stored as their letter
+enum {
+    COND_STR_EQ = 1, COND_STR_NE, COND_MATCH, COND_STR_LT, COND_STR_GT,
+    COND_INT_EQ, COND_INT_NE, COND_INT_LT, COND_INT_LE, COND_INT_GT, COND_INT_GE,
+    COND_NEWER, COND_OLDER, COND_SAME_FILE
+};
+
+typedef struct CondRegex CondRegex;
+
+typedef struct CondExpr {
+    int type;
+    int op;
+    struct CondExpr *left, *right;
+    Word word[2];
+    CondRegex *regex;   // compiled =~ pattern, keyed by its expanded text
+} CondExpr;
+
+#define CASE_FALLTHROUGH 1   // ;&
+#define CASE_CONTINUE    2   // ;;&
+
+typedef struct {
+    Word *patterns;
+    int count;
+    Node *body;
+    int fallthrough;
+} CaseItem;
+
+#define NODE_COMMAND   1
+#define NODE_PIPELINE  2
+#define NODE_AND       3
+#define NODE_OR        4
+#define NODE_LIST      5
+#define NODE_SUBSHELL  6
+#define NODE_GROUP     7
+#define NODE_IF        8
+#define NODE_WHILE     9
+#define NODE_UNTIL     10
+#define NODE_FOR       11
+#define NODE_ARITH_FOR 12
+#define NODE_CASE      13
+#define NODE_FUNCTION  14
+#define NODE_ARITH     15
+#define NODE_COND      16
+
+#define NODE_BACKGROUND 0x01   // followed by '&'
+#define NODE_NEGATE     0x02   // preceded by '!'
+
+struct Node {
+    int type;
+    int flags;
+    int lineno;
+    Script *owner;
+    Redirect *redirects;
+    char *text;         // source text of background commands
+    union {
+        struct { Word *words; int count; } cmd;
+        struct { Node **items; int count; } list;
+        struct { Node *left, *right; } binary;
+        struct { Node *cond, *then_part, *else_part; } if_;
+        struct { Node *cond, *body; } loop;
+        struct {
+            Word name;
+            Word *words;
+            int count;
+            int has_in;
+            Node *body;
+            Word jobs;          // for -P jobs: iterations run in parallel
+            int unordered;      // -u: output as iterations finish
+        } for_;
+        struct { Word expr[3]; ArithCache cache[3]; Node *body; } arith_for;
+        struct { Word expr; ArithCache cache; } arith;
+        struct { CondExpr *expr; } cond;
+        struct { Word subject; CaseItem *items; int count; } case_;
+        struct { char *name; Node *body; } func;
+        struct { Node *body; } group;
+    } u;
+};
+
+typedef struct ScriptCleanup {
+    void *ptr;
+    void (*fn)(void *);
+    struct ScriptCleanup *next;
+} ScriptCleanup;
+
+// A parsed top-level command, reference counted so function bodies
+// outlive the command that defined them
+struct Script {
+    Arena arena;
+    int refs;
+    ScriptCleanup *cleanups;
+};
+
+#define PARSE_OK         0
+#define PARSE_EOF        1
+#define PARSE_ERROR      2
+#define PARSE_INCOMPLETE 3
+
+typedef struct {
+    Lexer lx;
+    Token tok;
+    int have_tok;
+    Script *script;
+    int status;
+    Redirect *pending[16];   // here-documents waiting for their bodies
+    int npending;
+    const char *last_end;    // end of the last token consumed
+} Parser;
+
+// Saved positional parameters of a function caller
+typedef struct {
+    char **args;
+    int count;
+} PositionalSave;
+
+// Position in an arena to roll back to
+typedef struct {
+    ArenaBlock *block;
+    size_t used;
+} ArenaMark;
+
+// Compiled shell pattern
+typedef struct Pattern Pattern;
+
+#define PATTERN_REVERSE 0x01   // match right to left, for suffix removal
+
+// Indexed or associative array value
+typedef struct Array Array;
+
+// One file operation of a batch run by file_ops_run
+enum { FOP_STATX };
+
+typedef struct {
+    int op;
+    int fd;             // directory path is relative to
+    const char *path;
+    int flags;          // statx flags
+    void *buf;          // a struct statx
+    unsigned len;       // the statx field mask
+    long result;        // 0 or -errno
+} FileOp;
+
+// CPU affinity, scheduling policy, nice level and I/O priority for
+// pin and renice-job
+#define SCHED_MAX_CPUS 1024
+
+#define SCHED_SET_CPUS   0x01
+#define SCHED_SET_NICE   0x02
+#define SCHED_SET_POLICY 0x04
+#define SCHED_SET_IO     0x08
+
+typedef struct {
+    int set;            // SCHED_SET_* of the settings given
+    unsigned long cpus[SCHED_MAX_CPUS / (8 * sizeof(unsigned long))];
+    int nice;
+    int policy;
+    int rt_priority;
+    int io_class;
+    int io_level;
+} SchedAttrs;
+
+// Variable flags
+#define VAR_EXPORT   0x01
+#define VAR_READONLY 0x02
 
 // Global variables
 extern char current_dir[MAX_PATH_LENGTH];
@@ -128,13 +448,12 @@ void cleanup_shell(void);
 void handle_signal(int sig);
 
 // Command parsing and execution
-char **parse_command(char *command, int *argc);
-Command *parse_command_full(char *command);
 int execute_command(char *command);
-int execute_builtin(char **args);
+typedef int (*BuiltinFn)(char **args);
+BuiltinFn find_builtin(const char *name);
+int execute_builtin(BuiltinFn fn, char **args);
 int execute_external(char **args);
 char *find_command(const char *cmd);
-void free_command(Command *cmd);
 
 // Built-in commands
 int cmd_cd(char **args);
@@ -146,12 +465,30 @@ int cmd_history(char **args);
 int cmd_alias(char **args);
 int cmd_unalias(char **args);
 int cmd_jobs(char **args);
+int cmd_joblog(char **args);
+int cmd_files(char **args);
+int cmd_where(char **args);
+int cmd_sort_by(char **args);
+int cmd_select(char **args);
+int cmd_group_by(char **args);
 int cmd_fg(char **args);
 int cmd_bg(char **args);
 int cmd_kill(char **args);
 int cmd_set(char **args);
 int cmd_unset(char **args);
+int cmd_export(char **args);
 int cmd_source(char **args);
+int cmd_local(char **args);
+int cmd_declare(char **args);
+int cmd_echo(char **args);
+int cmd_cat(char **args);
+int cmd_tee(char **args);
+int cmd_cp(char **args);
+int cmd_queue(char **args);
+int cmd_renice_job(char **args);
+int cmd_timeout(char **args);
+int cmd_watch(char **args);
+int cmd_on_change(char **args);
 
 // Path handling
 char *get_short_path(const char *path);
@@ -176,8 +513,8 @@ void save_aliases(void);
 
 // Job control
 void update_jobs(void);
-void show_jobs(void);
-void add_job(pid_t pid, char *command);
+void show_jobs(int long_format);
+int add_job(pid_t pid, char *command, unsigned cgroup, JobLog *log);
 Job *get_job(int job_id);
 void remove_job(int job_id);
 void cleanup_jobs(void);
@@ -198,11 +535,204 @@ char *format_time(time_t t);
 char *get_file_owner(uid_t uid);
 char *get_file_group(gid_t gid);
 
+// Shell variables
+void vars_init(void);
+int is_valid_name(const char *name, size_t len);
+const char *var_lookup(const char *name, size_t len);
+int var_flags(const char *name);
+int var_assign(const char *name, size_t len, const char *value, int flags);
+int var_set(const char *name, const char *value, int flags);
+int var_remove(const char *name);
+void vars_print(int required_flags, const char *prefix);
+void set_positional(int argc, char **argv);
+const char *get_positional(int n);
+int positional_count(void);
+void set_shell_name(const char *name);
+int var_get_number(const char *name, size_t len, long long *out);
+int var_set_number(const char *name, size_t len, long long value);
+void positional_push(int argc, char **argv, PositionalSave *save);
+void positional_pop(PositionalSave *save);
+int var_push_scope(void);
+void var_pop_scope(void);
+int var_scope_depth(void);
+int var_make_local(const char *name, size_t len);
+Array *var_array(const char *name, size_t len);
+Array *var_make_array(const char *name, size_t len, int assoc);
+int var_set_array(const char *name, size_t len, Array *a);
+
+// Arrays
+const char *str_intern(const char *s, size_t len);
+void str_release(const char *s);
+size_t str_length(const char *s);
+Array *array_new(int assoc);
+Array *array_copy(const Array *a);
+void array_clear(Array *a);
+void array_free(Array *a);
+int array_is_assoc(const Array *a);
+size_t array_count(const Array *a);
+long long array_size(const Array *a);
+const char *array_get(const Array *a, long long index);
+const char *array_lookup(const Array *a, const char *key, size_t len);
+int array_set(Array *a, long long index, const char *value, size_t len);
+int array_store(Array *a, const char *key, size_t klen, const char *value, size_t vlen);
+int array_append(Array *a, const char *value, size_t len);
+void array_unset(Array *a, long long index);
+void array_delete(Array *a, const char *key, size_t len);
+int array_next(const Array *a, size_t *pos, const char **key, long long *index,
+               const char **value);
+
+// Lexer
+void lexer_init(Lexer *lx, const char *src, size_t len);
+int lexer_push_alias(Lexer *lx, const char *name, const char *value);
+int lexer_in_alias(const Lexer *lx, const char *name);
+int lex_next(Lexer *lx, Token *tok);
+int lex_heredoc(Lexer *lx, const char *delim, size_t dlen, int strip_tabs,
+                Arena *arena, char **body, size_t *blen);
+int lex_line(const char *line, size_t len, TokenList *list);
+void token_list_free(TokenList *list);
+size_t skip_param_braces(const char *s, size_t len);
+size_t skip_subscript(const char *s, size_t len);
+size_t skip_subst_parens(const char *s, size_t len);
+size_t skip_backquote(const char *s, size_t len);
+
+// Parser
+Script *script_new(void);
+void script_retain(Script *s);
+void script_release(Script *s);
+void script_attach(Script *s, void *ptr, void (*fn)(void *));
+void parser_init(Parser *p, const char *src, size_t len);
+Node *parse_next(Parser *p);
+Node *parse_pipeline(Parser *p);
+Node *parse_program(const char *src, size_t len);
+
+// Execution
+int run_script(const char *text, size_t len);
+int run_input(const char *text, size_t len, int *status);
+int command_subst(const char *text, size_t len, StrBuf *out);
+int exec_node(Node *n);
+int exec_argv(char **args);
+pid_t fork_argv(char **args, int group);
+void terminal_reclaim(void);
+int wait_for(pid_t pid);
+int function_exists(const char *name);
+int function_remove(const char *name);
+int cmd_break(char **args);
+int cmd_continue(char **args);
+int cmd_return(char **args);
+
+// Arithmetic
+#define ARITH_TEXTUAL 1     // an operand needs textual expansion first
+
+ArithExpr *arith_compile(const char *text, size_t len);
+int arith_evaluate(ArithExpr *e, long long *result);
+ArithExpr *arith_cached(const char *text, size_t len, int quiet);
+void arith_free(ArithExpr *e);
+int arith_parse_number(const char *s, size_t len, long long *out);
+int arith_eval_word(ArithCache *cache, Script *owner, const Word *w,
+                    Arena *arena, long long *result);
+
+// Word expansion
+int expand_word(char *word, size_t len, unsigned flags, Arena *arena, ArgvBuilder *out);
+char *expand_string(const char *word, size_t len, Arena *arena);
+char *expand_pattern(const char *word, size_t len, Arena *arena);
+char *expand_regex(const char *word, size_t len, Arena *arena);
+char *expand_heredoc(const char *body, size_t len, Arena *arena);
+int expand_subscript(const char *sub, size_t len, Arena *arena, long long *index);
+int assign_word(const char *word, size_t len, Arena *arena);
+
+// Pattern matching
+Pattern *pattern_compile(const char *pat, size_t len, int flags);
+void pattern_free(Pattern *p);
+const Pattern *pattern_cached(const char *pat, size_t len, int flags);
+int pattern_match(const Pattern *p, const char *s, size_t len);
+long pattern_match_prefix(const Pattern *p, const char *s, size_t len, int longest);
+long pattern_match_suffix(const Pattern *p, const char *s, size_t len, int longest);
+int pattern_has_magic(const char *s, size_t len);
+
+// Conditional expressions
+int cond_evaluate(CondExpr *e, Script *owner, Arena *arena);
+void stat_cache_clear(void);
+
+// Data copying
+int copy_fd(int in, int out);
+
+// Command queue
+void queue_pump(void);
+void queue_show(void);
+void queue_forget(void);
+int queue_active(void);
+int queue_pollfds(struct pollfd *pfds, int max, int *timeout);
+
+// Job cgroups
+int cgroup_option(CgroupLimits *l, const char *opt, const char *value);
+int cgroup_create(const CgroupLimits *l, unsigned *id);
+int cgroup_enter(unsigned id);
+void cgroup_forget(void);
+void cgroup_place(unsigned id, pid_t pid);
+int cgroup_limit_self(const CgroupLimits *l);
+int cgroup_stats(unsigned id, CgroupStats *s);
+void cgroup_remove(unsigned id);
+void cgroup_sweep(void);
+void cgroup_format(const CgroupStats *s, char *buf, size_t size);
+
+// Job logs
+int joblog_wanted(void);
+JobLog *joblog_create(int *write_fd);
+void joblog_free(JobLog *log);
+void joblog_pump(void);
+void joblog_trim(void);
+int joblog_poll(int fd, int timeout);
+void joblog_wait(pid_t pid);
+int joblog_getc(FILE *stream);
+void joblog_forget(void);
+size_t joblog_size(JobLog *log);
+
+// Tables
+int table_stages(Node **items, int count);
+void table_begin(void);
+void table_end(int render);
+
+// Command spawner
+void zygote_start(void);
+pid_t zygote_spawn(const char *path, char **args);
+void zygote_track_fd(int fd);
+
+// Server mode, and the requests it and the spawner read and write
+int server_run(const char *path, const char *setup);
+int client_run(const char *path, int argc, char **argv);
+int read_full(int fd, void *buf, size_t len);
+int send_full(int sock, const void *buf, size_t len);
+char *next_string(char **p, char *end);
+int add_string(StrBuf *b, const char *s);
+
+// Scheduling attributes
+int sched_option(SchedAttrs *a, const char *cmd, const char *opt, const char *value);
+int sched_cpus(SchedAttrs *a, const char *cmd, const char *spec);
+int sched_apply(const SchedAttrs *a, const char *cmd);
+
+// Batched file operations
+void file_ops_run(FileOp *ops, size_t count);
+
+// Pathname expansion
+int glob_expand(const char *pat, size_t len, Arena *arena, ArgvBuilder *out);
+void glob_cache_clear(void);
+
 // Environment variables
 char *get_env(const char *name);
 int set_env(const char *name, const char *value, int overwrite);
 int unset_env(const char *name);
 
+// Builtin output
+void out_write(int fd, const char *s, size_t n);
+void out_puts(int fd, const char *s);
+void out_putc(int fd, char c);
+void out_printf(int fd, const char *format, ...);
+void out_vprintf(int fd, const char *format, va_list args);
+void out_flush(void);
+void out_done(void);
+int out_direct(int fd);
+StrBuf *out_capture(StrBuf *target);
+
 // String utilities
 void print_error(const char *format, ...);
 void print_success(const char *format, ...);
@@ -211,6 +741,20 @@ char *trim_whitespace(char *str);
 char *strdup_safe(const char *str);
 char **split_string(const char *str, const char *delim, int *count);
 void free_array(char **array);
+int strbuf_reserve(StrBuf *b, size_t extra);
+int strbuf_append(StrBuf *b, const char *s, size_t n);
+int strbuf_putc(StrBuf *b, char c);
+void strbuf_reset(StrBuf *b);
+void strbuf_free(StrBuf *b);
+void *arena_alloc(Arena *a, size_t n);
+char *arena_strndup(Arena *a, const char *s, size_t n);
+void arena_reset(Arena *a);
+ArenaMark arena_mark(Arena *a);
+void arena_release(Arena *a, ArenaMark mark);
+void arena_free(Arena *a);
+int argv_push(ArgvBuilder *b, char *arg);
+void argv_reset(ArgvBuilder *b);
+void argv_free(ArgvBuilder *b);
 
 // Prompt generation
 char *generate_prompt(void);
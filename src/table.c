@@ -0,0 +1,690 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "shell.h"
+
+// Tables: structured pipelines.
+//
+// A pipeline that starts with a table source such as files and goes on
+// with where, sort-by, select or group-by passes a table from stage to
+// stage instead of text. Those stages run inside the shell one after
+// another, as a single stage of the pipeline, each working on whole
+// columns: where scans one column and compacts the others, sort-by
+// sorts a row order once and gathers every column by it, select only
+// rearranges columns. The table is rendered as text once, at the end of
+// its run of stages, for the terminal or for the text stages after it.
+// A source used on its own renders straight away.
+
+#define TABLE_MAX_COLUMNS 16
+#define TABLE_MIN_ROWS    256
+
+typedef enum { COL_STRING, COL_INT, COL_SIZE, COL_TIME, COL_MODE } ColumnType;
+
+typedef union {
+    long long num;
+    const char *str;    // in the table's arena
+} Cell;
+
+typedef struct {
+    const char *name;
+    ColumnType type;
+    Cell *cells;
+} Column;
+
+typedef struct {
+    Column cols[TABLE_MAX_COLUMNS];
+    int ncols;
+    size_t rows, cap;
+    Arena strings;
+} Table;
+
+// The table being passed along a pipeline, while one runs
+static int session_active;
+static Table *session_table;
+
+static Table *table_new(void) {
+    Table *t = calloc(1, sizeof(Table));
+    if (!t) print_error("malloc: failed to allocate memory");
+    return t;
+}
+
+static void table_free(Table *t) {
+    if (!t) return;
+    for (int c = 0; c < t->ncols; c++) free(t->cols[c].cells);
+    arena_free(&t->strings);
+    free(t);
+}
+
+static int table_add_column(Table *t, const char *name, ColumnType type) {
+    if (t->ncols == TABLE_MAX_COLUMNS) return -1;
+    Column *col = &t->cols[t->ncols];
+    col->cells = t->cap ? malloc(t->cap * sizeof(Cell)) : NULL;
+    if (t->cap && !col->cells) return -1;
+    col->name = name;
+    col->type = type;
+    return t->ncols++;
+}
+
+// Make room for one more row
+static int table_reserve(Table *t) {
+    if (t->rows < t->cap) return 0;
+    size_t cap = t->cap ? t->cap * 2 : TABLE_MIN_ROWS;
+    for (int c = 0; c < t->ncols; c++) {
+        Cell *grown = realloc(t->cols[c].cells, cap * sizeof(Cell));
+        if (!grown) {
+            print_error("malloc: failed to allocate memory");
+            return -1;
+        }
+        t->cols[c].cells = grown;
+    }
+    t->cap = cap;
+    return 0;
+}
+
+static int table_find(Table *t, const char *cmd, const char *name) {
+    for (int c = 0; c < t->ncols; c++) {
+        if (strcmp(t->cols[c].name, name) == 0) return c;
+    }
+    print_error("%s: %s: no such column", cmd, name);
+    return -1;
+}
+
+// Text for one cell. Uses a static buffer for the numeric types.
+static const char *cell_text(const Column *col, size_t row) {
+    static char buf[32];
+    long long v = col->cells[row].num;
+    switch (col->type) {
+        case COL_STRING:
+            return col->cells[row].str;
+        case COL_INT:
+            snprintf(buf, sizeof(buf), "%lld", v);
+            return buf;
+        case COL_SIZE:
+            return format_size((off_t)v);
+        case COL_TIME:
+            return format_time((time_t)v);
+        case COL_MODE:
+            buf[0] = get_file_type((mode_t)v)[0];
+            get_permissions((mode_t)v, buf + 1);
+            return buf;
+    }
+    return "";
+}
+
+// Write the table as aligned text: a header, then a line for each row.
+// Numbers are right-aligned, text left-aligned.
+static void table_render(Table *t) {
+    if (t->rows == 0 || t->ncols == 0) return;
+    size_t width[TABLE_MAX_COLUMNS];
+    for (int c = 0; c < t->ncols; c++) {
+        width[c] = strlen(t->cols[c].name);
+        for (size_t r = 0; r < t->rows; r++) {
+            size_t len = strlen(cell_text(&t->cols[c], r));
+            if (len > width[c]) width[c] = len;
+        }
+    }
+    for (size_t r = 0; r <= t->rows; r++) {
+        for (int c = 0; c < t->ncols; c++) {
+            Column *col = &t->cols[c];
+            // The header is row 0
+            const char *text = r == 0 ? col->name : cell_text(col, r - 1);
+            int last = c == t->ncols - 1;
+            if (col->type == COL_STRING && last) {
+                out_puts(STDOUT_FILENO, text);
+            } else if (col->type == COL_STRING) {
+                out_printf(STDOUT_FILENO, "%-*s  ", (int)width[c], text);
+            } else {
+                out_printf(STDOUT_FILENO, "%*s%s", (int)width[c], text, last ? "" : "  ");
+            }
+        }
+        out_putc(STDOUT_FILENO, '\n');
+    }
+}
+
+// Hand a table made by a source to the next stage, or render it if the
+// source is not in a table pipeline
+static int table_emit(Table *t) {
+    if (session_active) {
+        table_free(session_table);
+        session_table = t;
+        return EXIT_SUCCESS;
+    }
+    table_render(t);
+    table_free(t);
+    return EXIT_SUCCESS;
+}
+
+// The table a filter works on
+static Table *table_input(const char *cmd) {
+    if (!session_table) {
+        print_error("%s: no table to read; use it in a pipeline after files", cmd);
+        return NULL;
+    }
+    return session_table;
+}
+
+// Builtins that take a table from the stage before
+static int is_table_filter(const char *name) {
+    return strcmp(name, "where") == 0 || strcmp(name, "sort-by") == 0 ||
+           strcmp(name, "select") == 0 || strcmp(name, "group-by") == 0;
+}
+
+static const char *table_command(const Node *n) {
+    if (n->type != NODE_COMMAND || n->flags || n->u.cmd.count == 0) return NULL;
+    const Word *w = &n->u.cmd.words[0];
+    return w->flags == 0 ? w->text : NULL;
+}
+
+// The number of leading stages of a pipeline that pass a table along:
+// a source followed by filters. 0 unless there are at least two. Only
+// the last of them may have redirections, which apply to the rendering
+// as well, as in `files | select name > out`.
+int table_stages(Node **items, int count) {
+    const char *name = table_command(items[0]);
+    if (!name || items[0]->redirects || strcmp(name, "files") != 0) return 0;
+    int k = 1;
+    while (k < count && (name = table_command(items[k])) && is_table_filter(name)) {
+        if (items[k++]->redirects) break;
+    }
+    return k > 1 ? k : 0;
+}
+
+void table_begin(void) {
+    session_active = 1;
+}
+
+// End a run of table stages, rendering what they produced if render is
+// set
+void table_end(int render) {
+    if (render && session_table) table_render(session_table);
+    table_free(session_table);
+    session_table = NULL;
+    session_active = 0;
+}
+
+// files
+
+static const char *type_name(mode_t mode) {
+    switch (mode & S_IFMT) {
+        case S_IFREG:  return "file";
+        case S_IFDIR:  return "dir";
+        case S_IFLNK:  return "link";
+        case S_IFCHR:  return "char";
+        case S_IFBLK:  return "block";
+        case S_IFSOCK: return "socket";
+        case S_IFIFO:  return "fifo";
+        default:       return "unknown";
+    }
+}
+
+enum { FILE_NAME, FILE_TYPE, FILE_MODE, FILE_SIZE, FILE_MODIFIED };
+
+static int files_add(Table *t, const char *name, size_t len, mode_t mode, off_t size, time_t mtime) {
+    if (table_reserve(t) != 0) return -1;
+    size_t r = t->rows;
+    const char *copy = arena_strndup(&t->strings, name, len);
+    if (!copy) return -1;
+    t->cols[FILE_NAME].cells[r].str = copy;
+    t->cols[FILE_TYPE].cells[r].str = type_name(mode);
+    t->cols[FILE_MODE].cells[r].num = mode;
+    t->cols[FILE_SIZE].cells[r].num = size;
+    t->cols[FILE_MODIFIED].cells[r].num = mtime;
+    t->rows++;
+    return 0;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Add the entries of the directory open as fd, named prefix, in order
+// of name. They are read first and then stated in one batch.
+static int files_scan(Table *t, int fd, char *prefix, size_t len, int all, int recurse) {
+    DIR *d = fdopendir(fd);
+    if (!d) {
+        close(fd);
+        return -1;
+    }
+    char **names = NULL;
+    size_t n = 0, cap = 0;
+    struct dirent *ent;
+    int status = 0;
+    while ((ent = readdir(d))) {
+        const char *name = ent->d_name;
+        if (name[0] == '.' && (!all || !name[1] || (name[1] == '.' && !name[2]))) continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            char **grown = realloc(names, cap * sizeof(char *));
+            if (!grown) break;
+            names = grown;
+        }
+        if (!(names[n] = strdup(name))) break;
+        n++;
+    }
+    struct statx *stx = ent ? NULL : malloc((n ? n : 1) * sizeof(struct statx));
+    FileOp *ops = stx ? malloc((n ? n : 1) * sizeof(FileOp)) : NULL;
+    if (!ops) {
+        print_error("malloc: failed to allocate memory");
+        status = -1;
+        goto out;
+    }
+
+    if (n > 1) qsort(names, n, sizeof(char *), compare_names);
+    for (size_t k = 0; k < n; k++) {
+        ops[k] = (FileOp){FOP_STATX, dirfd(d), names[k], AT_SYMLINK_NOFOLLOW, &stx[k],
+                          STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME, 0};
+    }
+    file_ops_run(ops, n);
+
+    for (size_t k = 0; k < n && status == 0; k++) {
+        // Entries gone since they were read are left out
+        if (ops[k].result < 0) continue;
+        size_t nlen = strlen(names[k]);
+        if (len + nlen + 2 > PATH_MAX) continue;
+        memcpy(prefix + len, names[k], nlen + 1);
+        mode_t mode = stx[k].stx_mode;
+        if (files_add(t, prefix, len + nlen, mode, (off_t)stx[k].stx_size, (time_t)stx[k].stx_mtime.tv_sec) != 0) {
+            status = -1;
+            break;
+        }
+        if (recurse && S_ISDIR(mode)) {
+            int sub = openat(dirfd(d), names[k], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            prefix[len + nlen] = '/';
+            if (sub >= 0 && files_scan(t, sub, prefix, len + nlen + 1, all, recurse) != 0) status = -1;
+        }
+    }
+out:
+    for (size_t k = 0; k < n; k++) free(names[k]);
+    free(names);
+    free(stx);
+    free(ops);
+    closedir(d);
+    return status;
+}
+
+// files [-aR] [path...]
+int cmd_files(char **args) {
+    int all = 0, recurse = 0, i = 1;
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        for (const char *o = args[i] + 1; *o; o++) {
+            if (*o == 'a') all = 1;
+            else if (*o == 'R') recurse = 1;
+            else {
+                print_error("files: -%c: invalid option", *o);
+                return EXIT_USAGE;
+            }
+        }
+    }
+
+    Table *t = table_new();
+    if (!t) return EXIT_FAILURE;
+    table_add_column(t, "name", COL_STRING);
+    table_add_column(t, "type", COL_STRING);
+    table_add_column(t, "mode", COL_MODE);
+    table_add_column(t, "size", COL_SIZE);
+    table_add_column(t, "modified", COL_TIME);
+
+    int status = EXIT_SUCCESS;
+    char path[PATH_MAX];
+    const char *dot[] = {".", NULL};
+    for (char **p = args[i] ? args + i : (char **)dot; *p; p++) {
+        struct stat st;
+        if (lstat(*p, &st) != 0) {
+            print_error("files: %s: %s", *p, strerror(errno));
+            status = EXIT_FAILURE;
+            continue;
+        }
+        if (!S_ISDIR(st.st_mode)) {
+            if (files_add(t, *p, strlen(*p), st.st_mode, st.st_size, st.st_mtime) != 0) status = EXIT_FAILURE;
+            continue;
+        }
+        // Entries are named relative to the directory given, or to . if
+        // none was
+        size_t len = 0;
+        if (args[i]) {
+            len = snprintf(path, sizeof(path), "%s%s", *p, (*p)[strlen(*p) - 1] == '/' ? "" : "/");
+            if (len >= sizeof(path)) continue;
+        }
+        int fd = open(*p, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0 || files_scan(t, fd, path, len, all, recurse) != 0) {
+            print_error("files: %s: %s", *p, strerror(errno));
+            status = EXIT_FAILURE;
+        }
+    }
+    table_emit(t);
+    return status;
+}
+
+// Parse text as a value of the given column type. Sizes take K, M, G
+// and T suffixes counting in 1024s; times are @epoch, YYYY-MM-DD[ HH:MM]
+// or an age such as 30s, 15m, 2h or 7d before now; modes are octal.
+static int parse_value(ColumnType type, const char *text, long long *value) {
+    char *end;
+    errno = 0;
+    switch (type) {
+        case COL_STRING:
+            return -1;
+        case COL_INT:
+            *value = strtoll(text, &end, 10);
+            return end == text || *end || errno ? -1 : 0;
+        case COL_MODE:
+            *value = strtoll(text, &end, 8);
+            return end == text || *end || errno ? -1 : 0;
+        case COL_SIZE: {
+            long long v = strtoll(text, &end, 10);
+            if (end == text || errno || v < 0) return -1;
+            const char *units = "KMGT";
+            const char *unit = *end ? strchr(units, toupper((unsigned char)*end)) : NULL;
+            if (*end && (!unit || (end[1] && !(toupper((unsigned char)end[1]) == 'B' && !end[2])))) return -1;
+            for (const char *u = units; unit && u <= unit; u++) {
+                if (v > LLONG_MAX / 1024) return -1;
+                v *= 1024;
+            }
+            *value = v;
+            return 0;
+        }
+        case COL_TIME: {
+            if (text[0] == '@') {
+                *value = strtoll(text + 1, &end, 10);
+                return end == text + 1 || *end || errno ? -1 : 0;
+            }
+            struct tm tm;
+            memset(&tm, 0, sizeof(tm));
+            const char *rest = strptime(text, "%Y-%m-%d", &tm);
+            if (rest) {
+                if (*rest && !(rest = strptime(rest, " %H:%M", &tm))) return -1;
+                if (*rest) return -1;
+                tm.tm_isdst = -1;
+                *value = mktime(&tm);
+                return 0;
+            }
+            long long age = strtoll(text, &end, 10);
+            if (end == text || errno || age < 0 || !*end || end[1]) return -1;
+            const char *units = "smhd";
+            static const long long seconds[] = {1, 60, 3600, 86400};
+            const char *unit = strchr(units, *end);
+            if (!unit) return -1;
+            *value = time(NULL) - age * seconds[unit - units];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+enum { OP_EQ, OP_NE, OP_LT, OP_LE, OP_GT, OP_GE };
+
+static int parse_op(const char *text) {
+    static const char *names[][2] = {
+        {"-eq", "=="}, {"-ne", "!="}, {"-lt", "<"}, {"-le", "<="}, {"-gt", ">"}, {"-ge", ">="},
+    };
+    for (int op = OP_EQ; op <= OP_GE; op++) {
+        if (strcmp(text, names[op][0]) == 0 || strcmp(text, names[op][1]) == 0) return op;
+    }
+    return strcmp(text, "=") == 0 ? OP_EQ : -1;
+}
+
+static int compare_holds(int op, int cmp) {
+    switch (op) {
+        case OP_EQ: return cmp == 0;
+        case OP_NE: return cmp != 0;
+        case OP_LT: return cmp < 0;
+        case OP_LE: return cmp <= 0;
+        case OP_GT: return cmp > 0;
+        case OP_GE: return cmp >= 0;
+    }
+    return 0;
+}
+
+// Keep the rows listed in keep, in order, in every column
+static void table_keep(Table *t, const size_t *keep, size_t count) {
+    for (int c = 0; c < t->ncols; c++) {
+        Cell *cells = t->cols[c].cells;
+        for (size_t k = 0; k < count; k++) cells[k] = cells[keep[k]];
+    }
+    t->rows = count;
+}
+
+// where column op value: ops are -eq -ne -lt -le -gt -ge, or == != < <=
+// > >= quoted. == and != match text columns against a pattern.
+int cmd_where(char **args) {
+    if (!args[1] || !args[2] || !args[3] || args[4]) {
+        print_error("where: usage: where column op value");
+        return EXIT_USAGE;
+    }
+    Table *t = table_input("where");
+    if (!t) return EXIT_USAGE;
+    int c = table_find(t, "where", args[1]);
+    if (c < 0) return EXIT_USAGE;
+    int op = parse_op(args[2]);
+    if (op < 0) {
+        print_error("where: %s: unknown operator", args[2]);
+        return EXIT_USAGE;
+    }
+
+    Column *col = &t->cols[c];
+    long long value = 0;
+    const Pattern *pat = NULL;
+    if (col->type != COL_STRING && parse_value(col->type, args[3], &value) != 0) {
+        print_error("where: %s: not a value for %s", args[3], col->name);
+        return EXIT_USAGE;
+    }
+    if (col->type == COL_STRING && (op == OP_EQ || op == OP_NE) && pattern_has_magic(args[3], strlen(args[3]))) {
+        pat = pattern_cached(args[3], strlen(args[3]), 0);
+    }
+
+    size_t *keep = malloc((t->rows ? t->rows : 1) * sizeof(size_t));
+    if (!keep) return EXIT_FAILURE;
+    size_t count = 0;
+    Cell *cells = col->cells;
+    if (col->type == COL_MODE) {
+        for (size_t r = 0; r < t->rows; r++) {
+            long long v = cells[r].num & 07777;
+            if (compare_holds(op, (v > value) - (v < value))) keep[count++] = r;
+        }
+    } else if (col->type != COL_STRING) {
+        for (size_t r = 0; r < t->rows; r++) {
+            long long v = cells[r].num;
+            if (compare_holds(op, (v > value) - (v < value))) keep[count++] = r;
+        }
+    } else if (pat) {
+        int want = op == OP_EQ;
+        for (size_t r = 0; r < t->rows; r++) {
+            if (pattern_match(pat, cells[r].str, strlen(cells[r].str)) == want) keep[count++] = r;
+        }
+    } else {
+        for (size_t r = 0; r < t->rows; r++) {
+            if (compare_holds(op, strcmp(cells[r].str, args[3]))) keep[count++] = r;
+        }
+    }
+    table_keep(t, keep, count);
+    free(keep);
+    return EXIT_SUCCESS;
+}
+
+typedef struct {
+    const Column *cols[TABLE_MAX_COLUMNS];
+    int count;
+    int reverse;
+} SortKeys;
+
+static int compare_rows(const void *a, const void *b, void *arg) {
+    const SortKeys *keys = arg;
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    for (int k = 0; k < keys->count; k++) {
+        const Column *col = keys->cols[k];
+        int cmp;
+        if (col->type == COL_STRING) {
+            cmp = strcmp(col->cells[x].str, col->cells[y].str);
+        } else {
+            long long u = col->cells[x].num, v = col->cells[y].num;
+            cmp = (u > v) - (u < v);
+        }
+        if (cmp) return keys->reverse ? -cmp : cmp;
+    }
+    // Equal rows keep their order
+    return (x > y) - (x < y);
+}
+
+// The row order sorted by keys
+static size_t *sort_order(Table *t, const SortKeys *keys) {
+    size_t *order = malloc((t->rows ? t->rows : 1) * sizeof(size_t));
+    if (!order) return NULL;
+    for (size_t r = 0; r < t->rows; r++) order[r] = r;
+    qsort_r(order, t->rows, sizeof(size_t), compare_rows, (void *)keys);
+    return order;
+}
+
+static int sort_keys(Table *t, const char *cmd, char **names, SortKeys *keys) {
+    keys->count = 0;
+    for (; *names; names++) {
+        int c = table_find(t, cmd, *names);
+        if (c < 0) return -1;
+        if (keys->count == TABLE_MAX_COLUMNS) break;
+        keys->cols[keys->count++] = &t->cols[c];
+    }
+    return 0;
+}
+
+// Reorder every column by order, through one spare column
+static int table_permute(Table *t, const size_t *order) {
+    Cell *spare = malloc((t->cap ? t->cap : 1) * sizeof(Cell));
+    if (!spare) return -1;
+    for (int c = 0; c < t->ncols; c++) {
+        Cell *cells = t->cols[c].cells;
+        for (size_t r = 0; r < t->rows; r++) spare[r] = cells[order[r]];
+        t->cols[c].cells = spare;
+        spare = cells;
+    }
+    free(spare);
+    return 0;
+}
+
+// sort-by [-r] column...
+int cmd_sort_by(char **args) {
+    SortKeys keys = {.reverse = 0};
+    int i = 1;
+    if (args[i] && strcmp(args[i], "-r") == 0) {
+        keys.reverse = 1;
+        i++;
+    }
+    if (!args[i]) {
+        print_error("sort-by: usage: sort-by [-r] column...");
+        return EXIT_USAGE;
+    }
+    Table *t = table_input("sort-by");
+    if (!t) return EXIT_USAGE;
+    if (sort_keys(t, "sort-by", args + i, &keys) != 0) return EXIT_USAGE;
+
+    size_t *order = sort_order(t, &keys);
+    if (!order || table_permute(t, order) != 0) {
+        free(order);
+        print_error("malloc: failed to allocate memory");
+        return EXIT_FAILURE;
+    }
+    free(order);
+    return EXIT_SUCCESS;
+}
+
+// select column...
+int cmd_select(char **args) {
+    if (!args[1]) {
+        print_error("select: usage: select column...");
+        return EXIT_USAGE;
+    }
+    Table *t = table_input("select");
+    if (!t) return EXIT_USAGE;
+
+    Column picked[TABLE_MAX_COLUMNS];
+    int used[TABLE_MAX_COLUMNS] = {0};
+    int count = 0;
+    for (int i = 1; args[i] && count < TABLE_MAX_COLUMNS; i++) {
+        int c = table_find(t, "select", args[i]);
+        if (c < 0) return EXIT_USAGE;
+        if (used[c]) continue;
+        used[c] = 1;
+        picked[count++] = t->cols[c];
+    }
+    for (int c = 0; c < t->ncols; c++) {
+        if (!used[c]) free(t->cols[c].cells);
+    }
+    memcpy(t->cols, picked, count * sizeof(Column));
+    t->ncols = count;
+    return EXIT_SUCCESS;
+}
+
+// group-by column [sum-column...]: one row for each value of column,
+// with the number of rows that have it and the totals of the numeric
+// columns named after it
+int cmd_group_by(char **args) {
+    if (!args[1]) {
+        print_error("group-by: usage: group-by column [sum-column...]");
+        return EXIT_USAGE;
+    }
+    Table *t = table_input("group-by");
+    if (!t) return EXIT_USAGE;
+
+    SortKeys keys = {.reverse = 0};
+    char *key_name[] = {args[1], NULL};
+    if (sort_keys(t, "group-by", key_name, &keys) != 0) return EXIT_USAGE;
+    const Column *key = keys.cols[0];
+    const Column *sums[TABLE_MAX_COLUMNS - 2];
+    int nsums = 0;
+    for (int i = 2; args[i] && nsums < TABLE_MAX_COLUMNS - 2; i++) {
+        int c = table_find(t, "group-by", args[i]);
+        if (c < 0) return EXIT_USAGE;
+        if (t->cols[c].type != COL_INT && t->cols[c].type != COL_SIZE) {
+            print_error("group-by: %s: not a column of numbers or sizes", args[i]);
+            return EXIT_USAGE;
+        }
+        sums[nsums++] = &t->cols[c];
+    }
+
+    Table *g = table_new();
+    size_t *order = g ? sort_order(t, &keys) : NULL;
+    if (!order) {
+        table_free(g);
+        return EXIT_FAILURE;
+    }
+    table_add_column(g, key->name, key->type);
+    table_add_column(g, "count", COL_INT);
+    for (int s = 0; s < nsums; s++) table_add_column(g, sums[s]->name, sums[s]->type);
+
+    int status = EXIT_SUCCESS;
+    for (size_t r = 0; r < t->rows; r++) {
+        size_t row = order[r];
+        int same = g->rows > 0 && (key->type == COL_STRING
+                                       ? strcmp(g->cols[0].cells[g->rows - 1].str, key->cells[row].str) == 0
+                                       : g->cols[0].cells[g->rows - 1].num == key->cells[row].num);
+        if (!same) {
+            if (table_reserve(g) != 0) {
+                status = EXIT_FAILURE;
+                break;
+            }
+            Cell *first = &g->cols[0].cells[g->rows];
+            if (key->type == COL_STRING) {
+                first->str = arena_strndup(&g->strings, key->cells[row].str, strlen(key->cells[row].str));
+            } else {
+                first->num = key->cells[row].num;
+            }
+            for (int c = 1; c < g->ncols; c++) g->cols[c].cells[g->rows].num = 0;
+            g->rows++;
+        }
+        size_t last = g->rows - 1;
+        g->cols[1].cells[last].num++;
+        for (int s = 0; s < nsums; s++) g->cols[2 + s].cells[last].num += sums[s]->cells[row].num;
+    }
+    free(order);
+    // Column names are literals, and the key strings were copied
+    table_free(session_table);
+    session_table = g;
+    return status;
+}
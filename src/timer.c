@@ -0,0 +1,369 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include "shell.h"
+
+// Timed commands: timeout and watch.
+//
+// Both wait in poll on a timerfd, and timeout also on a pidfd of the
+// command, so nothing wakes up until the deadline passes or the command
+// exits, and no helper process sits between the shell and the command.
+// As with coreutils, timeout runs the command in a process group of its
+// own and signals the whole group, so what the command started goes
+// with it. The group is given the terminal if the shell has it; SIGINT
+// and SIGQUIT that reach the shell all the same are passed on to the
+// group through a signalfd.
+// watch runs on a periodic timer: runs start a whole number of
+// intervals after the first, however long each takes, and a run that
+// overruns its interval skips the ticks it missed.
+
+#define TIMEOUT_STATUS      124
+#define TIMEOUT_FAILED      125     // timeout itself failed
+#define TIMEOUT_KILL_AFTER  5.0     // seconds from the signal to SIGKILL
+#define WATCH_INTERVAL      2.0
+#define WATCH_MIN_INTERVAL  0.01
+
+// A duration such as 1.5, 30s, 2m, 1h or 1d, in seconds
+static int parse_duration(const char *text, double *seconds) {
+    char *end;
+    double v = strtod(text, &end);
+    if (end == text || v < 0 || !isfinite(v)) return -1;
+    switch (*end) {
+        case '\0': case 's': break;
+        case 'm': v *= 60; break;
+        case 'h': v *= 3600; break;
+        case 'd': v *= 86400; break;
+        default: return -1;
+    }
+    if (*end && end[1]) return -1;
+    *seconds = v;
+    return 0;
+}
+
+// A signal given as a number or a name, with or without SIG
+static int parse_signal(const char *text) {
+    char *end;
+    long n = strtol(text, &end, 10);
+    if (end != text && !*end) return n > 0 && n < NSIG ? (int)n : -1;
+    if (strncasecmp(text, "SIG", 3) == 0) text += 3;
+    for (int sig = 1; sig < NSIG; sig++) {
+        const char *name = sigabbrev_np(sig);
+        if (name && strcasecmp(name, text) == 0) return sig;
+    }
+    return -1;
+}
+
+static void timer_arm(int tfd, double seconds, double interval) {
+    struct itimerspec its = {0};
+    its.it_value.tv_sec = (time_t)seconds;
+    its.it_value.tv_nsec = (long)((seconds - (double)(time_t)seconds) * 1e9);
+    if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) its.it_value.tv_nsec = 1;
+    its.it_interval.tv_sec = (time_t)interval;
+    its.it_interval.tv_nsec = (long)((interval - (double)(time_t)interval) * 1e9);
+    timerfd_settime(tfd, 0, &its, NULL);
+}
+
+// Has pid exited? It is left to be waited for.
+static int exited(pid_t pid) {
+    siginfo_t info;
+    info.si_pid = 0;
+    return waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == pid;
+}
+
+// Signal the command's process group, or the command alone if it has
+// not got one, and wake it in case it is stopped, as by SIGTTIN, so
+// that it acts on the signal
+static void send_signal(pid_t pid, int pidfd, int sig) {
+    if (kill(-pid, sig) == 0) {
+        kill(-pid, SIGCONT);
+        return;
+    }
+    if (pidfd < 0 || syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0) != 0) kill(pid, sig);
+    kill(pid, SIGCONT);
+}
+
+// timeout [-s signal] [-k duration] [--preserve-status] duration command...
+int cmd_timeout(char **args) {
+    int sig = SIGTERM, preserve = 0;
+    double kill_after = TIMEOUT_KILL_AFTER, duration;
+    int i = 1;
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        const char *opt = args[i];
+        if (strcmp(opt, "--") == 0) {
+            i++;
+            break;
+        }
+        if (strcmp(opt, "--preserve-status") == 0) {
+            preserve = 1;
+            continue;
+        }
+        // Anything else is left to an external timeout
+        if ((opt[1] != 's' && opt[1] != 'k') || (!opt[2] && !args[i + 1])) return EXIT_DEFER;
+        const char *value = opt[2] ? opt + 2 : args[++i];
+        if (opt[1] == 's' ? (sig = parse_signal(value)) < 0 : parse_duration(value, &kill_after) != 0) {
+            print_error("timeout: %s: invalid %s", value, opt[1] == 's' ? "signal" : "duration");
+            return TIMEOUT_FAILED;
+        }
+    }
+    if (!args[i] || !args[i + 1]) {
+        print_error("timeout: usage: timeout [-s signal] [-k duration] duration command [args...]");
+        return TIMEOUT_FAILED;
+    }
+    if (parse_duration(args[i], &duration) != 0) {
+        print_error("timeout: %s: invalid duration", args[i]);
+        return TIMEOUT_FAILED;
+    }
+
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (tfd < 0) {
+        print_error("timeout: timerfd_create: %s", strerror(errno));
+        return TIMEOUT_FAILED;
+    }
+    pid_t pid = fork_argv(args + i + 1, 1);
+    if (pid < 0) {
+        close(tfd);
+        return TIMEOUT_FAILED;
+    }
+    int pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd >= 0) fcntl(pidfd, F_SETFD, FD_CLOEXEC);
+    if (duration > 0) timer_arm(tfd, duration, 0);
+
+    // The group is out of reach of the terminal's signals
+    sigset_t set, saved;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGQUIT);
+    sigprocmask(SIG_BLOCK, &set, &saved);
+    int sig_fd = signalfd(-1, &set, SFD_CLOEXEC | SFD_NONBLOCK);
+
+    // 0: running, 1: signalled, 2: killed
+    int stage = 0;
+    for (;;) {
+        struct pollfd pfds[3] = {{tfd, POLLIN, 0}, {sig_fd, POLLIN, 0}, {pidfd, POLLIN, 0}};
+        // Without a pidfd, look for the exit now and then
+        int rc = poll(pfds, pidfd >= 0 ? 3 : 2, pidfd >= 0 ? -1 : 10);
+        if (pidfd >= 0 ? rc > 0 && pfds[2].revents : exited(pid)) break;
+        if (rc > 0 && (pfds[1].revents & POLLIN)) {
+            struct signalfd_siginfo info;
+            while (read(sig_fd, &info, sizeof(info)) == (ssize_t)sizeof(info)) {
+                send_signal(pid, pidfd, (int)info.ssi_signo);
+            }
+        }
+        if (rc <= 0 || !(pfds[0].revents & POLLIN)) continue;
+
+        uint64_t ticks;
+        if (read(tfd, &ticks, sizeof(ticks)) != sizeof(ticks)) continue;
+        if (stage == 0) {
+            send_signal(pid, pidfd, sig);
+            stage = 1;
+            if (kill_after > 0 && sig != SIGKILL) timer_arm(tfd, kill_after, 0);
+        } else if (stage == 1) {
+            send_signal(pid, pidfd, SIGKILL);
+            stage = 2;
+        }
+    }
+    close(tfd);
+    if (sig_fd >= 0) close(sig_fd);
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+    if (pidfd >= 0) close(pidfd);
+    terminal_reclaim();
+
+    // A SIGINT sent by timeout is no interrupt of the shell's
+    if (stage == 0) return wait_for(pid);
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) continue;
+    status = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+    if (preserve) return status;
+    return stage == 2 || sig == SIGKILL ? 128 + SIGKILL : TIMEOUT_STATUS;
+}
+
+// Run args with standard output and error on a pipe, and collect what
+// they write in out
+static int watch_run(char **args, StrBuf *out) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        print_error("watch: pipe: %s", strerror(errno));
+        return -1;
+    }
+    out_flush();
+    int saved_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+    int saved_err = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 10);
+    dup2(fds[1], STDOUT_FILENO);
+    dup2(fds[1], STDERR_FILENO);
+    close(fds[1]);
+    pid_t pid = fork_argv(args, 0);
+    dup2(saved_out, STDOUT_FILENO);
+    dup2(saved_err, STDERR_FILENO);
+    close(saved_out);
+    close(saved_err);
+
+    out->len = 0;
+    for (;;) {
+        if (strbuf_reserve(out, 4096) != 0) break;
+        ssize_t n = read(fds[0], out->data + out->len, 4096);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        out->len += n;
+    }
+    close(fds[0]);
+    return pid < 0 ? -1 : wait_for(pid);
+}
+
+// The line of text starting at *p, advancing *p past it
+static size_t next_line(const char **p, const char *end, const char **line) {
+    *line = *p;
+    const char *nl = memchr(*p, '\n', end - *p);
+    size_t len = (nl ? nl : end) - *p;
+    *p = nl ? nl + 1 : end;
+    return len;
+}
+
+// Redraw the screen from the previous output to the current one,
+// writing only the lines that changed. prev is NULL for a full redraw.
+static void watch_draw(const StrBuf *cur, const StrBuf *prev, int first_row) {
+    struct winsize ws;
+    int rows = 24, cols = 80;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0) {
+        rows = ws.ws_row;
+        cols = ws.ws_col;
+    }
+
+    const char *c = cur->data, *c_end = cur->data + cur->len;
+    const char *p = prev ? prev->data : NULL, *p_end = prev ? prev->data + prev->len : NULL;
+    int row = first_row;
+    for (; row <= rows && c < c_end; row++) {
+        const char *line, *old = NULL;
+        size_t len = next_line(&c, c_end, &line);
+        size_t old_len = p && p < p_end ? next_line(&p, p_end, &old) : (size_t)-1;
+        if (len > (size_t)cols) len = cols;
+        if (old_len != (size_t)-1 && old_len > (size_t)cols) old_len = cols;
+        if (old_len == len && memcmp(line, old, len) == 0) continue;
+        out_printf(STDOUT_FILENO, "\033[%d;1H", row);
+        out_write(STDOUT_FILENO, line, len);
+        out_puts(STDOUT_FILENO, "\033[K");
+    }
+    // Clear what is left of a longer previous output
+    if (!prev || (p && p < p_end)) out_printf(STDOUT_FILENO, "\033[%d;1H\033[J", row);
+    out_flush();
+}
+
+// Draw the title line, or only its clock if the rest is on the screen
+// already. shown holds the time last drawn.
+static void watch_title(double interval, char **args, int cols, char *shown, size_t size) {
+    char stamp[64];
+    time_t now = time(NULL);
+    strftime(stamp, sizeof(stamp), "%a %b %e %H:%M:%S %Y", localtime(&now));
+    int stamp_col = cols - (int)strlen(stamp) + 1;
+    if (shown[0]) {
+        if (strcmp(shown, stamp) != 0 && stamp_col > 1) out_printf(STDOUT_FILENO, "\033[1;%dH%s", stamp_col, stamp);
+        snprintf(shown, size, "%s", stamp);
+        return;
+    }
+
+    StrBuf title = {0};
+    char every[32];
+    snprintf(every, sizeof(every), "Every %gs: ", interval);
+    strbuf_append(&title, every, strlen(every));
+    for (int i = 0; args[i]; i++) {
+        if (i > 0) strbuf_append(&title, " ", 1);
+        strbuf_append(&title, args[i], strlen(args[i]));
+    }
+    size_t room = stamp_col > 2 ? (size_t)stamp_col - 2 : 0;
+    if (title.len > room) title.len = room;
+    out_puts(STDOUT_FILENO, "\033[1;1H");
+    out_write(STDOUT_FILENO, title.data, title.len);
+    if (stamp_col > 1) out_printf(STDOUT_FILENO, "\033[1;%dH%s", stamp_col, stamp);
+    snprintf(shown, size, "%s", stamp);
+    strbuf_free(&title);
+}
+
+// watch [-n seconds] [-t] [-g] command...
+int cmd_watch(char **args) {
+    double interval = WATCH_INTERVAL;
+    int title = 1, until_change = 0;
+    int i = 1;
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        const char *opt = args[i];
+        if (strcmp(opt, "--") == 0) {
+            i++;
+            break;
+        }
+        if (strcmp(opt, "-t") == 0) {
+            title = 0;
+        } else if (strcmp(opt, "-g") == 0) {
+            until_change = 1;
+        } else if (opt[1] == 'n' && (opt[2] || args[i + 1])) {
+            const char *value = opt[2] ? opt + 2 : args[++i];
+            if (parse_duration(value, &interval) != 0) {
+                print_error("watch: %s: invalid interval", value);
+                return EXIT_USAGE;
+            }
+            if (interval < WATCH_MIN_INTERVAL) interval = WATCH_MIN_INTERVAL;
+        } else {
+            // Anything else is left to an external watch
+            return EXIT_DEFER;
+        }
+    }
+    if (!args[i]) {
+        print_error("watch: usage: watch [-n seconds] [-t] [-g] command [args...]");
+        return EXIT_USAGE;
+    }
+
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (tfd < 0) {
+        print_error("watch: timerfd_create: %s", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    timer_arm(tfd, interval, interval);
+
+    int tty = isatty(STDOUT_FILENO);
+    struct winsize ws;
+    int cols = tty && ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+    StrBuf bufs[2] = {{0}, {0}};
+    char stamp[64] = "";
+    int cur = 0, runs = 0, status = EXIT_SUCCESS;
+    for (;;) {
+        StrBuf *now = &bufs[cur], *prev = &bufs[!cur];
+        if (watch_run(args + i, now) < 0) {
+            status = EXIT_FAILURE;
+            break;
+        }
+        int changed = runs == 0 || now->len != prev->len || memcmp(now->data, prev->data, now->len) != 0;
+        if (tty) {
+            if (runs == 0) out_puts(STDOUT_FILENO, "\033[H\033[2J");
+            if (title) watch_title(interval, args + i, cols, stamp, sizeof(stamp));
+            watch_draw(now, runs > 0 ? prev : NULL, title ? 3 : 1);
+        } else if (now->len > 0) {
+            out_write(STDOUT_FILENO, now->data, now->len);
+            out_flush();
+        }
+        if (until_change && runs > 0 && changed) break;
+        runs++;
+        cur = !cur;
+
+        // Sleep until the next tick; an interrupt ends the watch
+        struct pollfd pfd = {tfd, POLLIN, 0};
+        uint64_t ticks;
+        if (poll(&pfd, 1, -1) < 0 || read(tfd, &ticks, sizeof(ticks)) != sizeof(ticks)) break;
+    }
+    close(tfd);
+    strbuf_free(&bufs[0]);
+    strbuf_free(&bufs[1]);
+    if (tty) out_puts(STDOUT_FILENO, "\n");
+    return status;
+}
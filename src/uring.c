@@ -0,0 +1,233 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "shell.h"
+
+// Batched file operations.
+//
+// Builtins that stat many files, files and cp listing a directory,
+// describe the statx calls they need as an array of FileOp and hand it
+// over whole. The operations are submitted on an io_uring, as many as
+// the ring holds per io_uring_enter, so stating the entries of a large
+// directory costs a few system calls instead of one per entry. The ring
+// is set up on first use; where io_uring is missing or forbidden the
+// same operations are made one by one with the ordinary calls.
+//
+// The kernel runs statx from a ring on its worker threads, which costs
+// more than the plain call unless the workers have CPUs of their own to
+// run on: with a single CPU, or a batch of a few operations, the plain
+// calls are used.
+//
+// Operations in one batch are independent of each other and may finish
+// in any order. If the ring fails partway, the operations it had taken
+// are waited for, since the kernel may still be writing their results,
+// and only the ones it never took are made with the plain calls. The
+// ring belongs to the shell thread of one process: a forked child that
+// runs a batch sets up its own.
+
+#define RING_ENTRIES   256
+#define RING_MIN_BATCH 16
+#define RESULT_PENDING LONG_MIN     // no completion for the operation yet
+
+typedef struct {
+    int fd;             // -1 before setup
+    pid_t pid;          // process that set it up
+    int broken;         // setup failed: always use plain calls
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_size, cq_size, sqes_size;
+} Ring;
+
+static Ring ring = {.fd = -1};
+
+static void ring_unmap(Ring *r) {
+    if (r->sqes) munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring && r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_size);
+    if (r->sq_ring) munmap(r->sq_ring, r->sq_size);
+    if (r->fd >= 0) close(r->fd);
+    r->sqes = NULL;
+    r->sq_ring = r->cq_ring = NULL;
+    r->fd = -1;
+}
+
+static int ring_setup(Ring *r) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if (fd < 0) return -1;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    r->fd = fd;
+    r->entries = p.sq_entries;
+
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_size > r->sq_size) r->sq_size = r->cq_size;
+        r->cq_size = r->sq_size;
+    }
+    r->sq_ring = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                      IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        r->sq_ring = NULL;
+        ring_unmap(r);
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                          IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) {
+            r->cq_ring = NULL;
+            ring_unmap(r);
+            return -1;
+        }
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                   IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        ring_unmap(r);
+        return -1;
+    }
+
+    char *sq = r->sq_ring, *cq = r->cq_ring;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    r->pid = getpid();
+    return 0;
+}
+
+// The ring of this process, or NULL if there is none to be had
+static Ring *ring_get(void) {
+    if (ring.broken) return NULL;
+    if (ring.fd >= 0 && ring.pid == getpid()) return &ring;
+    if (sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+        ring.broken = 1;
+        return NULL;
+    }
+    // A fork shares the parent's ring memory; leave it to the parent
+    ring_unmap(&ring);
+    if (ring_setup(&ring) != 0) {
+        ring.broken = 1;
+        return NULL;
+    }
+    return &ring;
+}
+
+static void prep_sqe(struct io_uring_sqe *sqe, const FileOp *op, size_t index) {
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = op->fd;
+    sqe->user_data = index;
+    switch (op->op) {
+        case FOP_STATX:
+            sqe->opcode = IORING_OP_STATX;
+            sqe->addr = (unsigned long)op->path;
+            sqe->len = op->len;
+            sqe->off = (unsigned long)op->buf;
+            sqe->statx_flags = op->flags;
+            break;
+    }
+}
+
+// Take the completions the kernel has posted
+static size_t ring_reap(Ring *r, FileOp *ops) {
+    size_t done = 0;
+    unsigned head = *r->cq_head;
+    unsigned ctail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != ctail; head++) {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        ops[cqe->user_data].result = cqe->res;
+        done++;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    return done;
+}
+
+// Run ops[0..count) on the ring, which holds them all at once. Returns
+// -1 if the ring failed, once every operation it took has completed.
+static int ring_run(Ring *r, FileOp *ops, size_t count) {
+    unsigned tail = *r->sq_tail;
+    for (size_t i = 0; i < count; i++) {
+        unsigned slot = tail & *r->sq_mask;
+        prep_sqe(&r->sqes[slot], &ops[i], i);
+        r->sq_array[slot] = slot;
+        tail++;
+    }
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+    size_t pending = count, done = 0;
+    while (done < count) {
+        long rc = syscall(__NR_io_uring_enter, r->fd, (unsigned)pending, (unsigned)(count - done),
+                          IORING_ENTER_GETEVENTS, NULL, 0);
+        int failed = rc < 0 && errno != EINTR;
+        if (rc > 0) pending -= rc;
+
+        // Completions already posted count even if the call failed
+        done += ring_reap(r, ops);
+        if (failed) break;
+    }
+    if (done == count) return 0;
+
+    // The ones it took finish whether or not anyone waits, writing to
+    // their buffers; the sleep gives the kernel a chance to post them
+    // when waiting on the ring fails as well
+    struct timespec tick = {0, 1000000};
+    while (done < count - pending) {
+        long rc = syscall(__NR_io_uring_enter, r->fd, 0, (unsigned)(count - pending - done),
+                          IORING_ENTER_GETEVENTS, NULL, 0);
+        if (rc < 0 && errno != EINTR) nanosleep(&tick, NULL);
+        done += ring_reap(r, ops);
+    }
+    return -1;
+}
+
+static void run_plain(FileOp *op) {
+    long rc;
+    switch (op->op) {
+        case FOP_STATX: rc = statx(op->fd, op->path, op->flags, op->len, op->buf); break;
+        default: rc = -1; errno = EINVAL; break;
+    }
+    op->result = rc < 0 ? -errno : rc;
+}
+
+// Run every operation in ops, leaving each one's outcome in its result
+void file_ops_run(FileOp *ops, size_t count) {
+    Ring *r = count >= RING_MIN_BATCH ? ring_get() : NULL;
+    for (size_t k = 0; k < count; k++) ops[k].result = RESULT_PENDING;
+    size_t i = 0;
+    while (r && i < count) {
+        size_t n = count - i < r->entries ? count - i : r->entries;
+        if (ring_run(r, ops + i, n) != 0) {
+            // The ring itself failed; nothing more goes near it
+            ring_unmap(r);
+            ring.broken = 1;
+            break;
+        }
+        i += n;
+    }
+    for (; i < count; i++) {
+        if (ops[i].result == RESULT_PENDING) run_plain(&ops[i]);
+    }
+}
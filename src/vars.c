@@ -0,0 +1,781 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ctype.h>
+#include "shell.h"
+
+extern char **environ;
+
+// Shell variable store: an open-addressed hash table with linear probing.
+// Exported variables are mirrored into the process environment so child
+// processes and getenv() callers see them. An array variable holds an
+// Array instead of a value; used as a scalar it reads element 0.
+
+typedef struct {
+    char *name;
+    char *value;            // NULL for arrays
+    Array *array;
+    int flags;
+    unsigned int hash;
+    int numeric;            // NUM_UNKNOWN, NUM_INTEGER or NUM_OTHER
+    long long number;       // value as an integer when NUM_INTEGER
+} Var;
+
+// Integer view of a value, parsed on first arithmetic use
+#define NUM_UNKNOWN 0
+#define NUM_INTEGER 1
+#define NUM_OTHER   2
+
+#define VAR_TOMBSTONE ((char *)-1)
+
+static Var *var_table;
+static size_t var_capacity;
+static size_t var_used;     // live entries plus tombstones
+
+// Positional parameters ($0, $1 ... $N)
+static char *shell_name;
+static char **positional;
+static int positional_count_;
+
+// Function-local variables: each scope records the previous value of
+// every name made local in it, restored when the scope is popped
+typedef struct {
+    char *name;
+    char *value;        // NULL if the variable did not exist
+    Array *array;       // ... or was an array
+    int flags;
+} SavedLocal;
+
+typedef struct {
+    SavedLocal *saved;
+    int count;
+    int capacity;
+} VarScope;
+
+static VarScope *scopes;
+static int scope_depth;
+static int scope_capacity;
+
+static unsigned int hash_name(const char *name, size_t len) {
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Find the slot holding name, or the slot it would be inserted into
+static Var *var_slot(const char *name, size_t len, unsigned int hash, int for_insert) {
+    if (!var_capacity) return NULL;
+
+    Var *tombstone = NULL;
+    size_t mask = var_capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        Var *v = &var_table[i];
+        if (!v->name) {
+            return for_insert ? (tombstone ? tombstone : v) : NULL;
+        }
+        if (v->name == VAR_TOMBSTONE) {
+            if (!tombstone) tombstone = v;
+            continue;
+        }
+        if (v->hash == hash && strncmp(v->name, name, len) == 0 && v->name[len] == '\0') {
+            return v;
+        }
+    }
+}
+
+static int var_grow(void) {
+    size_t old_capacity = var_capacity;
+    Var *old = var_table;
+
+    var_capacity = old_capacity ? old_capacity * 2 : 256;
+    var_table = calloc(var_capacity, sizeof(Var));
+    if (!var_table) {
+        var_table = old;
+        var_capacity = old_capacity;
+        return -1;
+    }
+    var_used = 0;
+
+    for (size_t i = 0; i < old_capacity; i++) {
+        Var *v = &old[i];
+        if (!v->name || v->name == VAR_TOMBSTONE) continue;
+        Var *slot = var_slot(v->name, strlen(v->name), v->hash, 1);
+        *slot = *v;
+        var_used++;
+    }
+    free(old);
+    return 0;
+}
+
+// Is this a valid variable name?
+int is_valid_name(const char *name, size_t len) {
+    if (len == 0 || !(isalpha((unsigned char)name[0]) || name[0] == '_')) return 0;
+    for (size_t i = 1; i < len; i++) {
+        if (!(isalnum((unsigned char)name[i]) || name[i] == '_')) return 0;
+    }
+    return 1;
+}
+
+// Look up a variable by name span. Returns NULL if unset.
+const char *var_lookup(const char *name, size_t len) {
+    Var *v = var_slot(name, len, hash_name(name, len), 0);
+    if (v && v->array) return array_get(v->array, 0);
+    return v ? v->value : NULL;
+}
+
+// Get variable flags, or -1 if unset
+int var_flags(const char *name) {
+    size_t len = strlen(name);
+    Var *v = var_slot(name, len, hash_name(name, len), 0);
+    return v ? v->flags : -1;
+}
+
+// Set a variable. Flags are OR-ed into the existing flags.
+int var_assign(const char *name, size_t len, const char *value, int flags) {
+    if (!is_valid_name(name, len)) {
+        print_error("%.*s: not a valid identifier", (int)len, name);
+        return -1;
+    }
+    if ((var_used + 1) * 4 >= var_capacity * 3 && var_grow() != 0) {
+        print_error("malloc: failed to allocate memory");
+        return -1;
+    }
+
+    unsigned int hash = hash_name(name, len);
+    Var *v = var_slot(name, len, hash, 1);
+
+    if (v->name && v->name != VAR_TOMBSTONE) {
+        if (v->flags & VAR_READONLY) {
+            print_error("%s: readonly variable", v->name);
+            return -1;
+        }
+        if (v->array) {
+            v->flags |= flags;
+            return value ? array_set(v->array, 0, value, strlen(value)) : 0;
+        }
+        if (value) {
+            char *copy = strdup(value);
+            if (!copy) return -1;
+            free(v->value);
+            v->value = copy;
+            v->numeric = NUM_UNKNOWN;
+        }
+        v->flags |= flags;
+    } else {
+        char *key = strndup(name, len);
+        char *copy = strdup(value ? value : "");
+        if (!key || !copy) {
+            free(key);
+            free(copy);
+            return -1;
+        }
+        if (!v->name) var_used++;
+        v->name = key;
+        v->value = copy;
+        v->array = NULL;
+        v->flags = flags;
+        v->hash = hash;
+        v->numeric = NUM_UNKNOWN;
+    }
+
+    if (v->flags & VAR_EXPORT) setenv(v->name, v->value, 1);
+    return 0;
+}
+
+// Parse a value that is a plain integer, allowing surrounding blanks
+static int parse_integer(const char *s, long long *out) {
+    while (isspace((unsigned char)*s)) s++;
+    int negative = 0;
+    if (*s == '-' || *s == '+') negative = *s++ == '-';
+    size_t n = strlen(s);
+    while (n > 0 && isspace((unsigned char)s[n - 1])) n--;
+    if (n == 0 || !isdigit((unsigned char)*s) || arith_parse_number(s, n, out) != 0) return -1;
+    if (negative) *out = (long long)(0ULL - (unsigned long long)*out);
+    return 0;
+}
+
+// Read a variable as an integer for arithmetic. Returns 1 and sets *out
+// if the value is a plain integer, otherwise 0 (*out is 0 if the variable
+// is unset or empty). The parsed number is kept with the variable, so
+// loop counters are not re-parsed on every use.
+int var_get_number(const char *name, size_t len, long long *out) {
+    Var *v = var_slot(name, len, hash_name(name, len), 0);
+    *out = 0;
+    if (!v) return 0;
+
+    if (v->array) {
+        const char *value = array_get(v->array, 0);
+        return value && parse_integer(value, out) == 0;
+    }
+    if (v->numeric == NUM_UNKNOWN) {
+        v->numeric = parse_integer(v->value, &v->number) == 0 ? NUM_INTEGER : NUM_OTHER;
+    }
+    if (v->numeric != NUM_INTEGER) return 0;
+    *out = v->number;
+    return 1;
+}
+
+// Store an arithmetic result, reusing the value buffer when it fits
+int var_set_number(const char *name, size_t len, long long value) {
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "%lld", value);
+
+    Var *v = var_slot(name, len, hash_name(name, len), 0);
+    if (v && v->array) return var_assign(name, len, buf, 0);
+    if (!v || (v->flags & VAR_READONLY) || strlen(v->value) < (size_t)n) {
+        if (var_assign(name, len, buf, 0) != 0) return -1;
+        v = var_slot(name, len, hash_name(name, len), 0);
+    } else {
+        memcpy(v->value, buf, n + 1);
+        if (v->flags & VAR_EXPORT) setenv(v->name, v->value, 1);
+    }
+    v->numeric = NUM_INTEGER;
+    v->number = value;
+    return 0;
+}
+
+// Convenience wrapper for NUL-terminated names
+int var_set(const char *name, const char *value, int flags) {
+    return var_assign(name, strlen(name), value, flags);
+}
+
+// Remove a variable
+int var_remove(const char *name) {
+    size_t len = strlen(name);
+    Var *v = var_slot(name, len, hash_name(name, len), 0);
+    if (!v) return 0;
+    if (v->flags & VAR_READONLY) {
+        print_error("%s: readonly variable", name);
+        return -1;
+    }
+    if (v->flags & VAR_EXPORT) unsetenv(name);
+    free(v->name);
+    free(v->value);
+    array_free(v->array);
+    v->name = VAR_TOMBSTONE;
+    v->value = NULL;
+    v->array = NULL;
+    return 0;
+}
+
+// Array value of a variable, or NULL if it is unset or a scalar
+Array *var_array(const char *name, size_t len) {
+    Var *v = var_slot(name, len, hash_name(name, len), 0);
+    return v ? v->array : NULL;
+}
+
+// Get name as an array for modification, creating it if unset. A scalar
+// value becomes element 0. Returns NULL on error.
+Array *var_make_array(const char *name, size_t len, int assoc) {
+    Var *v = var_slot(name, len, hash_name(name, len), 0);
+    if (v && (v->flags & VAR_READONLY)) {
+        print_error("%s: readonly variable", v->name);
+        return NULL;
+    }
+    if (v && v->array) {
+        if (assoc && !array_is_assoc(v->array)) {
+            print_error("%s: cannot convert indexed to associative array", v->name);
+            return NULL;
+        }
+        return v->array;
+    }
+
+    int existed = v != NULL;
+    if (!v) {
+        if (var_assign(name, len, NULL, 0) != 0) return NULL;
+        v = var_slot(name, len, hash_name(name, len), 0);
+    }
+    Array *a = array_new(assoc);
+    if (!a || (existed && array_set(a, 0, v->value, strlen(v->value)) != 0)) {
+        array_free(a);
+        return NULL;
+    }
+    if (v->flags & VAR_EXPORT) unsetenv(v->name);  // arrays are not exported
+    free(v->value);
+    v->value = NULL;
+    v->array = a;
+    return a;
+}
+
+// Replace the value of name with the array a, which the variable takes
+// over even on failure
+int var_set_array(const char *name, size_t len, Array *a) {
+    Var *v = var_slot(name, len, hash_name(name, len), 0);
+    if (v && (v->flags & VAR_READONLY)) {
+        print_error("%s: readonly variable", v->name);
+        array_free(a);
+        return -1;
+    }
+    if (!v) {
+        if (var_assign(name, len, NULL, 0) != 0) {
+            array_free(a);
+            return -1;
+        }
+        v = var_slot(name, len, hash_name(name, len), 0);
+    }
+    if (!v->array && (v->flags & VAR_EXPORT)) unsetenv(v->name);
+    free(v->value);
+    array_free(v->array);
+    v->value = NULL;
+    v->array = a;
+    return 0;
+}
+
+static int compare_vars(const void *a, const void *b) {
+    return strcmp((*(const Var **)a)->name, (*(const Var **)b)->name);
+}
+
+// Print a value in single quotes
+static void print_quoted(const char *s) {
+    out_putc(STDOUT_FILENO, '\'');
+    for (const char *c = s; *c; c++) {
+        if (*c == '\'') {
+            out_puts(STDOUT_FILENO, "'\\''");
+        } else {
+            out_putc(STDOUT_FILENO, *c);
+        }
+    }
+    out_putc(STDOUT_FILENO, '\'');
+}
+
+// Print an array as a compound assignment value
+static void print_array(const Array *a) {
+    size_t pos = 0;
+    const char *key, *value;
+    long long index;
+    int first = 1;
+
+    out_putc(STDOUT_FILENO, '(');
+    while (array_next(a, &pos, &key, &index, &value)) {
+        if (!first) out_putc(STDOUT_FILENO, ' ');
+        first = 0;
+        if (key) {
+            out_putc(STDOUT_FILENO, '[');
+            print_quoted(key);
+            out_puts(STDOUT_FILENO, "]=");
+        } else {
+            out_printf(STDOUT_FILENO, "[%lld]=", index);
+        }
+        print_quoted(value);
+    }
+    out_putc(STDOUT_FILENO, ')');
+}
+
+// Print variables in sorted order, optionally only those with given flags
+void vars_print(int required_flags, const char *prefix) {
+    Var **list = malloc((var_used + 1) * sizeof(Var *));
+    size_t count = 0;
+    if (!list) return;
+
+    for (size_t i = 0; i < var_capacity; i++) {
+        Var *v = &var_table[i];
+        if (!v->name || v->name == VAR_TOMBSTONE) continue;
+        if ((v->flags & required_flags) != required_flags) continue;
+        list[count++] = v;
+    }
+    qsort(list, count, sizeof(Var *), compare_vars);
+
+    for (size_t i = 0; i < count; i++) {
+        out_printf(STDOUT_FILENO, "%s%s=", prefix, list[i]->name);
+        if (list[i]->array) {
+            print_array(list[i]->array);
+        } else {
+            print_quoted(list[i]->value);
+        }
+        out_putc(STDOUT_FILENO, '\n');
+    }
+    free(list);
+}
+
+// Import the process environment
+void vars_init(void) {
+    for (char **env = environ; env && *env; env++) {
+        char *equals = strchr(*env, '=');
+        if (!equals || !is_valid_name(*env, equals - *env)) continue;
+        var_assign(*env, equals - *env, equals + 1, VAR_EXPORT);
+    }
+    if (!var_lookup("IFS", 3)) var_set("IFS", " \t\n", 0);
+    shell_name = strdup("xsh");
+}
+
+// Replace the positional parameters
+void set_positional(int argc, char **argv) {
+    char **copy = NULL;
+    if (argc > 0) {
+        copy = malloc((argc + 1) * sizeof(char *));
+        if (!copy) return;
+        for (int i = 0; i < argc; i++) copy[i] = strdup(argv[i]);
+        copy[argc] = NULL;
+    }
+    for (int i = 0; i < positional_count_; i++) free(positional[i]);
+    free(positional);
+    positional = copy;
+    positional_count_ = argc;
+}
+
+// Get positional parameter n ($0 is the shell or script name)
+const char *get_positional(int n) {
+    if (n == 0) return shell_name;
+    if (n < 0 || n > positional_count_) return NULL;
+    return positional[n - 1];
+}
+
+int positional_count(void) {
+    return positional_count_;
+}
+
+void set_shell_name(const char *name) {
+    char *copy = strdup(name);
+    if (!copy) return;
+    free(shell_name);
+    shell_name = copy;
+}
+
+// Replace the positional parameters, keeping the old ones in save
+void positional_push(int argc, char **argv, PositionalSave *save) {
+    save->args = positional;
+    save->count = positional_count_;
+    positional = NULL;
+    positional_count_ = 0;
+    set_positional(argc, argv);
+}
+
+// Restore positional parameters saved by positional_push
+void positional_pop(PositionalSave *save) {
+    set_positional(0, NULL);
+    positional = save->args;
+    positional_count_ = save->count;
+}
+
+// Enter a function scope
+int var_push_scope(void) {
+    if (scope_depth == scope_capacity) {
+        int cap = scope_capacity ? scope_capacity * 2 : 16;
+        VarScope *grown = realloc(scopes, cap * sizeof(VarScope));
+        if (!grown) {
+            print_error("malloc: failed to allocate memory");
+            return -1;
+        }
+        scopes = grown;
+        scope_capacity = cap;
+    }
+    memset(&scopes[scope_depth++], 0, sizeof(VarScope));
+    return 0;
+}
+
+// Leave a function scope, restoring variables made local in it
+void var_pop_scope(void) {
+    if (scope_depth == 0) return;
+    VarScope *scope = &scopes[--scope_depth];
+
+    for (int i = scope->count - 1; i >= 0; i--) {
+        SavedLocal *l = &scope->saved[i];
+        size_t len = strlen(l->name);
+        Var *v = var_slot(l->name, len, hash_name(l->name, len), 0);
+        if (v) {
+            v->flags &= ~VAR_READONLY;
+            var_remove(l->name);
+        }
+        if (l->array) {
+            var_set_array(l->name, len, l->array);
+            v = var_slot(l->name, len, hash_name(l->name, len), 0);
+            if (v) v->flags = l->flags;
+        } else if (l->value) {
+            var_assign(l->name, len, l->value, l->flags & ~VAR_READONLY);
+            v = var_slot(l->name, len, hash_name(l->name, len), 0);
+            if (v) v->flags = l->flags;
+        }
+        free(l->name);
+        free(l->value);
+    }
+    free(scope->saved);
+}
+
+int var_scope_depth(void) {
+    return scope_depth;
+}
+
+// Make a variable local to the innermost function scope
+int var_make_local(const char *name, size_t len) {
+    if (scope_depth == 0) {
+        print_error("local: can only be used in a function");
+        return -1;
+    }
+    if (!is_valid_name(name, len)) {
+        print_error("local: `%.*s': not a valid identifier", (int)len, name);
+        return -1;
+    }
+
+    VarScope *scope = &scopes[scope_depth - 1];
+    for (int i = 0; i < scope->count; i++) {
+        if (strlen(scope->saved[i].name) == len && strncmp(scope->saved[i].name, name, len) == 0) {
+            return 0;  // already local here
+        }
+    }
+
+    if (scope->count == scope->capacity) {
+        int cap = scope->capacity ? scope->capacity * 2 : 8;
+        SavedLocal *grown = realloc(scope->saved, cap * sizeof(SavedLocal));
+        if (!grown) return -1;
+        scope->saved = grown;
+        scope->capacity = cap;
+    }
+
+    Var *v = var_slot(name, len, hash_name(name, len), 0);
+    SavedLocal *l = &scope->saved[scope->count];
+    l->name = strndup(name, len);
+    l->value = v && !v->array ? strdup(v->value) : NULL;
+    l->array = v && v->array ? array_copy(v->array) : NULL;
+    l->flags = v ? v->flags : 0;
+    if (!l->name || (v && !l->value && !l->array)) {
+        free(l->name);
+        free(l->value);
+        array_free(l->array);
+        return -1;
+    }
+    scope->count++;
+    return 0;
+}
+
+// Environment variables
+char *get_env(const char *name) {
+    if (!name) return NULL;
+    return (char *)var_lookup(name, strlen(name));
+}
+
+int set_env(const char *name, const char *value, int overwrite) {
+    if (!name) return -1;
+    if (!overwrite && var_lookup(name, strlen(name))) return 0;
+    return var_set(name, value, VAR_EXPORT);
+}
+
+int unset_env(const char *name) {
+    if (!name) return -1;
+    return var_remove(name);
+}
+
+// Built-in commands
+int cmd_set(char **args) {
+    if (!args[1]) {
+        vars_print(0, "");
+        return EXIT_SUCCESS;
+    }
+
+    int i = 1;
+    if (strcmp(args[i], "--") == 0) i++;
+
+    int count = 0;
+    while (args[i + count]) count++;
+    set_positional(count, &args[i]);
+    return EXIT_SUCCESS;
+}
+
+// unset name[sub]: remove one element of an array
+static int unset_element(const char *arg, const char *open) {
+    size_t len = open - arg;
+    size_t end = skip_subscript(open + 1, strlen(open + 1));
+    if (open[1 + end] != ']' || open[2 + end] != '\0' || !is_valid_name(arg, len)) {
+        print_error("unset: `%s': not a valid identifier", arg);
+        return -1;
+    }
+    Var *v = var_slot(arg, len, hash_name(arg, len), 0);
+    if (!v) return 0;
+    if (v->flags & VAR_READONLY) {
+        print_error("%s: readonly variable", v->name);
+        return -1;
+    }
+    if (!v->array) {
+        // A scalar is element 0 of itself
+        long long index;
+        if (arith_parse_number(open + 1, end, &index) == 0 && index == 0) {
+            char *name = strndup(arg, len);
+            int rc = name ? var_remove(name) : -1;
+            free(name);
+            return rc;
+        }
+        return 0;
+    }
+    if (array_is_assoc(v->array)) {
+        array_delete(v->array, open + 1, end);
+        return 0;
+    }
+
+    Arena arena = {0};
+    long long index;
+    int rc = expand_subscript(open + 1, end, &arena, &index);
+    if (rc == 0) array_unset(v->array, index);
+    arena_free(&arena);
+    return rc;
+}
+
+int cmd_unset(char **args) {
+    int status = EXIT_SUCCESS;
+    int functions = 0;
+    int i = 1;
+    for (; args[i] && args[i][0] == '-'; i++) {
+        if (strcmp(args[i], "-f") == 0) {
+            functions = 1;
+        } else if (strcmp(args[i], "-v") == 0) {
+            functions = 0;
+        } else if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        } else {
+            print_error("unset: %s: invalid option", args[i]);
+            return EXIT_USAGE;
+        }
+    }
+    for (; args[i]; i++) {
+        char *open = functions ? NULL : strchr(args[i], '[');
+        int rc = open ? unset_element(args[i], open)
+               : functions ? function_remove(args[i]) : var_remove(args[i]);
+        if (rc != 0) status = EXIT_FAILURE;
+    }
+    return status;
+}
+
+// Print name as a declare command that recreates it
+static void print_declaration(const Var *v) {
+    char opts[8];
+    int n = 0;
+    if (v->array) opts[n++] = array_is_assoc(v->array) ? 'A' : 'a';
+    if (v->flags & VAR_READONLY) opts[n++] = 'r';
+    if (v->flags & VAR_EXPORT) opts[n++] = 'x';
+    if (n == 0) opts[n++] = '-';
+    opts[n] = '\0';
+
+    out_printf(STDOUT_FILENO, "declare -%s %s=", opts, v->name);
+    if (v->array) {
+        print_array(v->array);
+    } else {
+        print_quoted(v->value);
+    }
+    out_putc(STDOUT_FILENO, '\n');
+}
+
+// declare and local: [-aAprx] [name[=value] ...]. Variables are made
+// local when declared in a function. Compound array values reach here
+// unexpanded and are expanded as they are assigned.
+static int declare_vars(char **args, const char *cmd, int local) {
+    int kind = 0;       // 'a' or 'A'
+    int flags = 0;
+    int print = 0;
+    int i = 1;
+
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (const char *o = args[i] + 1; *o; o++) {
+            switch (*o) {
+                case 'a':
+                case 'A': kind = *o; break;
+                case 'r': flags |= VAR_READONLY; break;
+                case 'x': flags |= VAR_EXPORT; break;
+                case 'p': print = 1; break;
+                default:
+                    print_error("%s: -%c: invalid option", cmd, *o);
+                    return EXIT_USAGE;
+            }
+        }
+    }
+
+    if (!args[i]) {
+        if (strcmp(cmd, "local") == 0) return EXIT_SUCCESS;
+        for (size_t k = 0; k < var_capacity; k++) {
+            Var *v = &var_table[k];
+            if (!v->name || v->name == VAR_TOMBSTONE || (v->flags & flags) != flags) continue;
+            if (kind && (!v->array || array_is_assoc(v->array) != (kind == 'A'))) continue;
+            print_declaration(v);
+        }
+        return EXIT_SUCCESS;
+    }
+
+    int status = EXIT_SUCCESS;
+    Arena arena = {0};
+    for (; args[i]; i++) {
+        char *equals = strchr(args[i], '=');
+        size_t len = equals ? (size_t)(equals - args[i]) : strlen(args[i]);
+
+        if (print) {
+            Var *v = var_slot(args[i], len, hash_name(args[i], len), 0);
+            if (v) {
+                print_declaration(v);
+            } else {
+                print_error("%s: %s: not found", cmd, args[i]);
+                status = EXIT_FAILURE;
+            }
+            continue;
+        }
+
+        if (local && var_make_local(args[i], len) != 0) {
+            status = EXIT_FAILURE;
+            continue;
+        }
+        if (!is_valid_name(args[i], len)) {
+            print_error("%s: `%s': not a valid identifier", cmd, args[i]);
+            status = EXIT_FAILURE;
+            continue;
+        }
+
+        if (kind) {
+            Array *a = var_array(args[i], len);
+            int ok;
+            if (local && (!a || array_is_assoc(a) != (kind == 'A'))) {
+                Array *fresh = array_new(kind == 'A');
+                ok = fresh && var_set_array(args[i], len, fresh) == 0;
+            } else {
+                ok = var_make_array(args[i], len, kind == 'A') != NULL;
+            }
+            if (!ok) {
+                status = EXIT_FAILURE;
+                continue;
+            }
+        }
+
+        int rc = 0;
+        size_t vlen = equals ? strlen(equals + 1) : 0;
+        if (equals && vlen >= 2 && equals[1] == '(' && equals[vlen] == ')') {
+            rc = assign_word(args[i], len + 1 + vlen, &arena);
+            if (rc == 0 && flags) rc = var_assign(args[i], len, NULL, flags);
+        } else if (equals || flags) {
+            rc = var_assign(args[i], len, equals ? equals + 1 : NULL, flags);
+        }
+        if (rc != 0) status = EXIT_FAILURE;
+    }
+    arena_free(&arena);
+    return status;
+}
+
+int cmd_local(char **args) {
+    return declare_vars(args, "local", 1);
+}
+
+int cmd_declare(char **args) {
+    return declare_vars(args, args[0], var_scope_depth() > 0);
+}
+
+int cmd_export(char **args) {
+    if (!args[1] || strcmp(args[1], "-p") == 0) {
+        vars_print(VAR_EXPORT, "export ");
+        return EXIT_SUCCESS;
+    }
+
+    int status = EXIT_SUCCESS;
+    for (int i = 1; args[i]; i++) {
+        char *equals = strchr(args[i], '=');
+        int rc;
+        if (equals) {
+            rc = var_assign(args[i], equals - args[i], equals + 1, VAR_EXPORT);
+        } else {
+            rc = var_assign(args[i], strlen(args[i]), NULL, VAR_EXPORT);
+        }
+        if (rc != 0) status = EXIT_FAILURE;
+    }
+    return status;
+}
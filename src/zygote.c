@@ -0,0 +1,266 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <dirent.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include "shell.h"
+
+// Spawner: a small process that starts external commands for the shell.
+//
+// fork copies the page tables of the whole process, so its cost grows
+// with the shell's heap: history, arrays, caches and the job table. With
+// XSH_ZYGOTE set in the environment the shell forks a spawner before it
+// has set up anything else and asks it to start external commands
+// instead. The request carries the program path, the arguments, the
+// environment, the current directory and the shell's inheritable
+// descriptors as SCM_RIGHTS. The spawner clones with CLONE_PARENT, so
+// the command is still the shell's own child and is waited for, listed
+// as a job and signalled as usual, and sends its pid back.
+//
+// Only the process that started the spawner uses it; forked subshells
+// fork as before. The descriptors that may be inheritable are found
+// once at the start, and then added to as redirections make them, so a
+// request costs no scan of /proc/self/fd. If the spawner goes away, or
+// a descriptor numbered past those it can pass may be inherited, the
+// shell forks by itself.
+
+#define ZYGOTE_MAGIC    0x315a5358u     // "XSZ1"
+#define ZYGOTE_MAX_FDS  64              // descriptors that can be passed
+#define ZYGOTE_FD_BASE  (ZYGOTE_MAX_FDS + 16)
+#define ZYGOTE_MAX_REQUEST (64 << 20)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t len;       // bytes of the request that follows
+} SpawnHeader;
+
+extern char **environ;
+
+static int zygote_fd = -1;
+static pid_t zygote_owner;
+static pid_t zygote_pid;
+static StrBuf zygote_request;
+static uint64_t zygote_fds;     // descriptors that may be inheritable, a bit each
+static int zygote_fds_high;     // and whether one numbered past those may be
+
+// In the new process: put the descriptors in place and exec
+static void spawn_child(const char *path, char **argv, char **envp, const char *cwd, int *fds,
+                        int *targets, int count) {
+    // Move what was received out of the way of the numbers wanted
+    for (int k = 0; k < count; k++) {
+        int high = fcntl(fds[k], F_DUPFD_CLOEXEC, ZYGOTE_FD_BASE);
+        close(fds[k]);
+        fds[k] = high;
+    }
+    int present[3] = {0, 0, 0};
+    for (int k = 0; k < count; k++) {
+        dup2(fds[k], targets[k]);
+        if (targets[k] < 3) present[targets[k]] = 1;
+    }
+    for (int fd = 0; fd < 3; fd++) {
+        if (!present[fd]) close(fd);
+    }
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    if (chdir(cwd) == 0) execve(path, argv, envp);
+    dprintf(STDERR_FILENO, "%sError:%s %s: execution failed: %s\n", COLOR_RED, COLOR_RESET, argv[0],
+            strerror(errno));
+    _exit(EXIT_NOT_FOUND);
+}
+
+// Take one request and start its command. Returns -1 once the shell
+// has gone away.
+static int zygote_serve(int sock) {
+    SpawnHeader h;
+    union {
+        char buf[CMSG_SPACE(ZYGOTE_MAX_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {&h, sizeof(h)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t n;
+    while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL)) < 0 && errno == EINTR) continue;
+    if (n != sizeof(h) || h.magic != ZYGOTE_MAGIC || h.len > ZYGOTE_MAX_REQUEST) return -1;
+
+    int fds[ZYGOTE_MAX_FDS], count = 0;
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    if (c && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+        count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(c), count * sizeof(int));
+    }
+
+    // path, cwd, descriptor numbers, argument count, arguments, environment
+    char *request = malloc(h.len + 1);
+    int32_t reply = -ENOMEM;
+    char **argv = NULL, **envp = NULL;
+    if (!request || read_full(sock, request, h.len) != 0) {
+        free(request);
+        for (int k = 0; k < count; k++) close(fds[k]);
+        return -1;
+    }
+    char *p = request, *end = request + h.len;
+    char *path = next_string(&p, end);
+    char *cwd = next_string(&p, end);
+    int targets[ZYGOTE_MAX_FDS];
+    for (int k = 0; k < count; k++) {
+        char *t = next_string(&p, end);
+        targets[k] = t ? atoi(t) : -1;
+    }
+    char *argc_text = next_string(&p, end);
+    int argc = argc_text ? atoi(argc_text) : -1;
+    size_t env_count = 0;
+    if (argc >= 0 && (argv = calloc(argc + 1, sizeof(char *)))) {
+        for (int k = 0; k < argc; k++) argv[k] = next_string(&p, end);
+        for (char *q = p; next_string(&q, end); env_count++) continue;
+        if ((envp = calloc(env_count + 1, sizeof(char *)))) {
+            for (size_t k = 0; k < env_count; k++) envp[k] = next_string(&p, end);
+        }
+    }
+
+    if (envp && cwd) {
+        pid_t pid = (pid_t)syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, NULL, NULL, 0);
+        if (pid == 0) spawn_child(path, argv, envp, cwd, fds, targets, count);
+        reply = pid < 0 ? -errno : pid;
+    }
+    for (int k = 0; k < count; k++) close(fds[k]);
+    free(argv);
+    free(envp);
+    free(request);
+    return send_full(sock, &reply, sizeof(reply));
+}
+
+// Note that fd may be inheritable: the shell opens its own descriptors
+// close-on-exec, and only redirections clear it
+void zygote_track_fd(int fd) {
+    if (fd < ZYGOTE_MAX_FDS) zygote_fds |= (uint64_t)1 << fd;
+    else zygote_fds_high = 1;
+}
+
+// Fork the spawner, if XSH_ZYGOTE asks for one
+void zygote_start(void) {
+    const char *want = getenv("XSH_ZYGOTE");
+    if (!want || !*want) return;
+
+    // The standard descriptors, and those inherited open across exec
+    DIR *dir = opendir("/proc/self/fd");
+    if (!dir) return;
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        int fd = atoi(ent->d_name);
+        int flags = ent->d_name[0] == '.' || fd == dirfd(dir) ? -1 : fcntl(fd, F_GETFD);
+        if (flags >= 0 && !(flags & FD_CLOEXEC)) zygote_track_fd(fd);
+    }
+    closedir(dir);
+    for (int fd = 0; fd < 3; fd++) zygote_track_fd(fd);
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) return;
+    pid_t shell = getpid();
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(sv[0]);
+        // Die with the shell; signals from the terminal are for it
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        if (getppid() != shell) _exit(EXIT_SUCCESS);
+        signal(SIGINT, SIG_IGN);
+        signal(SIGQUIT, SIG_IGN);
+        signal(SIGTERM, SIG_IGN);
+        while (zygote_serve(sv[1]) == 0) continue;
+        _exit(EXIT_SUCCESS);
+    }
+    close(sv[1]);
+    if (pid < 0) {
+        close(sv[0]);
+        return;
+    }
+    zygote_fd = sv[0];
+    zygote_owner = shell;
+    zygote_pid = pid;
+}
+
+static void zygote_stop(void) {
+    close(zygote_fd);
+    zygote_fd = -1;
+    waitpid(zygote_pid, NULL, WNOHANG);
+}
+
+// Start path with args through the spawner. Returns the pid of the new
+// child, or -1 if there is no spawner to do it and the caller should
+// fork itself.
+pid_t zygote_spawn(const char *path, char **args) {
+    if (zygote_fd < 0 || getpid() != zygote_owner) return -1;
+
+    // Every descriptor the command would inherit across exec, out of
+    // those that may be. One the spawner cannot put in place: fork
+    // instead.
+    if (zygote_fds_high) return -1;
+    int fds[ZYGOTE_MAX_FDS], count = 0;
+    for (uint64_t left = zygote_fds; left; left &= left - 1) {
+        int fd = __builtin_ctzll(left);
+        int flags = fcntl(fd, F_GETFD);
+        if (flags >= 0 && !(flags & FD_CLOEXEC) && fd != zygote_fd) fds[count++] = fd;
+    }
+
+    StrBuf *b = &zygote_request;
+    char number[16];
+    strbuf_reset(b);
+    add_string(b, path);
+    add_string(b, current_dir);
+    for (int k = 0; k < count; k++) {
+        snprintf(number, sizeof(number), "%d", fds[k]);
+        add_string(b, number);
+    }
+    int argc = 0;
+    while (args[argc]) argc++;
+    snprintf(number, sizeof(number), "%d", argc);
+    add_string(b, number);
+    for (int k = 0; k < argc; k++) add_string(b, args[k]);
+    for (char **e = environ; e && *e; e++) add_string(b, *e);
+
+    SpawnHeader h = {ZYGOTE_MAGIC, (uint32_t)b->len};
+    union {
+        char buf[CMSG_SPACE(ZYGOTE_MAX_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = {&h, sizeof(h)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (count > 0) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(count * sizeof(int));
+        memcpy(CMSG_DATA(c), fds, count * sizeof(int));
+    }
+
+    int32_t reply;
+    ssize_t n;
+    while ((n = sendmsg(zygote_fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR) continue;
+    if (n != sizeof(h) || send_full(zygote_fd, b->data, b->len) != 0 ||
+        read_full(zygote_fd, &reply, sizeof(reply)) != 0) {
+        zygote_stop();
+        return -1;
+    }
+    if (b->cap > (1 << 20)) strbuf_free(b);
+    return reply > 0 ? reply : -1;
+}
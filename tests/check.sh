@@ -0,0 +1,35 @@
+#!/bin/sh
+# Regression checks: runs every script in tests/cases through xsh and
+# compares its standard output and exit status with the .out file next
+# to it, whose last line is the expected status.
+#
+#   tests/check.sh XSH_BINARY
+
+xsh=${1:?usage: $0 xsh}
+case $xsh in
+    /*) ;;
+    *) xsh=$(pwd)/$xsh ;;
+esac
+cases=$(cd "$(dirname "$0")/cases" && pwd)
+
+# Run each case in an empty directory with its own home
+scratch=$(mktemp -d)
+trap 'rm -rf "$scratch"' EXIT INT TERM
+export HOME="$scratch"
+
+failed=0
+for script in "$cases"/*.xsh; do
+    name=$(basename "$script" .xsh)
+    dir="$scratch/$name"
+    mkdir "$dir"
+    actual=$(cd "$dir" && timeout 10 "$xsh" "$script" 2>/dev/null; echo "status $?")
+    if [ "$actual" = "$(cat "$cases/$name.out")" ]; then
+        printf '%-12s ok\n' "$name"
+    else
+        printf '%-12s FAIL\n' "$name"
+        printf '%s\n' "$actual" | diff "$cases/$name.out" - | sed 's/^/    /'
+        failed=$((failed + 1))
+    fi
+done
+
+[ $failed -eq 0 ]